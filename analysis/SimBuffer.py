@@ -23,6 +23,7 @@
 import fnmatch
 import os
 from swig_generated.SphSim import SimulationBase, SphSnapshotBase, Parameters
+from rendercache import RenderCache
 
 
 
@@ -113,12 +114,24 @@ this reason, all of its methods are static.
         which the snapshot was used for the last time; the first snapshots to
         get deallocated are the ones that were used most time ago. Not that
         this technique is not scan resistant (but there are ways around that).
+        The buffers of the deallocated snapshot are returned to the snapshot
+        buffer pool, from where they are reused by the next snapshot.  If no
+        other snapshot is allocated, the rendered tiles cached with the
+        snapshots are freed instead.
         '''
         for snapshot in sorted(SimBuffer.snapshots, key=lambda element: element.LastUsed):
             if snapshot.allocated:
                 if snapshot != snapshottest:
                     snapshot.DeallocateBufferMemory()
+                    SimBuffer._clear_render_caches(snapshot)
                     return
+        # No other snapshot left to deallocate; free the remaining rendered
+        # tiles (e.g. those of the live snapshots) instead
+        for snapshot in SimBuffer.snapshots + [sim.live for sim in SimBuffer.simlist
+                                               if hasattr(sim, 'live')]:
+            if SimBuffer._render_cache_memory(snapshot) > 0:
+                SimBuffer._clear_render_caches(snapshot)
+                return
         raise RuntimeError('SimBuffer._deallocateSnapshot: should never get to this line!!!!')
         
 
@@ -131,10 +144,56 @@ this reason, all of its methods are static.
         for snapshot in SimBuffer.snapshots:
             if snapshot.allocated:
                 snapshot.DeallocateBufferMemory()
+            SimBuffer._clear_render_caches(snapshot)
+        SphSnapshotBase.FreeBufferPool()
         SimBuffer.snapshots = []
         SimBuffer.simlist = []
 
 
+    #--------------------------------------------------------------------------
+    @staticmethod
+    def _clear_render_caches(snapshot):
+        '''Discards the cached rendered tiles of the given snapshot, e.g.
+        because its data has been freed or has changed.
+        '''
+        snapshot.rendercaches = {}
+
+
+    #--------------------------------------------------------------------------
+    @staticmethod
+    def _render_cache_memory(snapshot):
+        '''Returns the memory used by the cached rendered tiles of the given
+        snapshot (in bytes).
+        '''
+        try:
+            caches = snapshot.rendercaches
+        except AttributeError:
+            return 0
+        return sum([cache.memory_usage() for cache in caches.values()])
+
+
+    #--------------------------------------------------------------------------
+    @staticmethod
+    def get_render_cache(snapshot, key):
+        '''Returns the cache of rendered tiles of the given snapshot for the
+        given key (identifying the rendered quantity and the rendering
+        options), creating it if needed.
+        The memory of the cached tiles counts towards the memory usage of the
+        buffer.  The caches are discarded when the snapshot is deallocated
+        from the buffer or, for live snapshots, when the data is copied again
+        from the simulation.
+        '''
+        try:
+            caches = snapshot.rendercaches
+        except AttributeError:
+            caches = snapshot.rendercaches = {}
+        try:
+            cache = caches[key]
+        except KeyError:
+            cache = caches[key] = RenderCache()
+        return cache
+
+
     #--------------------------------------------------------------------------
     @staticmethod
     def newsim (paramfile=None, ndim=None):
@@ -167,9 +226,11 @@ this reason, all of its methods are static.
             snap = sim.live
         except AttributeError:
             snap = SphSnapshotBase.SphSnapshotFactory("",sim,sim.simparams.intparams["ndim"])
+            snap.SetRequestedFields(sim.simparams.stringparams["snapshot_fields"])
             snap.sim = sim
             snap.live = True
         snap.CopyDataFromSimulation()
+        SimBuffer._clear_render_caches(snap)
         snap.t = sim.t
         sim.live = snap
         sim.current = sim.live
@@ -255,9 +316,11 @@ this reason, all of its methods are static.
         total_memory = 0
         for snapshot in SimBuffer.snapshots:
             total_memory += snapshot.CalculateMemoryUsage()
+            total_memory += SimBuffer._render_cache_memory(snapshot)
         for sim in SimBuffer.simlist:
             try:
                 total_memory += sim.live.CalculateMemoryUsage()
+                total_memory += SimBuffer._render_cache_memory(sim.live)
             except AttributeError:
                 pass
         return total_memory
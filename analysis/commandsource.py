@@ -529,7 +529,8 @@ class RenderPlotCommand (PlotCommand):
     def __init__(self, xquantity, yquantity, renderquantity, snap, simno,
                  overplot, autoscale, autoscalerender, coordlimits,
                  zslice=None, xunit="default", yunit="default", 
-                 renderunit="default", res=64, interpolation='nearest'):
+                 renderunit="default", res=64, interpolation='nearest',
+                 rendercache=False):
         PlotCommand.__init__(self, xquantity, yquantity, snap, simno, 
                              overplot, autoscale, xunit, yunit)
         self.renderquantity = renderquantity
@@ -542,6 +543,7 @@ class RenderPlotCommand (PlotCommand):
         self.renderunitname = ""
         self.res = res
         self.interpolation = interpolation
+        self.rendercache = rendercache
 
 
     #--------------------------------------------------------------------------
@@ -638,26 +640,41 @@ class RenderPlotCommand (PlotCommand):
         
         # Create the rendering object
         rendering = RenderBase.RenderFactory(sim.ndims, sim)
-        
-        # Allocate the rendered array
-        rendered = np.zeros(xres*yres, dtype=np.float32)
-        
-        # Call column integrated or slice rendering routine, depending on
-        # dimensionality and parameters.
-        if sim.ndims < 3 or self.zslice is None:
-            returncode, renderscaling_factor = rendering.CreateColumnRenderingGrid(xres, yres, self.xquantity, self.yquantity, self.renderquantity,
-                                                 self.renderunit, self.xmin, self.xmax,
-                                                 self.ymin, self.ymax, rendered, snap)
-        else:
+        if sim.ndims == 3 and self.zslice is not None:
             quantities = ['x','y','z']
             quantities.pop(quantities.index(self.xquantity))
             quantities.pop(quantities.index(self.yquantity))
             self.zquantity = quantities[0]
             zunitinfo, z_data, z_scaling_factor, zlabel = self.get_array('z', snap)
-            returncode, renderscaling_factor = rendering.CreateSliceRenderingGrid(xres, yres, self.xquantity, self.yquantity, self.zquantity, self.renderquantity,
-                                                 self.renderunit, self.xmin, self.xmax,
-                                                 self.ymin, self.ymax, self.zslice, rendered, snap)
-        rendered = rendered.reshape(yres,xres)
+
+        def renderfunction(xres, yres, xmin, xmax, ymin, ymax):
+            # Allocate the rendered array
+            rendered = np.zeros(xres*yres, dtype=np.float32)
+
+            # Call column integrated or slice rendering routine, depending on
+            # dimensionality and parameters.
+            if sim.ndims < 3 or self.zslice is None:
+                returncode, renderscaling_factor = rendering.CreateColumnRenderingGrid(xres, yres, self.xquantity, self.yquantity, self.renderquantity,
+                                                     self.renderunit, xmin, xmax,
+                                                     ymin, ymax, rendered, snap)
+            else:
+                returncode, renderscaling_factor = rendering.CreateSliceRenderingGrid(xres, yres, self.xquantity, self.yquantity, self.zquantity, self.renderquantity,
+                                                     self.renderunit, xmin, xmax,
+                                                     ymin, ymax, self.zslice, rendered, snap)
+            return rendered.reshape(yres,xres), renderscaling_factor
+
+        # Re-use (and refine) the tiles rendered for previous views of the
+        # same snapshot, if the cache is enabled
+        if self.rendercache:
+            key = (self.xquantity, self.yquantity, self.renderquantity,
+                   self.renderunit, self.zslice)
+            cache = SimBuffer.get_render_cache(snap, key)
+            rendered, renderscaling_factor = cache.render(renderfunction, xres, yres,
+                                                          self.xmin, self.xmax,
+                                                          self.ymin, self.ymax)
+        else:
+            rendered, renderscaling_factor = renderfunction(xres, yres, self.xmin, self.xmax,
+                                                            self.ymin, self.ymax)
         #data = Data(x*xscaling_factor, y*yscaling_factor, rendered*renderscaling_factor)
         data = Data(None, None, rendered*renderscaling_factor)
         
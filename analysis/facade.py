@@ -204,7 +204,8 @@ Optional arguments:
 def render(x, y, render, snap="current", sim="current", overplot=False,
            autoscale=False, autoscalerender=False, coordlimits=None,
            zslice=None, xunit="default", yunit="default",
-           renderunit="default", res=64, interpolation='nearest'):
+           renderunit="default", res=64, interpolation='nearest',
+           rendercache=False):
     '''Create a rendered plot from selected particle data.
 
 Required arguments:
@@ -251,12 +252,19 @@ Optional arguments:
                     wants to smooth the image, bilinear or bicubic could be
                     used. See pyplot documentation for the full list of
                     possible values.
+    rendercache : If True, the rendered images are built from a
+                  cache of tiles pre-rendered at several resolutions, which
+                  is kept with the snapshot.  Zooming and panning then only
+                  render the tiles that are not cached yet.  If False
+                  (default), all the particles are rendered again for every
+                  plot.
 '''
     if zslice is not None:
         zslice = float(zslice)
     simno = get_sim_no(sim)
     overplot = to_bool(overplot)
     autoscalerender = to_bool(autoscalerender)
+    rendercache = to_bool(rendercache)
     if coordlimits is not None and isinstance(coordlimits, types.StringTypes):
         coordlimits = to_list (coordlimits, float)
     if isinstance(res, types.StringTypes):
@@ -267,7 +275,8 @@ Optional arguments:
     command = Commands.RenderPlotCommand(x, y, render, snap, simno, overplot,
                                          autoscale, autoscalerender,
                                          coordlimits, zslice, xunit, yunit,
-                                         renderunit, res, interpolation)
+                                         renderunit, res, interpolation,
+                                         rendercache)
     data = command.prepareData(Singletons.globallimits)
     Singletons.queue.put([command, data])
 
@@ -0,0 +1,190 @@
+#==============================================================================
+#  rendercache.py
+#  Contains class definition for the multi-resolution cache of pre-rendered
+#  tiles used to speed up repeated rendering (zooming and panning) of the
+#  same snapshot in the python front-end.
+#
+#  This file is part of GANDALF :
+#  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+#  https://github.com/gandalfcode/gandalf
+#  Contact : gandalfcode@gmail.com
+#
+#  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+#
+#  GANDALF is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  GANDALF is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  General Public License (http://www.gnu.org/licenses) for more details.
+#==============================================================================
+import math
+import numpy as np
+
+
+
+#------------------------------------------------------------------------------
+class RenderCache:
+    '''Quadtree (mip-map) of pre-rendered square tiles of one rendered
+quantity of one snapshot.  Level 0 is a single tile covering the first
+view that was requested (made square); each level halves the tile size, so
+a tile (level, i, j) covers [x0 + i*w, x0 + (i+1)*w] x [y0 + j*w, y0 + (j+1)*w]
+with w = size/2**level.  Indices i, j may be negative or larger than
+2**level - 1, so views outside the first one are also cached.  Every tile
+holds tileres x tileres pixels.
+
+For a requested view, the coarsest level whose pixels are no larger than the
+view pixels is used.  Only the tiles of that level intersecting the view that
+are not cached yet are rendered (all of them with a single call of the
+rendering function, over their bounding rectangle), and each view pixel is
+then the area-weighted average of the tile pixels it overlaps.  The least
+recently used tiles are discarded when more than maxtiles are cached.
+'''
+
+    tileres = 128
+    maxlevel = 16
+    maxtiles = 256
+
+
+    #--------------------------------------------------------------------------
+    def __init__(self):
+        '''The rendering function is passed to render at each call rather
+        than stored, so that a cache kept with a snapshot holds no reference
+        back to the snapshot (or its simulation), which would otherwise form
+        a reference cycle delaying the release of the snapshot data.'''
+        self.origin = None
+        self.size = None
+        self.tiles = {}
+        self.lastused = {}
+        self.counter = 0
+        self.scaling_factor = 1.0
+
+
+    #--------------------------------------------------------------------------
+    def clear(self):
+        '''Discards all cached tiles (e.g. if the snapshot data changed).'''
+        self.origin = None
+        self.size = None
+        self.tiles = {}
+        self.lastused = {}
+
+
+    #--------------------------------------------------------------------------
+    def render(self, renderfunction, xres, yres, xmin, xmax, ymin, ymax):
+        '''Returns the rendered view as a (yres, xres) array (first row at
+        ymax) and the scaling factor of the rendered quantity.  Missing tiles
+        are rendered with renderfunction(xres, yres, xmin, xmax, ymin, ymax),
+        which must return the rendered grid as a (yres, xres) numpy array
+        (first row at ymax) and the scaling factor of the rendered quantity.'''
+        if self.origin is None:
+            self.origin = (xmin, ymin)
+            self.size = max(xmax - xmin, ymax - ymin)
+        pixelsize = min((xmax - xmin)/float(xres), (ymax - ymin)/float(yres))
+        if self.size <= 0.0 or pixelsize <= 0.0:
+            return renderfunction(xres, yres, xmin, xmax, ymin, ymax)
+
+        # Level whose pixels are no larger than the pixels of the view
+        level = max(int(math.ceil(math.log(self.size/(self.tileres*pixelsize),
+                                           2.0) - 1.0e-9)), 0)
+        if level > self.maxlevel:
+            return renderfunction(xres, yres, xmin, xmax, ymin, ymax)
+        width = self.size/2**level
+        tilepixel = width/self.tileres
+
+        # Range of tiles intersecting the view
+        imin = int(math.floor((xmin - self.origin[0])/width))
+        imax = int(math.ceil((xmax - self.origin[0])/width)) - 1
+        jmin = int(math.floor((ymin - self.origin[1])/width))
+        jmax = int(math.ceil((ymax - self.origin[1])/width)) - 1
+        imax = max(imax, imin)
+        jmax = max(jmax, jmin)
+        if (imax - imin + 1)*(jmax - jmin + 1) > self.maxtiles:
+            return renderfunction(xres, yres, xmin, xmax, ymin, ymax)
+        self._refine(renderfunction, level, imin, imax, jmin, jmax)
+
+        # Assemble the tiles into a mosaic (first row at the top)
+        T = self.tileres
+        mosaic = np.empty(((jmax - jmin + 1)*T, (imax - imin + 1)*T),
+                          dtype=np.float32)
+        for j in range(jmin, jmax + 1):
+            for i in range(imin, imax + 1):
+                key = (level, i, j)
+                self.counter += 1
+                self.lastused[key] = self.counter
+                row = (jmax - j)*T
+                col = (i - imin)*T
+                mosaic[row:row + T, col:col + T] = self.tiles[key]
+
+        # Average the mosaic pixels overlapping each pixel of the view
+        x0 = self.origin[0] + imin*width
+        y1 = self.origin[1] + (jmax + 1)*width
+        wx = self._weights(xres, (xmin - x0)/tilepixel, (xmax - x0)/tilepixel,
+                           mosaic.shape[1])
+        wy = self._weights(yres, (y1 - ymax)/tilepixel, (y1 - ymin)/tilepixel,
+                           mosaic.shape[0])
+        view = np.dot(np.dot(wy, mosaic), wx.T).astype(np.float32)
+        self._evict()
+
+        return view, self.scaling_factor
+
+
+    #--------------------------------------------------------------------------
+    def memory_usage(self):
+        '''Returns the memory used by the cached tiles (in bytes).'''
+        return sum([tile.nbytes for tile in self.tiles.values()])
+
+
+    #--------------------------------------------------------------------------
+    @staticmethod
+    def _weights(n, start, end, nsource):
+        '''Returns the (n, nsource) matrix of weights averaging the source
+        pixels onto n equal pixels covering [start, end] (given in units of
+        source pixels).  Each weight is the overlapping fraction of a source
+        pixel, normalised over the source pixels covered by the pixel.'''
+        edges = start + np.arange(n + 1)*(end - start)/float(n)
+        q = np.arange(nsource)
+        overlap = np.minimum(edges[1:,np.newaxis], q + 1) - \
+            np.maximum(edges[:-1,np.newaxis], q)
+        overlap = np.clip(overlap, 0.0, None)
+        total = overlap.sum(axis=1)
+        return overlap/np.maximum(total, 1.0e-30)[:,np.newaxis]
+
+
+    #--------------------------------------------------------------------------
+    def _refine(self, renderfunction, level, imin, imax, jmin, jmax):
+        '''Renders all missing tiles of the given level and index range with
+        a single call of the rendering function.'''
+        missing = [(i, j) for j in range(jmin, jmax + 1)
+                   for i in range(imin, imax + 1)
+                   if (level, i, j) not in self.tiles]
+        if len(missing) == 0:
+            return
+        i0 = min([i for i, j in missing])
+        i1 = max([i for i, j in missing])
+        j0 = min([j for i, j in missing])
+        j1 = max([j for i, j in missing])
+        T = self.tileres
+        width = self.size/2**level
+        grid, self.scaling_factor = renderfunction(
+            (i1 - i0 + 1)*T, (j1 - j0 + 1)*T,
+            self.origin[0] + i0*width, self.origin[0] + (i1 + 1)*width,
+            self.origin[1] + j0*width, self.origin[1] + (j1 + 1)*width)
+        for i, j in missing:
+            row = (j1 - j)*T
+            col = (i - i0)*T
+            self.tiles[(level, i, j)] = np.array(grid[row:row + T, col:col + T],
+                                                 dtype=np.float32)
+
+
+    #--------------------------------------------------------------------------
+    def _evict(self):
+        '''Discards the least recently used tiles beyond maxtiles.'''
+        if len(self.tiles) <= self.maxtiles:
+            return
+        keys = sorted(self.tiles.keys(), key=lambda key: self.lastused.get(key, 0))
+        for key in keys[:len(self.tiles) - self.maxtiles]:
+            del self.tiles[key]
+            self.lastused.pop(key, None)
@@ -0,0 +1,675 @@
+//=============================================================================
+//  BinaryCodec.cpp
+//  Contains all functions for compressing and decompressing the data blocks
+//  of native binary ("gandalf_bin") snapshot files.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "BinaryCodec.h"
+#include "Debug.h"
+using namespace std;
+
+
+static const int lz_hashlog = 14;            // Log2 of LZ hash table size
+static const int lz_minmatch = 4;            // Minimum LZ match length
+static const int lz_maxoffset = 65535;       // Maximum LZ match offset
+static const int lz_lastliterals = 5;        // Literals always kept at end
+static const int lz_mflimit = 12;            // No matches start after this
+static const double quantised_qmax = 1.0e9;  // Maximum |q| of quantised codec
+
+
+
+//=============================================================================
+//  LzWriteLength
+/// Append the extension bytes of a sequence length (>= 15) to the output.
+//=============================================================================
+static void LzWriteLength
+(int length,                        ///< [in] Length beyond token value 15
+ string &out)                       ///< [inout] Compressed output
+{
+  while (length >= 255) {
+    out += (char) 255;
+    length -= 255;
+  }
+  out += (char) length;
+  return;
+}
+
+
+
+//=============================================================================
+//  LzReadLength
+/// Read the extension bytes of a sequence length.  Returns false if the
+/// input ends before the length is complete.
+//=============================================================================
+static bool LzReadLength
+(const unsigned char *in,           ///< [in] Compressed input
+ long long nin,                     ///< [in] Size of compressed input
+ long long &ip,                     ///< [inout] Position in input
+ long long &length)                 ///< [inout] Sequence length
+{
+  unsigned char b;                  // Current extension byte
+
+  do {
+    if (ip >= nin) return false;
+    b = in[ip++];
+    length += b;
+  } while (b == 255);
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  LzCompress
+/// Compress a byte array with a greedy, hash-based LZ77 matcher.  Sequences
+/// follow the LZ4 block format: a token holding the literal and match
+/// lengths (4 bits each, extended with bytes of 255), the literals, and a
+/// 16-bit little-endian match offset.  The last sequence holds literals only.
+//=============================================================================
+static void LzCompress
+(const unsigned char *in,           ///< [in] Uncompressed bytes
+ int n,                             ///< [in] No. of uncompressed bytes
+ string &out)                       ///< [out] Compressed bytes
+{
+  int anchor = 0;                   // Start of pending literals
+  int h;                            // Hash of current 4 bytes
+  int ip = 0;                       // Current position in input
+  int len;                          // Match length
+  int lit;                          // No. of literals of sequence
+  int offset;                       // Match offset
+  int ref;                          // Position of match candidate
+  unsigned int seq;                 // Current 4 bytes
+  unsigned int seqref = 0;          // 4 bytes at match candidate
+  vector<int> table(1 << lz_hashlog,-1);   // Last position of each hash
+
+  out.clear();
+  out.reserve(n/2 + 16);
+
+  //---------------------------------------------------------------------------
+  while (ip < n - lz_mflimit) {
+    memcpy(&seq,in + ip,4);
+    h = (int) ((seq*2654435761U) >> (32 - lz_hashlog));
+    ref = table[h];
+    table[h] = ip;
+
+    if (ref >= 0 && ip - ref <= lz_maxoffset) memcpy(&seqref,in + ref,4);
+    if (ref < 0 || ip - ref > lz_maxoffset || seqref != seq) {
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    len = lz_minmatch;
+    while (ip + len < n - lz_lastliterals && in[ref + len] == in[ip + len])
+      len++;
+
+    lit = ip - anchor;
+    offset = ip - ref;
+    out += (char) ((min(lit,15) << 4) | min(len - lz_minmatch,15));
+    if (lit >= 15) LzWriteLength(lit - 15,out);
+    out.append((const char *) in + anchor,lit);
+    out += (char) (offset & 0xff);
+    out += (char) (offset >> 8);
+    if (len - lz_minmatch >= 15) LzWriteLength(len - lz_minmatch - 15,out);
+
+    ip += len;
+    anchor = ip;
+  }
+  //---------------------------------------------------------------------------
+
+  lit = n - anchor;
+  out += (char) (min(lit,15) << 4);
+  if (lit >= 15) LzWriteLength(lit - 15,out);
+  out.append((const char *) in + anchor,lit);
+
+  return;
+}
+
+
+
+//=============================================================================
+//  LzDecompress
+/// Decompress a byte array written by LzCompress.  Returns false if the
+/// input is corrupt or does not expand to exactly nout bytes.
+//=============================================================================
+static bool LzDecompress
+(const unsigned char *in,           ///< [in] Compressed bytes
+ long long nin,                     ///< [in] No. of compressed bytes
+ unsigned char *out,                ///< [out] Uncompressed bytes
+ long long nout)                    ///< [in] No. of uncompressed bytes
+{
+  int token;                        // Sequence token
+  long long i;                      // Byte counter
+  long long ip = 0;                 // Position in input
+  long long len;                    // Match length
+  long long lit;                    // No. of literals
+  long long offset;                 // Match offset
+  long long op = 0;                 // Position in output
+
+  //---------------------------------------------------------------------------
+  while (true) {
+    if (ip >= nin) return false;
+    token = in[ip++];
+
+    lit = token >> 4;
+    if (lit == 15 && !LzReadLength(in,nin,ip,lit)) return false;
+    if (op + lit > nout || ip + lit > nin) return false;
+    memcpy(out + op,in + ip,lit);
+    op += lit;
+    ip += lit;
+    if (op == nout) return (ip == nin);
+
+    if (ip + 2 > nin) return false;
+    offset = (long long) in[ip] | ((long long) in[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op) return false;
+
+    len = token & 15;
+    if (len == 15 && !LzReadLength(in,nin,ip,len)) return false;
+    len += lz_minmatch;
+    if (op + len > nout) return false;
+    for (i=0; i<len; i++) out[op + i] = out[op + i - offset];
+    op += len;
+  }
+  //---------------------------------------------------------------------------
+
+  return false;
+}
+
+
+
+//=============================================================================
+//  DeltaEncode
+/// Replace integer words by their differences to the previous word.
+//=============================================================================
+template <typename WORD>
+static void DeltaEncode
+(int n,                             ///< [in] No. of words
+ char *words)                       ///< [inout] Words
+{
+  int i;                            // Word counter
+  WORD prev = 0;                    // Previous word
+  WORD w;                           // Current word
+
+  for (i=0; i<n; i++) {
+    memcpy(&w,words + i*sizeof(WORD),sizeof(WORD));
+    w -= prev;
+    prev += w;
+    memcpy(words + i*sizeof(WORD),&w,sizeof(WORD));
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  DeltaDecode
+/// Invert DeltaEncode, i.e. replace differences by their running sum.
+//=============================================================================
+template <typename WORD>
+static void DeltaDecode
+(int n,                             ///< [in] No. of words
+ char *words)                       ///< [inout] Words
+{
+  int i;                            // Word counter
+  WORD prev = 0;                    // Previous word
+  WORD w;                           // Current word
+
+  for (i=0; i<n; i++) {
+    memcpy(&w,words + i*sizeof(WORD),sizeof(WORD));
+    prev += w;
+    memcpy(words + i*sizeof(WORD),&prev,sizeof(WORD));
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  QuantisedTolerance
+/// Relative error of the quantiser for a requested maximum relative error
+/// eps of the decoded values.  Decoded values are rounded to the precision
+/// of the field (and log/exp are not exact), so the quantiser must use a
+/// slightly smaller error for the bound to hold after decoding.  Returns
+/// zero if eps is not larger than the precision of the field.
+//=============================================================================
+static double QuantisedTolerance
+(double eps,                        ///< [in] Requested relative error
+ int typesize)                      ///< [in] Size of field elements
+{
+  double u;                         // Relative rounding error of field
+
+  u = (typesize == sizeof(float) ? FLT_EPSILON : 4.0*DBL_EPSILON);
+  if (!(eps > u)) return 0.0;
+
+  return (1.0 + eps)/(1.0 + u) - 1.0;
+}
+
+
+
+//=============================================================================
+//  QuantisedValid
+/// Check that all values of an array can be represented by the quantised
+/// codec, i.e. are positive, finite and within range of the quantiser.
+//=============================================================================
+static bool QuantisedValid
+(const BinaryFieldRecord &field,    ///< [in] Field description
+ const char *data)                  ///< [in] Array values
+{
+  int i;                            // Element counter
+  double lndelta;                   // Log. quantisation step
+  double x;                         // Current value
+  float xf;                         // Current single precision value
+
+  if (field.param <= 0.0 || field.param >= 1.0) return false;
+  if (field.typesize != sizeof(float) && field.typesize != sizeof(double))
+    return false;
+  lndelta = 2.0*log(1.0 + field.param);
+
+  for (i=0; i<field.N; i++) {
+    if (field.typesize == sizeof(float)) {
+      memcpy(&xf,data + i*sizeof(float),sizeof(float));
+      x = xf;
+    }
+    else memcpy(&x,data + i*sizeof(double),sizeof(double));
+    if (!(x > 0.0) || !(x < 1.0e300)) return false;
+    if (fabs(log(x)/lndelta) > quantised_qmax) return false;
+  }
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  EncodeChunk
+/// Compress n consecutive elements of an array into one chunk.
+//=============================================================================
+static void EncodeChunk
+(const BinaryFieldRecord &field,    ///< [in] Field description
+ int n,                             ///< [in] No. of elements of chunk
+ const char *data,                  ///< [in] Elements of chunk
+ string &chunk)                     ///< [out] Compressed chunk
+{
+  int i;                            // Element counter
+  int k;                            // Byte counter
+  int q;                            // Quantised value
+  int wordsize;                     // Bytes per encoded word
+  double lndelta;                   // Log. quantisation step
+  double x;                         // Current value
+  float xf;                         // Current single precision value
+  string lz;                        // LZ compressed bytes
+  vector<char> shuffled;            // Byte-shuffled words
+  vector<char> words;               // Integer words
+
+  wordsize = (field.codec == binary_codec_quantised ? 4 : field.typesize);
+  words.resize((size_t) n*wordsize + 1);
+  shuffled.resize((size_t) n*wordsize + 1);
+
+  // Convert values to integer words and delta-encode them
+  //---------------------------------------------------------------------------
+  if (field.codec == binary_codec_quantised) {
+    lndelta = 2.0*log(1.0 + field.param);
+    for (i=0; i<n; i++) {
+      if (field.typesize == sizeof(float)) {
+        memcpy(&xf,data + i*sizeof(float),sizeof(float));
+        x = xf;
+      }
+      else memcpy(&x,data + i*sizeof(double),sizeof(double));
+      q = (int) floor(log(x)/lndelta + 0.5);
+      memcpy(&words[i*4],&q,4);
+    }
+  }
+  else memcpy(&words[0],data,(size_t) n*wordsize);
+
+  if (wordsize == 4) DeltaEncode<unsigned int>(n,&words[0]);
+  else if (wordsize == 8) DeltaEncode<unsigned long long>(n,&words[0]);
+
+  // Shuffle bytes so that bytes of equal significance are contiguous
+  for (i=0; i<n; i++)
+    for (k=0; k<wordsize; k++) shuffled[k*n + i] = words[i*wordsize + k];
+
+  LzCompress((const unsigned char *) &shuffled[0],n*wordsize,lz);
+
+  if (lz.size() < (size_t) n*wordsize) {
+    chunk = '\1';
+    chunk += lz;
+  }
+  else {
+    chunk = '\0';
+    chunk.append(&shuffled[0],(size_t) n*wordsize);
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  DecodeChunk
+/// Decompress one chunk of n consecutive elements of an array.  Returns
+/// false if the chunk is corrupt.
+//=============================================================================
+static bool DecodeChunk
+(const BinaryFieldRecord &field,    ///< [in] Field description
+ int n,                             ///< [in] No. of elements of chunk
+ const char *chunk,                 ///< [in] Compressed chunk
+ long long nchunk,                  ///< [in] Size of compressed chunk
+ char *data)                        ///< [out] Elements of chunk
+{
+  int i;                            // Element counter
+  int k;                            // Byte counter
+  int q;                            // Quantised value
+  int wordsize;                     // Bytes per encoded word
+  long long nword;                  // Size of all words of chunk
+  double lndelta;                   // Log. quantisation step
+  double x;                         // Current value
+  float xf;                         // Current single precision value
+  vector<char> shuffled;            // Byte-shuffled words
+  vector<char> words;               // Integer words
+
+  wordsize = (field.codec == binary_codec_quantised ? 4 : field.typesize);
+  nword = (long long) n*wordsize;
+  words.resize(nword + 1);
+  shuffled.resize(nword + 1);
+  if (nchunk < 1) return false;
+
+  if (chunk[0] == '\0') {
+    if (nchunk - 1 != nword) return false;
+    memcpy(&shuffled[0],chunk + 1,nword);
+  }
+  else if (chunk[0] == '\1') {
+    if (!LzDecompress((const unsigned char *) chunk + 1,nchunk - 1,
+                      (unsigned char *) &shuffled[0],nword)) return false;
+  }
+  else return false;
+
+  for (i=0; i<n; i++)
+    for (k=0; k<wordsize; k++) words[i*wordsize + k] = shuffled[k*n + i];
+
+  if (wordsize == 4) DeltaDecode<unsigned int>(n,&words[0]);
+  else if (wordsize == 8) DeltaDecode<unsigned long long>(n,&words[0]);
+
+  if (field.codec != binary_codec_quantised) {
+    memcpy(data,&words[0],nword);
+    return true;
+  }
+
+  lndelta = 2.0*log(1.0 + field.param);
+  for (i=0; i<n; i++) {
+    memcpy(&q,&words[i*4],4);
+    x = exp((double) q*lndelta);
+    if (field.typesize == sizeof(float)) {
+      xf = (float) x;
+      memcpy(data + i*sizeof(float),&xf,sizeof(float));
+    }
+    else memcpy(data + i*sizeof(double),&x,sizeof(double));
+  }
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  EncodeBinaryField
+/// Encode the N elements of an array into a data block using the codec of
+/// the field record.  Arrays that cannot be represented by the quantised
+/// codec (or whose tolerance is below the precision of the field) fall back
+/// to the lossless codec.  On return, the record holds the codec actually
+/// used, its parameter, the chunk size and the size of the block.
+//=============================================================================
+void EncodeBinaryField
+(BinaryFieldRecord &field,          ///< [inout] Field description
+ const char *data,                  ///< [in] Array (N*typesize bytes)
+ string &block)                     ///< [out] Encoded data block
+{
+  int c;                            // Chunk counter
+  int Nchunk;                       // No. of chunks
+  long long nbytes;                 // Size of current chunk
+  vector<string> chunks;            // Compressed chunks
+
+  debug2("[EncodeBinaryField]");
+
+  if (field.codec == binary_codec_quantised)
+    field.param = QuantisedTolerance(field.param,field.typesize);
+  if (field.codec == binary_codec_quantised && !QuantisedValid(field,data))
+    field.codec = binary_codec_lossless;
+  if (field.codec != binary_codec_raw &&
+      field.typesize != 4 && field.typesize != 8)
+    field.codec = binary_codec_raw;
+
+  if (field.codec == binary_codec_raw) {
+    field.chunksize = 0;
+    field.param = 0.0;
+    block.assign(data,(size_t) field.N*field.typesize);
+    field.nbytes = block.size();
+    return;
+  }
+
+  if (field.chunksize <= 0) field.chunksize = binary_chunk_size;
+  Nchunk = (field.N + field.chunksize - 1)/field.chunksize;
+  chunks.resize(Nchunk);
+
+  // Compress all chunks independently
+  //---------------------------------------------------------------------------
+#pragma omp parallel for default(none) schedule(dynamic) \
+  shared(chunks,data,field,Nchunk)
+  for (c=0; c<Nchunk; c++) {
+    int n = min(field.chunksize,field.N - c*field.chunksize);
+    EncodeChunk(field,n,data + (size_t) c*field.chunksize*field.typesize,
+                chunks[c]);
+  }
+  //---------------------------------------------------------------------------
+
+  block.assign((const char *) &Nchunk,sizeof(int));
+  for (c=0; c<Nchunk; c++) {
+    nbytes = chunks[c].size();
+    block.append((const char *) &nbytes,sizeof(long long));
+  }
+  for (c=0; c<Nchunk; c++) block += chunks[c];
+  field.nbytes = block.size();
+
+  return;
+}
+
+
+
+//=============================================================================
+//  DecodeBinaryField
+/// Decode a data block of nbytes bytes into the N elements of the array
+/// described by the field record.  Returns false if the block is corrupt.
+//=============================================================================
+bool DecodeBinaryField
+(const BinaryFieldRecord &field,    ///< [in] Field description
+ const char *block,                 ///< [in] Encoded data block
+ char *data)                        ///< [out] Array (N*typesize bytes)
+{
+  int c;                            // Chunk counter
+  int Nchunk;                       // No. of chunks
+  int Nerror = 0;                   // No. of corrupt chunks
+  long long offset;                 // Offset of current chunk in block
+  vector<long long> nbytes;         // Sizes of chunks
+  vector<long long> offsets;        // Offsets of chunks in block
+
+  debug2("[DecodeBinaryField]");
+
+  if (field.codec == binary_codec_raw) {
+    if (field.nbytes != (long long) field.N*field.typesize) return false;
+    memcpy(data,block,field.nbytes);
+    return true;
+  }
+
+  if (field.chunksize <= 0 || field.nbytes < (long long) sizeof(int))
+    return false;
+  memcpy(&Nchunk,block,sizeof(int));
+  if (Nchunk != (field.N + field.chunksize - 1)/field.chunksize) return false;
+  offset = sizeof(int) + (long long) Nchunk*sizeof(long long);
+  if (offset > field.nbytes) return false;
+
+  nbytes.resize(Nchunk + 1);
+  offsets.resize(Nchunk + 1);
+  if (Nchunk > 0)
+    memcpy(&nbytes[0],block + sizeof(int),Nchunk*sizeof(long long));
+  for (c=0; c<Nchunk; c++) {
+    if (nbytes[c] < 0) return false;
+    offsets[c] = offset;
+    offset += nbytes[c];
+  }
+  if (offset != field.nbytes) return false;
+
+  // Decompress all chunks independently
+  //---------------------------------------------------------------------------
+#pragma omp parallel for default(none) schedule(dynamic) \
+  shared(block,data,field,nbytes,Nchunk,offsets) reduction(+:Nerror)
+  for (c=0; c<Nchunk; c++) {
+    int n = min(field.chunksize,field.N - c*field.chunksize);
+    if (!DecodeChunk(field,n,block + offsets[c],nbytes[c],
+                     data + (size_t) c*field.chunksize*field.typesize))
+      Nerror++;
+  }
+  //---------------------------------------------------------------------------
+
+  return (Nerror == 0);
+}
+
+
+
+//=============================================================================
+//  ComputeMortonOrder
+/// Compute the order of N points along a Morton (Z-order) space-filling
+/// curve spanning their bounding box.  On return, order[j] is the index of
+/// the j-th point along the curve.
+//=============================================================================
+void ComputeMortonOrder
+(int N,                             ///< [in] No. of points
+ int ndim,                          ///< [in] Dimensionality
+ const double *r,                   ///< [in] Positions (N*ndim values)
+ int *order)                        ///< [out] Order along curve
+{
+  int bits = min(63/ndim,21);       // Bits per dimension of key
+  int i;                            // Point counter
+  int k;                            // Dimension counter
+  double rmax[3];                   // Maximum extent of bounding box
+  double rmin[3];                   // Minimum extent of bounding box
+  double scale[3];                  // Scaling from position to grid
+  vector<pair<unsigned long long,int> > keys(N);   // Keys of all points
+
+  debug2("[ComputeMortonOrder]");
+
+  for (k=0; k<ndim; k++) {
+    rmin[k] = 1.0e300;
+    rmax[k] = -1.0e300;
+  }
+  for (i=0; i<N; i++) {
+    for (k=0; k<ndim; k++) {
+      rmin[k] = min(rmin[k],r[i*ndim + k]);
+      rmax[k] = max(rmax[k],r[i*ndim + k]);
+    }
+  }
+  for (k=0; k<ndim; k++) {
+    scale[k] = 0.0;
+    if (rmax[k] > rmin[k])
+      scale[k] = (double) ((1 << bits) - 1)/(rmax[k] - rmin[k]);
+  }
+
+  //---------------------------------------------------------------------------
+#pragma omp parallel for default(none) private(k) \
+  shared(bits,keys,N,ndim,r,rmin,scale)
+  for (i=0; i<N; i++) {
+    int b;
+    unsigned long long grid;
+    unsigned long long key = 0;
+    for (k=0; k<ndim; k++) {
+      grid = (unsigned long long) ((r[i*ndim + k] - rmin[k])*scale[k]);
+      for (b=0; b<bits; b++)
+        key |= ((grid >> b) & 1ULL) << (b*ndim + k);
+    }
+    keys[i] = make_pair(key,i);
+  }
+  //---------------------------------------------------------------------------
+
+  sort(keys.begin(),keys.end());
+  for (i=0; i<N; i++) order[i] = keys[i].second;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  PermuteElements
+/// Reorder the N elements of an array, i.e. out[j] = in[order[j]], or
+/// restore the original order, i.e. out[order[j]] = in[j], if inverse.
+//=============================================================================
+void PermuteElements
+(int N,                             ///< [in] No. of elements
+ int typesize,                      ///< [in] Bytes per element
+ const int *order,                  ///< [in] Order of elements
+ bool inverse,                      ///< [in] Restore original order?
+ const char *in,                    ///< [in] Input array
+ char *out)                         ///< [out] Reordered array
+{
+  int j;                            // Element counter
+
+  if (inverse) {
+    for (j=0; j<N; j++)
+      memcpy(out + (size_t) order[j]*typesize,in + (size_t) j*typesize,
+             typesize);
+  }
+  else {
+    for (j=0; j<N; j++)
+      memcpy(out + (size_t) j*typesize,in + (size_t) order[j]*typesize,
+             typesize);
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  ValidPermutation
+/// Return true if the N elements of order are a permutation of 0..N-1,
+/// i.e. each index is within range and appears exactly once.
+//=============================================================================
+bool ValidPermutation
+(int N,                             ///< [in] No. of elements
+ const int *order)                  ///< [in] Storage order of elements
+{
+  int j;                            // Element counter
+  vector<bool> seen(N,false);       // Has index already been seen?
+
+  for (j=0; j<N; j++) {
+    if (order[j] < 0 || order[j] >= N || seen[order[j]]) return false;
+    seen[order[j]] = true;
+  }
+
+  return true;
+}
@@ -0,0 +1,65 @@
+//=============================================================================
+//  BinaryCodec.h
+//  Contains the definitions of the compression codecs for the data blocks
+//  of native binary ("gandalf_bin") snapshot files.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#ifndef _BINARY_CODEC_H_
+#define _BINARY_CODEC_H_
+
+
+#include <string>
+#include "Precision.h"
+#include "BinarySnapshot.h"
+using namespace std;
+
+
+//=============================================================================
+//  Compressed block layout
+//
+//  block : int Nchunk, long long nbytes[Nchunk], Nchunk x chunk
+//  chunk : char mode, data
+//
+//  Each chunk holds (up to) chunksize consecutive elements of the array and
+//  is encoded independently, so chunks are compressed and decompressed in
+//  parallel.  Before compression the elements of a chunk are
+//
+//  lossless  : delta-encoded as integers (bit patterns of the values),
+//  quantised : replaced by q = nint(ln(x)/delta), delta = 2 ln(1 + eps),
+//              with eps the relative error of the quantiser (codec
+//              parameter, reduced from the requested error by the
+//              rounding error of the field precision), then
+//              delta-encoded as integers,
+//
+//  and then byte-shuffled (byte k of all elements stored contiguously).
+//  The shuffled bytes are stored LZ77-compressed (mode 1, LZ4-like sequence
+//  format with 64 kB window) or, if that does not make them smaller, as
+//  they are (mode 0).
+//=============================================================================
+
+
+void EncodeBinaryField(BinaryFieldRecord &, const char *, string &);
+bool DecodeBinaryField(const BinaryFieldRecord &, const char *, char *);
+void ComputeMortonOrder(int, int, const double *, int *);
+void PermuteElements(int, int, const int *, bool, const char *, char *);
+bool ValidPermutation(int, const int *);
+
+#endif
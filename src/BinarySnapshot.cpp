@@ -0,0 +1,512 @@
+//=============================================================================
+//  BinarySnapshot.cpp
+//  Contains all functions for packing and unpacking the header of native
+//  binary ("gandalf_bin") snapshot files.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "BinarySnapshot.h"
+#include "Debug.h"
+using namespace std;
+
+
+
+//=============================================================================
+//  PackString
+/// Copy string into fixed-length, zero-padded record of packed header.
+//=============================================================================
+static void PackString
+(string value,                      ///< [in] String to be packed
+ char *record)                      ///< [out] Fixed-length record
+{
+  memset(record,0,binary_string_length);
+  strncpy(record,value.c_str(),binary_string_length - 1);
+  return;
+}
+
+
+
+//=============================================================================
+//  UnpackString
+/// Extract string from fixed-length, zero-padded record of packed header.
+//=============================================================================
+static string UnpackString
+(const char *record)                ///< [in] Fixed-length record
+{
+  char aux[binary_string_length + 1];
+  memcpy(aux,record,binary_string_length);
+  aux[binary_string_length] = '\0';
+  return string(aux);
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::BinarySnapshotHeader
+/// BinarySnapshotHeader constructor.
+//=============================================================================
+BinarySnapshotHeader::BinarySnapshotHeader()
+{
+  version = binary_version;
+  ndim = 0;
+  precision = sizeof(FLOAT);
+  Nsph = 0;
+  Nstar = 0;
+  t = 0.0;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::AddUnit
+/// Add unit category with its output unit string and scaling to unit table.
+//=============================================================================
+void BinarySnapshotHeader::AddUnit
+(string name,                       ///< [in] Unit category
+ string unit,                       ///< [in] Output unit string
+ DOUBLE outscale)                   ///< [in] Code to output unit scaling
+{
+  BinaryUnitRecord record;
+  record.name = name;
+  record.unit = unit;
+  record.outscale = outscale;
+  units.push_back(record);
+  return;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::AddField
+/// Add array block to field table.  The no. of elements is set from the
+/// particle numbers of the given species and the offset is only computed
+/// once all fields are known (see ComputeOffsets).
+//=============================================================================
+void BinarySnapshotHeader::AddField
+(string name,                       ///< [in] Array name
+ string species,                    ///< [in] Particle species
+ string unit,                       ///< [in] Unit category
+ int typesize)                      ///< [in] Bytes per element
+{
+  BinaryFieldRecord record;
+  record.name = name;
+  record.species = species;
+  record.unit = unit;
+  record.typesize = typesize;
+  record.N = (species == "star" ? Nstar : Nsph);
+  record.offset = 0;
+  record.codec = binary_codec_raw;
+  record.chunksize = 0;
+  record.nbytes = (long long) record.N*(long long) typesize;
+  record.param = 0.0;
+  fields.push_back(record);
+  return;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::ComputeOffsets
+/// Lay out all data blocks contiguously after the header, in the order of
+/// the field table.
+//=============================================================================
+void BinarySnapshotHeader::ComputeOffsets(void)
+{
+  long long offset = HeaderSize();  // Offset of next block
+  unsigned int i;                   // Field counter
+
+  for (i=0; i<fields.size(); i++) {
+    fields[i].offset = offset;
+    offset += fields[i].nbytes;
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::FindField
+/// Return position of array in field table, or -1 if not present.
+//=============================================================================
+int BinarySnapshotHeader::FindField
+(string name,                       ///< [in] Array name
+ string species) const              ///< [in] Particle species
+{
+  unsigned int i;                   // Field counter
+
+  for (i=0; i<fields.size(); i++)
+    if (fields[i].name == name && fields[i].species == species) return i;
+
+  return -1;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::FindUnit
+/// Return position of unit category in unit table, or -1 if not present.
+//=============================================================================
+int BinarySnapshotHeader::FindUnit
+(string name) const                 ///< [in] Unit category
+{
+  unsigned int i;                   // Unit counter
+
+  for (i=0; i<units.size(); i++)
+    if (units[i].name == name) return i;
+
+  return -1;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::HeaderSize
+/// Size (in bytes) of packed header, i.e. the offset of the first data block.
+//=============================================================================
+long long BinarySnapshotHeader::HeaderSize(void) const
+{
+  return binary_preamble_size + units.size()*binary_unit_size +
+    fields.size()*(version == 1 ? binary_field_size_v1 : binary_field_size);
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::Compressed
+/// Return true if any block is compressed or stored in a different order
+/// than the particle arrays, i.e. if blocks cannot be used in place.
+//=============================================================================
+bool BinarySnapshotHeader::Compressed(void) const
+{
+  unsigned int i;                   // Field counter
+
+  for (i=0; i<fields.size(); i++)
+    if (fields[i].codec != binary_codec_raw || fields[i].name == "order")
+      return true;
+
+  return false;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::Pack
+/// Return packed on-disk representation of header.
+//=============================================================================
+string BinarySnapshotHeader::Pack(void) const
+{
+  int idata[8];                     // Integer preamble data
+  unsigned int i;                   // Unit/field counter
+  string buffer(HeaderSize(),'\0'); // Packed header
+  char *c = &buffer[0];             // Current position in buffer
+
+  idata[0] = version;
+  idata[1] = binary_endian;
+  idata[2] = ndim;
+  idata[3] = precision;
+  idata[4] = Nsph;
+  idata[5] = Nstar;
+  idata[6] = units.size();
+  idata[7] = fields.size();
+
+  memcpy(c,binary_magic,8);                  c += 8;
+  memcpy(c,idata,8*sizeof(int));             c += 8*sizeof(int);
+  memcpy(c,&t,sizeof(DOUBLE));               c += sizeof(DOUBLE);
+
+  for (i=0; i<units.size(); i++) {
+    PackString(units[i].name,c);             c += binary_string_length;
+    PackString(units[i].unit,c);             c += binary_string_length;
+    memcpy(c,&units[i].outscale,8);          c += 8;
+  }
+
+  for (i=0; i<fields.size(); i++) {
+    PackString(fields[i].name,c);            c += binary_string_length;
+    PackString(fields[i].species,c);         c += binary_string_length;
+    PackString(fields[i].unit,c);            c += binary_string_length;
+    memcpy(c,&fields[i].typesize,4);         c += 4;
+    memcpy(c,&fields[i].N,4);                c += 4;
+    memcpy(c,&fields[i].offset,8);           c += 8;
+    if (version == 1) continue;
+    memcpy(c,&fields[i].codec,4);            c += 4;
+    memcpy(c,&fields[i].chunksize,4);        c += 4;
+    memcpy(c,&fields[i].nbytes,8);           c += 8;
+    memcpy(c,&fields[i].param,8);            c += 8;
+  }
+
+  return buffer;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::Unpack
+/// Fill header from its packed representation.  Returns false if the buffer
+/// is not a (complete) binary snapshot header written on a machine with the
+/// same byte order.
+//=============================================================================
+bool BinarySnapshotHeader::Unpack
+(const char *buffer,                ///< [in] Packed header
+ long long size)                    ///< [in] No. of valid bytes in buffer
+{
+  int idata[8];                     // Integer preamble data
+  int i;                            // Unit/field counter
+  const char *c = buffer;           // Current position in buffer
+
+  debug2("[BinarySnapshotHeader::Unpack]");
+
+  if (size < binary_preamble_size) return false;
+  if (memcmp(c,binary_magic,8) != 0) return false;
+  c += 8;
+  memcpy(idata,c,8*sizeof(int));             c += 8*sizeof(int);
+  memcpy(&t,c,sizeof(DOUBLE));               c += sizeof(DOUBLE);
+  if (idata[0] < 1 || idata[0] > binary_version) return false;
+  if (idata[1] != binary_endian) return false;
+  if (idata[6] < 0 || idata[7] < 0) return false;
+
+  version   = idata[0];
+  ndim      = idata[2];
+  precision = idata[3];
+  Nsph      = idata[4];
+  Nstar     = idata[5];
+  units.resize(idata[6]);
+  fields.resize(idata[7]);
+  if (size < HeaderSize()) return false;
+
+  for (i=0; i<idata[6]; i++) {
+    units[i].name = UnpackString(c);         c += binary_string_length;
+    units[i].unit = UnpackString(c);         c += binary_string_length;
+    memcpy(&units[i].outscale,c,8);          c += 8;
+  }
+
+  for (i=0; i<idata[7]; i++) {
+    fields[i].name = UnpackString(c);        c += binary_string_length;
+    fields[i].species = UnpackString(c);     c += binary_string_length;
+    fields[i].unit = UnpackString(c);        c += binary_string_length;
+    memcpy(&fields[i].typesize,c,4);         c += 4;
+    memcpy(&fields[i].N,c,4);                c += 4;
+    memcpy(&fields[i].offset,c,8);           c += 8;
+    fields[i].codec = binary_codec_raw;
+    fields[i].chunksize = 0;
+    fields[i].nbytes = (long long) fields[i].N*(long long) fields[i].typesize;
+    fields[i].param = 0.0;
+    if (version == 1) continue;
+    memcpy(&fields[i].codec,c,4);            c += 4;
+    memcpy(&fields[i].chunksize,c,4);        c += 4;
+    memcpy(&fields[i].nbytes,c,8);           c += 8;
+    memcpy(&fields[i].param,c,8);            c += 8;
+  }
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::ReadHeader
+/// Read header from the beginning of an open (binary mode) file stream.
+//=============================================================================
+bool BinarySnapshotHeader::ReadHeader
+(ifstream &infile)                  ///< [in] Input file stream
+{
+  int idata[8];                     // Integer preamble data
+  long long filesize;               // Size of snapshot file
+  long long size;                   // Size of complete header
+  char preamble[binary_preamble_size];   // Fixed-size preamble
+  string buffer;                    // Complete packed header
+
+  debug2("[BinarySnapshotHeader::ReadHeader]");
+
+  infile.seekg(0,ios::end);
+  filesize = infile.tellg();
+  infile.seekg(0,ios::beg);
+  infile.read(preamble,binary_preamble_size);
+  if (!infile.good()) return false;
+  memcpy(idata,preamble + 8,8*sizeof(int));
+
+  // Check the unit and field counts before allocating the header buffer
+  if (idata[6] < 0 || idata[7] < 0) return false;
+  size = binary_preamble_size + (long long) idata[6]*binary_unit_size +
+    (long long) idata[7]*(idata[0] == 1 ? binary_field_size_v1 :
+                          binary_field_size);
+  if (size > filesize) return false;
+  buffer.resize(size);
+  memcpy(&buffer[0],preamble,binary_preamble_size);
+  infile.read(&buffer[binary_preamble_size],size - binary_preamble_size);
+  if (!infile.good()) return false;
+
+  return Unpack(buffer.c_str(),size) && Valid(filesize);
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotHeader::Valid
+/// Check the particle numbers and the field table against the size of the
+/// file, i.e. that all counts are non-negative and all data blocks lie
+/// within the file, behind the header.  Uncompressed blocks must hold
+/// exactly N*typesize bytes.
+//=============================================================================
+bool BinarySnapshotHeader::Valid
+(long long filesize) const          ///< [in] Size of snapshot file
+{
+  unsigned int i;                   // Field counter
+
+  if (Nsph < 0 || Nstar < 0 || HeaderSize() > filesize) return false;
+
+  for (i=0; i<fields.size(); i++) {
+    const BinaryFieldRecord &field = fields[i];
+    if (field.N < 0 || field.typesize <= 0 || field.nbytes < 0) return false;
+    if (field.offset < HeaderSize() ||
+        field.offset > filesize - field.nbytes) return false;
+    if (field.codec == binary_codec_raw &&
+        field.nbytes != (long long) field.N*(long long) field.typesize)
+      return false;
+  }
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotIndex::IsIndex
+/// Return true if the buffer starts with the magic string of an index file.
+//=============================================================================
+bool BinarySnapshotIndex::IsIndex
+(const char *buffer,                ///< [in] Start of file
+ long long size)                    ///< [in] No. of valid bytes in buffer
+{
+  return (size >= 8 && memcmp(buffer,binary_index_magic,8) == 0);
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotIndex::PieceFilename
+/// Return the filename of the piece written by the given process.
+//=============================================================================
+string BinarySnapshotIndex::PieceFilename
+(string filename,                   ///< [in] Filename of index file
+ int rank)                          ///< [in] Rank of writing process
+{
+  char suffix[16];                  // Rank suffix of piece
+
+  sprintf(suffix,".r%05d",rank);
+  return filename + suffix;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotIndex::Pack
+/// Return packed on-disk representation of index.
+//=============================================================================
+string BinarySnapshotIndex::Pack(void) const
+{
+  int idata[2];                     // Integer index data
+  unsigned int i;                   // Piece counter
+  string buffer(16 + 8*Nsph.size(),'\0');   // Packed index
+  char *c = &buffer[0];             // Current position in buffer
+
+  idata[0] = binary_index_version;
+  idata[1] = Nsph.size();
+
+  memcpy(c,binary_index_magic,8);            c += 8;
+  memcpy(c,idata,2*sizeof(int));             c += 2*sizeof(int);
+  for (i=0; i<Nsph.size(); i++) {
+    memcpy(c,&Nsph[i],4);                    c += 4;
+    memcpy(c,&Nstar[i],4);                   c += 4;
+  }
+
+  return buffer;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotIndex::Unpack
+/// Fill index from its packed representation.  Returns false if the buffer
+/// is not a (complete) index of a per-process binary snapshot.
+//=============================================================================
+bool BinarySnapshotIndex::Unpack
+(const char *buffer,                ///< [in] Packed index
+ long long size)                    ///< [in] No. of valid bytes in buffer
+{
+  int idata[2];                     // Integer index data
+  int i;                            // Piece counter
+  const char *c = buffer + 8;       // Current position in buffer
+
+  debug2("[BinarySnapshotIndex::Unpack]");
+
+  if (size < 16 || !IsIndex(buffer,size)) return false;
+  memcpy(idata,c,2*sizeof(int));             c += 2*sizeof(int);
+  if (idata[0] != binary_index_version || idata[1] < 1) return false;
+  if (size < 16 + 8*(long long) idata[1]) return false;
+
+  Nsph.resize(idata[1]);
+  Nstar.resize(idata[1]);
+  for (i=0; i<idata[1]; i++) {
+    memcpy(&Nsph[i],c,4);                    c += 4;
+    memcpy(&Nstar[i],c,4);                   c += 4;
+    if (Nsph[i] < 0 || Nstar[i] < 0) return false;
+  }
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  BinarySnapshotIndex::ReadIndex
+/// Read index from the beginning of an open (binary mode) file stream.
+//=============================================================================
+bool BinarySnapshotIndex::ReadIndex
+(ifstream &infile)                  ///< [in] Input file stream
+{
+  int Npiece;                       // No. of pieces
+  long long filesize;               // Size of file (in bytes)
+  char preamble[16];                // Magic string, version and Npiece
+  string buffer;                    // Complete packed index
+
+  debug2("[BinarySnapshotIndex::ReadIndex]");
+
+  infile.seekg(0,ios::end);
+  filesize = (long long) infile.tellg();
+  infile.seekg(0,ios::beg);
+  infile.read(preamble,16);
+  if (!infile.good() || !IsIndex(preamble,16)) return false;
+
+  // The piece table must fit inside the file before it is allocated
+  memcpy(&Npiece,preamble + 12,sizeof(int));
+  if (Npiece < 1 || 16 + 8*(long long) Npiece > filesize) return false;
+
+  buffer.resize(16 + 8*(long long) Npiece);
+  memcpy(&buffer[0],preamble,16);
+  infile.read(&buffer[16],buffer.size() - 16);
+  if (!infile.good()) return false;
+
+  return Unpack(buffer.c_str(),buffer.size());
+}
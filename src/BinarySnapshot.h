@@ -0,0 +1,179 @@
+//=============================================================================
+//  BinarySnapshot.h
+//  Contains the definition of the on-disk header of native binary
+//  ("gandalf_bin") snapshot files.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#ifndef _BINARY_SNAPSHOT_H_
+#define _BINARY_SNAPSHOT_H_
+
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include "Precision.h"
+using namespace std;
+
+
+//=============================================================================
+//  Binary snapshot layout
+//
+//  preamble : char magic[8], int version, int endian, int ndim,
+//             int precision, int Nsph, int Nstar, int Nunit, int Nfield,
+//             double t                                    (48 bytes)
+//  units    : Nunit  x {char name[16], char unit[16], double outscale}
+//  fields   : Nfield x {char name[16], char species[16], char unit[16],
+//                       int typesize, int N, long long offset,
+//                       int codec, int chunksize, long long nbytes,
+//                       double param}
+//  data     : one contiguous block of nbytes bytes per field, starting at
+//             the recorded byte offset from the beginning of the file.
+//
+//  All particle data are stored in output units, i.e. already multiplied by
+//  the outscale of the unit recorded for each field.  Uncompressed (raw)
+//  blocks hold the N*typesize bytes of the array.  Compressed blocks are
+//  described in BinaryCodec.h; if an SPH "order" field is present, all SPH
+//  arrays are stored in that (space-filling curve) order instead of the
+//  original particle order.  Version 1 files have no codec information in
+//  the field table (all blocks raw).
+//=============================================================================
+static const char binary_magic[8] = {'G','A','N','D','A','L','F','B'};
+static const int binary_version = 2;
+static const int binary_endian = 0x01020304;
+static const int binary_string_length = 16;
+static const int binary_preamble_size = 48;
+static const int binary_unit_size = 2*binary_string_length + 8;
+static const int binary_field_size_v1 = 3*binary_string_length + 16;
+static const int binary_field_size = binary_field_size_v1 + 24;
+static const int binary_buffer_size = 1 << 20;
+static const int binary_codec_raw = 0;
+static const int binary_codec_lossless = 1;
+static const int binary_codec_quantised = 2;
+static const int binary_chunk_size = 1 << 16;
+
+
+
+//=============================================================================
+//  Per-process snapshot index layout
+//
+//  index    : char magic[8], int version, int Npiece,
+//             Npiece x {int Nsph, int Nstar}
+//
+//  Written in place of a single snapshot file when every MPI process writes
+//  its own particles to a separate, complete binary snapshot (a "piece",
+//  see BinarySnapshotIndex::PieceFilename).  The snapshot consists of the
+//  particles of all pieces in order of process rank.
+//=============================================================================
+static const char binary_index_magic[8] = {'G','A','N','D','A','L','F','I'};
+static const int binary_index_version = 1;
+
+
+
+//=============================================================================
+//  Struct BinaryUnitRecord
+/// \brief   Unit information recorded in the header of a binary snapshot.
+//=============================================================================
+struct BinaryUnitRecord {
+  string name;                      ///< Unit category (e.g. r, v, rho)
+  string unit;                      ///< Output unit string
+  DOUBLE outscale;                  ///< Scaling from code to output units
+};
+
+
+
+//=============================================================================
+//  Struct BinaryFieldRecord
+/// \brief   Description of one contiguous data block in a binary snapshot.
+//=============================================================================
+struct BinaryFieldRecord {
+  string name;                      ///< Array name (e.g. x, vx, rho)
+  string species;                   ///< Particle species (sph or star)
+  string unit;                      ///< Unit category of array
+  int typesize;                     ///< Bytes per element (4 or 8)
+  int N;                            ///< No. of elements in block
+  long long offset;                 ///< Byte offset of block in file
+  int codec;                        ///< Compression codec of block
+  int chunksize;                    ///< Elements per compressed chunk
+  long long nbytes;                 ///< Size of block in file (bytes)
+  DOUBLE param;                     ///< Codec parameter (e.g. rel. error)
+};
+
+
+
+//=============================================================================
+//  Class BinarySnapshotHeader
+/// \brief   Self-describing header of native binary snapshot files.
+/// \details Holds the unit and field tables of a binary snapshot, computes
+///          the file offsets of all data blocks and converts the header
+///          to and from its packed on-disk representation.
+//=============================================================================
+class BinarySnapshotHeader
+{
+ public:
+
+  BinarySnapshotHeader();
+
+  void AddUnit(string, string, DOUBLE);
+  void AddField(string, string, string, int);
+  void ComputeOffsets(void);
+  int FindField(string, string) const;
+  int FindUnit(string) const;
+  long long HeaderSize(void) const;
+  string Pack(void) const;
+  bool ReadHeader(ifstream &);
+  bool Unpack(const char *, long long);
+  bool Valid(long long) const;
+  bool Compressed(void) const;
+
+  int version;                      ///< Format version of snapshot
+  int ndim;                         ///< Dimensionality of snapshot
+  int precision;                    ///< Bytes per floating point value
+  int Nsph;                         ///< Total no. of SPH particles
+  int Nstar;                        ///< Total no. of star particles
+  DOUBLE t;                         ///< Time (in output units)
+  vector<BinaryUnitRecord> units;   ///< Table of units
+  vector<BinaryFieldRecord> fields; ///< Table of data blocks
+
+};
+
+
+
+//=============================================================================
+//  Class BinarySnapshotIndex
+/// \brief   Index of a binary snapshot written as one piece per MPI process.
+/// \details Records the no. of SPH and star particles of every piece, so
+///          readers can merge the pieces into a single snapshot.
+//=============================================================================
+class BinarySnapshotIndex
+{
+ public:
+
+  static bool IsIndex(const char *, long long);
+  static string PieceFilename(string, int);
+  string Pack(void) const;
+  bool ReadIndex(ifstream &);
+  bool Unpack(const char *, long long);
+
+  vector<int> Nsph;                 ///< No. of SPH particles of each piece
+  vector<int> Nstar;                ///< No. of star particles of each piece
+
+};
+#endif
@@ -58,6 +58,7 @@ BinarySubTree<ndim>::BinarySubTree(int Nleafmaxaux, FLOAT thetamaxsqdaux,
   thetamaxsqd = thetamaxsqdaux;
   gravity_mac = gravity_mac_aux;
   multipole = multipole_aux;
+  simbox = NULL;
 }
 
 
@@ -187,15 +188,15 @@ void BinarySubTree<ndim>::ComputeSubTreeSize(void)
 
   // Increase level until tree can contain all particles
   ltot = 0;
-  while (Nleafmax*pow(2,ltot) < Ntotmax) {
+  while (Nleafmax*(1 << ltot) < Ntotmax) {
     ltot++;
   };
 
   // Set total number of leaf/grid cells and tree cells
-  gtot = pow(2,ltot);
+  gtot = 1 << ltot;
   Ncell = 2*gtot - 1;
   Ncellmax = Ncell;
-  Ntotmax = Nleafmax*pow(2,ltot);
+  Ntotmax = Nleafmax*(1 << ltot);
 
   // Optional output (for debugging)
 #if defined(VERIFY_ALL)
@@ -235,7 +236,7 @@ void BinarySubTree<ndim>::CreateSubTreeStructure(void)
 
   // Set pointers to second child-cell (if opened) and next cell (if unopened)
   for (l=0; l<ltot; l++) {
-    c2L[l] = pow(2,ltot - l);
+    c2L[l] = 1 << (ltot - l);
     cNL[l] = 2*c2L[l] - 1;
   }
 
@@ -452,6 +453,26 @@ void BinarySubTree<ndim>::LoadParticlesToSubTree(void)
 template <int ndim>
 void BinarySubTree<ndim>::StockCellProperties
 (SphParticle<ndim> *sphdata)        ///< SPH particle data array
+{
+  StockCellProperties(sphdata,NULL,tree);
+
+  return;
+}
+
+
+
+//=============================================================================
+//  BinarySubTree::StockCellProperties
+/// Calculate the physical properties of all cells in the tree and store them 
+/// in the array 'cell' (ordered identically to the main tree array).  
+/// Particles flagged in 'excluded' (if not NULL) do not contribute to the 
+/// cells, e.g. when computing cells of a locally essential tree.
+//=============================================================================
+template <int ndim>
+void BinarySubTree<ndim>::StockCellProperties
+(SphParticle<ndim> *sphdata,        ///< [in] SPH particle data array
+ bool *excluded,                    ///< [in] Flags of excluded particles
+ BinaryTreeCell<ndim> *cell)        ///< [out] Array of stocked tree cells
 {
   int c,cc,ccc;                     // Cell counters
   int i;                            // Particle counter
@@ -472,17 +493,19 @@ void BinarySubTree<ndim>::StockCellProperties
 
   // Zero all summation variables for all cells
   for (c=0; c<Ncell; c++) {
-    tree[c].Nactive = 0;
-    tree[c].N = 0;
-    tree[c].m = 0.0;
-    tree[c].hmax = 0.0;
-    tree[c].rmax = 0.0;
-    tree[c].dhmaxdt = 0.0;
-    tree[c].drmaxdt = 0.0;
-    tree[c].cdistsqd = big_number;
-    for (k=0; k<ndim; k++) tree[c].r[k] = 0.0;
-    for (k=0; k<ndim; k++) tree[c].v[k] = 0.0;
-    for (k=0; k<5; k++) tree[c].q[k] = 0.0;
+    cell[c].Nactive = 0;
+    cell[c].N = 0;
+    cell[c].m = 0.0;
+    cell[c].hmax = 0.0;
+    cell[c].rmax = 0.0;
+    cell[c].dhmaxdt = 0.0;
+    cell[c].drmaxdt = 0.0;
+    cell[c].cdistsqd = big_number;
+    cell[c].worktot = 0.0;
+    for (k=0; k<ndim; k++) cell[c].r[k] = 0.0;
+    for (k=0; k<ndim; k++) cell[c].rwork[k] = 0.0;
+    for (k=0; k<ndim; k++) cell[c].v[k] = 0.0;
+    for (k=0; k<5; k++) cell[c].q[k] = 0.0;
   }
 
   for (c=0; c<Ncell; c++)
@@ -499,18 +522,22 @@ void BinarySubTree<ndim>::StockCellProperties
 
     // If this is a leaf cell, sum over all particles
     //-------------------------------------------------------------------------
-    if (tree[c].c2 == 0) {
-      j = tree[c].ifirst;
+    if (cell[c].c2 == 0) {
+      j = cell[c].ifirst;
 
       // Loop over all particles in cell summing their contributions
       while (j != -1) {
         i = GlobalId(j);
-        tree[c].N++;
-        if (sphdata[i].active) tree[c].Nactive++;
-        tree[c].hmax = max(tree[c].hmax,sphdata[i].h);
-        tree[c].m += sphdata[i].m;
-        for (k=0; k<ndim; k++) tree[c].r[k] += sphdata[i].m*sphdata[i].r[k];
-        for (k=0; k<ndim; k++) tree[c].v[k] += sphdata[i].m*sphdata[i].v[k];
+        if (excluded != NULL && excluded[i]) {
+          j = inext[j];
+          continue;
+        }
+        cell[c].N++;
+        if (sphdata[i].active) cell[c].Nactive++;
+        cell[c].hmax = max(cell[c].hmax,sphdata[i].h);
+        cell[c].m += sphdata[i].m;
+        for (k=0; k<ndim; k++) cell[c].r[k] += sphdata[i].m*sphdata[i].r[k];
+        for (k=0; k<ndim; k++) cell[c].v[k] += sphdata[i].m*sphdata[i].v[k];
         for (k=0; k<ndim; k++) {
           if (sphdata[i].r[k] < crmin[c*ndim + k])
             crmin[c*ndim + k] = sphdata[i].r[k];
@@ -521,37 +548,41 @@ void BinarySubTree<ndim>::StockCellProperties
       };
 
       // Normalise all cell values
-      if (tree[c].N > 0) {
-        for (k=0; k<ndim; k++) tree[c].r[k] /= tree[c].m;
-        for (k=0; k<ndim; k++) tree[c].v[k] /= tree[c].m;
+      if (cell[c].N > 0) {
+        for (k=0; k<ndim; k++) cell[c].r[k] /= cell[c].m;
+        for (k=0; k<ndim; k++) cell[c].v[k] /= cell[c].m;
         for (k=0; k<ndim; k++) 
           dr[k] = 0.5*(crmax[c*ndim + k] - crmin[c*ndim + k]);
-        tree[c].cdistsqd = factor*DotProduct(dr,dr,ndim);
-        for (k=0; k<ndim; k++) dr[k] = max(crmax[c*ndim + k] - tree[c].r[k],
-		  			 tree[c].r[k] - crmin[c*ndim + k]);
-        tree[c].rmax = sqrt(DotProduct(dr,dr,ndim));
+        cell[c].cdistsqd = factor*DotProduct(dr,dr,ndim);
+        for (k=0; k<ndim; k++) dr[k] = max(crmax[c*ndim + k] - cell[c].r[k],
+		  			 cell[c].r[k] - crmin[c*ndim + k]);
+        cell[c].rmax = sqrt(DotProduct(dr,dr,ndim));
       }
 
       // Compute quadrupole moment terms if selected
       if (multipole == "quadrupole") {
-        j = tree[c].ifirst;
+        j = cell[c].ifirst;
 
         while (j != -1) {
           i = GlobalId(j);
+          if (excluded != NULL && excluded[i]) {
+            j = inext[j];
+            continue;
+          }
           mi = sphdata[i].m;
-          for (k=0; k<ndim; k++) dr[k] = sphdata[i].r[k] - tree[c].r[k];
+          for (k=0; k<ndim; k++) dr[k] = sphdata[i].r[k] - cell[c].r[k];
           drsqd = DotProduct(dr,dr,ndim);
           if (ndim == 3) {
-            tree[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
-            tree[c].q[1] += mi*3.0*dr[0]*dr[1];
-            tree[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
-            tree[c].q[3] += mi*3.0*dr[2]*dr[0];
-            tree[c].q[4] += mi*3.0*dr[2]*dr[1];
+            cell[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
+            cell[c].q[1] += mi*3.0*dr[0]*dr[1];
+            cell[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
+            cell[c].q[3] += mi*3.0*dr[2]*dr[0];
+            cell[c].q[4] += mi*3.0*dr[2]*dr[1];
           }
           else if (ndim == 2) {
-            tree[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
-            tree[c].q[1] += mi*3.0*dr[0]*dr[1];
-            tree[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
+            cell[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
+            cell[c].q[1] += mi*3.0*dr[0]*dr[1];
+            cell[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
           }
           j = inext[j];
         }
@@ -562,62 +593,62 @@ void BinarySubTree<ndim>::StockCellProperties
     //-------------------------------------------------------------------------
     else {
       cc = c + 1;
-      ccc = tree[c].c2;
-      tree[c].N = tree[cc].N + tree[ccc].N;
-
-      if (tree[c].N > 0) {
-        tree[c].hmax = max(tree[cc].hmax,tree[ccc].hmax);
-        tree[c].m = tree[cc].m + tree[ccc].m;
-        for (k=0; k<ndim; k++) tree[c].r[k] =
-          (tree[cc].m*tree[cc].r[k] + tree[ccc].m*tree[ccc].r[k])/tree[c].m;
-        for (k=0; k<ndim; k++) tree[c].v[k] =
-          (tree[cc].m*tree[cc].v[k] + tree[ccc].m*tree[ccc].v[k])/tree[c].m;
+      ccc = cell[c].c2;
+      cell[c].N = cell[cc].N + cell[ccc].N;
+
+      if (cell[c].N > 0) {
+        cell[c].hmax = max(cell[cc].hmax,cell[ccc].hmax);
+        cell[c].m = cell[cc].m + cell[ccc].m;
+        for (k=0; k<ndim; k++) cell[c].r[k] =
+          (cell[cc].m*cell[cc].r[k] + cell[ccc].m*cell[ccc].r[k])/cell[c].m;
+        for (k=0; k<ndim; k++) cell[c].v[k] =
+          (cell[cc].m*cell[cc].v[k] + cell[ccc].m*cell[ccc].v[k])/cell[c].m;
         for (k=0; k<ndim; k++)
           crmin[ndim*c + k] = min(crmin[ndim*cc+k],crmin[ndim*ccc+k]);
         for (k=0; k<ndim; k++)
           crmax[ndim*c + k] = max(crmax[ndim*cc+k],crmax[ndim*ccc+k]);
         for (k=0; k<ndim; k++) 
           dr[k] = 0.5*(crmax[c*ndim + k] - crmin[c*ndim + k]);
-        tree[c].cdistsqd = factor*DotProduct(dr,dr,ndim);
-        for (k=0; k<ndim; k++) dr[k] = max(crmax[c*ndim + k] - tree[c].r[k],
-                                           tree[c].r[k] - crmin[c*ndim + k]);
-        tree[c].rmax = sqrt(DotProduct(dr,dr,ndim));
+        cell[c].cdistsqd = factor*DotProduct(dr,dr,ndim);
+        for (k=0; k<ndim; k++) dr[k] = max(crmax[c*ndim + k] - cell[c].r[k],
+                                           cell[c].r[k] - crmin[c*ndim + k]);
+        cell[c].rmax = sqrt(DotProduct(dr,dr,ndim));
       }
 
       // Now add individual quadrupole moment terms
-      if (multipole == "quadrupole" && tree[cc].N > 0) {
-        mi = tree[cc].m;
-        for (k=0; k<ndim; k++) dr[k] = tree[cc].r[k] - tree[c].r[k];
+      if (multipole == "quadrupole" && cell[cc].N > 0) {
+        mi = cell[cc].m;
+        for (k=0; k<ndim; k++) dr[k] = cell[cc].r[k] - cell[c].r[k];
         drsqd = DotProduct(dr,dr,ndim);
         if (ndim == 3) {
-          tree[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
-          tree[c].q[1] += mi*3.0*dr[0]*dr[1];
-          tree[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
-          tree[c].q[3] += mi*3.0*dr[2]*dr[0];
-          tree[c].q[4] += mi*3.0*dr[2]*dr[1];
+          cell[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
+          cell[c].q[1] += mi*3.0*dr[0]*dr[1];
+          cell[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
+          cell[c].q[3] += mi*3.0*dr[2]*dr[0];
+          cell[c].q[4] += mi*3.0*dr[2]*dr[1];
         }
         else if (ndim == 2) {
-          tree[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
-          tree[c].q[1] += mi*3.0*dr[0]*dr[1];
-          tree[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
+          cell[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
+          cell[c].q[1] += mi*3.0*dr[0]*dr[1];
+          cell[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
         }
       }
 
-      if (multipole == "quadrupole" && tree[ccc].N > 0) {
-        mi = tree[ccc].m;
-        for (k=0; k<ndim; k++) dr[k] = tree[ccc].r[k] - tree[c].r[k];
+      if (multipole == "quadrupole" && cell[ccc].N > 0) {
+        mi = cell[ccc].m;
+        for (k=0; k<ndim; k++) dr[k] = cell[ccc].r[k] - cell[c].r[k];
         drsqd = DotProduct(dr,dr,ndim);
         if (ndim == 3) {
-          tree[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
-          tree[c].q[1] += mi*3.0*dr[0]*dr[1];
-          tree[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
-          tree[c].q[3] += mi*3.0*dr[2]*dr[0];
-          tree[c].q[4] += mi*3.0*dr[2]*dr[1];
+          cell[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
+          cell[c].q[1] += mi*3.0*dr[0]*dr[1];
+          cell[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
+          cell[c].q[3] += mi*3.0*dr[2]*dr[0];
+          cell[c].q[4] += mi*3.0*dr[2]*dr[1];
         }
         else if (ndim == 2) {
-          tree[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
-          tree[c].q[1] += mi*3.0*dr[0]*dr[1];
-          tree[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
+          cell[c].q[0] += mi*(3.0*dr[0]*dr[0] - drsqd);
+          cell[c].q[1] += mi*3.0*dr[0]*dr[1];
+          cell[c].q[2] += mi*(3.0*dr[1]*dr[1] - drsqd);
         }
       }
 
@@ -629,13 +660,13 @@ void BinarySubTree<ndim>::StockCellProperties
 
 
 #if defined(VERIFY_ALL)
-  cout << "Root cell position1 : " << tree[0].r[0] << "   " 
-       << tree[0].r[1] << endl;
-  cout << "Mass of root cell1 : " << tree[0].m << endl;
+  cout << "Root cell position1 : " << cell[0].r[0] << "   " 
+       << cell[0].r[1] << endl;
+  cout << "Mass of root cell1 : " << cell[0].m << endl;
   cout << "Bounding box : " << crmin[0] << "   " << crmax[0] 
        << "   " << crmin[1] << "   " << crmax[1] << endl;
-  cout << "No. inside root : " << tree[0].N << endl;
-  cout << "rmax : " << tree[0].rmax << "   " << tree[0].hmax << endl;
+  cout << "No. inside root : " << cell[0].N << endl;
+  cout << "rmax : " << cell[0].rmax << "   " << cell[0].hmax << endl;
 #endif
 
 
@@ -774,6 +805,7 @@ int BinarySubTree<ndim>::ComputeGatherNeighbourList
   int j;                            // Aux. particle counter
   int k;                            // Neighbour counter
   int Ntemp = Nneib;                // Aux. neighbour counter
+  bool periodic;                    // Wrap distances periodically?
   FLOAT dr[ndim];                   // Relative position vector
   FLOAT drsqd;                      // Distance squared
   FLOAT rc[ndim];                   // Position of cell
@@ -781,6 +813,7 @@ int BinarySubTree<ndim>::ComputeGatherNeighbourList
   //FLOAT neibrange;                  // Max. range of gather neighbours
 
   for (k=0; k<ndim; k++) rc[k] = cell->r[k];
+  periodic = (simbox != NULL && simbox->implicit_periodic);
   hrangemax = cell->rmax + kernrange*hmax;
 
   // Start with root cell and walk through entire tree
@@ -789,6 +822,7 @@ int BinarySubTree<ndim>::ComputeGatherNeighbourList
   //===========================================================================
   while (cc < Ncell) {
     for (k=0; k<ndim; k++) dr[k] = tree[cc].r[k] - rc[k];
+    if (periodic) NearestPeriodicVector(*simbox,dr);
     drsqd = DotProduct(dr,dr,ndim);
     //neibrange = tree[cc].rmax + hrangemax;
 
@@ -832,6 +866,7 @@ int BinarySubTree<ndim>::ComputeGatherNeighbourList
     i = GlobalId(neiblist[j]);
     //cout << "i : " << i << "    " << j << "     " << Nneibmax << "    " << neiblist[j] << endl;
     for (k=0; k<ndim; k++) dr[k] = sphdata[i].r[k] - rc[k];
+    if (periodic) NearestPeriodicVector(*simbox,dr);
     drsqd = DotProduct(dr,dr,ndim);
     if (drsqd < hrangemax) neiblist[Ntemp++] = i;
   }
@@ -862,6 +897,7 @@ int BinarySubTree<ndim>::ComputeNeighbourList
   int j;                            // Aux. particle counter
   int k;                            // Neighbour counter
   int Ntemp = Nneib;                // ..
+  bool periodic;                    // Wrap distances periodically?
   FLOAT dr[ndim];                   // Relative position vector
   FLOAT drsqd;                      // Distance squared
   FLOAT rc[ndim];                   // Position of cell
@@ -871,6 +907,7 @@ int BinarySubTree<ndim>::ComputeNeighbourList
   //FLOAT scatterrange;               // ..
 
   for (k=0; k<ndim; k++) rc[k] = cell->r[k];
+  periodic = (simbox != NULL && simbox->implicit_periodic);
   hrangemax = cell->rmax + kernrange*cell->hmax;
   rmax = cell->rmax;
 
@@ -880,6 +917,7 @@ int BinarySubTree<ndim>::ComputeNeighbourList
   //===========================================================================
   while (cc < Ncell) {
     for (k=0; k<ndim; k++) dr[k] = tree[cc].r[k] - rc[k];
+    if (periodic) NearestPeriodicVector(*simbox,dr);
     drsqd = DotProduct(dr,dr,ndim);
     //scatterrange = tree[cc].rmax + rmax + kernrange*tree[cc].hmax;
     //gatherrange = tree[cc].rmax + hrangemax;
@@ -924,6 +962,7 @@ int BinarySubTree<ndim>::ComputeNeighbourList
   for (j=Ntemp; j<Nneib; j++) {
     i = GlobalId(neiblist[j]);
     for (k=0; k<ndim; k++) dr[k] = sphdata[i].r[k] - rc[k];
+    if (periodic) NearestPeriodicVector(*simbox,dr);
     drsqd = DotProduct(dr,dr,ndim);
     if (drsqd < hrangemax || drsqd <
         (rmax + kernrange*sphdata[i].h)*(rmax + kernrange*sphdata[i].h));
@@ -1023,7 +1062,7 @@ int BinarySubTree<ndim>::ComputeGravityInteractionList
       // If cell is a leaf-cell with only one particle, more efficient to
       // compute the gravitational contribution from the particle than the cell
       if (tree[cc].c2 == 0 && tree[cc].N == 1 && Ndirect < Ndirectmax)
-        directlist[Ndirect++] = tree[cc].ifirst;
+        directlist[Ndirect++] = GlobalId(tree[cc].ifirst);
       else if (Ngravcell < Ngravcellmax)
         gravcelllist[Ngravcell++] = &(tree[cc]);
       else
@@ -1046,7 +1085,7 @@ int BinarySubTree<ndim>::ComputeGravityInteractionList
       else if (tree[cc].c2 == 0 && Ndirect + Nleafmax <= Ndirectmax) {
         i = tree[cc].ifirst;
         while (i != -1) {
-          directlist[Ndirect++] = i;
+          directlist[Ndirect++] = GlobalId(i);
        	  i = inext[i];
         };
         cc = tree[cc].cnext;
@@ -1088,6 +1127,227 @@ int BinarySubTree<ndim>::ComputeGravityInteractionList
 
 
 
+#if defined MPI_PARALLEL
+//=============================================================================
+//  BinarySubTree::CreateLocallyEssentialTree
+/// Append all cells of the sub-tree required by another MPI node to compute 
+/// the gravitational forces on its particles (i.e. the 'locally essential 
+/// tree') to 'letcells'.  Cell properties are recomputed without the excluded 
+/// particles (e.g. ghosts, or particles already exported as MPI ghosts to the 
+/// node).  Cells obeying the geometric opening criterion for any point inside 
+/// the node box are sent unopened; opened leaf cells are sent followed by a 
+/// single-particle cell for each of their particles.  Opened cells are kept 
+/// so the receiving node can walk the pruned tree as a normal sub-tree 
+/// (with cell ids relative to the first appended cell).  Returns the number 
+/// of appended cells.
+//=============================================================================
+template <int ndim>
+int BinarySubTree<ndim>::CreateLocallyEssentialTree
+(Box<ndim> &nodebox,                ///< [in] Bounding box of MPI node
+ bool *excluded,                    ///< [in] Flags of excluded particles
+ SphParticle<ndim> *sphdata,        ///< [in] SPH particle data
+ vector<BinaryTreeCell<ndim> > &letcells)  ///< [inout] Exported cells
+{
+  int c;                            // Cell counter
+  int cc;                           // i.d. of exported cell
+  int i;                            // Particle id
+  int j;                            // Aux. particle counter
+  int k;                            // Dimension counter
+  int Nfirst = letcells.size();     // i.d. of first exported cell
+  FLOAT dr[ndim];                   // Distance vector to node box
+  FLOAT drsqd;                      // Distance squared
+  vector<int> openlet;              // Opened exported cells
+  vector<int> opennext;             // Next (local) cell of opened cells
+  BinaryTreeCell<ndim> *cell;       // Cells without excluded particles
+  BinaryTreeCell<ndim> pcell;       // Single-particle cell
+
+  debug2("[BinarySubTree::CreateLocallyEssentialTree]");
+
+  // Recompute all cell properties without the excluded particles
+  cell = new BinaryTreeCell<ndim>[Ncell];
+  for (c=0; c<Ncell; c++) cell[c] = tree[c];
+  StockCellProperties(sphdata,excluded,cell);
+
+
+  // Walk through all cells in tree, opening cells that are too close
+  //===========================================================================
+  c = 0;
+  while (c < Ncell) {
+
+    // Set next cell of all opened cells once all children are exported
+    while (openlet.size() > 0 && opennext.back() <= c) {
+      letcells[openlet.back()].cnext = letcells.size() - Nfirst;
+      openlet.pop_back();
+      opennext.pop_back();
+    }
+
+    // Skip cells without any contributing particles
+    if (cell[c].N == 0) {
+      c = cell[c].cnext;
+      continue;
+    }
+
+    // Find minimum distance between the cell COM and the node box
+    for (k=0; k<ndim; k++) {
+      dr[k] = max(nodebox.boxmin[k] - cell[c].r[k],(FLOAT) 0.0);
+      dr[k] = max(cell[c].r[k] - nodebox.boxmax[k],dr[k]);
+    }
+    drsqd = DotProduct(dr,dr,ndim);
+
+    cc = letcells.size();
+    letcells.push_back(cell[c]);
+    letcells[cc].ifirst = -1;
+    letcells[cc].ilast = -1;
+    letcells[cc].Nactive = 0;
+
+    // If cell is far enough away from the entire node, send unopened
+    //-------------------------------------------------------------------------
+    if (drsqd > cell[c].cdistsqd) {
+      letcells[cc].c2 = 0;
+      letcells[cc].cnext = cc + 1 - Nfirst;
+      c = cell[c].cnext;
+    }
+
+    // If not a leaf-cell, then open cell to first child cell
+    //-------------------------------------------------------------------------
+    else if (cell[c].c2 != 0) {
+      letcells[cc].c2 = cc + 1 - Nfirst;
+      openlet.push_back(cc);
+      opennext.push_back(cell[c].cnext);
+      c++;
+    }
+
+    // If leaf-cell, send all particles as individual cells
+    //-------------------------------------------------------------------------
+    else {
+      letcells[cc].c2 = cc + 1 - Nfirst;
+      j = cell[c].ifirst;
+      while (j != -1) {
+        i = GlobalId(j);
+        if (!excluded[i]) {
+          pcell = letcells[cc];
+          pcell.c2 = 0;
+          pcell.cnext = letcells.size() + 1 - Nfirst;
+          pcell.N = 1;
+          pcell.m = sphdata[i].m;
+          pcell.rmax = 0.0;
+          pcell.hmax = 0.0;
+          pcell.cdistsqd = 0.0;
+          for (k=0; k<ndim; k++) pcell.r[k] = sphdata[i].r[k];
+          for (k=0; k<ndim; k++) pcell.v[k] = sphdata[i].v[k];
+          for (k=0; k<5; k++) pcell.q[k] = 0.0;
+          letcells.push_back(pcell);
+        }
+        j = inext[j];
+      };
+      letcells[cc].cnext = letcells.size() - Nfirst;
+      c = cell[c].cnext;
+    }
+
+  };
+  //===========================================================================
+
+  // Close all remaining opened cells
+  while (openlet.size() > 0) {
+    letcells[openlet.back()].cnext = letcells.size() - Nfirst;
+    openlet.pop_back();
+    opennext.pop_back();
+  }
+
+  delete[] cell;
+
+  return letcells.size() - Nfirst;
+}
+
+
+
+//=============================================================================
+//  BinarySubTree::GraftLocallyEssentialTree
+/// Replace all cells of the (particle-free) sub-tree with the cells of the 
+/// locally essential tree received from another MPI node.
+//=============================================================================
+template <int ndim>
+void BinarySubTree<ndim>::GraftLocallyEssentialTree
+(int Nletcell,                      ///< [in] No. of received cells
+ BinaryTreeCell<ndim> *letcells)    ///< [in] Received cells
+{
+  int c;                            // Cell counter
+
+  debug2("[BinarySubTree::GraftLocallyEssentialTree]");
+
+  // Allocate minimal sub-tree memory, then grow the cell array if required
+  if (!allocated_tree) {
+    Ntotmax = 0;
+    ComputeSubTreeSize();
+    AllocateSubTreeMemory();
+  }
+  if (Nletcell > Ncellmax) {
+    delete[] tree;
+    Ncellmax = 2*Nletcell;
+    tree = new struct BinaryTreeCell<ndim>[Ncellmax];
+  }
+
+  Ncell = Nletcell;
+  Nsph = 0;
+  Ntot = 0;
+  for (c=0; c<Ncell; c++) tree[c] = letcells[c];
+
+  return;
+}
+
+
+
+//=============================================================================
+//  BinarySubTree::ComputeDistantGravityInteractionList
+/// Computes the list of distant cells (and number, Ngravcell) interacting 
+/// with the active particles inside cell c by walking a grafted locally 
+/// essential tree.  Cells are accepted if all particles in cell c lie beyond 
+/// their opening distance, i.e. the same geometric criterion used to prune 
+/// the tree on the sending node.  Leaf cells of the grafted tree cannot be 
+/// opened and are therefore always accepted.  If the list array overflows, 
+/// return with error code (-1) to reallocate more memory.
+//=============================================================================
+template <int ndim>
+int BinarySubTree<ndim>::ComputeDistantGravityInteractionList
+(BinaryTreeCell<ndim> *cell,        ///< [in] Pointer to cell
+ int Ngravcellmax,                  ///< [in] Max. no. of cell interactions
+ int &Ngravcell,                    ///< [inout] No. of cell interactions
+ BinaryTreeCell<ndim> **gravcelllist)  ///< [inout] List of cell ids
+{
+  int cc = 0;                       // Cell counter
+  int k;                            // Dimension counter
+  FLOAT dr[ndim];                   // Relative position vector
+  FLOAT drsqd;                      // Distance squared
+  FLOAT rmax = cell->rmax;          // Radius of sphere containing particles
+
+  // Walk through all cells in tree
+  //===========================================================================
+  while (cc < Ncell) {
+    for (k=0; k<ndim; k++) dr[k] = tree[cc].r[k] - cell->r[k];
+    drsqd = DotProduct(dr,dr,ndim);
+
+    // Add cell if far enough away to use the COM approximation, or if it 
+    // cannot be opened.  Otherwise open cell to first child cell.
+    if (tree[cc].c2 == 0 || 
+        drsqd > pow(sqrt(tree[cc].cdistsqd) + rmax,2)) {
+      if (Ngravcell < Ngravcellmax)
+        gravcelllist[Ngravcell++] = &(tree[cc]);
+      else
+        return -1;
+      cc = tree[cc].cnext;
+    }
+    else
+      cc++;
+
+  };
+  //===========================================================================
+
+  return 1;
+}
+#endif
+
+
+
 #if defined(VERIFY_ALL)
 //=============================================================================
 //  BinarySubTree::ValidateTree
@@ -35,13 +35,37 @@
 #include "InlineFuncs.h"
 #include "SphParticle.h"
 #include "Debug.h"
+#if defined MPI_PARALLEL
+#include "Ghosts.h"
+#endif
 #if defined _OPENMP
 #include <omp.h>
+#else
+#include <sys/time.h>
 #endif
 using namespace std;
 
 
 
+#if defined MPI_PARALLEL
+//=============================================================================
+//  CellWallTime
+/// Wall-clock time (in seconds) used to measure the cost of each leaf cell.
+//=============================================================================
+static inline DOUBLE CellWallTime(void)
+{
+#if defined _OPENMP
+  return omp_get_wtime();
+#else
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return (DOUBLE) tv.tv_sec + 1.0e-6*(DOUBLE) tv.tv_usec;
+#endif
+}
+#endif
+
+
+
 //=============================================================================
 //  BinaryTree::BinaryTree
 /// BinaryTree constructor.  Initialises various variables.
@@ -56,7 +80,6 @@ BinaryTree<ndim>::BinaryTree(int Nleafmaxaux, FLOAT thetamaxsqdaux,
   Nlocalsubtrees = Nthreads;
   Nmpisubtrees = max(Nmpi - 1,0);
   Nsubtreemax = Nlocalsubtrees + Nmpisubtrees;
-  Nsubtree = Nsubtreemax;
   Ntot = 0;
   Ntotmax = 0;
   Ntotmaxold = 0;
@@ -68,15 +91,16 @@ BinaryTree<ndim>::BinaryTree(int Nleafmaxaux, FLOAT thetamaxsqdaux,
 #if defined _OPENMP
   // Check that no. of threads is valid
   int ltot = 0;
-  while (pow(2,ltot) < Nthreads) {
+  while ((1 << ltot) < Nthreads) {
     ltot++;
   };
-  if (Nthreads != pow(2,ltot)) {
-    Nlocalsubtrees = pow(2,ltot-1);
+  if (Nthreads != (1 << ltot)) {
+    Nlocalsubtrees = 1 << (ltot - 1);
     Nsubtreemax = Nlocalsubtrees + Nmpisubtrees;
     cout << "Warning: the number of OpenMP threads is not a power of two. This is sub-optimal for the binary tree parallelization" << endl;
   }
 #endif
+  Nsubtree = Nlocalsubtrees;
   assert(Nlocalsubtrees > 0);
   assert(Nsubtreemax > 0);
 }
@@ -121,11 +145,24 @@ void BinaryTree<ndim>::AllocateTreeMemory(void)
     for (int k=0; k<ndim; k++) rk[k] = new FLOAT[Ntotmax];
     allocated_tree = true;
 
+    // First-touch the particle-indexed arrays in the same static partition
+    // as the particle loops so their pages are local to the using thread
+#pragma omp parallel for schedule(static) default(none)
+    for (int i=0; i<Ntotmax; i++) {
+      pc[i] = 0;
+      pw[i] = 0.0;
+      for (int k=0; k<ndim; k++) porder[k][i] = i;
+      for (int k=0; k<ndim; k++) rk[k][i] = 0.0;
+    }
+
+    // Create all local sub-trees, followed by the (initially empty) MPI 
+    // ghost trees used for the locally essential trees of other nodes
     if (!created_sub_trees) {
-      for (int i=0; i<Nsubtree; i++) {
+      for (int i=0; i<Nsubtree + Nmpisubtrees; i++) {
         subtrees.push_back(new BinarySubTree<ndim>(Nleafmax, thetamaxsqd,
 						   kernrange, gravity_mac, 
                                                    multipole));
+        subtrees.back()->simbox = box;
       }
       created_sub_trees = true;
     }
@@ -160,10 +197,10 @@ void BinaryTree<ndim>::DeallocateTreeMemory(void)
     for (int i=Nsubtree-1; i>=0; i--) subtrees[i]->DeallocateSubTreeMemory();
     for (int k=ndim-1; k>=0; k--) delete[] rk[k];
     for (int k=ndim-1; k>=0; k--) delete[] porder[k];
-    delete[] stree;
     delete[] tree;
     delete[] pw;
     delete[] pc;
+    delete[] klevel;
     allocated_tree = false;
   }
 
@@ -257,7 +294,7 @@ void BinaryTree<ndim>::BuildTree
   //---------------------------------------------------------------------------
   else {
 
-#pragma omp parallel for default(none) private(i) shared(sph)
+#pragma omp parallel for default(none) private(i) shared(sph,timestep)
     for (i=0; i<Nsubtree; i++) {
       BinarySubTree<ndim>* subtree = subtrees[i];
       subtree->ExtrapolateCellProperties(timestep);
@@ -297,12 +334,12 @@ void BinaryTree<ndim>::ComputeTreeSize(void)
 
   // Increase level until tree can contain all particles
   ltot = 0;
-  while (pow(2,ltot) < Nsubtree) {
+  while ((1 << ltot) < Nsubtree) {
     ltot++;
   };
 
   // Set total number of leaf/grid cells and tree cells
-  gtot = pow(2,ltot);
+  gtot = 1 << ltot;
   Ncell = 2*gtot - 1;
   Ncellmax = Ncell;
 
@@ -341,7 +378,7 @@ void BinaryTree<ndim>::CreateTreeStructure(void)
 
   // Set pointers to second child-cell (if opened) and next cell (if unopened)
   for (l=0; l<ltot; l++) {
-    c2L[l] = pow(2,ltot - l);
+    c2L[l] = 1 << (ltot - l);
     cNL[l] = 2*c2L[l] - 1;
   }
 
@@ -640,7 +677,7 @@ int BinaryTree<ndim>::ComputeActiveCellList
   debug2("[BinaryTree::ComputeActiveCellList]");
 
   // Iterate/loop over all sub-trees to find all cells containing active ptcls
-  for (it = subtrees.begin(); it != subtrees.end(); it++) {
+  for (it = subtrees.begin(); it != subtrees.begin() + Nsubtree; it++) {
     Nactive = (*it)->ComputeActiveCellList(Nactive,celllist);
     for (i=Nfirst; i<Nactive; i++) treelist[i] = (*it);
     Nfirst = Nactive;
@@ -703,7 +740,7 @@ int BinaryTree<ndim>::ComputeGatherNeighbourList
                                     // (summed over all sub-trees)
 
   // Iterate/loop over all sub-trees to find all gather neighbours
-  for (it = subtrees.begin(); it != subtrees.end(); it++) {
+  for (it = subtrees.begin(); it != subtrees.begin() + Nsubtree; it++) {
     Nneib = (*it)->ComputeGatherNeighbourList(cell,Nneib,Nneibmax,
                                               neiblist,hmax,sphdata);
     if (Nneib == -1) return Nneib;
@@ -736,7 +773,7 @@ int BinaryTree<ndim>::ComputeNeighbourList
                                     // (summed over all sub-trees)
 
   // Iterate/loop over all sub-trees to find all SPH neighbours
-  for (it = subtrees.begin(); it != subtrees.end(); it++) {
+  for (it = subtrees.begin(); it != subtrees.begin() + Nsubtree; it++) {
     Nneib = (*it)->ComputeNeighbourList(cell,Nneib,Nneibmax,
                                         neiblist,sphdata);
     if (Nneib == -1) return Nneib;
@@ -780,7 +817,7 @@ int BinaryTree<ndim>::ComputeGravityInteractionList
 
   // Iterate/loop over all sub-trees to find all SPH neighbours, direct-sum 
   // gravity and distant cell interaction lists.
-  for (it = subtrees.begin(); it != subtrees.end(); it++) {
+  for (it = subtrees.begin(); it != subtrees.begin() + Nsubtree; it++) {
     okflag = (*it)->ComputeGravityInteractionList(cell,Nneibmax,Ndirectmax,
 						  Ngravcellmax,Nneib,Ndirect,
 						  Ngravcell,neiblist,
@@ -789,6 +826,16 @@ int BinaryTree<ndim>::ComputeGravityInteractionList
     if (okflag == -1) return -1;
   }
 
+#if defined MPI_PARALLEL
+  // Add all distant cells from the locally essential trees of other nodes
+  for (it = subtrees.begin() + Nsubtree; it != subtrees.end(); it++) {
+    okflag = (*it)->ComputeDistantGravityInteractionList(cell,Ngravcellmax,
+                                                         Ngravcell,
+                                                         gravcelllist);
+    if (okflag == -1) return -1;
+  }
+#endif
+
   return 1;
 }
 
@@ -915,6 +962,163 @@ void BinaryTree<ndim>::ComputeCellQuadrupoleForces
 
 
 
+#if defined MPI_PARALLEL
+//=============================================================================
+//  BinaryTree::AddCellWork
+/// Record the measured cost (wall-clock time) of computing the active
+/// particles of a leaf cell.  The cost is added to the cell's total work and
+/// 'centre of work', and shared equally between the active particles so it
+/// can be used by the MPI load balancing.  Each leaf cell is only processed
+/// by one thread, so no locking is required.
+//=============================================================================
+template <int ndim>
+void BinaryTree<ndim>::AddCellWork
+(BinaryTreeCell<ndim> *cell,        ///< [inout] Pointer to leaf cell
+ int Nactive,                       ///< [in] No. of active ptcls in cell
+ int *activelist,                   ///< [in] List of active particle ids
+ DOUBLE twork,                      ///< [in] Measured cost of cell
+ Sph<ndim> *sph)                    ///< [inout] Pointer to SPH object
+{
+  int i;                            // Particle id
+  int j;                            // Aux. particle counter
+  int k;                            // Dimension counter
+  FLOAT rwork[ndim];                // Work-weighted position of ptcls
+  FLOAT workpart;                   // Work per active particle
+
+  if (Nactive == 0 || twork <= 0.0) return;
+
+  workpart = (FLOAT) twork/(FLOAT) Nactive;
+  for (k=0; k<ndim; k++) rwork[k] = 0.0;
+
+  for (j=0; j<Nactive; j++) {
+    i = activelist[j];
+    sph->sphintdata[i].work += workpart;
+    for (k=0; k<ndim; k++) rwork[k] += workpart*sph->sphdata[i].r[k];
+  }
+
+  for (k=0; k<ndim; k++) cell->rwork[k] = (cell->worktot*cell->rwork[k] +
+    rwork[k])/(cell->worktot + (FLOAT) twork);
+  cell->worktot += (FLOAT) twork;
+
+  return;
+}
+#endif
+
+
+
+//=============================================================================
+//  BinaryTree::MpiGhostUpdatePending
+/// Returns true if an update of the MPI ghosts has been started but not yet
+/// completed.  The force loops then first compute all cells without MPI
+/// ghost neighbours, so the communication overlaps with the computation.
+//=============================================================================
+template <int ndim>
+bool BinaryTree<ndim>::MpiGhostUpdatePending(void)
+{
+#if defined MPI_PARALLEL
+  return (mpighosts != NULL && mpighosts->update_pending);
+#else
+  return false;
+#endif
+}
+
+
+
+//=============================================================================
+//  BinaryTree::ProgressMpiGhostUpdate
+/// Progress the pending MPI ghost update.  Only called by the master thread,
+/// i.e. the thread that initialised MPI.
+//=============================================================================
+template <int ndim>
+void BinaryTree<ndim>::ProgressMpiGhostUpdate(void)
+{
+#if defined MPI_PARALLEL
+#if defined _OPENMP
+  if (omp_get_thread_num() != 0) return;
+#endif
+  mpighosts->TestCopySphDataToGhosts();
+#endif
+  return;
+}
+
+
+
+//=============================================================================
+//  BinaryTree::FinishMpiGhostUpdate
+/// Wait for the pending MPI ghost update and copy the ghosts to the main
+/// particle arrays.
+//=============================================================================
+template <int ndim>
+void BinaryTree<ndim>::FinishMpiGhostUpdate
+(Sph<ndim> *sph)                    ///< Pointer to SPH object
+{
+#if defined MPI_PARALLEL
+  mpighosts->FinishCopySphDataToGhosts(sph);
+#endif
+  return;
+}
+
+
+
+#if defined MPI_PARALLEL
+//=============================================================================
+//  BinaryTree::CreateLocallyEssentialTree
+/// Append the locally essential tree of all local sub-trees required by the 
+/// MPI node with bounding box 'nodebox' to 'letcells'.  Cell ids of the 
+/// appended cells are relative to the first appended cell, so the cells can 
+/// be grafted directly by the receiving node.  Returns the no. of cells.
+//=============================================================================
+template <int ndim>
+int BinaryTree<ndim>::CreateLocallyEssentialTree
+(Box<ndim> &nodebox,                ///< [in] Bounding box of MPI node
+ bool *excluded,                    ///< [in] Flags of excluded particles
+ Sph<ndim> *sph,                    ///< [in] Pointer to SPH object
+ vector<BinaryTreeCell<ndim> > &letcells)  ///< [inout] Exported cells
+{
+  int c;                            // Cell counter
+  int i;                            // Sub-tree counter
+  int Nfirst = letcells.size();     // i.d. of first exported cell
+  int Nsubfirst;                    // i.d. of first cell of sub-tree
+
+  debug2("[BinaryTree::CreateLocallyEssentialTree]");
+
+  // Append the cells of each sub-tree in turn, shifting their cell ids so 
+  // the sub-trees are walked consecutively
+  for (i=0; i<Nsubtree; i++) {
+    Nsubfirst = letcells.size();
+    subtrees[i]->CreateLocallyEssentialTree(nodebox,excluded,
+                                            sph->sphdata,letcells);
+    for (c=Nsubfirst; c<(int) letcells.size(); c++) {
+      if (letcells[c].c2 != 0) letcells[c].c2 += Nsubfirst - Nfirst;
+      letcells[c].cnext += Nsubfirst - Nfirst;
+    }
+  }
+
+  return letcells.size() - Nfirst;
+}
+
+
+
+//=============================================================================
+//  BinaryTree::GraftLocallyEssentialTree
+/// Graft the locally essential tree received from another MPI node onto the 
+/// main tree as the i-th MPI ghost tree.  Returns a pointer to the sub-tree.
+//=============================================================================
+template <int ndim>
+BinarySubTree<ndim>* BinaryTree<ndim>::GraftLocallyEssentialTree
+(int i,                             ///< [in] i.d. of MPI ghost tree
+ int Nletcell,                      ///< [in] No. of received cells
+ BinaryTreeCell<ndim> *letcells)    ///< [in] Received cells
+{
+  assert(i >= 0 && i < Nmpisubtrees);
+  subtrees[Nsubtree + i]->GraftLocallyEssentialTree(Nletcell,letcells);
+
+  return subtrees[Nsubtree + i];
+}
+#endif
+
+
+
 //=============================================================================
 //  BinaryTree::UpdateAllSphProperties
 /// Compute all local 'gather' properties of currently active particles, and 
@@ -941,6 +1145,7 @@ void BinaryTree<ndim>::UpdateAllSphProperties
   int Nneibmax;                    // Max. no. of neighbours
   int *activelist;                 // List of active particle ids
   int *neiblist;                   // List of neighbour ids
+  bool periodic;                   // Use periodic wrapping for cell?
   FLOAT draux[ndim];               // Aux. relative position vector var
   FLOAT drsqdaux;                  // Distance squared
   FLOAT hrangesqd;                 // Kernel extent
@@ -971,7 +1176,7 @@ void BinaryTree<ndim>::UpdateAllSphProperties
   //===========================================================================
 #pragma omp parallel default(none) private(activelist,cc,cell,celldone,draux)\
   private(drsqd,drsqdaux,hmax,hrangesqd,i,j,jj,k,okflag,m,mu,Nactive,neiblist)\
-  private(Nneib,Nneibmax,r,rp,gpot,gpot2,m2,mu2,Ngather)\
+  private(Nneib,Nneibmax,periodic,r,rp,gpot,gpot2,m2,mu2,Ngather)\
   shared(sph,celllist,cactive,data,nbody,treelist)
   {
     Nneibmax = 2*sph->Ngather;
@@ -993,6 +1198,9 @@ void BinaryTree<ndim>::UpdateAllSphProperties
       cell = celllist[cc];
       celldone = 1;
       hmax = cell->hmax;
+#if defined MPI_PARALLEL
+      DOUBLE tcell = CellWallTime(); // Wall-clock time at start of cell
+#endif
 
       // If hmax is too small so the neighbour lists are invalid, make hmax
       // larger and then recompute for the current active cell.
@@ -1044,6 +1252,13 @@ void BinaryTree<ndim>::UpdateAllSphProperties
           for (k=0; k<ndim; k++) r[ndim*jj + k] = (FLOAT) data[j].r[k];
         }
 
+        // Only wrap distances if some neighbour may lie across the boundary
+        periodic = false;
+        for (jj=0; jj<Nneib && box->implicit_periodic && !periodic; jj++) {
+          for (k=0; k<ndim; k++) draux[k] = r[ndim*jj + k] - cell->r[k];
+          periodic = NearPeriodicImage(*box,draux,cell->rmax);
+        }
+
         // Loop over all active particles in the cell
         //---------------------------------------------------------------------
         for (j=0; j<Nactive; j++) {
@@ -1059,6 +1274,7 @@ void BinaryTree<ndim>::UpdateAllSphProperties
           //-------------------------------------------------------------------
           for (jj=0; jj<Nneib; jj++) {
             for (k=0; k<ndim; k++) draux[k] = r[ndim*jj + k] - rp[k];
+            if (periodic) NearestPeriodicVector(*box,draux);
             drsqdaux = DotProduct(draux,draux,ndim);
 
             // Record distance squared for all potential gather neighbours
@@ -1095,6 +1311,10 @@ void BinaryTree<ndim>::UpdateAllSphProperties
       } while (celldone == 0);
       //-----------------------------------------------------------------------
 
+#if defined MPI_PARALLEL
+      AddCellWork(cell,Nactive,activelist,CellWallTime() - tcell,sph);
+#endif
+
     }
     //=========================================================================
 
@@ -1138,6 +1358,8 @@ void BinaryTree<ndim>::UpdateAllSphHydroForces
   int cactive;                     // No. of active cells
   int cc;                          // Aux. cell counter
   int i;                           // Particle id
+  int ipass;                       // Pass counter over active cells
+  int iremote;                     // i.d. of first MPI ghost
   int j;                           // Aux. particle counter
   int jj;                          // Aux. particle counter
   int k;                           // Dimension counter
@@ -1145,9 +1367,12 @@ void BinaryTree<ndim>::UpdateAllSphHydroForces
   int Ninteract;                   // No. of near gather neighbours
   int Nneib;                       // No. of neighbours
   int Nneibmax;                    // Max. no. of neighbours
+  int Npass;                       // No. of passes over active cells
   int *activelist;                 // List of active particle ids
   int *interactlist;               // List of interactng SPH neighbours
   int *neiblist;                   // List of neighbour ids
+  bool *deferred;                  // Is cell deferred until MPI ghosts arrive?
+  bool periodic;                   // Use periodic wrapping for cell?
   FLOAT draux[ndim];               // Aux. relative position vector
   FLOAT drsqd;                     // Distance squared
   FLOAT hrangesqdi;                // Kernel gather extent
@@ -1170,13 +1395,21 @@ void BinaryTree<ndim>::UpdateAllSphHydroForces
   treelist = new BinarySubTree<ndim>*[gtot];
   cactive = ComputeActiveCellList(celllist,treelist);
 
+  // If the MPI ghosts are still being updated, first compute all cells
+  // without MPI ghost neighbours, then the deferred cells once they arrive
+  Npass = (MpiGhostUpdatePending() ? 2 : 1);
+  iremote = sph->Nsph + sph->NPeriodicGhost;
+  deferred = new bool[cactive];
+  for (cc=0; cc<cactive; cc++) deferred[cc] = false;
+
 
   // Set-up all OMP threads
   //===========================================================================
 #pragma omp parallel default(none) private(activelist,activepart,cc,cell,dr)\
   private(draux,drmag,drsqd,hrangesqdi,i,interactlist,invdrmag,j,jj,k) \
-  private(Nactive,neiblist,neibpart,Ninteract,Nneib,Nneibmax,rp)\
-  shared(cactive,celllist,data,sph,treelist)
+  private(Nactive,neiblist,neibpart,Ninteract,Nneib,Nneibmax,periodic,rp)\
+  private(ipass) shared(cactive,celllist,data,deferred,iremote,Npass)\
+  shared(sph,treelist)
   {
     Nneibmax = 2*sph->Ngather;
     activelist = new int[Nleafmax];
@@ -1190,139 +1423,175 @@ void BinaryTree<ndim>::UpdateAllSphHydroForces
 
     // Loop over all active cells
     //=========================================================================
+    for (ipass=0; ipass<Npass; ipass++) {
+
 #pragma omp for schedule(dynamic)
-    for (cc=0; cc<cactive; cc++) {
-      cell = celllist[cc];
+      for (cc=0; cc<cactive; cc++) {
+        if (ipass > 0 && !deferred[cc]) continue;
+        if (ipass < Npass - 1) ProgressMpiGhostUpdate();
+        cell = celllist[cc];
+#if defined MPI_PARALLEL
+        DOUBLE tcell = CellWallTime(); // Wall-clock time at start of cell
+#endif
 
-      // Find list of active particles in current cell
-      Nactive = ComputeActiveParticleList(cell,treelist[cc],sph,activelist);
-
-      // Make local copies of active particles
-      for (j=0; j<Nactive; j++) {
-        assert(activelist[j] >= 0 && activelist[j] < sph->Nsph);
-        activepart[j] = data[activelist[j]];
-        activepart[j].div_v = (FLOAT) 0.0;
-        activepart[j].dudt = (FLOAT) 0.0;
-        activepart[j].levelneib = 0;
-        for (k=0; k<ndim; k++) activepart[j].a[k] = (FLOAT) 0.0;
-      }
+        // Find list of active particles in current cell
+        Nactive = ComputeActiveParticleList(cell,treelist[cc],sph,activelist);
 
-      // Compute neighbour list for cell depending on physics options
-      Nneib = ComputeNeighbourList(cell,Nneibmax,neiblist,sph->sphdata);
-
-      // If there are too many neighbours, reallocate the arrays and
-      // recompute the neighbour list.
-      while (Nneib == -1) {
-        delete[] neibpart;
-        delete[] invdrmag;
-        delete[] drmag;
-        delete[] dr;
-        delete[] interactlist;
-        delete[] neiblist;
-        Nneibmax = 2*Nneibmax;
-        neiblist = new int[Nneibmax];
-        interactlist = new int[Nneibmax];
-        dr = new FLOAT[Nneibmax*ndim];
-        drmag = new FLOAT[Nneibmax];
-        invdrmag = new FLOAT[Nneibmax];
-        neibpart = new SphParticle<ndim>[Nneibmax];
+        // Make local copies of active particles
+        for (j=0; j<Nactive; j++) {
+          assert(activelist[j] >= 0 && activelist[j] < sph->Nsph);
+          activepart[j] = data[activelist[j]];
+          activepart[j].div_v = (FLOAT) 0.0;
+          activepart[j].dudt = (FLOAT) 0.0;
+          activepart[j].levelneib = 0;
+          for (k=0; k<ndim; k++) activepart[j].a[k] = (FLOAT) 0.0;
+        }
+
+        // Compute neighbour list for cell depending on physics options
         Nneib = ComputeNeighbourList(cell,Nneibmax,neiblist,sph->sphdata);
-      };
-
-      // Make local copies of all potential neighbours
-      for (j=0; j<Nneib; j++) {
-        assert(neiblist[j] >= 0 && neiblist[j] < sph->Ntot);
-        neibpart[j] = data[neiblist[j]];
-        neibpart[j].div_v = (FLOAT) 0.0;
-        neibpart[j].dudt = (FLOAT) 0.0;
-        neibpart[j].levelneib=0;
-        for (k=0; k<ndim; k++) neibpart[j].a[k] = (FLOAT) 0.0;
-      }
 
-      // Loop over all active particles in the cell
-      //-----------------------------------------------------------------------
-      for (j=0; j<Nactive; j++) {
-        i = activelist[j];
+        // If there are too many neighbours, reallocate the arrays and
+        // recompute the neighbour list.
+        while (Nneib == -1) {
+          delete[] neibpart;
+          delete[] invdrmag;
+          delete[] drmag;
+          delete[] dr;
+          delete[] interactlist;
+          delete[] neiblist;
+          Nneibmax = 2*Nneibmax;
+          neiblist = new int[Nneibmax];
+          interactlist = new int[Nneibmax];
+          dr = new FLOAT[Nneibmax*ndim];
+          drmag = new FLOAT[Nneibmax];
+          invdrmag = new FLOAT[Nneibmax];
+          neibpart = new SphParticle<ndim>[Nneibmax];
+          Nneib = ComputeNeighbourList(cell,Nneibmax,neiblist,sph->sphdata);
+        };
+
+        // Defer cell if any neighbour is an MPI ghost still being updated
+        if (ipass < Npass - 1) {
+          for (jj=0; jj<Nneib; jj++) if (neiblist[jj] >= iremote) break;
+          deferred[cc] = (jj < Nneib);
+          if (deferred[cc]) continue;
+        }
 
-        for (k=0; k<ndim; k++) rp[k] = activepart[j].r[k]; //data[i].r[k];
-        hrangesqdi = activepart[j].hrangesqd;
-        Ninteract = 0;
+        // Make local copies of all potential neighbours
+        for (j=0; j<Nneib; j++) {
+          assert(neiblist[j] >= 0 && neiblist[j] < sph->Ntot);
+          neibpart[j] = data[neiblist[j]];
+          neibpart[j].div_v = (FLOAT) 0.0;
+          neibpart[j].dudt = (FLOAT) 0.0;
+          neibpart[j].levelneib=0;
+          for (k=0; k<ndim; k++) neibpart[j].a[k] = (FLOAT) 0.0;
+        }
+
+        // Only wrap distances if some neighbour may lie across the boundary
+        periodic = false;
+        for (j=0; j<Nneib && box->implicit_periodic && !periodic; j++) {
+          for (k=0; k<ndim; k++) draux[k] = neibpart[j].r[k] - cell->r[k];
+          periodic = NearPeriodicImage(*box,draux,cell->rmax);
+        }
+
+        // Loop over all active particles in the cell
+        //-----------------------------------------------------------------------
+        for (j=0; j<Nactive; j++) {
+          i = activelist[j];
 
-        // Validate that gather neighbour list is correct
+          for (k=0; k<ndim; k++) rp[k] = activepart[j].r[k]; //data[i].r[k];
+          hrangesqdi = activepart[j].hrangesqd;
+          Ninteract = 0;
+
+          // Validate that gather neighbour list is correct
 #if defined(VERIFY_ALL)
-        if (neibcheck) CheckValidNeighbourList(sph,i,Nneib,neiblist,"all");
+          if (neibcheck) CheckValidNeighbourList(sph,i,Nneib,neiblist,"all");
 #endif
 
-        // Compute distances and the inverse between the current particle
-        // and all neighbours here, for both gather and inactive scatter neibs.
-        // Only consider particles with j > i to compute pair forces once
-        // unless particle j is inactive.
-        //---------------------------------------------------------------------
-        for (jj=0; jj<Nneib; jj++) {
-
-          // Skip neighbour if it's not the correct part of an active pair
-          if (neiblist[jj] <= i && neibpart[jj].active) continue;
+          // Compute distances and the inverse between the current particle
+          // and all neighbours here, for both gather and inactive scatter neibs.
+          // Only consider particles with j > i to compute pair forces once
+          // unless particle j is inactive.
+          //---------------------------------------------------------------------
+          for (jj=0; jj<Nneib; jj++) {
 
-          for (k=0; k<ndim; k++) draux[k] = neibpart[jj].r[k] - rp[k];
-          drsqd = DotProduct(draux,draux,ndim) + small_number;
+            // Skip neighbour if it's not the correct part of an active pair
+            if (neiblist[jj] <= i && neibpart[jj].active) continue;
+
+            for (k=0; k<ndim; k++) draux[k] = neibpart[jj].r[k] - rp[k];
+            if (periodic) NearestPeriodicVector(*box,draux);
+            drsqd = DotProduct(draux,draux,ndim) + small_number;
+
+            // Compute relative position and distance quantities for pair
+            if (drsqd <= hrangesqdi || drsqd <= neibpart[jj].hrangesqd) {
+              drmag[Ninteract] = sqrt(drsqd);
+              invdrmag[Ninteract] = (FLOAT) 1.0/drmag[Ninteract];
+              for (k=0; k<ndim; k++)
+                dr[Ninteract*ndim + k] = draux[k]*invdrmag[Ninteract];
+              interactlist[Ninteract] = jj;
+              Ninteract++;
+            }
 
-          // Compute relative position and distance quantities for pair
-          if (drsqd <= hrangesqdi || drsqd <= neibpart[jj].hrangesqd) {
-            drmag[Ninteract] = sqrt(drsqd);
-            invdrmag[Ninteract] = (FLOAT) 1.0/drmag[Ninteract];
-            for (k=0; k<ndim; k++)
-              dr[Ninteract*ndim + k] = draux[k]*invdrmag[Ninteract];
-            interactlist[Ninteract] = jj;
-            Ninteract++;
           }
+          //---------------------------------------------------------------------
 
-        }
-        //---------------------------------------------------------------------
-
-        // Compute all gather neighbour contributions to hydro forces
-        sph->ComputeSphHydroForces(i,Ninteract,interactlist,
-				   drmag,invdrmag,dr,activepart[j],neibpart);
+          // Compute all gather neighbour contributions to hydro forces
+          sph->ComputeSphHydroForces(i,Ninteract,interactlist,
+  				   drmag,invdrmag,dr,activepart[j],neibpart);
 
-      }
-      //-----------------------------------------------------------------------
+        }
+        //-----------------------------------------------------------------------
 
 
-      // Add all active particles contributions to main array
-      for (j=0; j<Nactive; j++) {
-    	i = activelist[j];
+        // Add all active particles contributions to main array
+        for (j=0; j<Nactive; j++) {
+      	i = activelist[j];
 #if defined _OPENMP
-    	omp_lock_t& lock = sph->GetParticleILock(i);
-    	omp_set_lock(&lock);
+      	omp_lock_t& lock = sph->GetParticleILock(i);
+      	omp_set_lock(&lock);
 #endif
-        for (k=0; k<ndim; k++) {
-          data[i].a[k] += activepart[j].a[k];
-        }
-        data[i].dudt += activepart[j].dudt;
-        data[i].div_v += activepart[j].div_v;
-        data[i].levelneib = max(data[i].levelneib,activepart[j].levelneib);
+          for (k=0; k<ndim; k++) {
+            data[i].a[k] += activepart[j].a[k];
+          }
+          data[i].dudt += activepart[j].dudt;
+          data[i].div_v += activepart[j].div_v;
+          data[i].levelneib = max(data[i].levelneib,activepart[j].levelneib);
 #if defined _OPENMP
-        omp_unset_lock(&lock);
+          omp_unset_lock(&lock);
 #endif
-      }
+        }
 
-      // Now add all active neighbour contributions to main array
-      for (jj=0; jj<Nneib; jj++) {
-        j = neiblist[jj];
+        // Now add all active neighbour contributions to main array
+        for (jj=0; jj<Nneib; jj++) {
+          j = neiblist[jj];
 #if defined _OPENMP
-        omp_lock_t& lock = sph->GetParticleILock(j);
-        omp_set_lock(&lock);
+          omp_lock_t& lock = sph->GetParticleILock(j);
+          omp_set_lock(&lock);
 #endif
-        if (neibpart[jj].active) {
-          for (k=0; k<ndim; k++) {
-            data[j].a[k] += neibpart[jj].a[k];
+          if (neibpart[jj].active) {
+            for (k=0; k<ndim; k++) {
+              data[j].a[k] += neibpart[jj].a[k];
+            }
+            data[j].dudt += neibpart[jj].dudt;
+            data[j].div_v += neibpart[jj].div_v;
           }
-          data[j].dudt += neibpart[jj].dudt;
-          data[j].div_v += neibpart[jj].div_v;
-        }
-        data[j].levelneib = max(data[j].levelneib,neibpart[jj].levelneib);
+          data[j].levelneib = max(data[j].levelneib,neibpart[jj].levelneib);
 #if defined _OPENMP
-        omp_unset_lock(&lock);
+          omp_unset_lock(&lock);
 #endif
+        }
+
+#if defined MPI_PARALLEL
+        AddCellWork(cell,Nactive,activelist,CellWallTime() - tcell,sph);
+#endif
+
+      }
+      //=======================================================================
+
+      // Complete the MPI ghost update with the thread that initialised MPI
+      if (ipass < Npass - 1) {
+#pragma omp master
+        FinishMpiGhostUpdate(sph);
+#pragma omp barrier
       }
 
     }
@@ -1341,6 +1610,7 @@ void BinaryTree<ndim>::UpdateAllSphHydroForces
   }
   //===========================================================================
 
+  delete[] deferred;
   delete[] treelist;
   delete[] celllist;
 
@@ -1372,6 +1642,8 @@ void BinaryTree<ndim>::UpdateAllSphForces
   int cactive;                      // No. of active cells
   int cc;                           // Aux. cell counter
   int i;                            // Particle id
+  int ipass;                        // Pass counter over active cells
+  int iremote;                      // i.d. of first MPI ghost
   int j;                            // Aux. particle counter
   int jj;                           // Aux. particle counter
   int k;                            // Dimension counter
@@ -1384,10 +1656,12 @@ void BinaryTree<ndim>::UpdateAllSphForces
   int Ninteract;                    // No. of interactions with hydro neibs
   int Nneib;                        // No. of neighbours
   int Nneibmax;                     // Max. no. of neighbours
+  int Npass;                        // No. of passes over active cells
   int *activelist;                  // List of active particle ids
   int *directlist;                  // List of direct sum particle ids
   int *interactlist;                // List of interacting neighbour ids
   int *neiblist;                    // List of neighbour ids
+  bool *deferred;                   // Is cell deferred until MPI ghosts arrive?
   FLOAT *agrav;                     // Local copy of gravitational accel.
   FLOAT *gpot;                      // Local copy of gravitational pot.
   BinarySubTree<ndim> **treelist;   // List of pointers to binary sub-trees
@@ -1406,6 +1680,13 @@ void BinaryTree<ndim>::UpdateAllSphForces
   treelist = new BinarySubTree<ndim>*[gtot];
   cactive = ComputeActiveCellList(celllist,treelist);
 
+  // If the MPI ghosts are still being updated, first compute all cells
+  // without MPI ghost neighbours, then the deferred cells once they arrive
+  Npass = (MpiGhostUpdatePending() ? 2 : 1);
+  iremote = sph->Nsph + sph->NPeriodicGhost;
+  deferred = new bool[cactive];
+  for (cc=0; cc<cactive; cc++) deferred[cc] = false;
+
 
   // Set-up all OMP threads
   //===========================================================================
@@ -1413,13 +1694,14 @@ void BinaryTree<ndim>::UpdateAllSphForces
   private(gpot,i,interactlist,j,jj,activepart)\
   private(k,okflag,Nactive,neiblist,neibpart,Ninteract,Nneib,directlist)\
   private(gravcelllist,Ngravcell,Ndirect,Nneibmax,Ndirectmax,Ngravcellmax)\
-  shared(celllist,cactive,sph,data,treelist,cout)
+  private(ipass) shared(celllist,cactive,sph,data,treelist,cout)\
+  shared(deferred,iremote,Npass)
   {
     Nneibmax = 4*sph->Ngather;
     Ndirectmax = 2*Nneibmax;
     Ngravcellmax = 2*Nneibmax;
-    agrav = new FLOAT[ndim*sph->Nsph];
-    gpot = new FLOAT[ndim*sph->Nsph];
+    agrav = new FLOAT[ndim*sph->Ntot];
+    gpot = new FLOAT[sph->Ntot];
     activelist = new int[Nleafmax];
     activepart = new SphParticle<ndim>[Nleafmax];
     neiblist = new int[Nneibmax];
@@ -1429,141 +1711,171 @@ void BinaryTree<ndim>::UpdateAllSphForces
     neibpart = new SphParticle<ndim>[Nneibmax];
 
     // Zero temporary grav. accel array
-    for (i=0; i<ndim*sph->Nsph; i++) agrav[i] = 0.0;
-    for (i=0; i<sph->Nsph; i++) gpot[i] = 0.0;
+    for (i=0; i<ndim*sph->Ntot; i++) agrav[i] = 0.0;
+    for (i=0; i<sph->Ntot; i++) gpot[i] = 0.0;
 
 
     // Loop over all active cells
     //=========================================================================
+    for (ipass=0; ipass<Npass; ipass++) {
+
 #pragma omp for schedule(dynamic)
-    for (cc=0; cc<cactive; cc++) {
-      cell = celllist[cc];
+      for (cc=0; cc<cactive; cc++) {
+        if (ipass > 0 && !deferred[cc]) continue;
+        if (ipass < Npass - 1) ProgressMpiGhostUpdate();
+        cell = celllist[cc];
+#if defined MPI_PARALLEL
+        DOUBLE tcell = CellWallTime(); // Wall-clock time at start of cell
+#endif
 
-      // Find list of active particles in current cell
-      Nactive = ComputeActiveParticleList(cell,treelist[cc],sph,activelist);
-
-      // Make local copies of active particles
-      for (j=0; j<Nactive; j++) {
-        assert(activelist[j] >= 0 && activelist[j] < sph->Nsph);
-        activepart[j] = data[activelist[j]];
-        activepart[j].div_v = (FLOAT) 0.0;
-        activepart[j].dudt = (FLOAT) 0.0;
-        activepart[j].gpot = activepart[j].m*activepart[j].invh*sph->kernp->wpot(0.0);
-        for (k=0; k<ndim; k++) activepart[j].a[k] = (FLOAT) 0.0;
-        for (k=0; k<ndim; k++) activepart[j].agrav[k] = (FLOAT) 0.0;
-      }
+        // Find list of active particles in current cell
+        Nactive = ComputeActiveParticleList(cell,treelist[cc],sph,activelist);
 
-      // Compute neighbour list for cell depending on physics options
-      okflag = ComputeGravityInteractionList(cell,Nneibmax,Ndirectmax,
-                                             Ngravcellmax,Nneib,Ndirect,
-                                             Ngravcell,neiblist,directlist,
-                                             gravcelllist,sph->sphdata);
-
-      // If there are too many neighbours, reallocate the arrays and
-      // recompute the neighbour lists.
-      while (okflag == -1) {
-        delete[] neibpart;
-        delete[] gravcelllist;
-        delete[] directlist;
-        delete[] interactlist;
-        delete[] neiblist;
-        Nneibmax = 2*Nneibmax;
-        Ndirectmax = 2*Ndirectmax;
-        Ngravcellmax = 2*Ngravcellmax;
-        neiblist = new int[Nneibmax];
-        interactlist = new int[Nneibmax];
-        directlist = new int[Ndirectmax];
-        gravcelllist = new BinaryTreeCell<ndim>*[Ngravcellmax];
-        neibpart = new SphParticle<ndim>[Nneibmax];
+        // Make local copies of active particles
+        for (j=0; j<Nactive; j++) {
+          assert(activelist[j] >= 0 && activelist[j] < sph->Nsph);
+          activepart[j] = data[activelist[j]];
+          activepart[j].div_v = (FLOAT) 0.0;
+          activepart[j].dudt = (FLOAT) 0.0;
+          activepart[j].gpot = activepart[j].m*activepart[j].invh*sph->kernp->wpot(0.0);
+          for (k=0; k<ndim; k++) activepart[j].a[k] = (FLOAT) 0.0;
+          for (k=0; k<ndim; k++) activepart[j].agrav[k] = (FLOAT) 0.0;
+        }
+
+        // Compute neighbour list for cell depending on physics options
         okflag = ComputeGravityInteractionList(cell,Nneibmax,Ndirectmax,
                                                Ngravcellmax,Nneib,Ndirect,
                                                Ngravcell,neiblist,directlist,
                                                gravcelllist,sph->sphdata);
-      };
-
-
-      // Make local copies of all potential neighbours
-      for (j=0; j<Nneib; j++) {
-        assert(neiblist[j] >= 0 && neiblist[j] < sph->Ntot);
-        neibpart[j] = data[neiblist[j]];
-        neibpart[j].div_v = (FLOAT) 0.0;
-        neibpart[j].dudt = (FLOAT) 0.0;
-        neibpart[j].gpot = (FLOAT) 0.0;
-        for (k=0; k<ndim; k++) neibpart[j].a[k] = (FLOAT) 0.0;
-        for (k=0; k<ndim; k++) neibpart[j].agrav[k] = (FLOAT) 0.0;
-      }
 
-      // Loop over all active particles in the cell
-      //-----------------------------------------------------------------------
-      for (j=0; j<Nactive; j++) {
-        i = activelist[j];
+        // If there are too many neighbours, reallocate the arrays and
+        // recompute the neighbour lists.
+        while (okflag == -1) {
+          delete[] neibpart;
+          delete[] gravcelllist;
+          delete[] directlist;
+          delete[] interactlist;
+          delete[] neiblist;
+          Nneibmax = 2*Nneibmax;
+          Ndirectmax = 2*Ndirectmax;
+          Ngravcellmax = 2*Ngravcellmax;
+          neiblist = new int[Nneibmax];
+          interactlist = new int[Nneibmax];
+          directlist = new int[Ndirectmax];
+          gravcelllist = new BinaryTreeCell<ndim>*[Ngravcellmax];
+          neibpart = new SphParticle<ndim>[Nneibmax];
+          okflag = ComputeGravityInteractionList(cell,Nneibmax,Ndirectmax,
+                                                 Ngravcellmax,Nneib,Ndirect,
+                                                 Ngravcell,neiblist,directlist,
+                                                 gravcelllist,sph->sphdata);
+        };
 
-        // Determine SPH neighbour interaction list 
-        // (to ensure we don't compute pair-wise forces twice)
-        Ninteract = 0;
-        for (jj=0; jj<Nneib; jj++) {
-          if ((neiblist[jj] < i && !neibpart[jj].active) || neiblist[jj] > i)
-            interactlist[Ninteract++] = jj;
+
+        // Defer cell if any neighbour is an MPI ghost still being updated
+        if (ipass < Npass - 1) {
+          for (jj=0; jj<Nneib; jj++) if (neiblist[jj] >= iremote) break;
+          deferred[cc] = (jj < Nneib);
+          for (jj=0; jj<Ndirect; jj++) if (directlist[jj] >= iremote) break;
+          deferred[cc] = (deferred[cc] || jj < Ndirect);
+          if (deferred[cc]) continue;
         }
 
-        // Compute forces between SPH neighbours (hydro and gravity)
-        sph->ComputeSphHydroGravForces(i,Ninteract,interactlist,
-                                       activepart[j],neibpart);
+        // Make local copies of all potential neighbours
+        for (j=0; j<Nneib; j++) {
+          assert(neiblist[j] >= 0 && neiblist[j] < sph->Ntot);
+          neibpart[j] = data[neiblist[j]];
+          neibpart[j].div_v = (FLOAT) 0.0;
+          neibpart[j].dudt = (FLOAT) 0.0;
+          neibpart[j].gpot = (FLOAT) 0.0;
+          for (k=0; k<ndim; k++) neibpart[j].a[k] = (FLOAT) 0.0;
+          for (k=0; k<ndim; k++) neibpart[j].agrav[k] = (FLOAT) 0.0;
+        }
 
-        // Compute direct gravity forces between distant particles
-        sph->ComputeDirectGravForces(i,Ndirect,directlist,
-                                     agrav,gpot,activepart[j],data);
+        // Loop over all active particles in the cell
+        //-----------------------------------------------------------------------
+        for (j=0; j<Nactive; j++) {
+          i = activelist[j];
 
-        // Compute gravitational force due to distant cells
-        if (multipole == "monopole")
-          ComputeCellMonopoleForces(i,Ngravcell,gravcelllist,activepart[j]);
-        else if (multipole == "quadrupole")
-          ComputeCellQuadrupoleForces(i,Ngravcell,gravcelllist,activepart[j]);
+          // Determine SPH neighbour interaction list 
+          // (to ensure we don't compute pair-wise forces twice)
+          Ninteract = 0;
+          for (jj=0; jj<Nneib; jj++) {
+            if ((neiblist[jj] < i && !neibpart[jj].active) || neiblist[jj] > i)
+              interactlist[Ninteract++] = jj;
+          }
 
-      }
-      //-----------------------------------------------------------------------
+          // Compute forces between SPH neighbours (hydro and gravity)
+          sph->ComputeSphHydroGravForces(i,Ninteract,interactlist,
+                                         activepart[j],neibpart);
+
+          // Compute direct gravity forces between distant particles
+          sph->ComputeDirectGravForces(i,Ndirect,directlist,
+                                       agrav,gpot,activepart[j],data);
+
+          // Compute gravitational force due to distant cells
+          if (multipole == "monopole")
+            ComputeCellMonopoleForces(i,Ngravcell,gravcelllist,activepart[j]);
+          else if (multipole == "quadrupole")
+            ComputeCellQuadrupoleForces(i,Ngravcell,gravcelllist,activepart[j]);
+
+        }
+        //-----------------------------------------------------------------------
 
 
-      // Add all active particles contributions to main array
-      for (j=0; j<Nactive; j++) {
-    	i = activelist[j];
+        // Add all active particles contributions to main array
+        for (j=0; j<Nactive; j++) {
+      	i = activelist[j];
 #if defined _OPENMP
-        omp_lock_t& lock = sph->GetParticleILock(i);
-        omp_set_lock(&lock);
+          omp_lock_t& lock = sph->GetParticleILock(i);
+          omp_set_lock(&lock);
 #endif
-        for (k=0; k<ndim; k++) {
-          data[i].a[k] += activepart[j].a[k];
-          data[i].agrav[k] += activepart[j].agrav[k];
-        }
-        data[i].gpot += activepart[j].gpot;
-        data[i].dudt += activepart[j].dudt;
-        data[i].div_v += activepart[j].div_v;
-        data[i].levelneib = max(data[i].levelneib,activepart[j].levelneib);
+          for (k=0; k<ndim; k++) {
+            data[i].a[k] += activepart[j].a[k];
+            data[i].agrav[k] += activepart[j].agrav[k];
+          }
+          data[i].gpot += activepart[j].gpot;
+          data[i].dudt += activepart[j].dudt;
+          data[i].div_v += activepart[j].div_v;
+          data[i].levelneib = max(data[i].levelneib,activepart[j].levelneib);
 #if defined _OPENMP
-        omp_unset_lock(&lock);
+          omp_unset_lock(&lock);
 #endif
-      }
+        }
 
-      // Now add all active neighbour contributions to the main arrays
-      for (jj=0; jj<Nneib; jj++) {
-        j = neiblist[jj];
+        // Now add all active neighbour contributions to the main arrays
+        for (jj=0; jj<Nneib; jj++) {
+          j = neiblist[jj];
 #if defined _OPENMP
-        omp_lock_t& lock = sph->GetParticleILock(j);
-        omp_set_lock(&lock);
+          omp_lock_t& lock = sph->GetParticleILock(j);
+          omp_set_lock(&lock);
 #endif
-        if (neibpart[jj].active) {
-          for (k=0; k<ndim; k++) {
-            data[j].a[k] += neibpart[jj].a[k];
-            data[j].agrav[k] += neibpart[jj].agrav[k];
+          if (neibpart[jj].active) {
+            for (k=0; k<ndim; k++) {
+              data[j].a[k] += neibpart[jj].a[k];
+              data[j].agrav[k] += neibpart[jj].agrav[k];
+            }
+            data[j].gpot += neibpart[jj].gpot;
+            data[j].dudt += neibpart[jj].dudt;
+            data[j].div_v += neibpart[jj].div_v;
           }
-          data[j].gpot += neibpart[jj].gpot;
-          data[j].dudt += neibpart[jj].dudt;
-          data[j].div_v += neibpart[jj].div_v;
-        }
-        data[j].levelneib = max(data[j].levelneib,neibpart[jj].levelneib);
+          data[j].levelneib = max(data[j].levelneib,neibpart[jj].levelneib);
 #if defined _OPENMP
-        omp_unset_lock(&lock);
+          omp_unset_lock(&lock);
 #endif
+        }
+
+#if defined MPI_PARALLEL
+        AddCellWork(cell,Nactive,activelist,CellWallTime() - tcell,sph);
+#endif
+
+      }
+      //=======================================================================
+
+      // Complete the MPI ghost update with the thread that initialised MPI
+      if (ipass < Npass - 1) {
+#pragma omp master
+        FinishMpiGhostUpdate(sph);
+#pragma omp barrier
       }
 
     }
@@ -1597,6 +1909,7 @@ void BinaryTree<ndim>::UpdateAllSphForces
   }
   //===========================================================================
 
+  delete[] deferred;
   delete[] treelist;
   delete[] celllist;
 
@@ -1688,6 +2001,7 @@ void BinaryTree<ndim>::CheckValidNeighbourList
     for (j=0; j<sph->Ntot; j++) {
       for (k=0; k<ndim; k++)
 	dr[k] = sph->sphdata[j].r[k] - sph->sphdata[i].r[k];
+      if (box->implicit_periodic) NearestPeriodicVector(*box,dr);
       drsqd = DotProduct(dr,dr,ndim);
       if (drsqd <
 	  sph->kernp->kernrangesqd*sph->sphdata[i].h*sph->sphdata[i].h)
@@ -1698,6 +2012,7 @@ void BinaryTree<ndim>::CheckValidNeighbourList
     for (j=0; j<sph->Ntot; j++) {
       for (k=0; k<ndim; k++) 
         dr[k] = sph->sphdata[j].r[k] - sph->sphdata[i].r[k];
+      if (box->implicit_periodic) NearestPeriodicVector(*box,dr);
       drsqd = DotProduct(dr,dr,ndim);
       if (drsqd < sph->kernp->kernrangesqd*sph->sphdata[i].h*sph->sphdata[i].h ||
     	  drsqd < sph->kernp->kernrangesqd*sph->sphdata[j].h*sph->sphdata[j].h)
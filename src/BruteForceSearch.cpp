@@ -638,7 +638,7 @@ void BruteForceSearch<ndim>::FindGhostParticlesToExport(
     SphParticle<ndim>& part = sph->sphdata[i];
 
     //Loop over potential domains and see if we need to export this particle to them
-    for (int inode=0; inode<overlapping_nodes.size(); inode++) {
+    for (int inode=0; inode<(int) overlapping_nodes.size(); inode++) {
       int node_number = overlapping_nodes[inode];
       if (ParticleBoxOverlap(part,mpinodes[node_number].hbox)) {
         particles_to_export_per_node[node_number].push_back(&part);
@@ -647,6 +647,40 @@ void BruteForceSearch<ndim>::FindGhostParticlesToExport(
   }
 }
 
+//=============================================================================
+//  BruteForceSearch::FindGhostParticlesToExport
+/// As above, but a particle is only exported to a node if it overlaps one of
+/// the node's (Peano-Hilbert cell) boxes, rather than its overall hbox
+//=============================================================================
+template <int ndim>
+void BruteForceSearch<ndim>::FindGhostParticlesToExport(
+    Sph<ndim>* sph,    ///< [in] Pointer to sph class
+    std::vector<std::vector<SphParticle<ndim>* > >& particles_to_export_per_node, ///< [inout] Vector that will be filled with values
+    const std::vector<int>& overlapping_nodes, ///< [in] Vector containing which nodes overlap our hbox
+    MpiNode<ndim>* mpinodes, ///< [in] Array of other mpi nodes
+    const std::vector<Box<ndim> >& nodeboxes, ///< [in] Boxes of all nodes
+    const std::vector<int>& nodeboxfirst) ///< [in] First box of each node
+{
+
+  //Loop over particles and prepare the ones to export
+  for (int i=0; i<sph->Ntot; i++) {
+    SphParticle<ndim>& part = sph->sphdata[i];
+
+    //Loop over potential domains and check the particle against their boxes
+    for (int inode=0; inode<(int) overlapping_nodes.size(); inode++) {
+      int node_number = overlapping_nodes[inode];
+      if (!ParticleBoxOverlap(part,mpinodes[node_number].hbox)) continue;
+      for (int ibox=nodeboxfirst[node_number]; ibox<nodeboxfirst[node_number+1]; ibox++) {
+        Box<ndim> box = nodeboxes[ibox];
+        if (ParticleBoxOverlap(part,box)) {
+          particles_to_export_per_node[node_number].push_back(&part);
+          break;
+        }
+      }
+    }
+  }
+}
+
 //=============================================================================
 //  BruteForceSearch::FindParticlesToTransfer
 /// Compute on behalf of the MpiControl class the particles that are outside the
@@ -28,6 +28,7 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <math.h>
 #include "Precision.h"
 using namespace std;
 
@@ -44,6 +45,13 @@ struct Box {
   FLOAT boxmax[ndim];                   ///< Maximum bounding box extent
 };
 
+//=============================================================================
+//  Enum boundaryenum
+/// \brief  Decoded boundary condition types (see BoundaryType helper).
+//=============================================================================
+enum boundaryenum{openboundary, mirrorboundary, periodicboundary};
+
+
 #ifdef MPI_PARALLEL
 template <int ndim>
 MPI_Datatype CreateBoxType (Box<ndim> dummy) {
@@ -77,6 +85,14 @@ struct DomainBox {
   FLOAT boxmax[ndim];                   ///< Maximum bounding box extent
   FLOAT boxsize[ndim];                  ///< Side-lengths of bounding box
   FLOAT boxhalf[ndim];                  ///< Half side-lengths of bounding box
+  bool implicit_periodic;               ///< Wrap any dimension in neib search?
+  bool periodic_wrap[ndim];             ///< Wrap k-dimension in neib search?
+
+  DomainBox()
+  {
+    implicit_periodic = false;
+    for (int k=0; k<ndim; k++) periodic_wrap[k] = false;
+  }
 };
 
 
@@ -109,6 +125,55 @@ bool IsAnyBoundarySpecial(const DomainBox<ndim>& box) {
 }
 
 
+//=============================================================================
+/// \brief  Helper function to decode a boundary condition string into the
+///         corresponding enum value, so that boundary checks inside particle
+///         loops do not need to perform string comparisons.
+/// \return The boundary type (unrecognised strings are treated as open)
+//=============================================================================
+inline boundaryenum BoundaryType(const string &boundary)
+{
+  if (boundary == "periodic") return periodicboundary;
+  else if (boundary == "mirror") return mirrorboundary;
+  else return openboundary;
+}
+
+
+//=============================================================================
+/// \brief  Helper function to convert a relative position vector into its 
+///         nearest periodic (minimum-image) vector for all dimensions that 
+///         are wrapped implicitly by the neighbour search.
+//=============================================================================
+template <int ndim>
+inline void NearestPeriodicVector(const DomainBox<ndim> &box, FLOAT dr[ndim])
+{
+  for (int k=0; k<ndim; k++) {
+    if (!box.periodic_wrap[k]) continue;
+    if (dr[k] > box.boxhalf[k]) dr[k] -= box.boxsize[k];
+    else if (dr[k] < -box.boxhalf[k]) dr[k] += box.boxsize[k];
+  }
+  return;
+}
+
+
+//=============================================================================
+/// \brief  Helper function to say if a particle at relative position 'dr' 
+///         from a cell centre may be nearer to the periodic image of some 
+///         particle within 'rmax' of the centre than to the particle itself, 
+///         i.e. if pair distances in the cell need periodic corrections.
+//=============================================================================
+template <int ndim>
+inline bool NearPeriodicImage(const DomainBox<ndim> &box, 
+                              const FLOAT dr[ndim], FLOAT rmax)
+{
+  for (int k=0; k<ndim; k++) {
+    if (!box.periodic_wrap[k]) continue;
+    if (fabs(dr[k]) + rmax > box.boxhalf[k]) return true;
+  }
+  return false;
+}
+
+
 //=============================================================================
 /// \brief  Helper function to say if a value is contained inside an interval
 //=============================================================================
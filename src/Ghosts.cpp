@@ -39,6 +39,42 @@ using namespace std;
 
 
 
+//=============================================================================
+//  PeriodicGhosts::PeriodicGhosts
+/// PeriodicGhosts constructor.  Initialises all boundaries to open until the 
+/// boundary types are decoded from the simulation box.
+//=============================================================================
+template <int ndim>
+PeriodicGhosts<ndim>::PeriodicGhosts()
+{
+  for (int k=0; k<3; k++) boundary_lhs[k] = openboundary;
+  for (int k=0; k<3; k++) boundary_rhs[k] = openboundary;
+  for (int k=0; k<4; k++) ighostdim[k] = 0;
+}
+
+
+
+//=============================================================================
+//  PeriodicGhosts::DecodeBoundaryTypes
+/// Convert the boundary condition strings of the simulation box into enums 
+/// so that no string comparisons are required inside any particle loops.
+//=============================================================================
+template <int ndim>
+void PeriodicGhosts<ndim>::DecodeBoundaryTypes
+(DomainBox<ndim> &simbox)           ///< [in] Simulation box structure
+{
+  boundary_lhs[0] = BoundaryType(simbox.x_boundary_lhs);
+  boundary_rhs[0] = BoundaryType(simbox.x_boundary_rhs);
+  boundary_lhs[1] = BoundaryType(simbox.y_boundary_lhs);
+  boundary_rhs[1] = BoundaryType(simbox.y_boundary_rhs);
+  boundary_lhs[2] = BoundaryType(simbox.z_boundary_lhs);
+  boundary_rhs[2] = BoundaryType(simbox.z_boundary_rhs);
+
+  return;
+}
+
+
+
 //=============================================================================
 //  Ghosts::CheckBoundaries
 /// Check all particles to see if any have crossed the simulation bounding 
@@ -51,50 +87,33 @@ void PeriodicGhosts<ndim>::CheckBoundaries
  Sph<ndim> *sph)
 {
   int i;                            // Particle counter
+  int k;                            // Dimension counter
   SphParticle<ndim> *part;          // Pointer to SPH particle data
   SphIntParticle<ndim> *partint;    // Pointer to SPH integration data
 
+  DecodeBoundaryTypes(simbox);
 
   // Loop over all particles and check if any lie outside the periodic box.
   // If so, then re-position with periodic wrapping.
   //---------------------------------------------------------------------------
-#pragma omp parallel for default(none) private(i,part) shared(simbox,sph)
+#pragma omp parallel for default(none) private(i,k,part,partint) \
+  shared(simbox,sph)
   for (i=0; i<sph->Nsph; i++) {
     part = &sph->sphdata[i];
     partint = &sph->sphintdata[i];
 
-    if (part->r[0] < simbox.boxmin[0])
-      if (simbox.x_boundary_lhs == "periodic") {
-        part->r[0] += simbox.boxsize[0];
-        partint->r0[0] += simbox.boxsize[0];
-      }
-    if (part->r[0] > simbox.boxmax[0])
-      if (simbox.x_boundary_rhs == "periodic") {
-        part->r[0] -= simbox.boxsize[0];
-        partint->r0[0] -= simbox.boxsize[0];
-      }
-
-    if (ndim >= 2 && part->r[1] < simbox.boxmin[1])
-      if (simbox.y_boundary_lhs == "periodic") {
-        part->r[1] += simbox.boxsize[1];
-        partint->r0[1] += simbox.boxsize[1];
-      }
-    if (ndim >= 2 && part->r[1] > simbox.boxmax[1])
-      if (simbox.y_boundary_rhs == "periodic") {
-        part->r[1] -= simbox.boxsize[1];
-        partint->r0[1] -= simbox.boxsize[1];
-      }
-
-    if (ndim == 3 && part->r[2] < simbox.boxmin[2])
-      if (simbox.z_boundary_lhs == "periodic") {
-        part->r[2] += simbox.boxsize[2];
-        partint->r0[2] += simbox.boxsize[2];
+    for (k=0; k<ndim; k++) {
+      if (part->r[k] < simbox.boxmin[k] && 
+          boundary_lhs[k] == periodicboundary) {
+        part->r[k] += simbox.boxsize[k];
+        partint->r0[k] += simbox.boxsize[k];
       }
-    if (ndim == 3 && part->r[2] > simbox.boxmax[2])
-      if (simbox.z_boundary_rhs == "periodic") {
-        part->r[2] -= simbox.boxsize[2];
-        partint->r0[2] -= simbox.boxsize[2];
+      if (part->r[k] > simbox.boxmax[k] && 
+          boundary_rhs[k] == periodicboundary) {
+        part->r[k] -= simbox.boxsize[k];
+        partint->r0[k] -= simbox.boxsize[k];
       }
+    }
 
   }
   //---------------------------------------------------------------------------
@@ -108,6 +127,8 @@ void PeriodicGhosts<ndim>::CheckBoundaries
 //  Ghosts::SearchGhostParticles
 /// Search domain to create any required ghost particles near any boundaries.
 /// Currently only searches to create periodic or mirror ghost particles.
+/// Ghosts are created one dimension at a time (so that ghosts of ghosts are 
+/// created for corners), with each dimension pass parallelised.
 //=============================================================================
 template <int ndim>
 void PeriodicGhosts<ndim>::SearchGhostParticles
@@ -115,158 +136,202 @@ void PeriodicGhosts<ndim>::SearchGhostParticles
  DomainBox<ndim> simbox,            ///< Simulation box structure
  Sph<ndim> *sph)                    ///< Sph object pointer
 {
-  int i;                                                // Particle counter
+  int k;                                                // Dimension counter
   FLOAT kernrange = sph->kernp->kernrange*sph->kernfac; // Kernel extent
-  SphParticle<ndim>* sphdata = sph->sphdata;            // SPH particle data
 
   // Set all relevant particle counters
   sph->Nghost    = 0;
   sph->NPeriodicGhost = 0;
   sph->Nghostmax = sph->Nsphmax - sph->Nsph;
   sph->Ntot      = sph->Nsph;
+  for (k=0; k<4; k++) ighostdim[k] = 0;
+
+  // Decode boundary strings once per rebuild.  Periodic dimensions that are 
+  // wrapped implicitly by the neighbour search do not require any ghosts.
+  DecodeBoundaryTypes(simbox);
+  for (k=0; k<ndim; k++) {
+    if (simbox.periodic_wrap[k]) {
+      boundary_lhs[k] = openboundary;
+      boundary_rhs[k] = openboundary;
+    }
+  }
 
   // If all boundaries are open, immediately return to main loop
-  if (simbox.x_boundary_lhs == "open" && simbox.x_boundary_rhs == "open" &&
-      simbox.y_boundary_lhs == "open" && simbox.y_boundary_rhs == "open" &&
-      simbox.z_boundary_lhs == "open" && simbox.z_boundary_rhs == "open")
+  if (boundary_lhs[0] == openboundary && boundary_rhs[0] == openboundary &&
+      boundary_lhs[1] == openboundary && boundary_rhs[1] == openboundary &&
+      boundary_lhs[2] == openboundary && boundary_rhs[2] == openboundary)
     return;
 
   debug2("[SphSimulation::SearchGhostParticles]");
 
-  // Create ghost particles in x-dimension
+  // Create ghost particles in x-, y- and z-dimensions in turn
   //---------------------------------------------------------------------------
-  if ((simbox.x_boundary_lhs == "open" && 
-       simbox.x_boundary_rhs == "open") == 0) {
-    for (i=0; i<sph->Ntot; i++) {
-      if (sphdata[i].r[0] + min(0.0,sphdata[i].v[0]*tghost) <
-          simbox.boxmin[0] + ghost_range*kernrange*sphdata[i].h) {
-        if (simbox.x_boundary_lhs == "periodic")
-          CreateGhostParticle(i,0,sphdata[i].r[0] + simbox.boxsize[0],
-                              sphdata[i].v[0],sph,x_lhs_periodic);
-        if (simbox.x_boundary_lhs == "mirror")
-          CreateGhostParticle(i,0,2.0*simbox.boxmin[0] - sphdata[i].r[0],
-                              -sphdata[i].v[0],sph,x_lhs_mirror);
-      }
-      if (sphdata[i].r[0] + max(0.0,sphdata[i].v[0]*tghost) >
-          simbox.boxmax[0] - ghost_range*kernrange*sphdata[i].h) {
-        if (simbox.x_boundary_rhs == "periodic")
-          CreateGhostParticle(i,0,sphdata[i].r[0] - simbox.boxsize[0],
-                              sphdata[i].v[0],sph,x_rhs_periodic);
-        if (simbox.x_boundary_rhs == "mirror")
-          CreateGhostParticle(i,0,2.0*simbox.boxmax[0] - sphdata[i].r[0],
-                              -sphdata[i].v[0],sph,x_rhs_mirror);
-      }
+  for (k=0; k<ndim; k++) {
+    ighostdim[k] = sph->Nghost;
+    if (boundary_lhs[k] == openboundary && boundary_rhs[k] == openboundary)
+      continue;
+
+    // Quit here if we've run out of memory for ghosts
+    if (SearchGhostParticlesInDimension(k,tghost,kernrange,simbox,sph) < 0) {
+      string message="Not enough memory for ghost particles";
+      ExceptionHandler::getIstance().raise(message);
     }
     sph->Ntot = sph->Nsph + sph->Nghost;
   }
+  for (k=ndim; k<4; k++) ighostdim[k] = sph->Nghost;
 
+  sph->NPeriodicGhost = sph->Nghost;
 
-  // Create ghost particles in y-dimension
-  //---------------------------------------------------------------------------
-  if (ndim >= 2 && (simbox.y_boundary_lhs == "open" && 
-		    simbox.y_boundary_rhs == "open") == 0) {
-    for (i=0; i<sph->Ntot; i++) {
-      if (sphdata[i].r[1] + min(0.0,sphdata[i].v[1]*tghost) <
-          simbox.boxmin[1] + ghost_range*kernrange*sphdata[i].h) {
-        if (simbox.y_boundary_lhs == "periodic")
-          CreateGhostParticle(i,1,sphdata[i].r[1] + simbox.boxsize[1],
-                              sphdata[i].v[1],sph,y_lhs_periodic);
-	    if (simbox.y_boundary_lhs == "mirror")
-          CreateGhostParticle(i,1,2.0*simbox.boxmin[1] - sphdata[i].r[1],
-                              -sphdata[i].v[1],sph,y_lhs_mirror);
-      }
-      if (sphdata[i].r[1] + max(0.0,sphdata[i].v[1]*tghost) >
-          simbox.boxmax[1] - ghost_range*kernrange*sphdata[i].h) {
-        if (simbox.y_boundary_rhs == "periodic")
-          CreateGhostParticle(i,1,sphdata[i].r[1] - simbox.boxsize[1],
-                              sphdata[i].v[1],sph,y_rhs_periodic);
-        if (simbox.y_boundary_rhs == "mirror")
-          CreateGhostParticle(i,1,2.0*simbox.boxmax[1] - sphdata[i].r[1],
-                              -sphdata[i].v[1],sph,y_rhs_mirror);
-      }
-    }
-    sph->Ntot = sph->Nsph + sph->Nghost;
-  }
+  return;
+}
+
+
+
+//=============================================================================
+//  PeriodicGhosts::SearchGhostParticlesInDimension
+/// Create all ghost particles for the k-dimension boundaries from all real 
+/// and existing ghost particles.  Uses two passes over the same static 
+/// partition of particles : first each thread counts the ghosts required 
+/// from its own particles, then (after a prefix sum of the counts) each 
+/// thread fills its own contiguous block of ghosts.  The ghost ordering is 
+/// therefore identical to a serial search.  Returns the number of new ghosts, 
+/// or -1 if there is not enough memory.
+//=============================================================================
+template <int ndim>
+int PeriodicGhosts<ndim>::SearchGhostParticlesInDimension
+(int k,                             ///< [in] Boundary dimension
+ FLOAT tghost,                      ///< [in] Ghost particle 'lifetime'
+ FLOAT kernrange,                   ///< [in] Kernel extent
+ DomainBox<ndim> &simbox,           ///< [in] Simulation box structure
+ Sph<ndim> *sph)                    ///< [inout] Sph object pointer
+{
+  bool overflow = false;                   // Flag if ghosts exceed memory
+  int Nsource = sph->Ntot;                 // No. of possible ghost sources
+  int Nnew = 0;                            // No. of new ghosts (all threads)
+  int Nthreads = 1;                        // Max. no. of OpenMP threads
+  int *Nthreadghost;                       // Ghost offsets of each thread
+  const FLOAT grange = ghost_range*kernrange;  // Ghost range (in units of h)
+  const boundaryenum lhs = boundary_lhs[k];    // Local copy of LHS boundary
+  const boundaryenum rhs = boundary_rhs[k];    // Local copy of RHS boundary
+  SphParticle<ndim> *sphdata = sph->sphdata;   // SPH particle data
+#if defined _OPENMP
+  Nthreads = omp_get_max_threads();
+#endif
 
+  Nthreadghost = new int[Nthreads + 1];
+  for (int ithread=0; ithread<Nthreads+1; ithread++) Nthreadghost[ithread] = 0;
 
-  // Create ghost particles in z-dimension
   //---------------------------------------------------------------------------
-  if (ndim == 3 && (simbox.z_boundary_lhs == "open" && 
-		    simbox.z_boundary_rhs == "open") == 0) {
-    for (i=0; i<sph->Ntot; i++) {
-      if (sphdata[i].r[2] + min(0.0,sphdata[i].v[2]*tghost) <
-          simbox.boxmin[2] + ghost_range*kernrange*sphdata[i].h) {
-        if (simbox.z_boundary_lhs == "periodic")
-          CreateGhostParticle(i,2,sphdata[i].r[2] + simbox.boxsize[2],
-                              sphdata[i].v[2],sph,z_lhs_periodic);
-        if (simbox.z_boundary_lhs == "mirror")
-          CreateGhostParticle(i,2,2.0*simbox.boxmin[2] - sphdata[i].r[2],
-                              -sphdata[i].v[2],sph,z_lhs_mirror);
-      }
-      if (sphdata[i].r[2] + max(0.0,sphdata[i].v[2]*tghost) >
-          simbox.boxmax[2] - ghost_range*kernrange*sphdata[i].h) {
-        if (simbox.z_boundary_rhs == "periodic")
-          CreateGhostParticle(i,2,sphdata[i].r[2] - simbox.boxsize[2],
-                              sphdata[i].v[2],sph,z_rhs_periodic);
-        if (simbox.z_boundary_rhs == "mirror")
-          CreateGhostParticle(i,2,2.0*simbox.boxmax[2] - sphdata[i].r[2],
-                              -sphdata[i].v[2],sph,z_rhs_mirror);
+#pragma omp parallel default(none) shared(k,lhs,rhs,grange,Nnew,Nsource,\
+  Nthreadghost,overflow,sph,sphdata,simbox,tghost)
+  {
+    int i;                                 // Particle counter
+    int ighost;                            // Id of next ghost particle
+    int ithread = 0;                       // Thread id
+    int Nthread = 1;                       // No. of active threads
+    int Nlocal = 0;                        // No. of ghosts found by thread
+#if defined _OPENMP
+    ithread = omp_get_thread_num();
+    Nthread = omp_get_num_threads();
+#endif
+    const int ifirst = (int) (((long) Nsource*ithread)/Nthread);
+    const int ilast = (int) (((long) Nsource*(ithread + 1))/Nthread);
+
+    // First pass : count number of ghosts required by this thread's particles
+    for (i=ifirst; i<ilast; i++) {
+      if (lhs != openboundary && sphdata[i].r[k] + 
+          min((FLOAT) 0.0,sphdata[i].v[k]*tghost) <
+          simbox.boxmin[k] + grange*sphdata[i].h) Nlocal++;
+      if (rhs != openboundary && sphdata[i].r[k] + 
+          max((FLOAT) 0.0,sphdata[i].v[k]*tghost) >
+          simbox.boxmax[k] - grange*sphdata[i].h) Nlocal++;
+    }
+    Nthreadghost[ithread + 1] = Nlocal;
+
+#pragma omp barrier
+
+    // Prefix sum of thread counts and check there's enough memory.
+    // The team may be smaller than omp_get_max_threads(), so the total is
+    // taken from the entry of the last active thread.
+#pragma omp single
+    {
+      Nthreadghost[0] = sph->Nsph + sph->Nghost;
+      for (int j=0; j<Nthread; j++) Nthreadghost[j + 1] += Nthreadghost[j];
+      Nnew = Nthreadghost[Nthread] - Nthreadghost[0];
+      if (Nthreadghost[Nthread] > sph->Nsphmax) overflow = true;
+    }
+
+    // Second pass : fill this thread's block of ghost particles
+    if (!overflow) {
+      ighost = Nthreadghost[ithread];
+      for (i=ifirst; i<ilast; i++) {
+        if (lhs != openboundary && sphdata[i].r[k] + 
+            min((FLOAT) 0.0,sphdata[i].v[k]*tghost) <
+            simbox.boxmin[k] + grange*sphdata[i].h) {
+          if (lhs == periodicboundary)
+            CreateGhostParticle(i,ighost++,k,sphdata[i].r[k] + 
+                                simbox.boxsize[k],sphdata[i].v[k],sph,
+                                x_lhs_periodic + 4*k);
+          else
+            CreateGhostParticle(i,ighost++,k,2.0*simbox.boxmin[k] - 
+                                sphdata[i].r[k],-sphdata[i].v[k],sph,
+                                x_lhs_mirror + 4*k);
+        }
+        if (rhs != openboundary && sphdata[i].r[k] + 
+            max((FLOAT) 0.0,sphdata[i].v[k]*tghost) >
+            simbox.boxmax[k] - grange*sphdata[i].h) {
+          if (rhs == periodicboundary)
+            CreateGhostParticle(i,ighost++,k,sphdata[i].r[k] - 
+                                simbox.boxsize[k],sphdata[i].v[k],sph,
+                                x_rhs_periodic + 4*k);
+          else
+            CreateGhostParticle(i,ighost++,k,2.0*simbox.boxmax[k] - 
+                                sphdata[i].r[k],-sphdata[i].v[k],sph,
+                                x_rhs_mirror + 4*k);
+        }
       }
     }
-    sph->Ntot = sph->Nsph + sph->Nghost;
-  }
 
-  // Quit here if we've run out of memory for ghosts
-  if (sph->Ntot > sph->Nsphmax) {
-    string message="Not enough memory for ghost particles";
-    ExceptionHandler::getIstance().raise(message);
   }
+  //---------------------------------------------------------------------------
 
-  sph->NPeriodicGhost = sph->Nghost;
+  delete[] Nthreadghost;
+  if (overflow) return -1;
 
-  //cout << "NGHOST : " << sph->Nghost << "     " << sph->Nghostmax << endl;
+  sph->Nghost += Nnew;
 
-  return;
+  return Nnew;
 }
 
 
 
 //=============================================================================
 //  Ghosts::CreateGhostParticle
-/// Create a new ghost particle from either 
+/// Create a new ghost particle in array position 'ighost' from either 
 /// (i) a real SPH particle (i < Nsph), or 
 /// (ii) an existing ghost particle (i >= Nsph).
 //=============================================================================
 template <int ndim>
 void PeriodicGhosts<ndim>::CreateGhostParticle
 (int i,                             ///< [in] i.d. of original particle
+ int ighost,                        ///< [in] i.d. of new ghost particle
  int k,                             ///< [in] Boundary dimension for new ghost
  FLOAT rk,                          ///< [in] k-position of original particle
  FLOAT vk,                          ///< [in] k-velocity of original particle
  Sph<ndim> *sph,                    ///< [inout] SPH particle object pointer
- int ghosttype)                     ///< ..
+ int ghosttype)                     ///< [in] Ghost particle type
 {
-  // Increase ghost counter and check there's enough space in memory
-  if (sph->Nghost > sph->Nghostmax) {
-    string message= "Not enough memory for new ghost";
-    ExceptionHandler::getIstance().raise(message);
-  }
+  SphParticle<ndim> &ghost = sph->sphdata[ighost];
 
-  // If there's enough memory, create ghost particle in arrays
-  sph->sphdata[sph->Nsph + sph->Nghost] = sph->sphdata[i];
-  sph->sphdata[sph->Nsph + sph->Nghost].r[k] = rk;
-  sph->sphdata[sph->Nsph + sph->Nghost].v[k] = vk;
-  sph->sphdata[sph->Nsph + sph->Nghost].active = false;
-  sph->sphdata[sph->Nsph + sph->Nghost].itype = ghosttype;
+  // Create ghost particle in arrays (memory is checked by calling routine)
+  ghost = sph->sphdata[i];
+  ghost.r[k] = rk;
+  ghost.v[k] = vk;
+  ghost.active = false;
+  ghost.itype = ghosttype;
 
   // Record id of original particle for later copying
-  //if (i >= sph->Nsph)
-  //  sph->sphdata[sph->Nsph + sph->Nghost].iorig = sph->sphdata[i].iorig;
-  //else
-  //  sph->sphdata[sph->Nsph + sph->Nghost].iorig = i;
-  sph->sphdata[sph->Nsph + sph->Nghost].iorig = i;
-
-  sph->Nghost = sph->Nghost + 1;
+  ghost.iorig = i;
 
   return;
 }
@@ -276,6 +341,8 @@ void PeriodicGhosts<ndim>::CreateGhostParticle
 //=============================================================================
 //  Ghosts::CopySphDataToGhosts
 /// Copy any newly calculated data from original SPH particles to ghosts.
+/// Ghosts of each dimension pass may be created from ghosts of a previous 
+/// pass, so each pass is copied in turn (each in parallel).
 //=============================================================================
 template <int ndim>
 void PeriodicGhosts<ndim>::CopySphDataToGhosts
@@ -287,34 +354,42 @@ void PeriodicGhosts<ndim>::CopySphDataToGhosts
   int itype;                        // Ghost particle type
   int j;                            // Ghost particle counter
   int k;                            // Dimension counter
-  FLOAT rp[ndim];                   // Particle position
-  FLOAT vp[ndim];                   // Particle velocity
+  SphParticle<ndim> *sphdata = sph->sphdata;   // SPH particle data
 
   debug2("[SphSimulation::CopySphDataToGhosts]");
 
   //---------------------------------------------------------------------------
-//#pragma omp parallel for default(none) private(i,iorig,itype,j,k) shared(simbox,sph)
-  for (j=0; j<sph->NPeriodicGhost; j++) {
-    i = sph->Nsph + j;
-    iorig = sph->sphdata[i].iorig;
-    itype = sph->sphdata[i].itype;
-
-    //for (k=0; k<ndim; k++) rp[k] = sph->sphdata[i].r[k];
-    //for (k=0; k<ndim; k++) vp[k] = sph->sphdata[i].v[k];
-    
-    sph->sphdata[i] = sph->sphdata[iorig];
-    sph->sphdata[i].iorig = iorig;
-    sph->sphdata[i].itype = itype;
-    sph->sphdata[i].active = false;
-    //for (k=0; k<ndim; k++) sph->sphdata[i].r[k] = rp[k];
-    //for (k=0; k<ndim; k++) sph->sphdata[i].v[k] = vp[k];
-
-    // Modify ghost position based on ghost type
-    if (itype == x_lhs_periodic) sph->sphdata[i].r[0] += simbox.boxsize[0];
-    else if (itype == x_rhs_periodic) sph->sphdata[i].r[0] -= simbox.boxsize[0];
-    else if (itype == y_lhs_periodic) sph->sphdata[i].r[1] += simbox.boxsize[1];
-    else if (itype == y_rhs_periodic) sph->sphdata[i].r[1] -= simbox.boxsize[1];
-    
+  for (k=0; k<ndim; k++) {
+    const int jstart = ighostdim[k];
+    const int jend = min(ighostdim[k+1],sph->NPeriodicGhost);
+
+#pragma omp parallel for default(none) private(i,iorig,itype,j) \
+  shared(jstart,jend,k,simbox,sph,sphdata)
+    for (j=jstart; j<jend; j++) {
+      i = sph->Nsph + j;
+      iorig = sphdata[i].iorig;
+      itype = sphdata[i].itype;
+
+      sphdata[i] = sphdata[iorig];
+      sphdata[i].iorig = iorig;
+      sphdata[i].itype = itype;
+      sphdata[i].active = false;
+
+      // Modify ghost position (and velocity for mirrors) based on ghost type
+      if (itype == x_lhs_periodic + 4*k)
+        sphdata[i].r[k] += simbox.boxsize[k];
+      else if (itype == x_rhs_periodic + 4*k)
+        sphdata[i].r[k] -= simbox.boxsize[k];
+      else if (itype == x_lhs_mirror + 4*k) {
+        sphdata[i].r[k] = 2.0*simbox.boxmin[k] - sphdata[i].r[k];
+        sphdata[i].v[k] = -sphdata[i].v[k];
+      }
+      else if (itype == x_rhs_mirror + 4*k) {
+        sphdata[i].r[k] = 2.0*simbox.boxmax[k] - sphdata[i].r[k];
+        sphdata[i].v[k] = -sphdata[i].v[k];
+      }
+    }
+
   }
   //---------------------------------------------------------------------------
 
@@ -408,9 +483,72 @@ void MPIGhosts<ndim>::SearchGhostParticles
 
 template <int ndim>
 void MPIGhosts<ndim>::CopySphDataToGhosts(DomainBox<ndim> simbox, Sph<ndim> *sph) {
+  CopySphDataToGhosts(simbox,sph,ghost_all);
+}
+
+
+
+//=============================================================================
+//  MPIGhosts::CopySphDataToGhosts
+/// Update the MPI ghost particles, sending only the given subset of the
+/// particle data (see MpiControl::UpdateGhostParticles).
+//=============================================================================
+template <int ndim>
+void MPIGhosts<ndim>::CopySphDataToGhosts
+(DomainBox<ndim> simbox,            ///< Simulation box structure
+ Sph<ndim> *sph,                    ///< Sph object pointer
+ ghostexchange exchange)            ///< Subset of particle data to send
+{
+  StartCopySphDataToGhosts(sph,exchange);
+  FinishCopySphDataToGhosts(sph);
+}
+
+
+
+//=============================================================================
+//  MPIGhosts::StartCopySphDataToGhosts
+/// Start updating the MPI ghost particles without waiting for the data to
+/// arrive, so that work not involving the MPI ghosts can be overlapped with
+/// the communication.  FinishCopySphDataToGhosts must be called before the
+/// MPI ghosts are used.
+//=============================================================================
+template <int ndim>
+void MPIGhosts<ndim>::StartCopySphDataToGhosts
+(Sph<ndim> *sph,                    ///< Sph object pointer
+ ghostexchange exchange)            ///< Subset of particle data to send
+{
+  mpicontrol->StartGhostUpdate(sph,exchange);
+  update_pending = true;
+}
+
+
+
+//=============================================================================
+//  MPIGhosts::TestCopySphDataToGhosts
+/// Progress the pending MPI ghost update (must be called by the thread that
+/// initialised MPI).
+//=============================================================================
+template <int ndim>
+void MPIGhosts<ndim>::TestCopySphDataToGhosts(void)
+{
+  if (update_pending) mpicontrol->TestGhostUpdate();
+}
+
+
+
+//=============================================================================
+//  MPIGhosts::FinishCopySphDataToGhosts
+/// Wait for the pending MPI ghost update (if any) and copy the received
+/// ghosts inside the main arrays.
+//=============================================================================
+template <int ndim>
+void MPIGhosts<ndim>::FinishCopySphDataToGhosts
+(Sph<ndim> *sph)                    ///< Sph object pointer
+{
+  if (!update_pending) return;
 
   SphParticle<ndim>* ghost_array;
-  int Nmpighosts = mpicontrol->UpdateGhostParticles(&ghost_array);
+  int Nmpighosts = mpicontrol->FinishGhostUpdate(&ghost_array);
   SphParticle<ndim>* main_array = sph->sphdata;
   int start_index = sph->Nsph + sph->NPeriodicGhost;
 
@@ -420,6 +558,7 @@ void MPIGhosts<ndim>::CopySphDataToGhosts(DomainBox<ndim> simbox, Sph<ndim> *sph
     main_array[i].active = false;
   }
 
+  update_pending = false;
 }
 #endif
 
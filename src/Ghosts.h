@@ -72,10 +72,20 @@ class Ghosts
 template <int ndim>
 class PeriodicGhosts : public Ghosts<ndim>
 {
-  void CreateGhostParticle(int, int, FLOAT, FLOAT, Sph<ndim> *,int);
+  void CreateGhostParticle(int, int, int, FLOAT, FLOAT, Sph<ndim> *, int);
+  void DecodeBoundaryTypes(DomainBox<ndim> &);
+  int SearchGhostParticlesInDimension(int, FLOAT, FLOAT, DomainBox<ndim> &,
+                                      Sph<ndim> *);
+
+  boundaryenum boundary_lhs[3];         ///< Decoded LHS boundary types
+  boundaryenum boundary_rhs[3];         ///< Decoded RHS boundary types
+  int ighostdim[4];                     ///< First ghost id (relative to Nsph)
+                                        ///< created in each dimension pass
 public:
   using Ghosts<ndim>::ghost_range;
 
+  PeriodicGhosts();
+
   virtual void SearchGhostParticles(FLOAT, DomainBox<ndim>, Sph<ndim> *);
   virtual void CopySphDataToGhosts(DomainBox<ndim>, Sph<ndim> *);
   virtual void CheckBoundaries(DomainBox<ndim>, Sph<ndim> *);
@@ -101,11 +111,18 @@ private:
 public:
   using Ghosts<ndim>::ghost_range;
 
-  MPIGhosts(MpiControl<ndim>* mpicontrol_aux): mpicontrol(mpicontrol_aux) {};
+  MPIGhosts(MpiControl<ndim>* mpicontrol_aux):
+    mpicontrol(mpicontrol_aux), update_pending(false) {};
 
   virtual void SearchGhostParticles(FLOAT, DomainBox<ndim>, Sph<ndim> *);
   virtual void CopySphDataToGhosts(DomainBox<ndim>, Sph<ndim> *);
   virtual void CheckBoundaries(DomainBox<ndim>, Sph<ndim> *);
+  void CopySphDataToGhosts(DomainBox<ndim>, Sph<ndim> *, ghostexchange);
+  void StartCopySphDataToGhosts(Sph<ndim> *, ghostexchange);
+  void TestCopySphDataToGhosts(void);
+  void FinishCopySphDataToGhosts(Sph<ndim> *);
+
+  bool update_pending;                  ///< Is a ghost update in progress?
 };
 #endif
 
@@ -170,6 +170,9 @@ void GodunovSphSimulation<ndim>::PostInitialConditionsSetup(void)
     MpiGhosts->CopySphDataToGhosts(simbox,sph);
 #endif
     sphneib->BuildTree(rebuild_tree,n,ntreebuildstep,ntreestockstep,timestep,sph);
+#ifdef MPI_PARALLEL
+    if (sph->self_gravity == 1) mpicontrol.UpdateLocallyEssentialTrees(sph);
+#endif
 
     // Compute timesteps for all particles
     if (Nlevels == 1) 
@@ -273,6 +276,9 @@ void GodunovSphSimulation<ndim>::MainLoop(void)
 
     // Update neighbour tree
     sphneib->BuildTree(rebuild_tree,n,ntreebuildstep,ntreestockstep,timestep,sph);
+#ifdef MPI_PARALLEL
+    if (sph->self_gravity == 1) mpicontrol.UpdateLocallyEssentialTrees(sph);
+#endif
 
     // Update cells containing active particles
     sphneib->UpdateActiveParticleCounters(sph);
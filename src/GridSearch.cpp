@@ -1,8 +1,10 @@
 //=============================================================================
 //  GridSearch.cpp
 //  Contains functions for grid neighbour search routines.
-//  Creates a uniform grid from particle distribution where the spacing is 
-//  the size of the maximum kernel range (i.e. kernrange*h_max) over all ptcls.
+//  Creates a hierarchy of nested uniform grids from the particle distribution
+//  where the coarsest spacing is the size of the maximum kernel range 
+//  (i.e. kernrange*h_max) over all ptcls and each finer level halves the 
+//  spacing.  Particles are placed on the finest level that fits their kernel.
 //
 //  This file is part of GANDALF :
 //  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
@@ -23,6 +25,7 @@
 //=============================================================================
 
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <string>
@@ -39,6 +42,7 @@ using namespace std;
 
 
 static const FLOAT grid_h_tolerance = (FLOAT) 1.1;
+static const int Ngridmax = 1 << 30;
 
 
 //=============================================================================
@@ -46,14 +50,18 @@ static const FLOAT grid_h_tolerance = (FLOAT) 1.1;
 /// GridSearch constructor.  Initialises various variables.
 //=============================================================================
 template <int ndim>
-GridSearch<ndim>::GridSearch()
+GridSearch<ndim>::GridSearch
+(int Nlevelmaxaux)                  ///< [in] Max. no. of grid levels
 {
   allocated_grid = false;
   Ncell = 0;
   Ncellmax = 0;
+  Nlevel = 0;
+  Nlevelmax = max(1,Nlevelmaxaux);
   Noccupymax = 0;
   Ntot = 0;
   Ntotmax = 0;
+  gridlevel = new GridLevel<ndim>[Nlevelmax];
 }
 
 
@@ -66,6 +74,7 @@ template <int ndim>
 GridSearch<ndim>::~GridSearch()
 {
   if (allocated_grid) DeallocateGridMemory();
+  delete[] gridlevel;
 }
 
 
@@ -134,6 +143,7 @@ void GridSearch<ndim>::UpdateAllSphProperties
 (Sph<ndim> *sph,                    ///< [inout] Pointer to main SPH object
  Nbody<ndim> *nbody)                ///< [in] Pointer to main N-body object
 {
+  bool periodic;                    // Use periodic wrapping for cell?
   int c;                            // Cell id
   int cactive;                      // No. of active cells
   int cc;                           // Aux. cell counter
@@ -174,8 +184,8 @@ void GridSearch<ndim>::UpdateAllSphProperties
   //===========================================================================
 #pragma omp parallel default(none) private(activelist,c,cc,draux,drsqd) \
   private(drsqdaux,hrangesqd,i,j,jj,k,okflag,m,m2,mu,mu2,Nactive) \
-  private(neiblist,Ngather,Nneib,r,rp,gpot,gpot2) \
-  shared(sph,data,nbody,Nneibmax,cactive,celllist)
+  private(neiblist,Ngather,Nneib,Nneibmax,periodic,r,rp,gpot,gpot2) \
+  shared(sph,data,nbody,cactive,celllist)
   {
     Nneibmax = Nlistmax;
     activelist = new int[Noccupymax];
@@ -199,7 +209,33 @@ void GridSearch<ndim>::UpdateAllSphProperties
       Nactive = ComputeActiveParticleList(c,activelist,sph);
 
       // Compute neighbour list for cell depending on physics options
-      Nneib = ComputeNeighbourList(c,neiblist);
+      Nneib = ComputeNeighbourList(c,Nneibmax,neiblist);
+
+      // If there are too many neighbours, reallocate the arrays and
+      // recompute the neighbour list.
+      while (Nneib == -1) {
+        delete[] r;
+        delete[] mu2;
+        delete[] mu;
+        delete[] m2;
+        delete[] m;
+        delete[] drsqd;
+        delete[] gpot2;
+        delete[] gpot;
+        delete[] neiblist;
+        Nneibmax = 2*Nneibmax;
+        neiblist = new int[Nneibmax];
+        gpot = new FLOAT[Nneibmax];
+        gpot2 = new FLOAT[Nneibmax];
+        drsqd = new FLOAT[Nneibmax];
+        m = new FLOAT[Nneibmax];
+        m2 = new FLOAT[Nneibmax];
+        mu = new FLOAT[Nneibmax];
+        mu2 = new FLOAT[Nneibmax];
+        r = new FLOAT[Nneibmax*ndim];
+        Nneib = ComputeNeighbourList(c,Nneibmax,neiblist);
+      };
+      periodic = PeriodicCell(c);
 
       // Make local copies of important neib information 
       // (mass and position; also gpot for finding ptcls at potential minima
@@ -226,6 +262,7 @@ void GridSearch<ndim>::UpdateAllSphProperties
         //---------------------------------------------------------------------
         for (jj=0; jj<Nneib; jj++) {
           for (k=0; k<ndim; k++) draux[k] = r[ndim*jj + k] - rp[k];
+          if (periodic) NearestPeriodicVector(*box,draux);
           drsqdaux = DotProduct(draux,draux,ndim);
 
           // Record distance squared for all potential gather neighbours
@@ -289,6 +326,7 @@ template <int ndim>
 void GridSearch<ndim>::UpdateAllSphHydroForces
 (Sph<ndim> *sph)                    ///< Pointer to SPH object
 {
+  bool periodic;                    // Use periodic wrapping for cell?
   int c;                            // Cell id
   int cactive;                      // No. of active cells
   int cc;                           // Aux. cell counter
@@ -327,7 +365,7 @@ void GridSearch<ndim>::UpdateAllSphHydroForces
   //===========================================================================
 #pragma omp parallel default(none) private(activelist,activepart,c,cc,dr)\
   private(draux,drmag,drsqd,hrangesqdi,i,interactlist,invdrmag,j,jj,k)\
-  private(okflag,Nactive,neiblist,neibpart,Ninteract,Nneib,Nneibmax,rp)\
+  private(okflag,Nactive,neiblist,neibpart,Ninteract,Nneib,Nneibmax,periodic,rp)\
   shared(cactive,celllist,data,sph)
   {
     Nneibmax = Nlistmax;
@@ -360,7 +398,27 @@ void GridSearch<ndim>::UpdateAllSphHydroForces
       }
 
       // Compute neighbour list for cell depending on physics options
-      Nneib = ComputeNeighbourList(c,neiblist);
+      Nneib = ComputeNeighbourList(c,Nneibmax,neiblist);
+
+      // If there are too many neighbours, reallocate the arrays and
+      // recompute the neighbour list.
+      while (Nneib == -1) {
+        delete[] neibpart;
+        delete[] invdrmag;
+        delete[] drmag;
+        delete[] dr;
+        delete[] interactlist;
+        delete[] neiblist;
+        Nneibmax = 2*Nneibmax;
+        neiblist = new int[Nneibmax];
+        interactlist = new int[Nneibmax];
+        dr = new FLOAT[Nneibmax*ndim];
+        drmag = new FLOAT[Nneibmax];
+        invdrmag = new FLOAT[Nneibmax];
+        neibpart = new SphParticle<ndim>[Nneibmax];
+        Nneib = ComputeNeighbourList(c,Nneibmax,neiblist);
+      };
+      periodic = PeriodicCell(c);
 
       // Make local copies of all potential neighbours
       for (j=0; j<Nneib; j++) {
@@ -399,6 +457,7 @@ void GridSearch<ndim>::UpdateAllSphHydroForces
           if (neiblist[jj] <= i && neibpart[jj].active) continue;
 
           for (k=0; k<ndim; k++) draux[k] = neibpart[jj].r[k] - rp[k];
+          if (periodic) NearestPeriodicVector(*box,draux);
           drsqd = DotProduct(draux,draux,ndim);
 
           // Compute list of particle-neighbour interactions and also
@@ -535,6 +594,7 @@ void GridSearch<ndim>::UpdateAllSphGravForces
 template <int ndim>
 void GridSearch<ndim>::UpdateAllSphDerivatives(Sph<ndim> *sph)
 {
+  bool periodic;                    // Use periodic wrapping for cell?
   int c;                            // Cell id
   int cactive;                      // No. of active cells
   int cc;                           // Aux. cell counter
@@ -567,16 +627,16 @@ void GridSearch<ndim>::UpdateAllSphDerivatives(Sph<ndim> *sph)
   // Find list of all cells that contain active particles
   celllist = new int[Ncell];
   cactive = ComputeActiveCellList(celllist);
-  Nneibmax = Nlistmax;
 
 
   // Set-up all OMP threads
   //===========================================================================
 #pragma omp parallel default(none) private(activelist,c,cc,dr,draux,drmag,drsqd)\
   private(hrangesqd,i,interactlist,invdrmag,j,jj,k,okflag,Nactive,neiblist)\
-  private(neibpart,Ninteract,Nneib,parti,rp) shared(celllist, cactive, Nneibmax, data)\
-  shared(sph)
+  private(neibpart,Ninteract,Nneib,Nneibmax,parti,periodic,rp)\
+  shared(celllist,cactive,data,sph)
   {
+    Nneibmax = Nlistmax;
     activelist = new int[Noccupymax];
     neiblist = new int[Nneibmax];
     interactlist = new int[Nneibmax];
@@ -595,7 +655,27 @@ void GridSearch<ndim>::UpdateAllSphDerivatives(Sph<ndim> *sph)
       Nactive = ComputeActiveParticleList(c,activelist,sph);
 
       // Compute neighbour list for cell depending on physics options
-      Nneib = ComputeNeighbourList(c,neiblist);
+      Nneib = ComputeNeighbourList(c,Nneibmax,neiblist);
+
+      // If there are too many neighbours, reallocate the arrays and
+      // recompute the neighbour list.
+      while (Nneib == -1) {
+        delete[] neibpart;
+        delete[] invdrmag;
+        delete[] drmag;
+        delete[] dr;
+        delete[] interactlist;
+        delete[] neiblist;
+        Nneibmax = 2*Nneibmax;
+        neiblist = new int[Nneibmax];
+        interactlist = new int[Nneibmax];
+        dr = new FLOAT[Nneibmax*ndim];
+        drmag = new FLOAT[Nneibmax];
+        invdrmag = new FLOAT[Nneibmax];
+        neibpart = new SphParticle<ndim>[Nneibmax];
+        Nneib = ComputeNeighbourList(c,Nneibmax,neiblist);
+      };
+      periodic = PeriodicCell(c);
       for (j=0; j<Nneib; j++) neibpart[j] = data[neiblist[j]];
 
       // Loop over all active particles in the cell
@@ -616,6 +696,7 @@ void GridSearch<ndim>::UpdateAllSphDerivatives(Sph<ndim> *sph)
         for (jj=0; jj<Nneib; jj++) {
 
           for (k=0; k<ndim; k++) draux[k] = neibpart[jj].r[k] - rp[k];
+          if (periodic) NearestPeriodicVector(*box,draux);
           drsqd = DotProduct(draux,draux,ndim);
 
           // Compute list of particle-neighbour interactions
@@ -674,6 +755,7 @@ void GridSearch<ndim>::UpdateAllSphDerivatives(Sph<ndim> *sph)
 template <int ndim>
 void GridSearch<ndim>::UpdateAllSphDudt(Sph<ndim> *sph)
 {
+  bool periodic;                    // Use periodic wrapping for cell?
   int c;                            // Cell id
   int cactive;                      // No. of active cells
   int cc;                           // Aux. cell counter
@@ -707,16 +789,16 @@ void GridSearch<ndim>::UpdateAllSphDudt(Sph<ndim> *sph)
   // Find list of all cells that contain active particles
   celllist = new int[Ncell];
   cactive = ComputeActiveCellList(celllist);
-  Nneibmax = Nlistmax;
 
 
   // Set-up all OMP threads
   //===========================================================================
 #pragma omp parallel default(none) private(activelist,c,cc,dr,draux,drmag,drsqd)\
   private(hrangesqdi,hrangesqdj,i,interactlist,invdrmag,j,jj,k,okflag,Nactive) \
-  private(neiblist,neibpart,Ninteract,Nneib,parti,rp) shared(sph, data, celllist)\
-  shared(Nneibmax, cactive)
+  private(neiblist,neibpart,Ninteract,Nneib,Nneibmax,parti,periodic,rp)\
+  shared(sph,data,celllist,cactive)
   {
+    Nneibmax = Nlistmax;
     activelist = new int[Noccupymax];
     neiblist = new int[Nneibmax];
     interactlist = new int[Nneibmax];
@@ -735,7 +817,27 @@ void GridSearch<ndim>::UpdateAllSphDudt(Sph<ndim> *sph)
       Nactive = ComputeActiveParticleList(c,activelist,sph);
 
       // Compute neighbour list for cell depending on physics options
-      Nneib = ComputeNeighbourList(c,neiblist);
+      Nneib = ComputeNeighbourList(c,Nneibmax,neiblist);
+
+      // If there are too many neighbours, reallocate the arrays and
+      // recompute the neighbour list.
+      while (Nneib == -1) {
+        delete[] neibpart;
+        delete[] invdrmag;
+        delete[] drmag;
+        delete[] dr;
+        delete[] interactlist;
+        delete[] neiblist;
+        Nneibmax = 2*Nneibmax;
+        neiblist = new int[Nneibmax];
+        interactlist = new int[Nneibmax];
+        dr = new FLOAT[Nneibmax*ndim];
+        drmag = new FLOAT[Nneibmax];
+        invdrmag = new FLOAT[Nneibmax];
+        neibpart = new SphParticle<ndim>[Nneibmax];
+        Nneib = ComputeNeighbourList(c,Nneibmax,neiblist);
+      };
+      periodic = PeriodicCell(c);
 
       // Make local copies of all potential neighbours
       for (j=0; j<Nneib; j++) {
@@ -769,6 +871,7 @@ void GridSearch<ndim>::UpdateAllSphDudt(Sph<ndim> *sph)
           hrangesqdj = 
             pow(sph->kernfac*sph->kernp->kernrange*neibpart[jj].h,2);
           for (k=0; k<ndim; k++) draux[k] = neibpart[jj].r[k] - rp[k];
+          if (periodic) NearestPeriodicVector(*box,draux);
           drsqd = DotProduct(draux,draux,ndim);
 
           // Compute list of particle-neighbour pair interactions
@@ -833,6 +936,8 @@ void GridSearch<ndim>::UpdateAllSphDudt(Sph<ndim> *sph)
 //  GridSearch::AllocateGridMemory
 /// Allocate memory for neighbour grid as requested.  If more memory is 
 /// required than currently allocated, grid is deallocated and reallocated.
+/// Since only occupied cells are stored, there are never more cells than 
+/// particles and the hash table is kept at least half empty.
 //=============================================================================
 template <int ndim>
 void GridSearch<ndim>::AllocateGridMemory(int Npart)
@@ -841,12 +946,17 @@ void GridSearch<ndim>::AllocateGridMemory(int Npart)
 
   Ntot = Npart;
 
-  if (Ntot > Ntotmax || Ncell > Ncellmax) {
+  if (Ntot > Ntotmax) {
     if (allocated_grid) DeallocateGridMemory();
     Ntotmax = 3*Ntot;
-    Ncellmax = 3*Ncell;
+    Ncellmax = Ntotmax;
+    Nhash = 1;
+    while (Nhash < 2*Ncellmax) Nhash *= 2;
     inext = new int[Ntotmax];
-    grid = new struct GridCell[Ncellmax];
+    ptclcell = new int[Ntotmax];
+    grid = new GridCell<ndim>[Ncellmax];
+    hashtable = new int[Nhash];
+    allocated_grid = true;
   }
 
   return;
@@ -863,7 +973,9 @@ void GridSearch<ndim>::DeallocateGridMemory(void)
 {
   debug2("[GridSearch::DeallocateGridMemory]");
 
+  delete[] hashtable;
   delete[] grid;
+  delete[] ptclcell;
   delete[] inext;
   allocated_grid = false;
 
@@ -872,43 +984,184 @@ void GridSearch<ndim>::DeallocateGridMemory(void)
 
 
 
+//=============================================================================
+//  GridCellOrder
+/// Comparison functor for ordering grid cells by level and then by 
+/// position (z, then y, then x) so that nearby cells are stored together.
+//=============================================================================
+template <int ndim>
+struct GridCellOrder {
+  GridCell<ndim> *grid;             ///< Array of grid cells to order
+
+  GridCellOrder(GridCell<ndim> *gridaux) : grid(gridaux) {}
+
+  bool operator()(int c1, int c2) const
+  {
+    if (grid[c1].level != grid[c2].level) 
+      return grid[c1].level < grid[c2].level;
+    for (int k=ndim-1; k>=0; k--)
+      if (grid[c1].igrid[k] != grid[c2].igrid[k]) 
+        return grid[c1].igrid[k] < grid[c2].igrid[k];
+    return false;
+  }
+};
+
+
+
 //=============================================================================
 //  GridSearch::CreateGrid
-/// Create a regular neighbour grid using all SPH particles contained within 
-/// the SPH object.  The grid spacing is equal to the maximum smoothing kernel 
-/// range of all particles multiplied by some arbitrary tolerance parameter 
-/// (grid_h_tolerance) to allow for some smoothing lengths increasing.
+/// Create the hierarchy of neighbour grids using all SPH particles contained 
+/// within the SPH object.  The coarsest grid spacing is equal to the maximum 
+/// smoothing kernel range of all particles multiplied by some arbitrary 
+/// tolerance parameter (grid_h_tolerance) to allow for some smoothing lengths
+/// increasing.  Finer levels halve the spacing until it reaches the smallest 
+/// kernel range (or Nlevelmax levels are used).  Each particle is assigned 
+/// to the finest level whose spacing is larger than its own kernel range.
+/// Occupied cells are created on demand through the cell hash table and 
+/// then sorted by level and position.
 //=============================================================================
 template <int ndim>
 void GridSearch<ndim>::CreateGrid(Sph<ndim> *sph)
 {
+  int c;                            // Grid cell counter/id
   int i;                            // Particle counter
   int k;                            // Dimension counter
-  int c;                            // Grid cell counter/id
+  int l;                            // Grid level counter
+  int slot;                         // Hash table slot
+  int igrid[ndim];                  // Grid cell coordinate
+  int *cellorder;                   // Cell ids sorted by level and position
+  int *cellrank;                    // New id of each cell after sorting
+  FLOAT extentwrap = 0.0;           // Maximum extent of wrapped dimensions
+  FLOAT hrangefac;                  // Kernel range per smoothing length
   FLOAT h_max = 0.0;                // Maximum smoothing length of ptcls
+  FLOAT h_min = big_number;         // Minimum smoothing length of ptcls
+  GridCell<ndim> *gridaux;          // Unsorted copy of grid cells
 
   debug2("[GridSearch::CreateGrid]");
   
-  // Compute maximum smoothing length to determine optimum grid spacing
-  for (i=0; i<sph->Nsph; i++) h_max = max(h_max,sph->sphdata[i].h);
-  dx_grid = grid_h_tolerance*sph->kernfac*sph->kernp->kernrange*h_max;
+  // Compute maximum and minimum smoothing lengths to determine optimum 
+  // grid spacing on coarsest and finest levels
+  for (i=0; i<sph->Nsph; i++) {
+    h_max = max(h_max,sph->sphdata[i].h);
+    h_min = min(h_min,sph->sphdata[i].h);
+  }
+  hrangefac = grid_h_tolerance*sph->kernfac*sph->kernp->kernrange;
+  dx_grid = hrangefac*h_max;
 
-  // Compute bounding box of all particles
+  // Compute bounding box of all particles.  Dimensions wrapped implicitly by 
+  // the search span the periodic box exactly.
   sph->SphBoundingBox(rmax,rmin,sph->Ntot);
+  for (k=0; k<ndim; k++) {
+    if (box->periodic_wrap[k]) {
+      rmin[k] = box->boxmin[k];
+      rmax[k] = box->boxmax[k];
+      extentwrap = max(extentwrap,rmax[k] - rmin[k]);
+    }
+  }
 
-  // Calculate no. of grid cells in each dimension and in total
-  Ncell = 1;
+  // Add finer levels (halving the grid spacing each time) while they can 
+  // still contain particles, keeping wrapped cell coordinates in range
+  Nlevel = 1;
+  while (Nlevel < Nlevelmax && ldexp(dx_grid,-Nlevel) >= hrangefac*h_min &&
+         extentwrap < ldexp(dx_grid,-Nlevel)*(FLOAT) Ngridmax) Nlevel++;
+  for (l=0; l<Nlevel; l++)
+    gridlevel[l].hrangemax = ldexp(dx_grid,l - Nlevel + 1);
+
+  // Calculate no. of finest-level cells in each dimension.  In wrapped 
+  // dimensions, the number of cells on the coarsest level sets the finest 
+  // level so that the cells of all levels nest exactly inside the box.
+  // Otherwise, coordinates are limited to Ngridmax so that distant escaping 
+  // particles share the outermost cells instead of overflowing.
   for (k=0; k<ndim; k++) {
-    Ngrid[k] = (int)((rmax[k] - rmin[k])/dx_grid) + 1;
-    Ncell = Ngrid[k]*Ncell;
+    if (box->periodic_wrap[k]) {
+      Ngrid[k] = max(1,(int)((rmax[k] - rmin[k])/dx_grid)) << (Nlevel - 1);
+      dxcell[k] = (rmax[k] - rmin[k])/(FLOAT) Ngrid[k];
+    }
+    else {
+      dxcell[k] = gridlevel[0].hrangemax;
+      Ngrid[k] = (int) min((rmax[k] - rmin[k])/dxcell[k] + (FLOAT) 1.0,
+                           (FLOAT) Ngridmax);
+    }
   }
 
   // Allocate memory for grid if not previously done
   AllocateGridMemory(sph->Ntot);
   Nsph = sph->Nsph;
 
+  // Initialise all levels and the (empty) hash table
+  for (l=0; l<Nlevel; l++) {
+    gridlevel[l].Ncell = 0;
+    gridlevel[l].Nptcls = 0;
+    for (k=0; k<ndim; k++) {
+      gridlevel[l].imin[k] = Ngrid[k];
+      gridlevel[l].imax[k] = -1;
+    }
+  }
+  for (slot=0; slot<Nhash; slot++) hashtable[slot] = -1;
+  Ncell = 0;
+
+  // Find the cell of every particle, creating it if it is not yet occupied
+  //---------------------------------------------------------------------------
+  for (i=0; i<sph->Ntot; i++) {
+    l = ComputeParticleLevel(hrangefac*sph->sphdata[i].h);
+    ComputeParticleCoordinate(sph->sphdata[i].r,igrid);
+    for (k=0; k<ndim; k++) igrid[k] = igrid[k] >> l;
+    slot = ComputeHashSlot(l,igrid);
+
+    if (hashtable[slot] == -1) {
+      c = Ncell++;
+      hashtable[slot] = c;
+      grid[c].level = l;
+      for (k=0; k<ndim; k++) {
+        grid[c].igrid[k] = igrid[k];
+        gridlevel[l].imin[k] = min(gridlevel[l].imin[k],igrid[k]);
+        gridlevel[l].imax[k] = max(gridlevel[l].imax[k],igrid[k]);
+      }
+      gridlevel[l].Ncell++;
+    }
+    ptclcell[i] = hashtable[slot];
+    gridlevel[l].Nptcls++;
+  }
+  //---------------------------------------------------------------------------
+
+  // Sort the occupied cells by level and position, and renumber all 
+  // references to them (i.e. hash table and particle cell ids)
+  cellorder = new int[Ncell];
+  cellrank = new int[Ncell];
+  gridaux = new GridCell<ndim>[Ncell];
+  for (c=0; c<Ncell; c++) {
+    cellorder[c] = c;
+    gridaux[c] = grid[c];
+  }
+  std::sort(cellorder,cellorder + Ncell,GridCellOrder<ndim>(gridaux));
+  for (c=0; c<Ncell; c++) {
+    grid[c] = gridaux[cellorder[c]];
+    cellrank[cellorder[c]] = c;
+  }
+  for (slot=0; slot<Nhash; slot++)
+    if (hashtable[slot] != -1) hashtable[slot] = cellrank[hashtable[slot]];
+  for (i=0; i<sph->Ntot; i++) ptclcell[i] = cellrank[ptclcell[i]];
+  delete[] gridaux;
+  delete[] cellrank;
+  delete[] cellorder;
+
+  // Record the first cell and the extent of each level.  In wrapped 
+  // dimensions, every level spans the whole periodic box.
+  c = 0;
+  for (l=0; l<Nlevel; l++) {
+    gridlevel[l].cfirst = c;
+    c += gridlevel[l].Ncell;
+    for (k=0; k<ndim; k++) {
+      if (box->periodic_wrap[k]) {
+        gridlevel[l].imin[k] = 0;
+        gridlevel[l].imax[k] = (Ngrid[k] >> l) - 1;
+      }
+      gridlevel[l].Ngrid[k] = gridlevel[l].imax[k] - gridlevel[l].imin[k] + 1;
+    }
+  }
+
   // Initialise all values in cells
-  for (c=0; c<Ncellmax; c++) {
+  for (c=0; c<Ncell; c++) {
     grid[c].Nactive = 0;
     grid[c].Nptcls = 0;
     grid[c].ifirst = 0;
@@ -919,13 +1172,10 @@ void GridSearch<ndim>::CreateGrid(Sph<ndim> *sph)
   // Now attach all particles to grid cells
   //---------------------------------------------------------------------------
   for (i=0; i<sph->Ntot; i++) {
-    c = ComputeParticleGridCell(sph->sphdata[i].r);
+    c = ptclcell[i];
 
     // If cell currently contains no particles, record first particle.
     // Else, add to end of linked list.
-    if (c < 0) cout << "rp : " << sph->sphdata[i].r[0] << "   " 
-		    << sph->sphdata[i].a[0] << "   " << sph->sphdata[i].dudt 
-		    << endl;
     if (grid[c].Nptcls == 0) grid[c].ifirst = i;
     else inext[grid[c].ilast] = i;
     grid[c].ilast = i;
@@ -935,7 +1185,9 @@ void GridSearch<ndim>::CreateGrid(Sph<ndim> *sph)
   }
   //---------------------------------------------------------------------------
 
-  // Find maximum occupations of all cells
+  // Find maximum occupations of all cells.  Neighbour lists from levels with 
+  // different cell sizes can be longer, so the list arrays are enlarged 
+  // on the fly if required.
   Noccupymax = 0;
   for (c=0; c<Ncell; c++) Noccupymax = max(Noccupymax,grid[c].Nptcls);
   Nlistmax = Noccupymax*pow(3,ndim);
@@ -950,57 +1202,115 @@ void GridSearch<ndim>::CreateGrid(Sph<ndim> *sph)
 
 
 //=============================================================================
-//  GridSearch::ComputeParticleGridCell
-/// Compute and return the grid cell i.d. that contains the position 'rp'.
+//  GridSearch::ComputeParticleLevel
+/// Compute and return the finest grid level whose spacing is larger than 
+/// the given kernel range 'hrange'.
+//=============================================================================
+template <int ndim>
+int GridSearch<ndim>::ComputeParticleLevel
+(FLOAT hrange)                      ///< [in] Kernel range of particle
+{
+  int l = 0;                        // Grid level
+
+  while (l < Nlevel - 1 && hrange > gridlevel[l].hrangemax) l++;
+
+  return l;
+}
+
+
+
+//=============================================================================
+//  GridSearch::ComputeParticleCoordinate
+/// Compute the coordinate 'igrid' of the finest-level cell that contains the
+/// position 'rp'.  The coordinate on level l is then igrid >> l.
 //=============================================================================
 template <int ndim>
-int GridSearch<ndim>::ComputeParticleGridCell
-(FLOAT *rp)                         ///< [in] Position vector
+void GridSearch<ndim>::ComputeParticleCoordinate
+(FLOAT *rp,                         ///< [in] Position vector
+ int igrid[ndim])                   ///< [out] Finest-level cell coordinate
 {
   int k;                            // Dimension counter
-  int igrid[ndim];                  // Grid cell coordinate
+  FLOAT xaux;                       // Cell coordinate (before truncation)
 
   for (k=0; k<ndim; k++) {
-    igrid[k] = (int) ((rp[k] - rmin[k])/dx_grid);
-    if (igrid[k] < 0) igrid[k] = 0;
-    if (igrid[k] >= Ngrid[k]) igrid[k] = Ngrid[k] - 1;
+    xaux = (rp[k] - rmin[k])/dxcell[k];
+    if (xaux < (FLOAT) 0.0) igrid[k] = 0;
+    else if (xaux >= (FLOAT) Ngrid[k]) igrid[k] = Ngrid[k] - 1;
+    else igrid[k] = (int) xaux;
   }
-  if (ndim == 1) 
-    return igrid[0];
-  else if (ndim == 2) 
-    return igrid[0] + Ngrid[0]*igrid[1];
-  else if (ndim == 3) 
-    return igrid[0] + Ngrid[0]*igrid[1] + Ngrid[0]*Ngrid[1]*igrid[2];
+
+  return;
+}
+
+
+
+//=============================================================================
+//  GridSearch::ComputeHashSlot
+/// Compute and return the slot of the cell hash table that holds the cell 
+/// with coordinate 'igrid' on level 'l', or the empty slot where it would 
+/// be inserted.  Collisions are resolved by linear probing.
+//=============================================================================
+template <int ndim>
+int GridSearch<ndim>::ComputeHashSlot
+(int l,                             ///< [in] Grid level
+ int igrid[ndim])                   ///< [in] Grid-cell co-ordinate on level
+{
+  static const unsigned int prime[3] = {73856093u,19349663u,83492791u};
+  int c;                            // Cell id in current slot
+  int k;                            // Dimension counter
+  int slot;                         // Hash table slot
+  unsigned int key;                 // Hash key of cell
+
+  key = (unsigned int) l*2654435761u;
+  for (k=0; k<ndim; k++) key ^= (unsigned int) igrid[k]*prime[k];
+  slot = (int) (key & (unsigned int) (Nhash - 1));
+
+  // Probe until either the cell or an empty slot is found
+  do {
+    c = hashtable[slot];
+    if (c == -1) return slot;
+    if (grid[c].level == l) {
+      for (k=0; k<ndim; k++) if (grid[c].igrid[k] != igrid[k]) break;
+      if (k == ndim) return slot;
+    }
+    slot = (slot + 1) & (Nhash - 1);
+  } while (true);
+}
+
+
+
+//=============================================================================
+//  GridSearch::ComputeCellId
+/// Compute and return the grid cell i.d. of the cell with coordinate 'igrid' 
+/// on level 'l', or -1 if that cell contains no particles.
+//=============================================================================
+template <int ndim>
+int GridSearch<ndim>::ComputeCellId
+(int l,                             ///< [in] Grid level
+ int igrid[ndim])                   ///< [in] Grid-cell co-ordinate on level
+{
+  return hashtable[ComputeHashSlot(l,igrid)];
 }
 
 
 
 //=============================================================================
 //  GridSearch::ComputeCellCoordinate
-/// Computes and returns the grid cell coordinate 'igrid' from the 
-/// grid cell i.d. 'c'
+/// Computes and returns the grid level 'l' and the grid cell coordinate 
+/// 'igrid' on that level from the grid cell i.d. 'c'
 //=============================================================================
 template <int ndim>
 void GridSearch<ndim>::ComputeCellCoordinate
 (int c,                             ///< [in] Grid-cell id
+ int &l,                            ///< [out] Grid level of cell
  int igrid[ndim])                   ///< [out] Grid-cell co-ordinate
 {
-  if (ndim == 1) 
-    igrid[0] = c;
-  else if (ndim == 2) {
-    igrid[1] = c/Ngrid[0];
-    igrid[0] = c%Ngrid[0];
-  }
-  else if (ndim == 3) {
-    igrid[2] = c/Ngrid[0]/Ngrid[1];
-    igrid[1] = (c/Ngrid[0])%Ngrid[1];
-    igrid[0] = c%Ngrid[0];
-  }
+  int k;                            // Dimension counter
+
+  l = grid[c].level;
+  for (k=0; k<ndim; k++) igrid[k] = grid[c].igrid[k];
 #if defined(VERIFY_ALL)
-  if ((ndim == 1 && c != igrid[0]) ||
-      (ndim == 2 && c != igrid[0] + Ngrid[0]*igrid[1]) || 
-      (ndim == 3 && c!= igrid[0] + Ngrid[0]*igrid[1] + 
-       Ngrid[0]*Ngrid[1]*igrid[2])) {
+  if (c != ComputeCellId(l,igrid)) {
     string message= "Problem computing Grid cell coorindate";
     ExceptionHandler::getIstance().raise(message);
   }
@@ -1066,95 +1376,174 @@ int GridSearch<ndim>::ComputeActiveParticleList
 //  GridSearch::ComputeNeighbourList
 /// Computes and returns number of neighbour, 'Nneib', and the list 
 /// of neighbour ids, 'neiblist', for all particles inside cell 'c'.
-/// Includes all particles in the selected cell, plus all particles 
-/// contained in adjacent cells (including diagonal cells).
+/// On the same or coarser levels, includes all particles in the cell 
+/// containing 'c' plus all particles contained in adjacent cells (including 
+/// diagonal cells).  On finer levels, includes all cells covering 'c' and 
+/// its adjacent cells.  For dimensions wrapped implicitly by the search, 
+/// adjacent cells wrap around the box.  If the list would exceed 'Nneibmax' 
+/// neighbours, returns -1 so that the caller can enlarge its arrays.
 //=============================================================================
 template <int ndim>
 int GridSearch<ndim>::ComputeNeighbourList
 (int c,                             ///< [in] i.d. of cell
- int *neiblist)                     ///< [out] List of neighbour i.d.s
+ int Nneibmax,                      ///< [in] Max. no. of neighbours
+ int *neiblist)                     ///< [out] List of neighbour ids
 {
-  int i;                            // Particle id
-  int ilast;                        // id of last particle in current cell
-  int caux,cx,cy,cz;                // Aux. cell counters and coordinates
+  bool empty;                       // Is range of cells empty?
+  int k;                            // Dimension counter
+  int l;                            // Grid level of cell
+  int lneib;                        // Grid level of neighbouring cells
+  int caux,cx,cy,cz;                // Aux. cell counters
   int igrid[ndim];                  // Grid cell coordinate
-  int gridmin[ndim];                // Minimum neighbour cell coordinate
-  int gridmax[ndim];                // Maximum neighbour cell coordinate
+  int ineib[ndim];                  // Neighbouring cell coordinate
+  int ilo[3] = {0,0,0};             // Lowest neighbouring cell coordinate
+  int ihi[3] = {0,0,0};             // Highest neighbouring cell coordinate
   int Nneib = 0;                    // No. of neighbours
+  FLOAT Nrange;                     // No. of cells in neighbouring range
 
-  // Compute the location of the cell on the grid using the id
-  ComputeCellCoordinate(c,igrid);
+  // Compute the level and location of the cell on the grid using the id
+  ComputeCellCoordinate(c,l,igrid);
 
-  //---------------------------------------------------------------------------
-  if (ndim == 1) {
-    gridmin[0] = max(0,igrid[0]-1);
-    gridmax[0] = min(Ngrid[0]-1,igrid[0]+1);
-    
-    for (cx=gridmin[0]; cx<=gridmax[0]; cx++) {
-      caux = cx;
-      if (grid[caux].Nptcls == 0) continue;
-      i = grid[caux].ifirst;
-      ilast = grid[caux].ilast;
-      do {
-	neiblist[Nneib++] = i;
-	if (i == ilast) break;
-	i = inext[i];
-      } while (i != -1);
+  // Loop over all grid levels containing particles
+  //===========================================================================
+  for (lneib=0; lneib<Nlevel; lneib++) {
+    GridLevel<ndim> &level = gridlevel[lneib];
+    if (level.Nptcls == 0) continue;
+
+    // Find range of neighbouring cell coordinates in each dimension.  
+    // Periodic ranges spanning the whole level contain every cell once.
+    //-------------------------------------------------------------------------
+    empty = false;
+    for (k=0; k<ndim; k++) {
+      if (lneib >= l) {
+        ilo[k] = (igrid[k] >> (lneib - l)) - 1;
+        ihi[k] = (igrid[k] >> (lneib - l)) + 1;
+      }
+      else {
+        ilo[k] = (igrid[k] - 1)*(1 << (l - lneib));
+        ihi[k] = (igrid[k] + 2)*(1 << (l - lneib)) - 1;
+      }
+      if (box->periodic_wrap[k]) {
+        if (ihi[k] - ilo[k] + 1 >= level.Ngrid[k]) {
+          ilo[k] = 0;
+          ihi[k] = level.Ngrid[k] - 1;
+        }
+      }
+      else {
+        ilo[k] = max(ilo[k],level.imin[k]);
+        ihi[k] = min(ihi[k],level.imax[k]);
+        if (ilo[k] > ihi[k]) empty = true;
+      }
     }
-  }
-  //---------------------------------------------------------------------------
-  else if (ndim == 2) {
-    gridmin[0] = max(0,igrid[0]-1);
-    gridmax[0] = min(Ngrid[0]-1,igrid[0]+1);
-    gridmin[1] = max(0,igrid[1]-1);
-    gridmax[1] = min(Ngrid[1]-1,igrid[1]+1);
-    
-    for (cy=gridmin[1]; cy<=gridmax[1]; cy++) {
-      for (cx=gridmin[0]; cx<=gridmax[0]; cx++) {
-	caux = cx + cy*Ngrid[0];
-	if (grid[caux].Nptcls == 0) continue;
-	i = grid[caux].ifirst;
-	ilast = grid[caux].ilast;
-	do {
-	  neiblist[Nneib++] = i;
-	  if (i == ilast) break;
-	  i = inext[i];
-	} while (i != -1);
+    if (empty) continue;
+
+    // If the range spans more cells than are occupied on the level (e.g. 
+    // for much finer levels), scan the level's occupied cells instead of 
+    // looking up every cell in the range.
+    //-------------------------------------------------------------------------
+    Nrange = 1;
+    for (k=0; k<ndim; k++) Nrange *= (FLOAT) (ihi[k] - ilo[k] + 1);
+
+    if (Nrange > (FLOAT) level.Ncell) {
+      for (caux=level.cfirst; caux<level.cfirst+level.Ncell; caux++) {
+        for (k=0; k<ndim; k++) {
+          cx = grid[caux].igrid[k] - ilo[k];
+          if (box->periodic_wrap[k]) cx = (cx % level.Ngrid[k] + 
+                                           level.Ngrid[k]) % level.Ngrid[k];
+          if (cx < 0 || cx > ihi[k] - ilo[k]) break;
+        }
+        if (k < ndim) continue;
+        if (Nneib + grid[caux].Nptcls > Nneibmax) return -1;
+        Nneib = AddCellToList(caux,Nneib,neiblist);
       }
+      continue;
     }
-  }
-  //---------------------------------------------------------------------------
-  else if (ndim == 3) {
-    gridmin[0] = max(0,igrid[0]-1);
-    gridmax[0] = min(Ngrid[0]-1,igrid[0]+1);
-    gridmin[1] = max(0,igrid[1]-1);
-    gridmax[1] = min(Ngrid[1]-1,igrid[1]+1);
-    gridmin[2] = max(0,igrid[2]-1);
-    gridmax[2] = min(Ngrid[2]-1,igrid[2]+1);
-    
-    for (cz=gridmin[2]; cz<=gridmax[2]; cz++) {
-      for (cy=gridmin[1]; cy<=gridmax[1]; cy++) {
-	for (cx=gridmin[0]; cx<=gridmax[0]; cx++) {
-	  caux = cx + cy*Ngrid[0] + cz*Ngrid[0]*Ngrid[1];
-	  if (grid[caux].Nptcls == 0) continue;
-	  i = grid[caux].ifirst;
-	  ilast = grid[caux].ilast;
-	  do {
-	    neiblist[Nneib++] = i;
-	    if (i == ilast) break;
-	    i = inext[i];
-	  } while (i != -1);
-	}
+
+    // Walk through linked lists of all neighbouring cells
+    //-------------------------------------------------------------------------
+    for (cz=ilo[2]; cz<=ihi[2]; cz++) {
+      for (cy=ilo[1]; cy<=ihi[1]; cy++) {
+        for (cx=ilo[0]; cx<=ihi[0]; cx++) {
+          ineib[0] = cx;
+          if (ndim > 1) ineib[1] = cy;
+          if (ndim > 2) ineib[2] = cz;
+          for (k=0; k<ndim; k++)
+            if (box->periodic_wrap[k]) ineib[k] = 
+              (ineib[k] % level.Ngrid[k] + level.Ngrid[k]) % level.Ngrid[k];
+          caux = ComputeCellId(lneib,ineib);
+          if (caux == -1) continue;
+          if (Nneib + grid[caux].Nptcls > Nneibmax) return -1;
+          Nneib = AddCellToList(caux,Nneib,neiblist);
+        }
       }
     }
+    //-------------------------------------------------------------------------
+
   }
-  //---------------------------------------------------------------------------
+  //===========================================================================
 
   return Nneib;
 }
 
 
 
+//=============================================================================
+//  GridSearch::AddCellToList
+/// Appends the ids of all particles in cell 'c' to the neighbour list 
+/// 'neiblist' (which must have space for them) and returns the new length.
+//=============================================================================
+template <int ndim>
+int GridSearch<ndim>::AddCellToList
+(int c,                             ///< [in] i.d. of cell
+ int Nneib,                         ///< [in] Current no. of neighbours
+ int *neiblist)                     ///< [inout] List of neighbour ids
+{
+  int i = grid[c].ifirst;           // Particle id (set to first ptcl id)
+  int ilast = grid[c].ilast;        // i.d. of last particle in cell c
+
+  do {
+    neiblist[Nneib++] = i;
+    if (i == ilast) break;
+    i = inext[i];
+  } while (i != -1);
+
+  return Nneib;
+}
+
+
+
+//=============================================================================
+//  GridSearch::PeriodicCell
+/// Returns true if the neighbour list of cell 'c' may contain particles 
+/// across an implicitly wrapped periodic boundary, so that relative 
+/// positions must be converted to their nearest periodic image.  This is 
+/// only the case if the neighbour cells on the coarsest level touch the 
+/// edge of the periodic box.
+//=============================================================================
+template <int ndim>
+bool GridSearch<ndim>::PeriodicCell
+(int c)                             ///< [in] i.d. of cell
+{
+  int k;                            // Dimension counter
+  int l;                            // Grid level of cell
+  int ltop = Nlevel - 1;            // Coarsest grid level
+  int igrid[ndim];                  // Grid cell coordinate
+
+  if (!box->implicit_periodic) return false;
+
+  ComputeCellCoordinate(c,l,igrid);
+
+  for (k=0; k<ndim; k++) {
+    if (!box->periodic_wrap[k]) continue;
+    if ((igrid[k] >> (ltop - l)) == 0 || 
+        (igrid[k] >> (ltop - l)) == (Ngrid[k] >> ltop) - 1) return true;
+  }
+
+  return false;
+}
+
+
+
 #if defined(VERIFY_ALL)
 //=============================================================================
 //  GridSearch::CheckValidNeighbourList
@@ -1186,6 +1575,7 @@ void GridSearch<ndim>::CheckValidNeighbourList
     for (j=0; j<sph->Ntot; j++) {
       for (k=0; k<ndim; k++)
 	dr[k] = sph->sphdata[j].r[k] - sph->sphdata[i].r[k];
+      if (box->implicit_periodic) NearestPeriodicVector(*box,dr);
       drsqd = DotProduct(dr,dr,ndim);
       if (drsqd <= 
 	  sph->kernp->kernrangesqd*sph->sphdata[i].h*sph->sphdata[i].h)
@@ -1196,6 +1586,7 @@ void GridSearch<ndim>::CheckValidNeighbourList
     for (j=0; j<sph->Ntot; j++) {
       for (k=0; k<ndim; k++) 
         dr[k] = sph->sphdata[j].r[k] - sph->sphdata[i].r[k];
+      if (box->implicit_periodic) NearestPeriodicVector(*box,dr);
       drsqd = DotProduct(dr,dr,ndim);
       if (drsqd < sph->kernp->kernrangesqd*sph->sphdata[i].h*sph->sphdata[i].h ||
     	  drsqd < sph->kernp->kernrangesqd*sph->sphdata[j].h*sph->sphdata[j].h)
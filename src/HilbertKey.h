@@ -0,0 +1,106 @@
+//=============================================================================
+//  HilbertKey.h
+//  Contains the functions for computing Peano-Hilbert space-filling curve
+//  keys of particle positions (used for the MPI domain decomposition).
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#ifndef _HILBERT_KEY_H_
+#define _HILBERT_KEY_H_
+
+
+#include "Precision.h"
+#include "DomainBox.h"
+
+
+typedef unsigned long long hilbertkey;  ///< Peano-Hilbert key type
+
+
+
+//=============================================================================
+//  HilbertKeyBits
+/// No. of bits of the Peano-Hilbert keys (i.e. the no. of bits per dimension
+/// times ndim), chosen so that all keys fit into 64 bits.
+//=============================================================================
+template <int ndim>
+inline int HilbertKeyBits(void)
+{
+  return (ndim == 1 ? 32 : (ndim == 2 ? 62 : 63));
+}
+
+
+
+//=============================================================================
+//  HilbertKey
+/// Returns the Peano-Hilbert key of position r inside the given box (points
+/// outside the box are moved to its edge).  The integer coordinates are
+/// transformed to the 'transposed' Hilbert index with the algorithm of
+/// Skilling (2004, AIP Conf. Proc. 707, 381), whose bits are then
+/// interleaved to give the key.  Consecutive keys are always adjacent cells.
+//=============================================================================
+template <int ndim>
+inline hilbertkey HilbertKey
+(const FLOAT *r,                    ///< [in] Position
+ const Box<ndim> &box)              ///< [in] Box mapped onto the curve
+{
+  const int b = HilbertKeyBits<ndim>()/ndim;    // Bits per dimension
+  const unsigned int M = 1u << (b - 1);         // Highest bit
+  int i;                            // Dimension counter
+  int j;                            // Bit counter
+  unsigned int P;                   // Mask of lower bits
+  unsigned int Q;                   // Current bit
+  unsigned int t;                   // Aux. variable
+  unsigned int X[ndim];             // Integer (transposed) coordinates
+  DOUBLE x;                         // Scaled coordinate
+  hilbertkey key = 0;               // Peano-Hilbert key
+
+  // Scale position to integer coordinates
+  for (i=0; i<ndim; i++) {
+    x = (DOUBLE) (r[i] - box.boxmin[i])/(DOUBLE) (box.boxmax[i] - box.boxmin[i]);
+    x = (x < 0.0 ? 0.0 : (x > 1.0 ? 1.0 : x));
+    X[i] = (unsigned int) (x*(DOUBLE) (((hilbertkey) 1 << b) - 1));
+  }
+
+  // Inverse undo excess work
+  for (Q=M; Q>1; Q>>=1) {
+    P = Q - 1;
+    for (i=0; i<ndim; i++) {
+      if (X[i] & Q) X[0] ^= P;
+      else {
+        t = (X[0] ^ X[i]) & P;
+        X[0] ^= t;
+        X[i] ^= t;
+      }
+    }
+  }
+
+  // Gray encode
+  for (i=1; i<ndim; i++) X[i] ^= X[i-1];
+  t = 0;
+  for (Q=M; Q>1; Q>>=1) if (X[ndim-1] & Q) t ^= Q - 1;
+  for (i=0; i<ndim; i++) X[i] ^= t;
+
+  // Interleave the bits of the transposed index, most significant first
+  for (j=b-1; j>=0; j--)
+    for (i=0; i<ndim; i++) key = (key << 1) | ((X[i] >> j) & 1u);
+
+  return key;
+}
+#endif
@@ -0,0 +1,734 @@
+//=============================================================================
+//  InSituAnalysis.cpp
+//  Contains all functions of the in-situ analysis interface and of the
+//  built-in analyses.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "InSituAnalysis.h"
+#include "InlineFuncs.h"
+#include "Simulation.h"
+#include "Exception.h"
+#include "Debug.h"
+#ifdef MPI_PARALLEL
+#include "mpi.h"
+#endif
+using namespace std;
+
+
+static const int lagrangian_nhist = 4096;     // No. of mass histogram bins
+static const DOUBLE lagrangian_rrange = 1.0e-8;  // rmin/rmax of histogram
+
+
+
+//=============================================================================
+//  RadialBin
+/// Returns the logarithmic bin of the Lagrangian radii mass histogram for a
+/// given distance squared (clamped to the first and last bins).
+//=============================================================================
+static inline int RadialBin
+(DOUBLE drsqd,                      ///< [in] Distance squared from centre
+ DOUBLE rlogmin,                    ///< [in] log of inner edge of histogram
+ DOUBLE invdlogr)                   ///< [in] Inverse bin width in log r
+{
+  if (drsqd <= 0.0) return 0;
+  int b = (int) ((0.5*log(drsqd) - rlogmin)*invdlogr);
+  return max(0,min(lagrangian_nhist - 1,b));
+}
+
+
+
+//=============================================================================
+//  InSituAnalysis::InSituAnalysis
+/// InSituAnalysis constructor.
+//=============================================================================
+template <int ndim>
+InSituAnalysis<ndim>::InSituAnalysis
+(string filenameaux)                ///< [in] Name of time-series file
+{
+  filename = filenameaux;
+}
+
+
+
+//=============================================================================
+//  InSituAnalysis::~InSituAnalysis
+/// InSituAnalysis destructor.  Closes the time-series file.
+//=============================================================================
+template <int ndim>
+InSituAnalysis<ndim>::~InSituAnalysis()
+{
+  if (outfile.is_open()) outfile.close();
+}
+
+
+
+//=============================================================================
+//  InSituAnalysis::OpenFile
+/// Open the time-series file on the root process.  New files (position < 0) 
+/// start with a header describing the columns.  Restarted runs pass the 
+/// file length recorded in the restart file; any records written after the 
+/// restart file are discarded and new records are appended.
+//=============================================================================
+template <int ndim>
+void InSituAnalysis<ndim>::OpenFile
+(Simulation<ndim> *sim,             ///< [in] Simulation object
+ long position)                     ///< [in] Length of file to keep (or -1)
+{
+  struct stat filestat;             // File status (for file length)
+
+  debug2("[InSituAnalysis::OpenFile]");
+
+  if (sim->rank != 0) return;
+
+  if (position >= 0 && stat(filename.c_str(),&filestat) != 0) {
+    cout << "Warning: analysis file " << filename << " not found; "
+         << "starting a new file" << endl;
+    position = -1;
+  }
+
+  if (position < 0) outfile.open(filename.c_str(), ios::out | ios::trunc);
+  else {
+    if ((long) filestat.st_size < position ||
+        truncate(filename.c_str(),(off_t) position) != 0) {
+      string msg = "Error: analysis file " + filename +
+        " is shorter than recorded in the restart file";
+      ExceptionHandler::getIstance().raise(msg);
+    }
+    outfile.open(filename.c_str(), ios::out | ios::app);
+  }
+  if (!outfile.is_open()) {
+    string msg = "Error: could not open analysis file : " + filename;
+    ExceptionHandler::getIstance().raise(msg);
+  }
+  outfile << setprecision(8);
+  if (position < 0) WriteFileHeader(sim);
+
+  return;
+}
+
+
+
+//=============================================================================
+//  InSituAnalysis::FilePosition
+/// Flush the time-series file and return its current length (zero on all 
+/// but the root process), for storing in restart files.
+//=============================================================================
+template <int ndim>
+long InSituAnalysis<ndim>::FilePosition(void)
+{
+  if (!outfile.is_open()) return 0;
+  outfile.flush();
+  return (long) outfile.tellp();
+}
+
+
+
+//=============================================================================
+//  InSituAnalysis::CentreOfMass
+/// Compute the centre of mass position and velocity of all particles (SPH
+/// and stars) with OpenMP reductions (summed over all MPI processes).
+//=============================================================================
+template <int ndim>
+void InSituAnalysis<ndim>::CentreOfMass
+(Simulation<ndim> *sim,             ///< [in] Simulation object
+ DOUBLE *rcom,                      ///< [out] Centre of mass position
+ DOUBLE *vcom)                      ///< [out] Centre of mass velocity
+{
+  int i;                            // Particle counter
+  int k;                            // Dimension counter
+  int Nsph = sim->sph->Nsph;        // No. of SPH particles
+  DOUBLE sum[2*ndim + 1];           // Mass, mass-weighted r and v sums
+  SphParticle<ndim> *sphdata = sim->sph->sphdata;   // SPH particle data
+
+  for (k=0; k<2*ndim+1; k++) sum[k] = 0.0;
+
+  // Per-thread sums of SPH particles, merged at the end
+  //---------------------------------------------------------------------------
+#pragma omp parallel default(none) private(i,k) shared(Nsph,sphdata,sum)
+  {
+    DOUBLE sumlocal[2*ndim + 1];
+    for (k=0; k<2*ndim+1; k++) sumlocal[k] = 0.0;
+#pragma omp for
+    for (i=0; i<Nsph; i++) {
+      sumlocal[0] += sphdata[i].m;
+      for (k=0; k<ndim; k++) sumlocal[k + 1] += sphdata[i].m*sphdata[i].r[k];
+      for (k=0; k<ndim; k++)
+        sumlocal[ndim + k + 1] += sphdata[i].m*sphdata[i].v[k];
+    }
+#pragma omp critical
+    for (k=0; k<2*ndim+1; k++) sum[k] += sumlocal[k];
+  }
+
+  for (i=0; i<sim->nbody->Nstar; i++) {
+    StarParticle<ndim> &star = sim->nbody->stardata[i];
+    sum[0] += star.m;
+    for (k=0; k<ndim; k++) sum[k + 1] += star.m*star.r[k];
+    for (k=0; k<ndim; k++) sum[ndim + k + 1] += star.m*star.v[k];
+  }
+
+#ifdef MPI_PARALLEL
+  MPI_Allreduce(MPI_IN_PLACE,sum,2*ndim + 1,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+#endif
+
+  for (k=0; k<ndim; k++) {
+    rcom[k] = (sum[0] > 0.0 ? sum[k + 1]/sum[0] : 0.0);
+    vcom[k] = (sum[0] > 0.0 ? sum[ndim + k + 1]/sum[0] : 0.0);
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  LagrangianRadiiAnalysis::LagrangianRadiiAnalysis
+/// LagrangianRadiiAnalysis constructor.
+//=============================================================================
+template <int ndim>
+LagrangianRadiiAnalysis<ndim>::LagrangianRadiiAnalysis
+(string filenameaux) :              ///< [in] Name of time-series file
+  InSituAnalysis<ndim>(filenameaux)
+{
+  const DOUBLE fractions[] = {0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 0.75, 0.9};
+  mfrac.assign(fractions, fractions + sizeof(fractions)/sizeof(DOUBLE));
+}
+
+
+
+//=============================================================================
+//  LagrangianRadiiAnalysis::WriteFileHeader
+/// Write column description of Lagrangian radii file.
+//=============================================================================
+template <int ndim>
+void LagrangianRadiiAnalysis<ndim>::WriteFileHeader
+(Simulation<ndim> *sim)             ///< [in] Simulation object
+{
+  unsigned int j;                   // Mass fraction counter
+
+  this->outfile << "# Lagrangian radii [" << sim->simunits.r.outunit
+                << "] of all particles; columns : t ["
+                << sim->simunits.t.outunit << "]";
+  for (j=0; j<mfrac.size(); j++) this->outfile << "  r(" << mfrac[j] << ")";
+  this->outfile << endl;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  LagrangianRadiiAnalysis::Analyse
+/// Compute and write the Lagrangian radii.  A mass histogram over
+/// logarithmic radial bins is accumulated in parallel (per-thread
+/// histograms, merged at the end) to find the bin holding each mass
+/// fraction.  The radius is then the distance of the particle at which the
+/// cumulative mass (in order of distance) first reaches the mass fraction,
+/// found among the particles of that bin only.
+//=============================================================================
+template <int ndim>
+void LagrangianRadiiAnalysis<ndim>::Analyse
+(Simulation<ndim> *sim)             ///< [in] Simulation object
+{
+  int b;                            // Histogram bin
+  int i;                            // Particle counter
+  int k;                            // Dimension counter
+  int Nsph = sim->sph->Nsph;        // No. of SPH particles
+  int Nstar = sim->nbody->Nstar;    // No. of star particles
+  unsigned int j;                   // Mass fraction counter
+  unsigned int l;                   // Selected particle counter
+  DOUBLE dr[ndim];                  // Relative position
+  DOUBLE mcum;                      // Cumulative mass
+  DOUBLE mtot;                      // Total mass
+  DOUBLE rcom[ndim];                // Centre of mass position
+  DOUBLE rlagrange;                 // Lagrangian radius
+  DOUBLE rlogmin;                   // log of inner edge of histogram
+  DOUBLE rsqdmax = 0.0;             // Max. distance squared from COM
+  DOUBLE vcom[ndim];                // Centre of mass velocity
+  DOUBLE invdlogr;                  // Inverse bin width in log r
+  vector<int> ibin(mfrac.size());   // Bin holding each mass fraction
+  vector<int> selected(lagrangian_nhist,0);   // Flag bins of interest
+  vector<DOUBLE> mbelow(mfrac.size());        // Mass inside bin of fraction
+  vector<DOUBLE> mhist(lagrangian_nhist,0.0); // Mass histogram
+  vector<DOUBLE> rsqd(Nsph + Nstar);          // Distances squared from COM
+  vector<DOUBLE> mpart(Nsph + Nstar);         // Masses of all particles
+  vector<DOUBLE> candidates;        // (bin, r, m) of selected particles
+  vector<pair<DOUBLE,DOUBLE> > binparts;     // (r, m) of particles of bin
+  SphParticle<ndim> *sphdata = sim->sph->sphdata;   // SPH particle data
+
+  debug2("[LagrangianRadiiAnalysis::Analyse]");
+
+  this->CentreOfMass(sim,rcom,vcom);
+
+  // Distances from centre of mass of all particles
+  //---------------------------------------------------------------------------
+#pragma omp parallel for default(none) private(dr,i,k) \
+  shared(Nsph,mpart,rcom,rsqd,sphdata)
+  for (i=0; i<Nsph; i++) {
+    for (k=0; k<ndim; k++) dr[k] = sphdata[i].r[k] - rcom[k];
+    rsqd[i] = DotProduct(dr,dr,ndim);
+    mpart[i] = sphdata[i].m;
+  }
+  for (i=0; i<Nstar; i++) {
+    for (k=0; k<ndim; k++) dr[k] = sim->nbody->stardata[i].r[k] - rcom[k];
+    rsqd[Nsph + i] = DotProduct(dr,dr,ndim);
+    mpart[Nsph + i] = sim->nbody->stardata[i].m;
+  }
+  for (i=0; i<Nsph+Nstar; i++) rsqdmax = max(rsqdmax,rsqd[i]);
+#ifdef MPI_PARALLEL
+  MPI_Allreduce(MPI_IN_PLACE,&rsqdmax,1,MPI_DOUBLE,MPI_MAX,MPI_COMM_WORLD);
+#endif
+  if (rsqdmax <= 0.0) rsqdmax = 1.0;
+
+  rlogmin = 0.5*log(rsqdmax) + log(lagrangian_rrange);
+  invdlogr = (DOUBLE) lagrangian_nhist/(-log(lagrangian_rrange));
+
+  // Parallel mass histogram (per-thread histograms merged at the end)
+  //---------------------------------------------------------------------------
+#pragma omp parallel default(none) private(b,i) \
+  shared(invdlogr,mhist,mpart,Nsph,Nstar,rlogmin,rsqd)
+  {
+    vector<DOUBLE> mlocal(lagrangian_nhist,0.0);
+#pragma omp for
+    for (i=0; i<Nsph+Nstar; i++) {
+      b = RadialBin(rsqd[i],rlogmin,invdlogr);
+      mlocal[b] += mpart[i];
+    }
+#pragma omp critical
+    for (b=0; b<lagrangian_nhist; b++) mhist[b] += mlocal[b];
+  }
+#ifdef MPI_PARALLEL
+  MPI_Allreduce(MPI_IN_PLACE,&mhist[0],lagrangian_nhist,MPI_DOUBLE,MPI_SUM,
+                MPI_COMM_WORLD);
+#endif
+
+  // Find bin holding each mass fraction and the mass inside that bin
+  mtot = 0.0;
+  for (b=0; b<lagrangian_nhist; b++) mtot += mhist[b];
+  for (j=0; j<mfrac.size(); j++) {
+    mcum = 0.0;
+    for (b=0; b<lagrangian_nhist-1; b++) {
+      if (mcum + mhist[b] >= mfrac[j]*mtot) break;
+      mcum += mhist[b];
+    }
+    ibin[j] = b;
+    mbelow[j] = mcum;
+    selected[b] = 1;
+  }
+
+  // Collect the particles of all selected bins
+  //---------------------------------------------------------------------------
+#pragma omp parallel default(none) private(b,i) \
+  shared(candidates,invdlogr,mpart,Nsph,Nstar,rlogmin,rsqd,selected)
+  {
+    vector<DOUBLE> clocal;
+#pragma omp for
+    for (i=0; i<Nsph+Nstar; i++) {
+      b = RadialBin(rsqd[i],rlogmin,invdlogr);
+      if (selected[b] == 0) continue;
+      clocal.push_back((DOUBLE) b);
+      clocal.push_back(sqrt(rsqd[i]));
+      clocal.push_back(mpart[i]);
+    }
+#pragma omp critical
+    candidates.insert(candidates.end(),clocal.begin(),clocal.end());
+  }
+#ifdef MPI_PARALLEL
+  {
+    int Nlocal = candidates.size();
+    int Nall;
+    vector<int> counts(sim->Nmpi);
+    vector<int> displs(sim->Nmpi,0);
+    vector<DOUBLE> allcandidates;
+    MPI_Allgather(&Nlocal,1,MPI_INT,&counts[0],1,MPI_INT,MPI_COMM_WORLD);
+    for (i=1; i<sim->Nmpi; i++) displs[i] = displs[i - 1] + counts[i - 1];
+    Nall = displs[sim->Nmpi - 1] + counts[sim->Nmpi - 1];
+    allcandidates.resize(Nall + 1);
+    MPI_Allgatherv(Nlocal > 0 ? &candidates[0] : NULL,Nlocal,MPI_DOUBLE,
+                   &allcandidates[0],&counts[0],&displs[0],MPI_DOUBLE,
+                   MPI_COMM_WORLD);
+    allcandidates.resize(Nall);
+    candidates.swap(allcandidates);
+  }
+#endif
+
+  if (sim->rank != 0) return;
+
+  // Select Lagrangian radius among the particles of each bin
+  //---------------------------------------------------------------------------
+  this->outfile << sim->t*sim->simunits.t.outscale;
+  for (j=0; j<mfrac.size(); j++) {
+    binparts.clear();
+    for (l=0; l<candidates.size(); l+=3)
+      if ((int) candidates[l] == ibin[j])
+        binparts.push_back(make_pair(candidates[l + 1],candidates[l + 2]));
+    sort(binparts.begin(),binparts.end());
+    mcum = mbelow[j];
+    rlagrange = 0.0;
+    for (l=0; l<binparts.size(); l++) {
+      rlagrange = binparts[l].first;
+      mcum += binparts[l].second;
+      if (mcum >= mfrac[j]*mtot) break;
+    }
+    this->outfile << "  " << rlagrange*sim->simunits.r.outscale;
+  }
+  this->outfile << endl;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  DensityPdfAnalysis::DensityPdfAnalysis
+/// DensityPdfAnalysis constructor.
+//=============================================================================
+template <int ndim>
+DensityPdfAnalysis<ndim>::DensityPdfAnalysis
+(string filenameaux,                ///< [in] Name of time-series file
+ int Nbinaux) :                     ///< [in] No. of histogram bins
+  InSituAnalysis<ndim>(filenameaux)
+{
+  Nbin = max(Nbinaux,1);
+  smax = 10.0;
+}
+
+
+
+//=============================================================================
+//  DensityPdfAnalysis::WriteFileHeader
+/// Write column description of density PDF file.
+//=============================================================================
+template <int ndim>
+void DensityPdfAnalysis<ndim>::WriteFileHeader
+(Simulation<ndim> *sim)             ///< [in] Simulation object
+{
+  this->outfile << "# Mass-weighted PDF of s = ln(rho/rho0) in " << Nbin
+                << " bins of width " << 2.0*smax/(DOUBLE) Nbin << " from s = "
+                << -smax << " to " << smax << endl;
+  this->outfile << "# columns : t [" << sim->simunits.t.outunit << "]  rho0 ["
+                << sim->simunits.rho.outunit << "]  <s>  sigma_s  "
+                << "mass fraction of each bin" << endl;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  DensityPdfAnalysis::Analyse
+/// Compute and write the mass-weighted density PDF.  All sums are OpenMP
+/// reductions; the histogram is accumulated in per-thread histograms.
+//=============================================================================
+template <int ndim>
+void DensityPdfAnalysis<ndim>::Analyse
+(Simulation<ndim> *sim)             ///< [in] Simulation object
+{
+  int b;                            // Histogram bin
+  int i;                            // Particle counter
+  int Nsph = sim->sph->Nsph;        // No. of SPH particles
+  int nbin = Nbin;                  // Local copy of no. of bins
+  DOUBLE srange = smax;             // Local copy of histogram range
+  DOUBLE lnrho0;                    // ln of volume-weighted mean density
+  DOUBLE s;                         // ln(rho/rho0)
+  DOUBLE sums[4];                   // Mass, volume, m*s and m*s^2 sums
+  DOUBLE msum = 0.0;                // Mass sum
+  DOUBLE vsum = 0.0;                // Volume sum
+  DOUBLE mssum = 0.0;               // m*s sum
+  DOUBLE ms2sum = 0.0;              // m*s^2 sum
+  DOUBLE smean;                     // Mass-weighted mean of s
+  vector<DOUBLE> mhist(Nbin,0.0);   // Mass histogram
+  SphParticle<ndim> *sphdata = sim->sph->sphdata;   // SPH particle data
+
+  debug2("[DensityPdfAnalysis::Analyse]");
+
+  // Volume-weighted mean density
+#pragma omp parallel for default(none) private(i) shared(Nsph,sphdata) \
+  reduction(+:msum,vsum)
+  for (i=0; i<Nsph; i++) {
+    if (sphdata[i].rho <= 0.0) continue;
+    msum += sphdata[i].m;
+    vsum += sphdata[i].m/sphdata[i].rho;
+  }
+  sums[0] = msum;
+  sums[1] = vsum;
+#ifdef MPI_PARALLEL
+  MPI_Allreduce(MPI_IN_PLACE,sums,2,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+#endif
+  lnrho0 = (sums[1] > 0.0 ? log(sums[0]/sums[1]) : 0.0);
+
+  // Histogram and moments of s
+  //---------------------------------------------------------------------------
+#pragma omp parallel default(none) private(b,i,s) \
+  shared(lnrho0,mhist,nbin,Nsph,sphdata,srange) reduction(+:mssum,ms2sum)
+  {
+    vector<DOUBLE> mlocal(nbin,0.0);
+#pragma omp for
+    for (i=0; i<Nsph; i++) {
+      if (sphdata[i].rho <= 0.0) continue;
+      s = log(sphdata[i].rho) - lnrho0;
+      mssum += sphdata[i].m*s;
+      ms2sum += sphdata[i].m*s*s;
+      b = (int) ((s + srange)*(DOUBLE) nbin/(2.0*srange));
+      b = max(0,min(nbin - 1,b));
+      mlocal[b] += sphdata[i].m;
+    }
+#pragma omp critical
+    for (b=0; b<nbin; b++) mhist[b] += mlocal[b];
+  }
+  sums[2] = mssum;
+  sums[3] = ms2sum;
+#ifdef MPI_PARALLEL
+  MPI_Allreduce(MPI_IN_PLACE,&sums[2],2,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE,&mhist[0],Nbin,MPI_DOUBLE,MPI_SUM,
+                MPI_COMM_WORLD);
+#endif
+
+  if (sim->rank != 0) return;
+
+  if (sums[0] <= 0.0) sums[0] = 1.0;
+  smean = sums[2]/sums[0];
+  this->outfile << sim->t*sim->simunits.t.outscale << "  "
+                << exp(lnrho0)*sim->simunits.rho.outscale << "  " << smean
+                << "  " << sqrt(max(sums[3]/sums[0] - smean*smean,0.0));
+  for (b=0; b<Nbin; b++) this->outfile << "  " << mhist[b]/sums[0];
+  this->outfile << endl;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  RadialProfileAnalysis::RadialProfileAnalysis
+/// RadialProfileAnalysis constructor.
+//=============================================================================
+template <int ndim>
+RadialProfileAnalysis<ndim>::RadialProfileAnalysis
+(string filenameaux,                ///< [in] Name of time-series file
+ int Nbinaux,                       ///< [in] No. of radial bins
+ DOUBLE rminaux,                    ///< [in] Inner radius (code units)
+ DOUBLE rmaxaux) :                  ///< [in] Outer radius (code units)
+  InSituAnalysis<ndim>(filenameaux)
+{
+  Nbin = max(Nbinaux,1);
+  rmin = rminaux;
+  rmax = rmaxaux;
+  if (rmin <= 0.0 || rmax <= rmin) {
+    string msg = "Error: radial profile needs 0 < analysis_rmin < analysis_rmax";
+    ExceptionHandler::getIstance().raise(msg);
+  }
+}
+
+
+
+//=============================================================================
+//  RadialProfileAnalysis::WriteFileHeader
+/// Write bin edges and column description of radial profile file.
+//=============================================================================
+template <int ndim>
+void RadialProfileAnalysis<ndim>::WriteFileHeader
+(Simulation<ndim> *sim)             ///< [in] Simulation object
+{
+  int b;                            // Radial bin counter
+
+  this->outfile << "# Radial profiles about the centre of mass; bin edges ["
+                << sim->simunits.r.outunit << "] :";
+  for (b=0; b<Nbin+1; b++)
+    this->outfile << "  " << rmin*pow(rmax/rmin,(DOUBLE) b/(DOUBLE) Nbin)*
+      sim->simunits.r.outscale;
+  this->outfile << endl;
+  this->outfile << "# columns : t [" << sim->simunits.t.outunit
+                << "], then for each bin : m [" << sim->simunits.m.outunit
+                << "]  rho [" << sim->simunits.rho.outunit << "]  u ["
+                << sim->simunits.u.outunit << "]  vr ["
+                << sim->simunits.v.outunit << "] (mass-weighted means)"
+                << endl;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  RadialProfileAnalysis::Analyse
+/// Compute and write the mass-weighted radial profiles of the SPH particles
+/// (accumulated in per-thread profiles, merged at the end).
+//=============================================================================
+template <int ndim>
+void RadialProfileAnalysis<ndim>::Analyse
+(Simulation<ndim> *sim)             ///< [in] Simulation object
+{
+  int b;                            // Radial bin
+  int i;                            // Particle counter
+  int k;                            // Dimension counter
+  int Nsph = sim->sph->Nsph;        // No. of SPH particles
+  int nbin = Nbin;                  // Local copy of no. of bins
+  DOUBLE dr[ndim];                  // Relative position
+  DOUBLE drmag;                     // Distance from centre of mass
+  DOUBLE dv[ndim];                  // Relative velocity
+  DOUBLE m;                         // Mass of bin
+  DOUBLE rcom[ndim];                // Centre of mass position
+  DOUBLE vcom[ndim];                // Centre of mass velocity
+  DOUBLE rinner = rmin;             // Inner radius of first bin
+  DOUBLE router = rmax;             // Outer radius of last bin
+  DOUBLE rlogmin = log(rmin);       // log of inner radius
+  DOUBLE invdlogr = (DOUBLE) Nbin/log(rmax/rmin);   // Inverse bin width
+  vector<DOUBLE> profile(4*Nbin,0.0);   // m, m*rho, m*u and m*vr of bins
+  SphParticle<ndim> *sphdata = sim->sph->sphdata;   // SPH particle data
+
+  debug2("[RadialProfileAnalysis::Analyse]");
+
+  this->CentreOfMass(sim,rcom,vcom);
+
+  //---------------------------------------------------------------------------
+#pragma omp parallel default(none) private(b,dr,drmag,dv,i,k) \
+  shared(invdlogr,nbin,Nsph,profile,rcom,rinner,rlogmin,router,sphdata,vcom)
+  {
+    vector<DOUBLE> plocal(4*nbin,0.0);
+#pragma omp for
+    for (i=0; i<Nsph; i++) {
+      for (k=0; k<ndim; k++) dr[k] = sphdata[i].r[k] - rcom[k];
+      for (k=0; k<ndim; k++) dv[k] = sphdata[i].v[k] - vcom[k];
+      drmag = sqrt(DotProduct(dr,dr,ndim));
+      if (drmag < rinner || drmag >= router) continue;
+      b = min(nbin - 1,(int) ((log(drmag) - rlogmin)*invdlogr));
+      plocal[4*b] += sphdata[i].m;
+      plocal[4*b + 1] += sphdata[i].m*sphdata[i].rho;
+      plocal[4*b + 2] += sphdata[i].m*sphdata[i].u;
+      plocal[4*b + 3] += sphdata[i].m*DotProduct(dr,dv,ndim)/drmag;
+    }
+#pragma omp critical
+    for (b=0; b<4*nbin; b++) profile[b] += plocal[b];
+  }
+  //---------------------------------------------------------------------------
+
+#ifdef MPI_PARALLEL
+  MPI_Allreduce(MPI_IN_PLACE,&profile[0],4*Nbin,MPI_DOUBLE,MPI_SUM,
+                MPI_COMM_WORLD);
+#endif
+
+  if (sim->rank != 0) return;
+
+  this->outfile << sim->t*sim->simunits.t.outscale;
+  for (b=0; b<Nbin; b++) {
+    m = profile[4*b];
+    if (m <= 0.0) m = 1.0;
+    this->outfile << "  " << profile[4*b]*sim->simunits.m.outscale
+                  << "  " << profile[4*b + 1]/m*sim->simunits.rho.outscale
+                  << "  " << profile[4*b + 2]/m*sim->simunits.u.outscale
+                  << "  " << profile[4*b + 3]/m*sim->simunits.v.outscale;
+  }
+  this->outfile << endl;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SinkHistoryAnalysis::SinkHistoryAnalysis
+/// SinkHistoryAnalysis constructor.
+//=============================================================================
+template <int ndim>
+SinkHistoryAnalysis<ndim>::SinkHistoryAnalysis
+(string filenameaux) :              ///< [in] Name of time-series file
+  InSituAnalysis<ndim>(filenameaux)
+{
+}
+
+
+
+//=============================================================================
+//  SinkHistoryAnalysis::WriteFileHeader
+/// Write column description of sink history file.
+//=============================================================================
+template <int ndim>
+void SinkHistoryAnalysis<ndim>::WriteFileHeader
+(Simulation<ndim> *sim)             ///< [in] Simulation object
+{
+  this->outfile << "# Sink histories; columns : t [" << sim->simunits.t.outunit
+                << "]  sink i.d.  m [" << sim->simunits.m.outunit
+                << "]  dmdt [" << sim->simunits.dmdt.outunit << "]  r["
+                << ndim << "] [" << sim->simunits.r.outunit << "]  v["
+                << ndim << "] [" << sim->simunits.v.outunit << "]" << endl;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SinkHistoryAnalysis::Analyse
+/// Write one record for each sink particle.
+//=============================================================================
+template <int ndim>
+void SinkHistoryAnalysis<ndim>::Analyse
+(Simulation<ndim> *sim)             ///< [in] Simulation object
+{
+  int k;                            // Dimension counter
+  int s;                            // Sink counter
+
+  debug2("[SinkHistoryAnalysis::Analyse]");
+
+  if (sim->rank != 0) return;
+
+  for (s=0; s<sim->sinks.Nsink; s++) {
+    SinkParticle<ndim> &sink = sim->sinks.sink[s];
+    this->outfile << sim->t*sim->simunits.t.outscale << "  " << s << "  "
+                  << sink.star->m*sim->simunits.m.outscale << "  "
+                  << sink.dmdt*sim->simunits.dmdt.outscale;
+    for (k=0; k<ndim; k++)
+      this->outfile << "  " << sink.star->r[k]*sim->simunits.r.outscale;
+    for (k=0; k<ndim; k++)
+      this->outfile << "  " << sink.star->v[k]*sim->simunits.v.outscale;
+    this->outfile << endl;
+  }
+
+  return;
+}
+
+
+
+template class InSituAnalysis<1>;
+template class InSituAnalysis<2>;
+template class InSituAnalysis<3>;
+template class LagrangianRadiiAnalysis<1>;
+template class LagrangianRadiiAnalysis<2>;
+template class LagrangianRadiiAnalysis<3>;
+template class DensityPdfAnalysis<1>;
+template class DensityPdfAnalysis<2>;
+template class DensityPdfAnalysis<3>;
+template class RadialProfileAnalysis<1>;
+template class RadialProfileAnalysis<2>;
+template class RadialProfileAnalysis<3>;
+template class SinkHistoryAnalysis<1>;
+template class SinkHistoryAnalysis<2>;
+template class SinkHistoryAnalysis<3>;
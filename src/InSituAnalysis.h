@@ -0,0 +1,168 @@
+//=============================================================================
+//  InSituAnalysis.h
+//  Contains the definitions of the in-situ analysis interface and of the
+//  built-in analyses, which are evaluated during the run and written to
+//  time-series files.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#ifndef _IN_SITU_ANALYSIS_H_
+#define _IN_SITU_ANALYSIS_H_
+
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include "Precision.h"
+using namespace std;
+
+
+// Forward declaration of Simulation to prevent circular dependency
+template <int ndim>
+class Simulation;
+
+
+
+//=============================================================================
+//  Class InSituAnalysis
+/// \brief   Parent class of all in-situ analyses.
+/// \details Each analysis is called at regular intervals (dt_analysis) from
+///          the main loop with the complete simulation, and appends one
+///          record per call to its own time-series file.  New analyses are
+///          derived from this class and registered with
+///          Simulation::AddInSituAnalysis.  For MPI runs, Analyse is called
+///          on all processes (so results can be reduced across processes),
+///          but only the root process writes to the file.
+//=============================================================================
+template <int ndim>
+class InSituAnalysis
+{
+ public:
+
+  InSituAnalysis(string);
+  virtual ~InSituAnalysis();
+
+  void OpenFile(Simulation<ndim> *, long);
+  long FilePosition(void);
+  virtual void Analyse(Simulation<ndim> *)=0;
+  virtual void WriteFileHeader(Simulation<ndim> *)=0;
+
+  string filename;                  ///< Name of time-series file
+  ofstream outfile;                 ///< Time-series file stream (root only)
+
+ protected:
+
+  void CentreOfMass(Simulation<ndim> *, DOUBLE *, DOUBLE *);
+
+};
+
+
+
+//=============================================================================
+//  Class LagrangianRadiiAnalysis
+/// \brief   Lagrangian radii of all particles (SPH and stars).
+/// \details Radii (relative to the centre of mass) enclosing fixed fractions
+///          of the total mass.  The radii are found exactly from a parallel
+///          logarithmic mass histogram, followed by a selection among the
+///          few particles of the bins holding each mass fraction.
+//=============================================================================
+template <int ndim>
+class LagrangianRadiiAnalysis : public InSituAnalysis<ndim>
+{
+ public:
+
+  LagrangianRadiiAnalysis(string);
+
+  virtual void Analyse(Simulation<ndim> *);
+  virtual void WriteFileHeader(Simulation<ndim> *);
+
+  vector<DOUBLE> mfrac;             ///< Enclosed mass fractions
+
+};
+
+
+
+//=============================================================================
+//  Class DensityPdfAnalysis
+/// \brief   Mass-weighted probability density function of the SPH density.
+/// \details Histogram of s = ln(rho/rho0), where rho0 is the volume-weighted
+///          mean density, over Nbin bins in -smax <= s <= smax (particles
+///          outside this range are added to the first or last bin).
+//=============================================================================
+template <int ndim>
+class DensityPdfAnalysis : public InSituAnalysis<ndim>
+{
+ public:
+
+  DensityPdfAnalysis(string, int);
+
+  virtual void Analyse(Simulation<ndim> *);
+  virtual void WriteFileHeader(Simulation<ndim> *);
+
+  int Nbin;                         ///< No. of histogram bins
+  DOUBLE smax;                      ///< Max. |ln(rho/rho0)| of histogram
+
+};
+
+
+
+//=============================================================================
+//  Class RadialProfileAnalysis
+/// \brief   Mass-weighted radial profiles of the SPH particles.
+/// \details Mass, and mass-weighted density, specific internal energy and
+///          radial velocity (relative to the centre of mass), in Nbin
+///          logarithmic radial bins between rmin and rmax.
+//=============================================================================
+template <int ndim>
+class RadialProfileAnalysis : public InSituAnalysis<ndim>
+{
+ public:
+
+  RadialProfileAnalysis(string, int, DOUBLE, DOUBLE);
+
+  virtual void Analyse(Simulation<ndim> *);
+  virtual void WriteFileHeader(Simulation<ndim> *);
+
+  int Nbin;                         ///< No. of radial bins
+  DOUBLE rmin;                      ///< Inner radius of first bin
+  DOUBLE rmax;                      ///< Outer radius of last bin
+
+};
+
+
+
+//=============================================================================
+//  Class SinkHistoryAnalysis
+/// \brief   Accretion histories of all sink particles.
+/// \details One record per sink and call : mass, accretion rate, position
+///          and velocity of the sink.
+//=============================================================================
+template <int ndim>
+class SinkHistoryAnalysis : public InSituAnalysis<ndim>
+{
+ public:
+
+  SinkHistoryAnalysis(string);
+
+  virtual void Analyse(Simulation<ndim> *);
+  virtual void WriteFileHeader(Simulation<ndim> *);
+
+};
+#endif
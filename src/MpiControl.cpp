@@ -29,6 +29,8 @@
 #include <iostream>
 #include <math.h>
 #include <numeric>
+#include <algorithm>
+#include <vector>
 #include "Constants.h"
 #include "Precision.h"
 #include "SphKernel.h"
@@ -38,10 +40,89 @@
 #include "Exception.h"
 #include "InlineFuncs.h"
 #include "MpiControl.h"
-#include "MpiTree.h"
 using namespace std;
 
 
+static const int Nbalancebin = 128;     ///< No. of bins of load-balancing
+                                        ///< cost histograms
+static const int Nbalanceiter = 3;      ///< No. of histogram refinements
+static const DOUBLE bisectionhysteresis = 1.25;  ///< Max. ratio of 
+                                        ///< extents to keep previous split
+static const int Nhilbertbinbits = 8;   ///< No. of key bits resolved by each
+                                        ///< Peano-Hilbert cost histogram
+static const int Nhilbertboxbits = 3;   ///< Bits per dimension of the cells
+                                        ///< of Peano-Hilbert ghost boxes
+
+
+
+//=============================================================================
+//  ReduceMinMaxSum
+/// User-defined MPI reduction operation of MpiReduction buffers, taking 
+/// the minimum, maximum or sum of each packed value as appropriate.
+//=============================================================================
+static void ReduceMinMaxSum
+(void *invec,                       ///< [in] Buffers of other process(es)
+ void *inoutvec,                    ///< [inout] Local buffers (and result)
+ int *len,                          ///< [in] No. of buffers
+ MPI_Datatype *datatype)            ///< [in] Datatype (reduction_type)
+{
+  int i;                            // Buffer counter
+  int j;                            // Value counter
+  MpiReduction *in = (MpiReduction *) invec;
+  MpiReduction *inout = (MpiReduction *) inoutvec;
+
+  for (i=0; i<*len; i++) {
+    for (j=0; j<Nreducemax; j++) {
+      inout[i].minval[j] = min(inout[i].minval[j],in[i].minval[j]);
+      inout[i].maxval[j] = max(inout[i].maxval[j],in[i].maxval[j]);
+      inout[i].sumval[j] += in[i].sumval[j];
+    }
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SumDiagnostics
+/// User-defined MPI reduction operation summing all (extensive) diagnostic 
+/// quantities.  The centre of mass position and velocity must already be 
+/// mass-weighted.  The energy error is left unchanged.
+//=============================================================================
+template <int ndim>
+static void SumDiagnostics
+(void *invec,                       ///< [in] Diagnostics of other process(es)
+ void *inoutvec,                    ///< [inout] Local diagnostics (and result)
+ int *len,                          ///< [in] No. of structures
+ MPI_Datatype *datatype)            ///< [in] Datatype (diagnostics_type)
+{
+  int i;                            // Structure counter
+  int k;                            // Dimension counter
+  Diagnostics<ndim> *in = (Diagnostics<ndim> *) invec;
+  Diagnostics<ndim> *inout = (Diagnostics<ndim> *) inoutvec;
+
+  for (i=0; i<*len; i++) {
+    inout[i].Nsph += in[i].Nsph;
+    inout[i].Nstar += in[i].Nstar;
+    inout[i].Etot += in[i].Etot;
+    inout[i].utot += in[i].utot;
+    inout[i].ketot += in[i].ketot;
+    inout[i].gpetot += in[i].gpetot;
+    inout[i].mtot += in[i].mtot;
+    for (k=0; k<ndim; k++) inout[i].mom[k] += in[i].mom[k];
+    for (k=0; k<3; k++) inout[i].angmom[k] += in[i].angmom[k];
+    for (k=0; k<ndim; k++) inout[i].force[k] += in[i].force[k];
+    for (k=0; k<ndim; k++) inout[i].force_hydro[k] += in[i].force_hydro[k];
+    for (k=0; k<ndim; k++) inout[i].force_grav[k] += in[i].force_grav[k];
+    for (k=0; k<ndim; k++) inout[i].rcom[k] += in[i].rcom[k];
+    for (k=0; k<ndim; k++) inout[i].vcom[k] += in[i].vcom[k];
+  }
+
+  return;
+}
+
+
 
 //=============================================================================
 //  MpiControl::MpiControl()
@@ -56,6 +137,7 @@ MpiControl<ndim>::MpiControl()
 
   allocated_mpi = false;
   balance_level = 0;
+  decomposition = "kdtree";
 
   // Find local processor rank, total no. of processors and host processor name
   MPI_Comm_size(MPI_COMM_WORLD,&Nmpi);
@@ -78,6 +160,26 @@ MpiControl<ndim>::MpiControl()
   box_type = CreateBoxType(dummy);
   MPI_Type_commit(&box_type);
 
+  // Create and commit the migrating particle datatype
+  MPI_Type_contiguous(sizeof(MigrantParticle<ndim>),MPI_BYTE,&migrant_type);
+  MPI_Type_commit(&migrant_type);
+
+  // Create and commit the datatypes of the fields of updated ghosts
+  position_type = SphParticle<ndim>::CreatePositionMpiDataType();
+  MPI_Type_commit(&position_type);
+  property_type = SphParticle<ndim>::CreatePropertyMpiDataType();
+  MPI_Type_commit(&property_type);
+
+  // Create and commit the tree cell datatype
+  MPI_Type_contiguous(sizeof(BinaryTreeCell<ndim>),MPI_BYTE,&treecell_type);
+  MPI_Type_commit(&treecell_type);
+
+  // Create and commit the packed reduction datatype and reduction operations
+  MPI_Type_contiguous(sizeof(MpiReduction),MPI_BYTE,&reduction_type);
+  MPI_Type_commit(&reduction_type);
+  MPI_Op_create(&ReduceMinMaxSum,1,&reduction_op);
+  MPI_Op_create(&SumDiagnostics<ndim>,1,&diagnostics_op);
+
   // Allocate buffer to send and receive boxes
   boxes_buffer.resize(Nmpi);
 
@@ -88,8 +190,24 @@ MpiControl<ndim>::MpiControl()
   displacements_send.resize(Nmpi);
   num_particles_to_be_received.resize(Nmpi);
   receive_displs.resize(Nmpi);
-
-  CreateLeagueCalendar();
+  Nupdate_send.resize(Nmpi);
+  Nupdate_receive.resize(Nmpi);
+  send_bytes.resize(Nmpi);
+  receive_counts.resize(Nmpi,0);
+  receive_bytes.resize(Nmpi,0);
+  send_types.resize(Nmpi,property_type);
+  receive_types.resize(Nmpi,property_type);
+  ghostrequest = MPI_REQUEST_NULL;
+  Nletcell_send.resize(Nmpi,0);
+  Nletcell_receive.resize(Nmpi,0);
+  letsend_displs.resize(Nmpi,0);
+  letreceive_displs.resize(Nmpi,0);
+  gravtree = NULL;
+  particles_to_transfer.resize(Nmpi);
+  Nmigrant_send.resize(Nmpi,0);
+  Nmigrant_receive.resize(Nmpi,0);
+  migrantsend_displs.resize(Nmpi,0);
+  migrantreceive_displs.resize(Nmpi,0);
 
 #ifdef VERIFY_ALL
   if (this->rank == 0)
@@ -129,6 +247,13 @@ MpiControl<ndim>::~MpiControl()
   MPI_Type_free(&partint_type);
   MPI_Type_free(&box_type);
   MPI_Type_free(&diagnostics_type);
+  MPI_Type_free(&migrant_type);
+  MPI_Type_free(&position_type);
+  MPI_Type_free(&property_type);
+  MPI_Type_free(&treecell_type);
+  MPI_Type_free(&reduction_type);
+  MPI_Op_free(&reduction_op);
+  MPI_Op_free(&diagnostics_op);
 }
 
 
@@ -172,121 +297,64 @@ void MpiControl<ndim>::DeallocateMemory(void)
 
 
 //=============================================================================
-//  MpiControl::CreateLeagueCalendar
-/// Create the calendar for the League. In this analogy with soccer,
-/// each communication between two nodes is like a football match.
-/// Since everybody neads to speak with everybody, this is effectively
-/// like a league. We use the scheduling/Berger algorithm
-/// (http://en.wikipedia.org/wiki/Round-robin_tournament#Scheduling_algorithm,
-/// http://it.wikipedia.org/wiki/Algoritmo_di_Berger) to organize the event.
+//  MpiControl::CreateInitialDomainDecomposition
+/// Distribute the particles, initially all held by the root process, across
+/// all MPI nodes.  Before the timesteps are known, all particles have equal
+/// weighting, so each node receives equal numbers of particles.  The domains
+/// are found by recursive bisection (BisectionDecomposition, as in later
+/// load-balancing steps) or, for the Peano-Hilbert decomposition, by
+/// HilbertDecomposition.
 //=============================================================================
 template <int ndim>
-void MpiControl<ndim>::CreateLeagueCalendar(void)
+void MpiControl<ndim>::CreateInitialDomainDecomposition
+(Sph<ndim> *sph,                   ///< Pointer to main SPH object
+ Nbody<ndim> *nbody,               ///< Pointer to main N-body object
+ Parameters *simparams,            ///< Simulation parameters
+ DomainBox<ndim> simbox)           ///< Simulation domain box
 {
-
-  //First check that number of processes is even
-  if (! Nmpi%2) {
-    std::string error = "The number of MPI processes must be even!";
-    ExceptionHandler::getIstance().raise(error);
+  int Ntotal;                      // Total no. of SPH particles
+
+  if (rank == 0) debug2("[MpiControl::CreateInitialDomainDecomposition]");
+
+  // All nodes allocate memory for their share of the particles, which are
+  // then sent from the root process by the decomposition itself
+  Ntotal = sph->Nsph;
+  MPI_Bcast(&Ntotal,1,MPI_INT,0,MPI_COMM_WORLD);
+  AllocateMemory(Ntotal);
+  if (rank != 0) {
+    sph->Nsph = 0;
+    sph->Ntot = 0;
+    sph->AllocateMemory(2*Ntotal/Nmpi);
   }
 
-  int Nturns = Nmpi-1;
-
-  //Allocate memory for the calendar
-  my_matches.resize(Nturns);
-
-
-  if (rank==0) {
-
-    //Create a vector containing the full calendar
-    //First index is process
-    std::vector<std::vector<int> > calendar(Nmpi);
-    //And second is turn
-    for (int iteam=0; iteam< calendar.size(); iteam++) {
-      std::vector<int>& calendar_team = calendar[iteam];
-      calendar_team.resize(Nturns);
-    }
-
-    // Create pairs table
-    std::vector<std::vector<int> > pairs (Nturns);
-    for (int iturn=0; iturn< pairs.size(); iturn++) {
-      std::vector<int>& pairs_turn = pairs[iturn];
-      pairs_turn.resize(Nmpi);
-      // Fill in the pairs table
-      pairs_turn[0]=Nturns;
-      for (int i=1; i<pairs_turn.size(); i++) {
-        pairs_turn[i] = (i+iturn) % (Nmpi-1);
-      }
-      // Can now fill in the calendar
-      for (int istep =0; istep<Nmpi/2; istep++) {
-        int first_team = pairs_turn[istep];
-        int size = pairs_turn.size()-1;
-        int second_team = pairs_turn[size-istep];
-        calendar[first_team][iturn]=second_team;
-        calendar[second_team][iturn]=first_team;
-      }
-    }
-
-
-#if defined VERIFY_ALL
-    //Validate the calendar
-    std::vector<bool> other_teams(Nmpi-1);
-
-    for (int iteam=0; iteam<calendar.size();iteam++) {
+  DecomposeDomains(sph,simbox);
 
-      std::fill(other_teams.begin(), other_teams.end(), false);
-
-      for (int iturn=0; iturn<calendar[iteam].size(); iturn++) {
-        int opponent = calendar[iteam][iturn];
-
-        //1st check: verify the matches are correctly reported in both locations
-        if (calendar[opponent][iturn] != iteam) {
-          string msg = "Error 1 in validating the calendar!";
-          ExceptionHandler::getIstance().raise(msg);
-        }
-
-        //2nd check: verify each team is played against only once
-        int index_other_teams = opponent>=iteam ? opponent-1 : opponent;
-
-        if (other_teams[index_other_teams]) {
-          string msg = "Error 2 in validating the calendar!";
-          ExceptionHandler::getIstance().raise(msg);
-        }
-        other_teams[index_other_teams] = true;
-      }
-
-      for (int jteam; jteam<other_teams.size(); jteam++) {
-        if (!other_teams[jteam]) {
-          string msg = "Error 3 in validating the calendar!";
-          ExceptionHandler::getIstance().raise(msg);
-        }
-      }
-    }
-
-    cout << "Calendar validated!" << endl;
-
-#endif
-
-
-    //Copy our calendar to the vector
-    for (int iturn=0; iturn<Nturns; iturn++) {
-      my_matches[iturn] = calendar[0][iturn];
-    }
+  return;
+}
 
 
-    //Now transmit the calendar to the other nodes
-    for (int inode=1; inode < Nmpi; inode++) {
-      MPI_Send(&calendar[inode][0], Nturns, MPI_INT, inode, tag_league, MPI_COMM_WORLD);
-    }
 
-  }
+//=============================================================================
+//  MpiControl::CreateRestartDomainDecomposition
+/// Create the domains of all MPI nodes for a run restarted from per-process
+/// restart files, where every node already holds particles.  The domains are
+/// found as for the initial decomposition, but weighted with the work of the
+/// particles measured before the restart, and the particles are migrated to
+/// their new nodes.
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::CreateRestartDomainDecomposition
+(Sph<ndim> *sph,                   ///< Pointer to main SPH object
+ DomainBox<ndim> simbox)           ///< Simulation domain box
+{
+  int Ntotal;                      // Total no. of SPH particles
 
-  else {
-    MPI_Status status;
-    MPI_Recv(&my_matches[0], Nturns, MPI_INT, 0, tag_league, MPI_COMM_WORLD, &status);
+  if (rank == 0) debug2("[MpiControl::CreateRestartDomainDecomposition]");
 
-  }
+  MPI_Allreduce(&sph->Nsph,&Ntotal,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD);
+  AllocateMemory(Ntotal);
 
+  DecomposeDomains(sph,simbox);
 
   return;
 }
@@ -294,173 +362,72 @@ void MpiControl<ndim>::CreateLeagueCalendar(void)
 
 
 //=============================================================================
-//  MpiControl::CreateInitialDomainDecomposition
-/// Creates a binary tree containing all particles in order to determine how 
-/// to distribute the particles across all MPI nodes with an equal amount of 
-/// CPU work per MPI node.  If creating the initial partition (i.e. before 
-/// we have calculated the timestep), we give the particles equal weighting 
-/// and therefore each node will have equal numbers of particles.  For later 
-/// steps (i.e. when we know the timesteps and work information), we split 
-/// the domains to give each MPI node equal amounts of work.  This routine 
-/// should only be called for the root process.
+//  MpiControl::DecomposeDomains
+/// Find the domains of all nodes from scratch and move the particles to the
+/// node whose domain contains them.
 //=============================================================================
 template <int ndim>
-void MpiControl<ndim>::CreateInitialDomainDecomposition
+void MpiControl<ndim>::DecomposeDomains
 (Sph<ndim> *sph,                   ///< Pointer to main SPH object
- Nbody<ndim> *nbody,               ///< Pointer to main N-body object
- Parameters *simparams,            ///< Simulation parameters
  DomainBox<ndim> simbox)           ///< Simulation domain box
 {
-  int i;                           // Particle counter
   int inode;                       // Node counter
   int k;                           // Dimension counter
-  int okflag;                      // ..
-  FLOAT boxbuffer[2*ndim*Nmpi];    // Bounding box buffer
-  SphParticle<ndim> *partbuffer;   // ..
+  DOUBLE *partwork;                // Cost (weight) of each local particle
+  std::vector<int> potential_nodes;  // Nodes that may receive particles
 
 
-  // For main process, create load balancing tree, transmit information to all
-  // other nodes including particle data
+  // The Peano-Hilbert decomposition distributes the particles itself
   //---------------------------------------------------------------------------
-  if (rank == 0) {
-
-    debug2("[MpiControl::CreateInitialDomainDecomposition]");
-
-    // Create MPI binary tree for organising domain decomposition
-    mpitree = new MpiTree<ndim>(Nmpi);
-
-    // Create binary tree from all SPH particles
-    // Set number of tree members to total number of SPH particles (inc. ghosts)
-    mpitree->Nsph = sph->Nsph;
-    mpitree->Ntot = sph->Nsph;
-    mpitree->Ntotmax = max(mpitree->Ntot,mpitree->Ntotmax);
-    mpitree->gtot = 0;
-
-    // Create all other MPI node objects
-    AllocateMemory(mpitree->Ntotmax);
-
-
-    for (i=0; i<sph->Nsph; i++)
-      for (k=0; k<ndim; k++) sph->rsph[ndim*i + k] = sph->sphdata[i].r[k];
-
-    // For periodic simulations, set bounding box of root node to be the 
-    // periodic box size.  Otherwise, set to be the particle bounding box.
-    if (simbox.x_boundary_lhs == "open") mpibox.boxmin[0] = -big_number;
-    else mpibox.boxmin[0] = simbox.boxmin[0];
-    if (simbox.x_boundary_rhs == "open") mpibox.boxmax[0] = big_number;
-    else mpibox.boxmax[0] = simbox.boxmax[0];
-    if (ndim > 1) {
-      if (simbox.y_boundary_lhs == "open") mpibox.boxmin[1] = -big_number;
-      else mpibox.boxmin[1] = simbox.boxmin[1];
-      if (simbox.y_boundary_rhs == "open") mpibox.boxmax[1] = big_number;
-      else mpibox.boxmax[1] = simbox.boxmax[1];
-    }
-    if (ndim == 3) {
-      if (simbox.z_boundary_lhs == "open") mpibox.boxmin[2] = -big_number;
-      else mpibox.boxmin[2] = simbox.boxmin[2];
-      if (simbox.z_boundary_rhs == "open") mpibox.boxmax[2] = big_number;
-      else mpibox.boxmax[2] = simbox.boxmax[2];
-    }
-    mpitree->box = &mpibox;
-
-
-    // Compute the size of all tree-related arrays now we know number of points
-    mpitree->ComputeTreeSize();
-
-    // Allocate (or reallocate if needed) all tree memory
-    mpitree->AllocateTreeMemory();
-
-    // Create tree data structure including linked lists and cell pointers
-    mpitree->CreateTreeStructure(mpinode);
-
-    // Find ordered list of ptcl positions ready for adding particles to tree
-    mpitree->OrderParticlesByCartCoord(sph->sphdata);
-
-    // Now add particles to tree depending on Cartesian coordinates
-    mpitree->LoadParticlesToTree(sph->rsph);
-
-    // Create bounding boxes containing particles in each sub-tree
-    for (inode=0; inode<Nmpi; inode++) {
-      //for (k=0; k<ndim; k++) mpinode[inode].domain.boxmin[k] =
-      //  mpitree->subtrees[inode]->box.boxmin[k];
-      //for (k=0; k<ndim; k++) mpinode[inode].domain.boxmax[k] =
-      //  mpitree->subtrees[inode]->box.boxmax[k];
-      cout << "MPIDOMAIN : " << mpinode[inode].domain.boxmin[0] << "     " << mpinode[inode].domain.boxmax[0] << endl;
-    }
-
-
-    // Pack all bounding box data into single array
-    for (inode=0; inode<Nmpi; inode++) {
-      for (k=0; k<ndim; k++) 
-	boxbuffer[2*ndim*inode + k] = mpinode[inode].domain.boxmin[k];
-      for (k=0; k<ndim; k++) 
-	boxbuffer[2*ndim*inode + ndim + k] = mpinode[inode].domain.boxmax[k];
-    }
-
-    // Now broadcast all bounding boxes to other processes
-    MPI_Bcast(boxbuffer,2*ndim*Nmpi,MPI_DOUBLE,0,MPI_COMM_WORLD);
-
-    // Send particles to all other domains
-    for (inode=1; inode<Nmpi; inode++) {
-      SendParticles(inode, mpinode[inode].Ntot,
-                    mpinode[inode].ids, sph->sphdata);
-      cout << "Sent " << mpinode[inode].Nsph
-           << " particles to node " << inode << endl;
-    }
-
-    cout << "Sent all particles to other processes" << endl;
-
-    // Delete all other particles from local domain
-    sph->Nsph = mpinode[0].Nsph;
-    partbuffer = new SphParticle<ndim>[sph->Nsph];
-    for (i=0; i<sph->Nsph; i++) partbuffer[i] = sph->sphdata[mpinode[0].ids[i]];
-    for (i=0; i<sph->Nsph; i++) sph->sphdata[i] = partbuffer[i];
-    delete[] partbuffer;
-    cout << "Deleted all other particles from root node" << endl;
+  if (decomposition == "hilbert") {
+    partwork = new DOUBLE[max(sph->Nsph,1)];
+    ComputeParticleWork(sph,partwork);
+    HilbertDecomposition(sph,partwork);
+    delete[] partwork;
 
+    return;
   }
 
-  // For other nodes, receive all bounding box and particle data once
-  // transmitted by main process.
-  //---------------------------------------------------------------------------
-  else {
 
-    // Create MPI node objects
-    AllocateMemory(sph->Nsph);
-
-    // Receive bounding box data for domain and unpack data
-    MPI_Bcast(boxbuffer,2*ndim*Nmpi,MPI_DOUBLE,0,MPI_COMM_WORLD);
-
-    // Unpack all bounding box data
-    for (inode=0; inode<Nmpi; inode++) {
-      for (k=0; k<ndim; k++)
-        mpinode[inode].domain.boxmin[k] = boxbuffer[2*ndim*inode + k];
-      for (k=0; k<ndim; k++)
-        mpinode[inode].domain.boxmax[k] = boxbuffer[2*ndim*inode + ndim + k];
-      if (rank == 1) {
-      cout << "Node " << i << endl;
-      cout << "xbox : " << mpinode[inode].domain.boxmin[0]
-           << "    " << mpinode[inode].domain.boxmax[0] << endl;
-      cout << "ybox : " << mpinode[inode].domain.boxmin[1] << "    "
-           << mpinode[inode].domain.boxmax[1] << endl;
-      cout << "zbox : " << mpinode[inode].domain.boxmin[2] << "    "
-           << mpinode[inode].domain.boxmax[2] << endl;
-      }
-    }
-    // Now, receive particles form main process and copy to local main array
-    ReceiveParticles(0, (sph->Nsph), &partbuffer);
+  // For the recursive bisection, the domains of all nodes start from the
+  // periodic box (or an unbounded box for open boundaries) and are split
+  // by the particle weights.  Each node then sends its particles to the
+  // node whose domain contains them.
+  //---------------------------------------------------------------------------
 
-    sph->AllocateMemory(sph->Nsph);
-    mpinode[rank].Nsph = sph->Nsph;
+  // For periodic simulations, set bounding box of root node to be the 
+  // periodic box size.  Otherwise, set to be the particle bounding box.
+  if (simbox.x_boundary_lhs == "open") mpibox.boxmin[0] = -big_number;
+  else mpibox.boxmin[0] = simbox.boxmin[0];
+  if (simbox.x_boundary_rhs == "open") mpibox.boxmax[0] = big_number;
+  else mpibox.boxmax[0] = simbox.boxmax[0];
+  if (ndim > 1) {
+    if (simbox.y_boundary_lhs == "open") mpibox.boxmin[1] = -big_number;
+    else mpibox.boxmin[1] = simbox.boxmin[1];
+    if (simbox.y_boundary_rhs == "open") mpibox.boxmax[1] = big_number;
+    else mpibox.boxmax[1] = simbox.boxmax[1];
+  }
+  if (ndim == 3) {
+    if (simbox.z_boundary_lhs == "open") mpibox.boxmin[2] = -big_number;
+    else mpibox.boxmin[2] = simbox.boxmin[2];
+    if (simbox.z_boundary_rhs == "open") mpibox.boxmax[2] = big_number;
+    else mpibox.boxmax[2] = simbox.boxmax[2];
+  }
+  for (inode=0; inode<Nmpi; inode++) {
+    for (k=0; k<ndim; k++) mpinode[inode].domain.boxmin[k] = mpibox.boxmin[k];
+    for (k=0; k<ndim; k++) mpinode[inode].domain.boxmax[k] = mpibox.boxmax[k];
+  }
 
-    cout << "Received particles on node " << rank << "   Nsph : " << sph->Nsph << endl;
+  partwork = new DOUBLE[max(sph->Nsph,1)];
+  ComputeParticleWork(sph,partwork);
+  BisectionDecomposition(sph,partwork);
+  delete[] partwork;
 
-    for (i=0; i<sph->Nsph; i++) sph->sphdata[i] = partbuffer[i];
-    delete[] partbuffer;
-    cout << "Deallocated partbuffer" << endl;
-
-  }
-  //---------------------------------------------------------------------------
+  for (inode=0; inode<Nmpi; inode++)
+    if (inode != rank) potential_nodes.push_back(inode);
+  MigrateParticles(sph,potential_nodes);
+  sph->Ntot = sph->Nsph;
+  mpinode[rank].Nsph = sph->Nsph;
 
   return;
 }
@@ -504,368 +471,674 @@ void MpiControl<ndim>::UpdateAllBoundingBoxes
     mpinode[inode].rbox = boxes_buffer[inode];
   }
 
+  if (decomposition == "hilbert") UpdateHilbertBoxes(Npart,sphdata,kernptr);
+
   return;
 }
 
 
 
 //=============================================================================
-//  MpiControl::LoadBalancing
-/// If we are on a load balancing step, then determine which level of 
-/// the binary partition we are adjusting for load balancing.  Next, adjust 
-/// the domain boundaries at that level (and for all child domains).
-/// Then broadcast the new domain boundaries to all other nodes to determine 
-/// which particles should be transfered to new nodes.
+//  MpiControl::UpdateHilbertBoxes
+/// For the Peano-Hilbert decomposition, the bounding box of a node's key
+/// range can be much larger than the volume it occupies.  The h-extent
+/// boxes of the local particles in each occupied cell of a coarse grid (the
+/// first Nhilbertboxbits bits per dimension of the keys) are therefore
+/// gathered from all nodes, and used to select the ghosts exported to them.
 //=============================================================================
 template <int ndim>
-void MpiControl<ndim>::LoadBalancing
-(Sph<ndim> *sph,                    ///< Pointer to main SPH object
- Nbody<ndim> *nbody)                ///< Pointer to main N-body object
+void MpiControl<ndim>::UpdateHilbertBoxes
+(int Npart,                         ///< No. of SPH particles
+ SphParticle<ndim> *sphdata,        ///< Pointer to SPH data
+ SphKernel<ndim> *kernptr)          ///< Pointer to kernel object
 {
-  int c;                            // MPI tree cell counter
-  int c2;                           // ..
   int i;                            // Particle counter
+  int icell;                        // Coarse grid cell counter
   int inode;                        // MPI node counter
   int k;                            // Dimension counter
-  int kk;                           // ..
-  int okflag;                       // Successful communication flag
-  FLOAT rnew;                       // New boundary position for load balancing
-  FLOAT boxbuffer[2*ndim*Nmpi];     // Bounding box buffer
-  FLOAT workbuffer[1+ndim+Nmpi];    // Node work information buffer
-  MPI_Status status;                // MPI status flag
-
-  // If running on only one MPI node, return immediately
-  if (Nmpi == 1) return;
+  int Nbox = 0;                     // No. of local boxes
+  const int shift = HilbertKeyBits<ndim>() - ndim*Nhilbertboxbits;
+  const int Ncell = 1 << (ndim*Nhilbertboxbits);
+  FLOAT hrange;                     // Kernel extent of particle
+  vector<int> Nboxnode(Nmpi);       // No. of boxes of each node
+  vector<bool> occupied(Ncell,false);   // Does cell contain local ptcls?
+  vector<Box<ndim> > cellbox(Ncell);    // h-extent box of each cell
+  vector<Box<ndim> > localboxes(1);     // Boxes of all occupied cells
+
+  for (i=0; i<Npart; i++) {
+    icell = (int) (HilbertKey<ndim>(sphdata[i].r,keybox) >> shift);
+    hrange = 2.0*kernptr->kernrange*sphdata[i].h;
+    if (!occupied[icell]) {
+      occupied[icell] = true;
+      for (k=0; k<ndim; k++) cellbox[icell].boxmin[k] = big_number;
+      for (k=0; k<ndim; k++) cellbox[icell].boxmax[k] = -big_number;
+    }
+    for (k=0; k<ndim; k++) {
+      cellbox[icell].boxmin[k] = min(cellbox[icell].boxmin[k],
+                                     sphdata[i].r[k] - hrange);
+      cellbox[icell].boxmax[k] = max(cellbox[icell].boxmax[k],
+                                     sphdata[i].r[k] + hrange);
+    }
+  }
 
+  for (icell=0; icell<Ncell; icell++) {
+    if (!occupied[icell]) continue;
+    if (Nbox == (int) localboxes.size()) localboxes.resize(2*Nbox);
+    localboxes[Nbox++] = cellbox[icell];
+  }
 
-  // Compute work that will be transmitted to all other domains if using
-  // current domain boxes and particle positions
-  // (DAVID : Maybe in the future once basic implementation works)
+  // Gather the boxes of all nodes
+  MPI_Allgather(&Nbox,1,MPI_INT,&Nboxnode[0],1,MPI_INT,MPI_COMM_WORLD);
+  hilbertboxfirst.resize(Nmpi + 1);
+  hilbertboxfirst[0] = 0;
+  for (inode=0; inode<Nmpi; inode++)
+    hilbertboxfirst[inode+1] = hilbertboxfirst[inode] + Nboxnode[inode];
+  hilbertboxes.resize(max(hilbertboxfirst[Nmpi],1));
+  MPI_Allgatherv(&localboxes[0],Nbox,box_type,&hilbertboxes[0],&Nboxnode[0],
+                 &hilbertboxfirst[0],box_type,MPI_COMM_WORLD);
 
-  // Compute total work contained in domain at present and the weighted 
-  // centre of work position.
-  mpinode[rank].worktot = 0.0;
-  for (inode=0; inode<Nmpi; inode++) mpinode[rank].worksent[inode] = 0.0;
-  for (inode=0; inode<Nmpi; inode++) mpinode[rank].workreceived[inode] = 0.0;
+  return;
+}
 
-  for (k=0; k<ndim; k++) mpinode[rank].rwork[k] = 0.0;
-  for (i=0; i<sph->Nsph; i++) {
-    mpinode[rank].worktot += 1.0/(FLOAT) sph->sphintdata[i].nstep;
-    for (k=0; k<ndim; k++) 
-      mpinode[rank].rwork[k] += sph->sphdata[i].r[k]/(FLOAT) sph->sphintdata[i].nstep;
-  }
-  for (k=0; k<ndim; k++) mpinode[rank].rwork[k] /= mpinode[rank].worktot;
 
-  for (inode=0; inode<Nmpi; inode++) cout << "CHECKING DOMAIN : " << rank << "   " << inode << "   " << mpinode[inode].domain.boxmin[0] << "    " << mpinode[inode].domain.boxmax[0] << endl;
 
-  // Now find total work transfered to all other nodes if node
-  // boundaries remained unchanged.
+//=============================================================================
+//  MpiControl::ComputeParticleWork
+/// Collect the measured cost of all local particles, i.e. the wall-clock
+/// time of their leaf cells in the tree force loops since the last
+/// load-balancing step (so neighbour numbers, gravity interaction lists and
+/// ghosts are all included), and record the total work and centre of work
+/// of all nodes.
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::ComputeParticleWork
+(Sph<ndim> *sph,                    ///< [inout] Pointer to main SPH object
+ DOUBLE *partwork)                  ///< [out] Cost of each local particle
+{
+  int i;                            // Particle counter
+  int inode;                        // MPI node counter
+  int k;                            // Dimension counter
+  DOUBLE worklocal;                 // Total measured work on this node
+  DOUBLE worktotal;                 // Total measured work on all nodes
+  DOUBLE workbuffer[1+ndim];        // Local work and centre of work
+  DOUBLE *allwork;                  // Work and centre of work of all nodes
+
+  // Collect the measured cost of all local particles (and reset for the
+  // next load-balancing step).  If no cost has been measured yet on any
+  // node, use the no. of force computations per unit time instead.
+  //---------------------------------------------------------------------------
+  worklocal = 0.0;
   for (i=0; i<sph->Nsph; i++) {
-    SphParticle<ndim>& part = sph->sphdata[i];
+    partwork[i] = (DOUBLE) sph->sphintdata[i].work;
+    sph->sphintdata[i].work = (FLOAT) 0.0;
+    worklocal += partwork[i];
+  }
+  MPI_Allreduce(&worklocal,&worktotal,1,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
 
-    // Loop over potential domains and see if we need to transfer this particle to them
-    for (inode=0; inode<Nmpi; inode++) {
-      //if (rank == 1) cout << "R : " << ParticleInBox(part,mpinode[inode].domain) << "    " << inode << "     " << rank << "    " << part.r[0] << "    " << mpinode[inode].domain.boxmin[0] << "    " << mpinode[inode].domain.boxmax[0] << endl;
-      if (ParticleInBox(part,mpinode[inode].domain)) {
-        if (inode == rank) break;
-        mpinode[rank].worksent[inode] += 1.0/(FLOAT) sph->sphintdata[i].nstep;
-        if (rank == 1) cout << "OVERLAP?? : " << rank << "    " << mpinode[rank].worksent[inode] << endl;
-        // The particle can belong only to one domain, so we can break from this loop
-        break;
-      }
+  if (worktotal <= 0.0) {
+    worklocal = 0.0;
+    for (i=0; i<sph->Nsph; i++) {
+      partwork[i] = 1.0/(DOUBLE) max(sph->sphintdata[i].nstep,1);
+      worklocal += partwork[i];
     }
   }
-  for (inode=0; inode<Nmpi; inode++) mpinode[inode].workreceived[rank] = mpinode[rank].worksent[k];
-
 
-  cout << "Work sent1 by " << rank << " : ";
-  for (k=0; k<Nmpi; k++) cout <<  mpinode[rank].worksent[k] << "    ";
-  cout << endl;
+  // Record the total work and centre of work of all nodes
+  workbuffer[0] = worklocal;
+  for (k=0; k<ndim; k++) workbuffer[k+1] = 0.0;
+  for (i=0; i<sph->Nsph; i++)
+    for (k=0; k<ndim; k++) workbuffer[k+1] += partwork[i]*sph->sphdata[i].r[k];
+  if (worklocal > 0.0)
+    for (k=0; k<ndim; k++) workbuffer[k+1] /= worklocal;
+
+  allwork = new DOUBLE[(1+ndim)*Nmpi];
+  MPI_Allgather(workbuffer,1+ndim,MPI_DOUBLE,allwork,1+ndim,MPI_DOUBLE,
+                MPI_COMM_WORLD);
+  for (inode=0; inode<Nmpi; inode++) {
+    mpinode[inode].worktot = allwork[(1+ndim)*inode];
+    for (k=0; k<ndim; k++)
+      mpinode[inode].rwork[k] = allwork[(1+ndim)*inode + k + 1];
+  }
+  delete[] allwork;
 
+  return;
+}
 
-  cout << "worktot[" << rank << "] : " << mpinode[rank].worktot << "     Nsph : " << sph->Nsph << endl;
-  cout << "rwork : " << mpinode[rank].rwork[0] << endl;
 
 
-  // For root process, receive work information from all other CPU nodes, 
-  // adjust domain boundaries to balance out work more evenly and then 
-  // broadcast new domain boxes to all other nodes.
+//=============================================================================
+//  MpiControl::BisectionDecomposition
+/// Compute new domain boxes for all MPI nodes by recursive bisection : the
+/// nodes of each domain are divided into two halves, and the domain is split
+/// along the dimension of largest particle extent at the cost-weighted
+/// median.  The medians of all domains on a level are found together from
+/// global cost histograms (MPI_Allreduce) that are refined iteratively, so
+/// every node computes the same domain boxes and no boxes need to be
+/// broadcast from the root.
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::BisectionDecomposition
+(Sph<ndim> *sph,                    ///< [in] Pointer to main SPH object
+ DOUBLE *partwork)                  ///< [in] Cost of each local particle
+{
+  int c;                            // Domain counter
+  int cnew;                         // i.d. of new (upper) child domain
+  int i;                            // Particle counter
+  int ibin;                         // Histogram bin counter
+  int inode;                        // MPI node counter
+  int isplit = 0;                   // No. of splits on previous levels
+  int iter;                         // Histogram refinement iteration
+  int k;                            // Dimension counter
+  int nmid;                         // First node of upper child domain
+  int Ndomain;                      // No. of domains on current level
+  int Nsplit;                       // No. of domains to be split
+  int s;                            // Split domain counter
+  DOUBLE dx;                        // Width of histogram bin
+  DOUBLE wcum;                      // Cumulative work of histogram
+  DOUBLE x;                         // Particle position along split
+  vector<int> domainid;             // Domain containing each particle
+  vector<int> nfirst;               // First node of each domain
+  vector<int> nlast;                // Last node (+1) of each domain
+  vector<int> splitid;              // Split index of each domain (or -1)
+  vector<int> splitdomain;          // Domain i.d. of each split
+  vector<int> ksplit;               // Dimension of each split
+  vector<DOUBLE> extent;            // -min and max extent of split domains
+  vector<DOUBLE> hist;              // Cost histograms of split domains
+  vector<DOUBLE> target;            // Cost of lower child of each split
+  vector<DOUBLE> wbelow;            // Cost below histogram range
+  vector<DOUBLE> xlo;               // Lower edge of histogram range
+  vector<DOUBLE> xhi;               // Upper edge of histogram range
+  vector<DOUBLE> xsplit;            // Position of each split
+  vector<Box<ndim> > domainbox;     // Bounding box of each domain
+
+  // Start from a single domain containing all nodes, bounded by the union
+  // of all current domain boxes.
   //---------------------------------------------------------------------------
-  if (rank == 0) {
+  Ndomain = 1;
+  nfirst.push_back(0);
+  nlast.push_back(Nmpi);
+  domainbox.push_back(mpinode[0].domain);
+  for (inode=1; inode<Nmpi; inode++) {
+    for (k=0; k<ndim; k++) domainbox[0].boxmin[k] =
+      min(domainbox[0].boxmin[k],mpinode[inode].domain.boxmin[k]);
+    for (k=0; k<ndim; k++) domainbox[0].boxmax[k] =
+      max(domainbox[0].boxmax[k],mpinode[inode].domain.boxmax[k]);
+  }
+  domainid.assign(sph->Nsph,0);
 
-    debug2("[MpiControl::LoadBalancing]");
 
+  // Split all domains containing more than one node, one level at a time
+  //===========================================================================
+  do {
 
-    // Receive all important load balancing information from other nodes
-    for (inode=1; inode<Nmpi; inode++) {
-      cout << "Root waiting for " << inode << endl;
-      okflag = MPI_Recv(&workbuffer,Nmpi+ndim+1,MPI_DOUBLE,
-                        inode,0,MPI_COMM_WORLD,&status);
-      mpinode[inode].worktot = workbuffer[0];
-      for (k=0; k<ndim; k++) mpinode[inode].rwork[k] = workbuffer[k+1];
-      for (k=0; k<Nmpi; k++) mpinode[inode].worksent[k] = workbuffer[ndim+k+1];
-      for (k=0; k<Nmpi; k++) mpinode[k].workreceived[inode] = workbuffer[ndim+k+1];
-      cout << "Work from rank " << inode << " : " << workbuffer[0] << endl;
+    // Find all domains that need to be split on this level
+    splitid.assign(Ndomain,-1);
+    splitdomain.clear();
+    for (c=0; c<Ndomain; c++) {
+      if (nlast[c] - nfirst[c] < 2) continue;
+      splitid[c] = splitdomain.size();
+      splitdomain.push_back(c);
+    }
+    Nsplit = splitdomain.size();
+    if (Nsplit == 0) break;
+
+    ksplit.assign(Nsplit,0);
+    target.assign(Nsplit,0.0);
+    wbelow.assign(Nsplit,0.0);
+    xlo.assign(Nsplit,0.0);
+    xhi.assign(Nsplit,0.0);
+    xsplit.assign(Nsplit,0.0);
+
+    // Find the global extent of the particles in each split domain
+    extent.assign(2*ndim*Nsplit,-big_number);
+    for (i=0; i<sph->Nsph; i++) {
+      s = splitid[domainid[i]];
+      if (s < 0) continue;
+      for (k=0; k<ndim; k++) {
+        extent[2*ndim*s + k] = max(extent[2*ndim*s + k],
+                                   (DOUBLE) -sph->sphdata[i].r[k]);
+        extent[2*ndim*s + ndim + k] = max(extent[2*ndim*s + ndim + k],
+                                          (DOUBLE) sph->sphdata[i].r[k]);
+      }
+    }
+    MPI_Allreduce(MPI_IN_PLACE,&extent[0],2*ndim*Nsplit,MPI_DOUBLE,
+                  MPI_MAX,MPI_COMM_WORLD);
+
+    // Split each domain along the dimension of largest particle extent,
+    // unless the dimension of the previous decomposition is almost as long
+    // (so the domains do not flip between similar dimensions, which would
+    // migrate most particles).  The histogram range is padded so the last
+    // particle lies inside it.
+    for (s=0; s<Nsplit; s++) {
+      for (k=1; k<ndim; k++) {
+        if (extent[2*ndim*s + ndim + k] + extent[2*ndim*s + k] >
+            extent[2*ndim*s + ndim + ksplit[s]] + extent[2*ndim*s + ksplit[s]])
+          ksplit[s] = k;
+      }
+      if (isplit + s < (int) bisectiondim.size()) {
+        k = bisectiondim[isplit + s];
+        if (bisectionhysteresis*(extent[2*ndim*s + ndim + k] +
+                                 extent[2*ndim*s + k]) >=
+            extent[2*ndim*s + ndim + ksplit[s]] + extent[2*ndim*s + ksplit[s]])
+          ksplit[s] = k;
+      }
+      k = ksplit[s];
+      xlo[s] = -extent[2*ndim*s + k];
+      xhi[s] = extent[2*ndim*s + ndim + k];
+      xhi[s] += 1.0e-6*(xhi[s] - xlo[s]);
     }
 
-	MPI_Barrier(MPI_COMM_WORLD);
-
-	for (inode=0; inode<Nmpi; inode++) {
-      cout << "Work sent by " << inode << " : ";
-      for (k=0; k<Nmpi; k++) cout <<  mpinode[inode].worksent[k] << "    ";
-      cout << endl;
-	}
-
-    cout << "Done receiving boxes " << endl;
-
-    // Walk upwards through MPI tree to propagate work information from 
-    // leaf cells to parent cells.
+    // Refine the cost histograms of all split domains until the bin
+    // containing the cost-weighted median is sufficiently small
     //-------------------------------------------------------------------------
-    for (c=mpitree->Ncell-1; c>=0; c--) {
-      
-      // For leaf cells, simply set total work and 'centre of work' position
-      if (mpitree->tree[c].c2 == 0) {
-        inode = mpitree->tree[c].c2g;
-        mpitree->tree[c].worktot = mpinode[inode].worktot;
-        for (k=0; k<ndim; k++) mpitree->tree[c].rwork[k] = mpinode[inode].rwork[k];
-      }
-      // For non-leaf cells, sum up contributions from both child cells
-      else {
-        c2 = mpitree->tree[c].c2;
-        mpitree->tree[c].worktot = mpitree->tree[c+1].worktot + mpitree->tree[c2].worktot;
-        for (k=0; k<ndim; k++) mpitree->tree[c].rwork[k] =
-          (mpitree->tree[c].worktot*mpitree->tree[c].rwork[k] +
-           mpitree->tree[c2].worktot*mpitree->tree[c2].rwork[k]) / mpitree->tree[c].worktot;
+    for (iter=0; iter<Nbalanceiter; iter++) {
+      hist.assign(Nbalancebin*Nsplit,0.0);
+
+      for (i=0; i<sph->Nsph; i++) {
+        s = splitid[domainid[i]];
+        if (s < 0 || xhi[s] <= xlo[s]) continue;
+        x = sph->sphdata[i].r[ksplit[s]];
+        if (x < xlo[s] || x >= xhi[s]) continue;
+        ibin = (int) ((DOUBLE) Nbalancebin*(x - xlo[s])/(xhi[s] - xlo[s]));
+        ibin = min(ibin,Nbalancebin - 1);
+        hist[Nbalancebin*s + ibin] += partwork[i];
       }
+      MPI_Allreduce(MPI_IN_PLACE,&hist[0],Nbalancebin*Nsplit,MPI_DOUBLE,
+                    MPI_SUM,MPI_COMM_WORLD);
+
+      for (s=0; s<Nsplit; s++) {
+        c = splitdomain[s];
+
+        // Domains without (or with coincident) particles are split at the
+        // lower edge of the particles (or the middle of the box)
+        if (xhi[s] <= xlo[s]) {
+          if (iter == 0) {
+            if (xlo[s] > xhi[s]) xlo[s] = 0.5*(domainbox[c].boxmin[ksplit[s]]
+                                            + domainbox[c].boxmax[ksplit[s]]);
+            xsplit[s] = xlo[s];
+          }
+          continue;
+        }
+
+        // The lower child receives the same fraction of the work as of nodes
+        if (iter == 0) {
+          wcum = 0.0;
+          for (ibin=0; ibin<Nbalancebin; ibin++)
+            wcum += hist[Nbalancebin*s + ibin];
+          nmid = (nfirst[c] + nlast[c])/2;
+          target[s] = wcum*(DOUBLE) (nmid - nfirst[c])/
+            (DOUBLE) (nlast[c] - nfirst[c]);
+        }
 
-      cout << "Tree work : " << c << "    " << mpitree->tree[c].worktot << endl;
+        // Find the bin where the cumulative work reaches the target, and
+        // interpolate the split position within it
+        wcum = wbelow[s];
+        for (ibin=0; ibin<Nbalancebin-1; ibin++) {
+          if (wcum + hist[Nbalancebin*s + ibin] >= target[s]) break;
+          wcum += hist[Nbalancebin*s + ibin];
+        }
+        dx = (xhi[s] - xlo[s])/(DOUBLE) Nbalancebin;
+        xlo[s] += dx*(DOUBLE) ibin;
+        xhi[s] = xlo[s] + dx;
+        wbelow[s] = wcum;
+        if (hist[Nbalancebin*s + ibin] > 0.0)
+          xsplit[s] = xlo[s] + dx*min(1.0,max(0.0,(target[s] - wcum)/
+                                          hist[Nbalancebin*s + ibin]));
+        else
+          xsplit[s] = xlo[s] + 0.5*dx;
+      }
 
     }
     //-------------------------------------------------------------------------
 
+    // Record the split dimensions for the next decomposition
+    bisectiondim.resize(max((int) bisectiondim.size(),isplit + Nsplit));
+    for (s=0; s<Nsplit; s++) bisectiondim[isplit + s] = ksplit[s];
+    isplit += Nsplit;
+
+    // Create the new child domains and re-assign the particles
+    for (s=0; s<Nsplit; s++) {
+      c = splitdomain[s];
+      k = ksplit[s];
+      nmid = (nfirst[c] + nlast[c])/2;
+      cnew = nfirst.size();
+      nfirst.push_back(nmid);
+      nlast.push_back(nlast[c]);
+      domainbox.push_back(domainbox[c]);
+      domainbox[cnew].boxmin[k] = xsplit[s];
+      domainbox[c].boxmax[k] = xsplit[s];
+      nlast[c] = nmid;
+      splitdomain[s] = cnew;
+    }
+    for (i=0; i<sph->Nsph; i++) {
+      s = splitid[domainid[i]];
+      if (s >= 0 && sph->sphdata[i].r[ksplit[s]] >= xsplit[s])
+        domainid[i] = splitdomain[s];
+    }
+    Ndomain = nfirst.size();
 
-    // Work out tree level at which we are altering the load balancing.  
-    // Stars at lowest level and then works back up wrapping around to the 
-    // bottom again once reaching the root node.
-    balance_level--;
-    if (balance_level < 0) balance_level = mpitree->ltot - 1;
-    k = mpitree->klevel[balance_level];
-
-    cout << "Balancing on level : " << balance_level << "     " << mpitree->ltot << "    " << k << endl;
+  } while (Nsplit > 0);
+  //===========================================================================
 
+  // Each domain now contains a single node
+  for (c=0; c<Ndomain; c++) mpinode[nfirst[c]].domain = domainbox[c];
 
-    // Now walk downwards through MPI tree, adjusting bounding box sizes on 
-    // load balancing level and propagating new box sizes to lower levels.
-    //-------------------------------------------------------------------------
-    for (c=0; c<mpitree->Ncell; c++) {
-      c2 = mpitree->tree[c].c2;
-
-      cout << "Checking cell " << c << "   " << c2 << "     " << mpitree->tree[c].clevel << endl;
-
-      // If on load-balancing level, then estimate new division of domains 
-      // based on work in each domain and position of 'centre of work'.
-      // If work is already balanced, then domain boundaries remain unchanged.
-      if (mpitree->tree[c].clevel == balance_level && c2 != 0) {
-        //if (mpitree->tree[c+1].worktot > mpitree->tree[c2].worktot)
-        //  rnew = mpitree->tree[c+1].rwork[k] +
-        //    2.0*(mpitree->tree[c+1].bbmax[k] - mpitree->tree[c+1].rwork[k])*
-        //    mpitree->tree[c+1].worktot/mpitree->tree[c].worktot;
-        //else
-	    //  rnew = mpitree->tree[c2].rwork[k] +
-	    //    2.0*(mpitree->tree[c2].bbmin[k] - mpitree->tree[c2].rwork[k])*
-	    //    mpitree->tree[c2].worktot/mpitree->tree[c].worktot;
-    	int i1 = mpitree->tree[c+1].c2g;
-    	int i2 = mpitree->tree[c2].c2g;
-    	FLOAT dwdx1 = 0.5*mpitree->tree[c+1].worktot/
-    			(mpitree->tree[c+1].bbmax[k] - mpitree->tree[c+1].rwork[k]);
-    	FLOAT dwdx2 = 0.5*mpitree->tree[c2].worktot/
-    			(mpitree->tree[c2].rwork[k] - mpitree->tree[c2].bbmin[k]);
-    	FLOAT dxnew = (mpinode[i1].worksent[i2] + mpinode[i2].worksent[i1])/
-    			(dwdx1 + dwdx2);
-    	rnew = mpitree->tree[c+1].bbmax[k] + dxnew;
-    	cout << "dwdx : " << dwdx1 << "    " << dwdx2 << "      dxnew : " << dxnew << endl;
-    	cout << "worksent : " << mpinode[i1].worksent[i2] << "    " << mpinode[i2].worksent[i1] << endl;
-    	cout << "rold : " << mpitree->tree[c+1].bbmax[k] << "     rnew : " << rnew << endl;
-
-    	mpitree->tree[c+1].bbmax[k] = rnew;
-        mpitree->tree[c2].bbmin[k] = rnew;
-        cout << "work : " << mpitree->tree[c+1].worktot << "    " << mpitree->tree[c2].worktot << endl;
-        cout << "Child 1 domain : " << mpitree->tree[c+1].bbmin[k] << "     " << mpitree->tree[c+1].bbmax[k] << endl;
-        cout << "Child 1 rbox   : " << mpinode[i1].rbox.boxmin[k] << "     " << mpinode[i1].rbox.boxmax[k] << endl;
-        cout << "Child 2 domain : " << mpitree->tree[c2].bbmin[k] << "     " << mpitree->tree[c2].bbmax[k] << endl;
-        cout << "Child 2 rbox   : " << mpinode[i2].rbox.boxmin[k] << "     " << mpinode[i2].rbox.boxmax[k] << endl;
-      }
+  return;
+}
 
-      // For leaf cells, set new MPI node box sizes 
-      else if (c2 == 0) {
-        inode = mpitree->tree[c].c2g;
-        for (kk=0; kk<ndim; kk++)
-          mpinode[inode].domain.boxmin[kk] = mpitree->tree[c].bbmin[kk];
-        for (kk=0; kk<ndim; kk++)
-          mpinode[inode].domain.boxmax[kk] = mpitree->tree[c].bbmax[kk];
-      }
 
-      // For other cells, propagate new bounding box information downwards
-      else {
-        mpitree->tree[c+1].bbmin[k] = mpitree->tree[c].bbmin[k];
-        mpitree->tree[c2].bbmax[k] = mpitree->tree[c].bbmax[k];
-      }
 
+//=============================================================================
+//  MpiControl::HilbertDecomposition
+/// Peano-Hilbert decomposition : each MPI node owns a contiguous range of
+/// Peano-Hilbert keys (computed inside the bounding box of all particles),
+/// with the ranges chosen so that all nodes hold equal cost.  The splitting
+/// keys are found from global cost histograms (MPI_Allreduce) of the keys,
+/// refined Nhilbertbinbits bits at a time.  The local particles are then
+/// sorted by key, so the particles of each node are contiguous, and all
+/// particles are migrated with ExchangeMigrants.  On return, the local
+/// particles are ordered by key.
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::HilbertDecomposition
+(Sph<ndim> *sph,                    ///< [inout] Pointer to main SPH object
+ DOUBLE *partwork)                  ///< [in] Cost of each local particle
+{
+  int i;                            // Particle counter
+  int ibin;                         // Histogram bin counter
+  int inode;                        // MPI node counter
+  int j;                            // Split counter
+  int k;                            // Dimension counter
+  int Nbin;                         // No. of bins of current histograms
+  int nbits;                        // No. of key bits of current histograms
+  int Nrecv;                        // No. of particles received
+  int shift;                        // No. of unresolved key bits
+  const int Nsplit = Nmpi - 1;      // No. of splitting keys
+  const int keybits = HilbertKeyBits<ndim>();  // No. of bits of keys
+  DOUBLE wcum;                      // Cumulative work of histogram
+  DOUBLE worklocal = 0.0;           // Total work on this node
+  DOUBLE worktotal;                 // Total work on all nodes
+  DOUBLE extent[2*ndim];            // -min and max extent of all particles
+  hilbertkey keyhi;                 // Upper end of histogram key range
+  vector<DOUBLE> hist;              // Cost histograms of all splits
+  vector<DOUBLE> target;            // Cost below each splitting key
+  vector<DOUBLE> wbelow;            // Cost below histogram range
+  vector<hilbertkey> splitkey;      // Lower end of histogram key range
+  vector<pair<hilbertkey,int> > keys;  // Sorted keys and ids of all ptcls
+
+  debug2("[MpiControl::HilbertDecomposition]");
+
+  // Map the bounding box of all particles onto the Peano-Hilbert curve
+  for (k=0; k<2*ndim; k++) extent[k] = -big_number;
+  for (i=0; i<sph->Nsph; i++) {
+    for (k=0; k<ndim; k++) {
+      extent[k] = max(extent[k],(DOUBLE) -sph->sphdata[i].r[k]);
+      extent[ndim + k] = max(extent[ndim + k],(DOUBLE) sph->sphdata[i].r[k]);
     }
-    //-------------------------------------------------------------------------
+  }
+  MPI_Allreduce(MPI_IN_PLACE,extent,2*ndim,MPI_DOUBLE,MPI_MAX,MPI_COMM_WORLD);
+  for (k=0; k<ndim; k++) {
+    keybox.boxmin[k] = -extent[k];
+    keybox.boxmax[k] = extent[ndim + k];
+    if (keybox.boxmax[k] <= keybox.boxmin[k]) {
+      keybox.boxmin[k] -= small_number;
+      keybox.boxmax[k] += small_number;
+    }
+  }
 
+  // Compute and sort the keys of all local particles
+  keys.resize(sph->Nsph);
+#pragma omp parallel for default(none) private(i) shared(keys,sph)
+  for (i=0; i<sph->Nsph; i++) {
+    keys[i].first = HilbertKey<ndim>(sph->sphdata[i].r,keybox);
+    keys[i].second = i;
+  }
+  sort(keys.begin(),keys.end());
 
-    // Transmit new bounding box sizes to all other nodes
-    for (inode=0; inode<Nmpi; inode++) {
-      for (k=0; k<ndim; k++)
-        boxbuffer[2*ndim*inode + k] = mpinode[inode].domain.boxmin[k];
-      for (k=0; k<ndim; k++)
-        boxbuffer[2*ndim*inode + ndim + k] = mpinode[inode].domain.boxmax[k];
+  // Cost below each splitting key
+  for (i=0; i<sph->Nsph; i++) worklocal += partwork[i];
+  MPI_Allreduce(&worklocal,&worktotal,1,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+  target.resize(Nsplit);
+  for (j=0; j<Nsplit; j++)
+    target[j] = worktotal*(DOUBLE) (j + 1)/(DOUBLE) Nmpi;
 
-      cout << "New box for node " << inode << "    : " << mpinode[inode].domain.boxmin[0] << "     " << mpinode[inode].domain.boxmax[0] << endl;
 
+  // Find all splitting keys together, resolving nbits more bits of each key
+  // on every iteration
+  //---------------------------------------------------------------------------
+  splitkey.assign(Nsplit,0);
+  wbelow.assign(Nsplit,0.0);
+  shift = keybits;
+
+  while (shift > 0) {
+    nbits = min(Nhilbertbinbits,shift);
+    Nbin = 1 << nbits;
+    shift -= nbits;
+    hist.assign(Nbin*Nsplit,0.0);
+
+    // Histogram of the cost of all particles inside each split's key range
+    for (j=0; j<Nsplit; j++) {
+      if (j > 0 && splitkey[j] == splitkey[j-1]) {
+        for (ibin=0; ibin<Nbin; ibin++)
+          hist[Nbin*j + ibin] = hist[Nbin*(j - 1) + ibin];
+        continue;
+      }
+      keyhi = splitkey[j] + ((hilbertkey) Nbin << shift);
+      i = lower_bound(keys.begin(),keys.end(),
+                      make_pair(splitkey[j],-1)) - keys.begin();
+      for (; i<sph->Nsph && keys[i].first < keyhi; i++) {
+        ibin = (int) ((keys[i].first - splitkey[j]) >> shift);
+        hist[Nbin*j + ibin] += partwork[keys[i].second];
+      }
+    }
+    MPI_Allreduce(MPI_IN_PLACE,&hist[0],Nbin*Nsplit,MPI_DOUBLE,
+                  MPI_SUM,MPI_COMM_WORLD);
+
+    // Narrow each key range to the bin where the cumulative cost reaches
+    // the target
+    for (j=0; j<Nsplit; j++) {
+      wcum = wbelow[j];
+      for (ibin=0; ibin<Nbin-1; ibin++) {
+        if (wcum + hist[Nbin*j + ibin] >= target[j]) break;
+        wcum += hist[Nbin*j + ibin];
+      }
+      splitkey[j] += (hilbertkey) ibin << shift;
+      wbelow[j] = wcum;
     }
+  }
+  //---------------------------------------------------------------------------
 
-    // Now broadcast all bounding boxes to other processes
-    MPI_Bcast(boxbuffer,2*ndim*Nmpi,MPI_DOUBLE,0,MPI_COMM_WORLD);
-    MPI_Barrier(MPI_COMM_WORLD);
+  // Node inode owns all keys keysplit[inode] <= key < keysplit[inode+1]
+  keysplit.resize(Nmpi + 1);
+  keysplit[0] = 0;
+  for (j=0; j<Nsplit; j++) keysplit[j+1] = max(splitkey[j],keysplit[j]);
+  keysplit[Nmpi] = ~((hilbertkey) 0);
 
-  }
+
+  // Migrate all particles in key order with a single MPI_Alltoallv
   //---------------------------------------------------------------------------
-  else {
+  i = 0;
+  for (inode=0; inode<Nmpi; inode++) {
+    j = i;
+    while (i < sph->Nsph && (inode == Nmpi - 1 ||
+                             keys[i].first < keysplit[inode+1])) i++;
+    Nmigrant_send[inode] = i - j;
+  }
 
+  if ((int) migrants_send.size() < sph->Nsph) migrants_send.resize(sph->Nsph);
+  for (i=0; i<sph->Nsph; i++) {
+    migrants_send[i].part = sph->sphdata[keys[i].second];
+    migrants_send[i].intpart = sph->sphintdata[keys[i].second];
+  }
 
-	cout << "Node : " << rank << " sending information" << endl;
+  Nrecv = ExchangeMigrants();
+  sph->ReallocateMemory(Nrecv);
 
-    // Transmit load balancing information to main root node
-    workbuffer[0] = mpinode[rank].worktot;
-    for (k=0; k<ndim; k++) workbuffer[k+1] = mpinode[rank].rwork[k];
-    for (k=0; k<Nmpi; k++) workbuffer[ndim+k+1] = mpinode[rank].worksent[k];
-    okflag = MPI_Send(&workbuffer,ndim+1,MPI_DOUBLE,0,0,MPI_COMM_WORLD);
-	MPI_Barrier(MPI_COMM_WORLD);
+  // Replace all local particles with the received particles
+  for (i=0; i<Nrecv; i++) {
+    sph->sphdata[i] = migrants_receive[i].part;
+    sph->sphintdata[i] = migrants_receive[i].intpart;
+    sph->sphintdata[i].part = &sph->sphdata[i];
+  }
+  sph->Nsph = Nrecv;
+  sph->Ntot = Nrecv;
+  mpinode[rank].Nsph = Nrecv;
 
-	cout << "Node " << rank << " waiting to receive all boxes" << endl;
+  return;
+}
 
-    // Receive bounding box data for domain and unpack data
-    MPI_Bcast(boxbuffer,2*ndim*Nmpi,MPI_DOUBLE,0,MPI_COMM_WORLD);
 
-    // Unpack all bounding box data
-    for (inode=0; inode<Nmpi; inode++) {
-      for (k=0; k<ndim; k++) 
-        mpinode[inode].domain.boxmin[k] = boxbuffer[2*ndim*inode + k];
-      for (k=0; k<ndim; k++) 
-        mpinode[inode].domain.boxmax[k] = boxbuffer[2*ndim*inode + ndim + k];
-    }
-    MPI_Barrier(MPI_COMM_WORLD);
 
+//=============================================================================
+//  MpiControl::LoadBalancing
+/// Re-partition the domains of all MPI nodes so each node holds an equal
+/// share of the measured computational cost (see ComputeParticleWork), using
+/// either recursive bisection into boxes or Peano-Hilbert key ranges
+/// (decomposition = "kdtree" or "hilbert"), then transfer all particles that
+/// now belong to other nodes (one MPI_Alltoall of the particle counts and
+/// one MPI_Alltoallv of the particles, see ExchangeMigrants).
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::LoadBalancing
+(Sph<ndim> *sph,                    ///< Pointer to main SPH object
+ Nbody<ndim> *nbody)                ///< Pointer to main N-body object
+{
+  int inode;                        // MPI node counter
+  DOUBLE *partwork;                 // Cost of each local particle
+
+  // If running on only one MPI node, return immediately
+  if (Nmpi == 1) return;
 
-  }
-  //---------------------------------------------------------------------------
+  debug2("[MpiControl::LoadBalancing]");
 
+  partwork = new DOUBLE[max(sph->Nsph,1)];
+  ComputeParticleWork(sph,partwork);
 
+  // Peano-Hilbert decomposition also migrates the particles
+  if (decomposition == "hilbert") {
+    HilbertDecomposition(sph,partwork);
+    delete[] partwork;
+    return;
+  }
 
-  // Prepare lists of particles that now occupy other processor domains that 
-  // need to be transfered
+  BisectionDecomposition(sph,partwork);
+  delete[] partwork;
 
-  // First construct the list of nodes that we might be sending particles to
+  // Construct the list of nodes that we might be sending particles to
   std::vector<int> potential_nodes;
   potential_nodes.reserve(Nmpi);
-  for (int inode=0; inode<Nmpi; inode++) {
+  for (inode=0; inode<Nmpi; inode++) {
     if (inode == rank) continue;
     if (BoxesOverlap(mpinode[inode].domain,mpinode[rank].rbox)) {
       potential_nodes.push_back(inode);
     }
   }
 
+  MigrateParticles(sph,potential_nodes);
 
+  return;
+}
 
-  // Now find the particles that need to be transferred - delegate to NeighbourSearch
-  std::vector<std::vector<int> > particles_to_transfer (Nmpi);
-  std::vector<int> all_particles_to_export;
-  BruteForceSearch<ndim> bruteforce;
-  bruteforce.FindParticlesToTransfer(sph, particles_to_transfer, all_particles_to_export, potential_nodes, mpinode);
-
-  // Send and receive particles from/to all other nodes
-  std::vector<SphParticle<ndim> > sendbuffer, recvbuffer;
-  std::vector<SphIntParticle<ndim> > sendbufferint, recvbufferint;
-  for (int iturn = 0; iturn<my_matches.size(); iturn++) {
-    int inode = my_matches[iturn];
-
-    int N_to_transfer = particles_to_transfer[inode].size();
-    cout << "Transfer!!  Rank : " << rank << "    N_to_transfer : " << N_to_transfer << "    dest : " << inode << endl;
-    sendbuffer.clear(); sendbuffer.resize(N_to_transfer);
-    sendbufferint.clear(); sendbufferint.resize(N_to_transfer);
-    recvbuffer.clear();
-    recvbufferint.clear();
-
-    // Copy particles into send buffer
-    for (int ipart=0; ipart < N_to_transfer; ipart++) {
-      int index = particles_to_transfer[inode][ipart];
-      sendbuffer[ipart] = sph->sphdata[index];
-      sendbufferint[ipart] = sph->sphintdata[index];
-    }
 
-    // Do the actual send and receive
 
-    //Decide if we have to send or receive first
-    bool send_turn;
-    if (rank < inode) {
-      send_turn=true;
-    }
-    else {
-      send_turn=false;
-    }
+//=============================================================================
+//  MpiControl::MigrateParticles
+/// Transfer all local particles that now occupy the domains of other nodes
+/// (only the given potential nodes are checked) to these nodes, and add the
+/// particles received from other nodes to the local arrays.
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::MigrateParticles
+(Sph<ndim> *sph,                    ///< Pointer to main SPH object
+ const std::vector<int> &potential_nodes)  ///< Nodes that may receive ptcls
+{
+  int i;                            // Particle counter
+  int inode;                        // MPI node counter
+  int j;                            // Aux. particle counter
+  int Nrecv;                        // No. of particles received
+  int Nsend;                        // No. of particles sent
 
-    //Do the actual communication, sending and receiving in the right order
-    for (int i=0; i < 2; i++) {
-      if (send_turn) {
-        cout << "Sending " << N_to_transfer << " from " << rank << " to " << inode << endl;
-        MPI_Send(&sendbuffer[0], N_to_transfer, particle_type, inode, tag_bal, MPI_COMM_WORLD);
-        MPI_Send(&sendbufferint[0], N_to_transfer, partint_type, inode, tag_bal, MPI_COMM_WORLD);
-        send_turn = false;
-        cout << "Sent " << N_to_transfer << " from " << rank << " to " << inode << endl;
-      }
-      else {
-        int N_to_receive;
-        MPI_Status status;
-        MPI_Probe(inode, tag_bal, MPI_COMM_WORLD, &status);
-        MPI_Get_count(&status, particle_type, &N_to_receive);
-        recvbuffer.resize(N_to_receive); recvbufferint.resize(N_to_receive);
-        cout << "Rank " << rank << " receiving " << N_to_receive << " from " << inode << endl;
-        if (sph->Nsph+N_to_receive > sph->Nsphmax) {
-          cout << "Memory problem : " << rank << " " << sph->Nsph << " " << N_to_receive << " " << sph->Nsphmax <<endl;
-          string message = "Not enough memory for transfering particles";
-          ExceptionHandler::getIstance().raise(message);
-        }
-        MPI_Recv(&recvbuffer[0], N_to_receive, particle_type, inode, tag_bal, MPI_COMM_WORLD, &status);
-        MPI_Recv(&recvbufferint[0], N_to_receive, partint_type, inode, tag_bal, MPI_COMM_WORLD, &status);
-        send_turn = true;
-        cout << "Rank " << rank << " received " << N_to_receive << " from " << inode << endl;
-      }
-    }
+  debug2("[MpiControl::MigrateParticles]");
+
+  // Find the particles that need to be transferred - delegate to NeighbourSearch
+  for (inode=0; inode<Nmpi; inode++) particles_to_transfer[inode].clear();
+  all_particles_to_transfer.clear();
+  BruteForceSearch<ndim> bruteforce;
+  bruteforce.FindParticlesToTransfer(sph, particles_to_transfer, all_particles_to_transfer, potential_nodes, mpinode);
 
-    // Copy particles from receive buffer to main arrays
-    int running_counter = sph->Nsph;
-    // TODO: check we have enough memory
-    for (int i=0; i< recvbuffer.size(); i++) {
-      sph->sphdata[running_counter] = recvbuffer[i];
-      sph->sphintdata[running_counter] = recvbufferint[i];
-      sph->sphintdata[running_counter].part = &sph->sphdata[running_counter];
-      running_counter++;
+  // Pack the migrating particles of all nodes contiguously (in node order)
+  // and exchange them with all other nodes at once
+  if (migrants_send.size() < all_particles_to_transfer.size())
+    migrants_send.resize(all_particles_to_transfer.size());
+  Nsend = 0;
+  for (inode=0; inode<Nmpi; inode++) {
+    Nmigrant_send[inode] = particles_to_transfer[inode].size();
+    for (i=0; i<Nmigrant_send[inode]; i++) {
+      j = particles_to_transfer[inode][i];
+      migrants_send[Nsend].part = sph->sphdata[j];
+      migrants_send[Nsend].intpart = sph->sphintdata[j];
+      Nsend++;
     }
-    sph->Nsph = running_counter;
+  }
 
+  Nrecv = ExchangeMigrants();
+  sph->ReallocateMemory(sph->Nsph + Nrecv);
+
+  // Copy particles from receive buffer to main arrays
+  for (i=0; i<Nrecv; i++) {
+    j = sph->Nsph + i;
+    sph->sphdata[j] = migrants_receive[i].part;
+    sph->sphintdata[j] = migrants_receive[i].intpart;
+    sph->sphintdata[j].part = &sph->sphdata[j];
   }
+  sph->Nsph += Nrecv;
 
 
   // Remove transferred particles
-  sph->DeleteParticles(all_particles_to_export.size(), &all_particles_to_export[0]);
+  sph->DeleteParticles(all_particles_to_transfer.size(),
+                       &all_particles_to_transfer[0]);
 
+  return;
+}
 
 
 
-  return;
+//=============================================================================
+//  MpiControl::ExchangeMigrants
+/// Send the migrating particles packed in migrants_send (Nmigrant_send[inode]
+/// consecutive particles for each node, in node order) to their new nodes 
+/// and receive all particles migrating to this node into migrants_receive.
+/// Only the counts (MPI_Alltoall) and the particles (MPI_Alltoallv) are 
+/// communicated; the buffers are kept between calls.  Returns the number of 
+/// particles received.
+//=============================================================================
+template <int ndim>
+int MpiControl<ndim>::ExchangeMigrants(void)
+{
+  int inode;                        // MPI node counter
+  int Nrecv = 0;                    // No. of particles received
+  int Nsend = 0;                    // No. of particles sent
+
+  debug2("[MpiControl::ExchangeMigrants]");
+
+  MPI_Alltoall(&Nmigrant_send[0],1,MPI_INT,&Nmigrant_receive[0],1,MPI_INT,
+               MPI_COMM_WORLD);
+
+  for (inode=0; inode<Nmpi; inode++) {
+    migrantsend_displs[inode] = Nsend;
+    migrantreceive_displs[inode] = Nrecv;
+    Nsend += Nmigrant_send[inode];
+    Nrecv += Nmigrant_receive[inode];
+  }
+  if ((int) migrants_send.size() < max(Nsend,1)) migrants_send.resize(max(Nsend,1));
+  if ((int) migrants_receive.size() < max(Nrecv,1)) 
+    migrants_receive.resize(max(Nrecv,1));
+
+  MPI_Alltoallv(&migrants_send[0],&Nmigrant_send[0],&migrantsend_displs[0],
+                migrant_type,&migrants_receive[0],&Nmigrant_receive[0],
+                &migrantreceive_displs[0],migrant_type,MPI_COMM_WORLD);
 
+  return Nrecv;
 }
 
 
@@ -910,7 +1183,12 @@ int MpiControl<ndim>::SendReceiveGhosts
   //Ask the neighbour search class to compute the list of particles to export
   //For now, hard-coded the BruteForce class
   BruteForceSearch<ndim> bruteforce;
-  bruteforce.FindGhostParticlesToExport(sph,particles_to_export_per_node,overlapping_nodes,mpinode);
+  if (decomposition == "hilbert")
+    bruteforce.FindGhostParticlesToExport(sph,particles_to_export_per_node,
+                                          overlapping_nodes,mpinode,
+                                          hilbertboxes,hilbertboxfirst);
+  else
+    bruteforce.FindGhostParticlesToExport(sph,particles_to_export_per_node,overlapping_nodes,mpinode);
 
   //Prepare arrays with number of particles to export per node and displacements
   std::fill(num_particles_export_per_node.begin(),num_particles_export_per_node.end(),0);
@@ -985,26 +1263,160 @@ int MpiControl<ndim>::SendReceiveGhosts
 //=============================================================================
 template <int ndim>
 int MpiControl<ndim>::UpdateGhostParticles
-(SphParticle<ndim>** array)         ///< Main SPH particle array
+(SphParticle<ndim>** array,         ///< Main SPH particle array
+ Sph<ndim>* sph,                    ///< Main SPH object pointer
+ ghostexchange exchange)            ///< Subset of particle data to send
+{
+  StartGhostUpdate(sph,exchange);
+
+  return FinishGhostUpdate(array);
+}
+
+
+
+//=============================================================================
+//  MpiControl::StartGhostUpdate
+/// Start the (non-blocking) update of the ghost particles that were
+/// previously found.  Only the fields selected by exchange are sent : all
+/// of them, those needed by the density pass (ghost_positions), or those
+/// computed by the density pass (ghost_properties).  The latter are only
+/// sent for particles that were active, i.e. whose properties have changed.
+/// The update must be completed with FinishGhostUpdate.
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::StartGhostUpdate
+(Sph<ndim>* sph,                    ///< Main SPH object pointer
+ ghostexchange exchange)            ///< Subset of particle data to send
 {
+  int i;                            // Particle id
   int index = 0;                    // ..
   int inode;                        // MPI node counter
   int ipart;                        // Particle counter
+  int Nupdate = 0;                  // Total no. of updated ghosts received
+  SphParticle<ndim> *part;          // Pointer to exported particle
+  MPI_Datatype ghost_type;          // Datatype of exchanged fields
 
   //Update the local buffer of particles to send
+  //---------------------------------------------------------------------------
+  if (exchange != ghost_properties) {
+    for (inode=0; inode<Nmpi; inode++) {
+      std::vector<SphParticle<ndim>* >& particles_on_this_node = particles_to_export_per_node[inode];
+      for (ipart=0; ipart<(int) particles_on_this_node.size(); ipart++) {
+        particles_to_export[index] = *particles_on_this_node[ipart];
+        index++;
+      }
+    }
+
+    //Send and receive particles
+    ghost_type = (exchange == ghost_positions ? position_type : particle_type);
+    MPI_Ialltoallv(&particles_to_export[0], &num_particles_export_per_node[0],
+                   &displacements_send[0], ghost_type, &particles_receive[0],
+                   &num_particles_to_be_received[0], &receive_displs[0],
+                   ghost_type, MPI_COMM_WORLD, &ghostrequest);
+
+    return;
+  }
+
+
+  // Otherwise, pack only the particles that were active in the density
+  // pass (or whose original particle was, for periodic ghosts), together
+  // with their slot in the list of ghosts exported to each node
+  //---------------------------------------------------------------------------
+  std::vector<int> send_displs(Nmpi);
+  std::vector<int> update_displs(Nmpi);
+
+  ghostslot_send.clear();
   for (inode=0; inode<Nmpi; inode++) {
     std::vector<SphParticle<ndim>* >& particles_on_this_node = particles_to_export_per_node[inode];
-    for (ipart=0; ipart<particles_on_this_node.size(); ipart++) {
-      particles_to_export[index] = *particles_on_this_node[ipart];
+    send_displs[inode] = index;
+    for (ipart=0; ipart<(int) particles_on_this_node.size(); ipart++) {
+      part = particles_on_this_node[ipart];
+      i = part - sph->sphdata;
+      if (!(i < sph->Nsph ? part->active : sph->sphdata[part->iorig].active))
+        continue;
+      particles_to_export[index] = *part;
+      ghostslot_send.push_back(ipart);
       index++;
     }
+    Nupdate_send[inode] = index - send_displs[inode];
+    send_bytes[inode] = send_displs[inode]*sizeof(SphParticle<ndim>);
   }
+  ghostslot_send.push_back(0);
+
+  //Exchange the numbers and slots of the updated ghosts
+  MPI_Alltoall(&Nupdate_send[0], 1, MPI_INT, &Nupdate_receive[0], 1,
+               MPI_INT, MPI_COMM_WORLD);
+  for (inode=0; inode<Nmpi; inode++) {
+    update_displs[inode] = Nupdate;
+    Nupdate += Nupdate_receive[inode];
+  }
+  ghostslot_receive.resize(Nupdate + 1);
+  MPI_Alltoallv(&ghostslot_send[0], &Nupdate_send[0], &send_displs[0],
+                MPI_INT, &ghostslot_receive[0], &Nupdate_receive[0],
+                &update_displs[0], MPI_INT, MPI_COMM_WORLD);
+
+  //Receive the fields of the updated ghosts of each node directly into
+  //their slots in the receive buffer
+  for (inode=0; inode<Nmpi; inode++) {
+    receive_types[inode] = property_type;
+    receive_counts[inode] = 0;
+    if (Nupdate_receive[inode] == 0) continue;
+    for (ipart=update_displs[inode];
+         ipart<update_displs[inode]+Nupdate_receive[inode]; ipart++)
+      ghostslot_receive[ipart] += receive_displs[inode];
+    MPI_Type_create_indexed_block(Nupdate_receive[inode], 1,
+                                  &ghostslot_receive[update_displs[inode]],
+                                  property_type, &receive_types[inode]);
+    MPI_Type_commit(&receive_types[inode]);
+    receive_counts[inode] = 1;
+  }
+
+  MPI_Ialltoallw(&particles_to_export[0], &Nupdate_send[0], &send_bytes[0],
+                 &send_types[0], &particles_receive[0], &receive_counts[0],
+                 &receive_bytes[0], &receive_types[0], MPI_COMM_WORLD,
+                 &ghostrequest);
+
+  return;
+}
 
-  //Send and receive particles
-  MPI_Alltoallv(&particles_to_export[0], &num_particles_export_per_node[0],
-                &displacements_send[0], particle_type, &particles_receive[0],
-                &num_particles_to_be_received[0], &receive_displs[0],
-                particle_type, MPI_COMM_WORLD);
+
+
+//=============================================================================
+//  MpiControl::TestGhostUpdate
+/// Progress the pending ghost update (if any) without blocking.  Returns
+/// true if the update has been completed.
+//=============================================================================
+template <int ndim>
+bool MpiControl<ndim>::TestGhostUpdate(void)
+{
+  int flag = 1;                     // Has the update been completed?
+
+  if (ghostrequest != MPI_REQUEST_NULL)
+    MPI_Test(&ghostrequest,&flag,MPI_STATUS_IGNORE);
+
+  return (flag != 0);
+}
+
+
+
+//=============================================================================
+//  MpiControl::FinishGhostUpdate
+/// Wait for the ghost update started by StartGhostUpdate to complete.
+/// Returns the number of Mpi ghosts, and the address of the array of ghosts
+/// in the passed pointer (as for UpdateGhostParticles).
+//=============================================================================
+template <int ndim>
+int MpiControl<ndim>::FinishGhostUpdate
+(SphParticle<ndim>** array)         ///< Main SPH particle array
+{
+  int inode;                        // MPI node counter
+
+  MPI_Wait(&ghostrequest,MPI_STATUS_IGNORE);
+
+  for (inode=0; inode<Nmpi; inode++) {
+    if (receive_counts[inode] > 0) MPI_Type_free(&receive_types[inode]);
+    receive_counts[inode] = 0;
+  }
 
   *array = &particles_receive[0];
 
@@ -1013,6 +1425,80 @@ int MpiControl<ndim>::UpdateGhostParticles
 
 
 
+//=============================================================================
+//  MpiControl::UpdateLocallyEssentialTrees
+/// Exchange the locally essential trees needed to compute the gravitational 
+/// forces due to the particles on all other MPI nodes.  For each other node, 
+/// the local tree is pruned with the gravity opening criterion against the 
+/// node's h-box.  Particles already exported to the node as MPI ghosts are 
+/// left out, since they are already contained in the node's own tree.  The 
+/// received trees are grafted onto the local tree as MPI ghost trees.
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::UpdateLocallyEssentialTrees
+(Sph<ndim> *sph)                    ///< Main SPH object pointer
+{
+  int i;                            // Particle counter
+  int inode;                        // MPI node counter
+  int itree = 0;                    // MPI ghost tree counter
+  int j;                            // Aux. particle counter
+  int running_counter = 0;          // No. of cells received
+  bool *excluded;                   // Flags of particles not sent to node
+
+  if (rank == 0) debug2("[MpiControl::UpdateLocallyEssentialTrees]");
+
+  // Only real particles are sent (i.e. not periodic or MPI ghosts)
+  excluded = new bool[sph->Ntot];
+  for (i=0; i<sph->Ntot; i++) excluded[i] = (i >= sph->Nsph);
+
+  // Walk local tree to find the locally essential tree of each other node
+  //---------------------------------------------------------------------------
+  letcells_send.clear();
+  for (inode=0; inode<Nmpi; inode++) {
+    std::vector<SphParticle<ndim>* >& ghosts = 
+      particles_to_export_per_node[inode];
+    letsend_displs[inode] = letcells_send.size();
+    Nletcell_send[inode] = 0;
+    if (inode == rank) continue;
+
+    for (j=0; j<(int) ghosts.size(); j++) excluded[ghosts[j] - sph->sphdata] = true;
+    Nletcell_send[inode] = gravtree->CreateLocallyEssentialTree
+      (mpinode[inode].hbox,excluded,sph,letcells_send);
+    for (j=0; j<(int) ghosts.size(); j++) {
+      i = ghosts[j] - sph->sphdata;
+      excluded[i] = (i >= sph->Nsph);
+    }
+  }
+  //---------------------------------------------------------------------------
+
+  delete[] excluded;
+
+  // Communicate the number of cells, then send and receive all cells
+  MPI_Alltoall(&Nletcell_send[0],1,MPI_INT,&Nletcell_receive[0],1,MPI_INT,
+               MPI_COMM_WORLD);
+  for (inode=0; inode<Nmpi; inode++) {
+    letreceive_displs[inode] = running_counter;
+    running_counter += Nletcell_receive[inode];
+  }
+  letcells_receive.resize(running_counter);
+
+  MPI_Alltoallv(&letcells_send[0],&Nletcell_send[0],&letsend_displs[0],
+                treecell_type,&letcells_receive[0],&Nletcell_receive[0],
+                &letreceive_displs[0],treecell_type,MPI_COMM_WORLD);
+
+  // Graft all received trees onto the local tree
+  for (inode=0; inode<Nmpi; inode++) {
+    if (inode == rank) continue;
+    mpinode[inode].nodetree = gravtree->GraftLocallyEssentialTree
+      (itree++,Nletcell_receive[inode],
+       &letcells_receive[0] + letreceive_displs[inode]);
+  }
+
+  return;
+}
+
+
+
 //=============================================================================
 //  MpiControl::SendParticles
 /// Given an array of ids and a node, copy particles inside a buffer and 
@@ -1079,55 +1565,55 @@ void MpiControl<ndim>::ReceiveParticles
 
 //=============================================================================
 //  MpiControl::CollateDiagnosticsData
-/// ..
+/// Sum the diagnostic quantities of all nodes onto the root node with a 
+/// single (tree-based) MPI_Reduce.  Only the root node's diag is replaced 
+/// by the global values.
 //=============================================================================
 template <int ndim>
 void MpiControl<ndim>::CollateDiagnosticsData(Diagnostics<ndim> &diag)
 {
-  int inode;
-  int j;
-  int k;
-  Diagnostics<ndim> diagaux;
-  MPI_Status status;
+  int k;                            // Dimension counter
+  Diagnostics<ndim> diaglocal;      // Local values (mass-weighted com)
+  Diagnostics<ndim> diagsum;        // Global sum of diagnostics
 
-  //---------------------------------------------------------------------------
-  if (rank == 0) {
+  debug2("[MpiControl::CollateDiagnosticsData]");
 
-    // First multiply root node values by mass
-    for (k=0; k<ndim; k++) diag.rcom[k] *= diag.mtot;
-    for (k=0; k<ndim; k++) diag.vcom[k] *= diag.mtot;
-
-    for (inode=1; inode<Nmpi; inode++) {
-      MPI_Recv(&diagaux, 1, diagnostics_type, 
-               inode, 0, MPI_COMM_WORLD, &status);
-      diag.Nsph += diagaux.Nsph;
-      diag.Nstar += diagaux.Nstar;
-      diag.Etot += diagaux.Etot;
-      diag.utot += diagaux.utot;
-      diag.ketot += diagaux.ketot;
-      diag.gpetot += diagaux.gpetot;
-      diag.mtot += diagaux.mtot;
-      for (k=0; k<ndim; k++) diag.mom[k] += diagaux.mom[k];
-      for (k=0; k<3; k++) diag.angmom[k] += diagaux.angmom[k];
-      for (k=0; k<ndim; k++) diag.force[k] += diagaux.force[k];
-      for (k=0; k<ndim; k++) diag.force_hydro[k] += diagaux.force_hydro[k];
-      for (k=0; k<ndim; k++) diag.force_grav[k] += diagaux.force_grav[k];
-      for (k=0; k<ndim; k++) diag.rcom[k] += diagaux.mtot*diagaux.rcom[k];
-      for (k=0; k<ndim; k++) diag.vcom[k] += diagaux.mtot*diagaux.vcom[k];
-    }
+  // Weight centre of mass values by the node mass so they can be summed
+  diaglocal = diag;
+  for (k=0; k<ndim; k++) {
+    diaglocal.rcom[k] = (diag.mtot > 0.0 ? diag.mtot*diag.rcom[k] : 0.0);
+    diaglocal.vcom[k] = (diag.mtot > 0.0 ? diag.mtot*diag.vcom[k] : 0.0);
+  }
 
-    // Renormalise centre of mass positions and velocities
+  MPI_Reduce(&diaglocal,&diagsum,1,diagnostics_type,diagnostics_op,
+             0,MPI_COMM_WORLD);
+
+  // Renormalise centre of mass positions and velocities on root node
+  if (rank == 0) {
+    diagsum.Eerror = diag.Eerror;
+    diag = diagsum;
     for (k=0; k<ndim; k++) diag.rcom[k] /= diag.mtot;
     for (k=0; k<ndim; k++) diag.vcom[k] /= diag.mtot;
-
   }
-  //---------------------------------------------------------------------------
-  else {
 
-    MPI_Send(&diag, 1, diagnostics_type, 0, 0, MPI_COMM_WORLD);
+  return;
+}
+
 
-  }
-  //---------------------------------------------------------------------------
+
+//=============================================================================
+//  MpiControl::GlobalReduction
+/// Reduce all packed values of the buffer (global minima, maxima and sums) 
+/// over all nodes with one MPI_Allreduce.  Used to batch all global 
+/// reductions of a timestep into a single collective call.
+//=============================================================================
+template <int ndim>
+void MpiControl<ndim>::GlobalReduction(MpiReduction &reduction)
+{
+  debug2("[MpiControl::GlobalReduction]");
+
+  MPI_Allreduce(MPI_IN_PLACE,&reduction,1,reduction_type,reduction_op,
+                MPI_COMM_WORLD);
 
   return;
 }
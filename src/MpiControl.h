@@ -29,13 +29,14 @@
 
 #include <string>
 #include "Precision.h"
+#include "Constants.h"
 #include "MpiNode.h"
 #include "Sph.h"
 #include "Nbody.h"
-#include "MpiTree.h"
 #include "SphParticle.h"
 #include "DomainBox.h"
 #include "Diagnostics.h"
+#include "HilbertKey.h"
 #if defined MPI_PARALLEL
 #include "mpi.h"
 #endif
@@ -43,8 +44,46 @@ using namespace std;
 
 
 static const int tag_srpart = 1;
-static const int tag_league = 2;
-static const int tag_bal = 3;
+
+
+// Subsets of particle data sent when updating MPI ghost particles
+enum ghostexchange{ghost_all, ghost_positions, ghost_properties};
+
+
+
+//=============================================================================
+//  Structure MpiReduction
+/// \brief  Packed buffer of all per-step global reductions, so that every
+///         global minimum, maximum and sum of a step is found with a single
+///         MPI_Allreduce (with a custom reduction operation).  Integer 
+///         quantities (e.g. timestep levels) are stored exactly as DOUBLE.
+//=============================================================================
+static const int Nreducemax = 4;    ///< Max. no. of values of each kind
+
+struct MpiReduction {
+  DOUBLE minval[Nreducemax];        ///< Values reduced to global minimum
+  DOUBLE maxval[Nreducemax];        ///< Values reduced to global maximum
+  DOUBLE sumval[Nreducemax];        ///< Values reduced to global sum
+
+  MpiReduction() {
+    for (int i=0; i<Nreducemax; i++) minval[i] = big_number_dp;
+    for (int i=0; i<Nreducemax; i++) maxval[i] = -big_number_dp;
+    for (int i=0; i<Nreducemax; i++) sumval[i] = 0.0;
+  }
+};
+
+
+
+//=============================================================================
+//  Structure MigrantParticle
+/// \brief  SPH particle and integration data of a particle migrating to
+///         another MPI node (exchanged as a single contiguous MPI type).
+//=============================================================================
+template <int ndim>
+struct MigrantParticle {
+  SphParticle<ndim> part;           ///< Main SPH particle data
+  SphIntParticle<ndim> intpart;     ///< SPH integration data
+};
 
 
 //=============================================================================
@@ -66,6 +105,13 @@ class MpiControl
   MPI_Datatype partint_type;         ///< Datatype for the SphIntParticle structure
   MPI_Datatype box_type;             ///< Datatype for the box
   MPI_Datatype diagnostics_type;     ///< Datatype for diagnostic info
+  MPI_Datatype migrant_type;         ///< Datatype for migrating particles
+  MPI_Datatype position_type;        ///< Ghost fields needed by density pass
+  MPI_Datatype property_type;        ///< Ghost fields set by density pass
+  MPI_Datatype treecell_type;        ///< Datatype for tree cells
+  MPI_Datatype reduction_type;       ///< Datatype for packed reductions
+  MPI_Op reduction_op;               ///< Min/max/sum of packed reductions
+  MPI_Op diagnostics_op;             ///< Sum of diagnostic quantities
 
   //Buffers needed to send and receive particles
   std::vector<std::vector<SphParticle<ndim>* > > particles_to_export_per_node;
@@ -76,13 +122,52 @@ class MpiControl
   std::vector<int> num_particles_to_be_received;
   std::vector<int> receive_displs;
   int tot_particles_to_receive;
+  std::vector<int> ghostslot_send;   ///< Export slots of updated ghosts
+  std::vector<int> ghostslot_receive;  ///< Receive slots of updated ghosts
+  std::vector<int> Nupdate_send;     ///< No. of updated ghosts sent to node
+  std::vector<int> Nupdate_receive;  ///< No. of updated ghosts from node
+  std::vector<int> send_bytes;       ///< Send displacements (in bytes)
+  std::vector<int> receive_counts;   ///< No. of receive types from node
+  std::vector<int> receive_bytes;    ///< Receive displacements (in bytes)
+  std::vector<MPI_Datatype> send_types;     ///< Datatypes sent to nodes
+  std::vector<MPI_Datatype> receive_types;  ///< Datatypes received
+  MPI_Request ghostrequest;          ///< Request of pending ghost update
 
   std::vector<Box<ndim> > boxes_buffer;     ///< Buffer needed by the UpdateAllBoundingBoxes routine
 
-  SphNeighbourSearch<ndim>* neibsearch;    ///< Neighbour search class
+  //Buffers needed to send and receive locally essential trees
+  std::vector<BinaryTreeCell<ndim> > letcells_send;     ///< Cells sent
+  std::vector<BinaryTreeCell<ndim> > letcells_receive;  ///< Cells received
+  std::vector<int> Nletcell_send;    ///< No. of cells sent to node
+  std::vector<int> Nletcell_receive; ///< No. of cells received from node
+  std::vector<int> letsend_displs;   ///< Displacements of cells sent
+  std::vector<int> letreceive_displs;  ///< Displacements of cells received
+
+  //Buffers needed to migrate particles (kept between load balancing steps)
+  std::vector<std::vector<int> > particles_to_transfer;  ///< Ids of ptcls
+                                     ///< migrating to each node
+  std::vector<int> all_particles_to_transfer;  ///< Ids of all migrating ptcls
+  std::vector<MigrantParticle<ndim> > migrants_send;     ///< Ptcls sent
+  std::vector<MigrantParticle<ndim> > migrants_receive;  ///< Ptcls received
+  std::vector<int> Nmigrant_send;    ///< No. of ptcls sent to node
+  std::vector<int> Nmigrant_receive; ///< No. of ptcls received from node
+  std::vector<int> migrantsend_displs;     ///< Displacements of ptcls sent
+  std::vector<int> migrantreceive_displs;  ///< Displacements of ptcls received
 
-  void CreateLeagueCalendar();
-  std::vector<int> my_matches; ///< List of the matches of this node. For each turn, gives the node we will play with
+  SphNeighbourSearch<ndim>* neibsearch;    ///< Neighbour search class
+  BinaryTree<ndim>* gravtree;              ///< Tree used for self-gravity
+
+  void ComputeParticleWork(Sph<ndim> *, DOUBLE *);
+  void DecomposeDomains(Sph<ndim> *, DomainBox<ndim>);
+  void BisectionDecomposition(Sph<ndim> *, DOUBLE *);
+  void HilbertDecomposition(Sph<ndim> *, DOUBLE *);
+  void MigrateParticles(Sph<ndim> *, const std::vector<int> &);
+  void UpdateHilbertBoxes(int, SphParticle<ndim> *, SphKernel<ndim> *);
+  int ExchangeMigrants(void);
+  std::vector<int> bisectiondim;     ///< Split dimensions of last bisection
+  std::vector<Box<ndim> > hilbertboxes;  ///< h-extent boxes of occupied
+                                     ///< Peano-Hilbert cells of all nodes
+  std::vector<int> hilbertboxfirst;  ///< First box of each node (+ end)
 
  public:
 
@@ -97,13 +182,21 @@ class MpiControl
   void AllocateMemory(int);
   void DeallocateMemory(void);
   void SetNeibSearch(SphNeighbourSearch<ndim>* _neibsearch) {neibsearch=_neibsearch;}
+  void SetGravityTree(BinaryTree<ndim>* _gravtree) {gravtree=_gravtree;}
 
   void CollateDiagnosticsData(Diagnostics<ndim> &);
+  void GlobalReduction(MpiReduction &);
   void CreateInitialDomainDecomposition(Sph<ndim> *, Nbody<ndim> *, Parameters* , DomainBox<ndim>);
+  void CreateRestartDomainDecomposition(Sph<ndim> *, DomainBox<ndim>);
   void LoadBalancing(Sph<ndim> *, Nbody<ndim> *);
   void UpdateAllBoundingBoxes(int, SphParticle<ndim> *, SphKernel<ndim> *);
   int SendReceiveGhosts(SphParticle<ndim>** array, Sph<ndim>* sph);
-  int UpdateGhostParticles(SphParticle<ndim>** array);
+  int UpdateGhostParticles(SphParticle<ndim>** array, Sph<ndim>* sph,
+                           ghostexchange exchange=ghost_all);
+  void StartGhostUpdate(Sph<ndim>* sph, ghostexchange exchange);
+  bool TestGhostUpdate(void);
+  int FinishGhostUpdate(SphParticle<ndim>** array);
+  void UpdateLocallyEssentialTrees(Sph<ndim> *);
 
 
   // MPI control variables
@@ -114,9 +207,14 @@ class MpiControl
   int Nmpi;                         ///< No. of MPI processes
   int Nloadbalance;                 ///< No. of steps between load-balancing
 
+  string decomposition;             ///< Domain decomposition method
+                                    ///< ('kdtree' or 'hilbert')
+  vector<hilbertkey> keysplit;      ///< First Peano-Hilbert key of each node
+                                    ///< (Nmpi + 1 values)
+  Box<ndim> keybox;                 ///< Box mapped onto Peano-Hilbert curve
+
   char hostname[MPI_MAX_PROCESSOR_NAME];
   DomainBox<ndim> mpibox;           ///< ..
-  MpiTree<ndim> *mpitree;           ///< Main MPI load balancing tree
   MpiNode<ndim> *mpinode;           ///< Data for all MPI nodes
 
 };
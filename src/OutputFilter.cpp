@@ -0,0 +1,236 @@
+//=============================================================================
+//  OutputFilter.cpp
+//  Contains all functions of the particle filter used to write reduced
+//  ("filtered") snapshot files.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "OutputFilter.h"
+#include "Exception.h"
+#include "Debug.h"
+#if defined _OPENMP
+#include "omp.h"
+#endif
+using namespace std;
+
+
+
+//=============================================================================
+//  SubsampleHash
+/// Mix the bits of a particle i.d. (32-bit integer finaliser of MurmurHash3)
+/// so that the residues of the hash select an unbiased random subsample.
+//=============================================================================
+static inline unsigned int SubsampleHash(unsigned int id)
+{
+  id ^= id >> 16;
+  id *= 0x85ebca6bu;
+  id ^= id >> 13;
+  id *= 0xc2b2ae35u;
+  id ^= id >> 16;
+  return id;
+}
+
+
+
+//=============================================================================
+//  OutputFilter::OutputFilter
+/// OutputFilter constructor.  By default no particle is selected.
+//=============================================================================
+template <int ndim>
+OutputFilter<ndim>::OutputFilter()
+{
+  region = nofilterregion;
+  Nsubsample = 0;
+  radius = 0.0;
+  for (int k=0; k<ndim; k++) {
+    boxmin[k] = 0.0;
+    boxmax[k] = 0.0;
+    centre[k] = 0.0;
+  }
+}
+
+
+
+//=============================================================================
+//  OutputFilter::Active
+/// Returns true if any selection criterion is set.
+//=============================================================================
+template <int ndim>
+bool OutputFilter<ndim>::Active(void) const
+{
+  return (region != nofilterregion || Nsubsample > 0 || !idlist.empty());
+}
+
+
+
+//=============================================================================
+//  OutputFilter::ReadIdList
+/// Read the original i.d.s of the particles to be always written from an
+/// ASCII file (whitespace separated integers; lines starting with '#' are
+/// comments).
+//=============================================================================
+template <int ndim>
+void OutputFilter<ndim>::ReadIdList
+(string filename)                   ///< [in] Name of i.d. list file
+{
+  int id;                           // Particle i.d.
+  string line;                      // Current line of file
+  ifstream infile;                  // Input file stream
+
+  debug2("[OutputFilter::ReadIdList]");
+
+  infile.open(filename.c_str());
+  if (!infile.is_open()) {
+    string msg = "Error: could not open filter i.d. list : " + filename;
+    ExceptionHandler::getIstance().raise(msg);
+  }
+
+  idlist.clear();
+  while (getline(infile,line)) {
+    if (line.empty() || line[0] == '#') continue;
+    istringstream ss(line);
+    while (ss >> id) idlist.push_back(id);
+  }
+  infile.close();
+
+  sort(idlist.begin(),idlist.end());
+  idlist.erase(unique(idlist.begin(),idlist.end()),idlist.end());
+
+  return;
+}
+
+
+
+//=============================================================================
+//  OutputFilter::Selected
+/// Returns true if the given SPH particle is written to filtered snapshots.
+//=============================================================================
+template <int ndim>
+bool OutputFilter<ndim>::Selected
+(const SphParticle<ndim> &part) const    ///< [in] SPH particle
+{
+  int k;                            // Dimension counter
+  FLOAT dr;                         // Relative position component
+  FLOAT drsqd;                      // Distance squared from centre
+
+  if (region == boxfilterregion) {
+    for (k=0; k<ndim; k++)
+      if (part.r[k] < boxmin[k] || part.r[k] > boxmax[k]) break;
+    if (k == ndim) return true;
+  }
+  else if (region == spherefilterregion) {
+    drsqd = 0.0;
+    for (k=0; k<ndim; k++) {
+      dr = part.r[k] - centre[k];
+      drsqd += dr*dr;
+    }
+    if (drsqd <= radius*radius) return true;
+  }
+
+  if (Nsubsample > 0 &&
+      SubsampleHash((unsigned int) part.iorig) % Nsubsample == 0) return true;
+
+  if (!idlist.empty() &&
+      binary_search(idlist.begin(),idlist.end(),part.iorig)) return true;
+
+  return false;
+}
+
+
+
+//=============================================================================
+//  OutputFilter::SelectParticles
+/// Copy all selected SPH particles (in their original order) to the output
+/// array, which must hold at least N particles.  The filter is evaluated in
+/// parallel: each thread counts the selected particles of its block, the
+/// counts are prefix-summed, and each thread then copies its particles to
+/// its own part of the output array.  Returns the no. of selected particles.
+//=============================================================================
+template <int ndim>
+int OutputFilter<ndim>::SelectParticles
+(int N,                             ///< [in] No. of SPH particles
+ SphParticle<ndim> *sphdata,        ///< [in] SPH particle array
+ SnapshotParticle<ndim> *sphout)    ///< [out] Selected SPH particles
+{
+  int Nselected = 0;                // No. of selected particles
+  int Nthreads = 1;                 // Max. no. of OpenMP threads
+  int *Nthreadselect;               // Output offsets of each thread
+#if defined _OPENMP
+  Nthreads = omp_get_max_threads();
+#endif
+
+  debug2("[OutputFilter::SelectParticles]");
+
+  Nthreadselect = new int[Nthreads + 1];
+  for (int ithread=0; ithread<Nthreads+1; ithread++) Nthreadselect[ithread] = 0;
+
+  //---------------------------------------------------------------------------
+#pragma omp parallel default(none) shared(N,Nselected,Nthreadselect,\
+  sphdata,sphout)
+  {
+    int i;                          // Particle counter
+    int iout;                       // Position of next selected particle
+    int ithread = 0;                // Thread id
+    int Nthread = 1;                // No. of active threads
+    int Nlocal = 0;                 // No. of ptcls selected by thread
+#if defined _OPENMP
+    ithread = omp_get_thread_num();
+    Nthread = omp_get_num_threads();
+#endif
+    const int ifirst = (int) (((long) N*ithread)/Nthread);
+    const int ilast = (int) (((long) N*(ithread + 1))/Nthread);
+
+    // First pass : count the selected particles of this thread's block
+    for (i=ifirst; i<ilast; i++)
+      if (Selected(sphdata[i])) Nlocal++;
+    Nthreadselect[ithread + 1] = Nlocal;
+
+#pragma omp barrier
+
+    // Prefix sum of thread counts
+#pragma omp single
+    {
+      for (int j=0; j<Nthread; j++) Nthreadselect[j + 1] += Nthreadselect[j];
+      Nselected = Nthreadselect[Nthread];
+    }
+
+    // Second pass : copy this thread's selected particles
+    iout = Nthreadselect[ithread];
+    for (i=ifirst; i<ilast; i++)
+      if (Selected(sphdata[i])) sphout[iout++] = sphdata[i];
+
+  }
+  //---------------------------------------------------------------------------
+
+  delete[] Nthreadselect;
+
+  return Nselected;
+}
+
+
+
+template class OutputFilter<1>;
+template class OutputFilter<2>;
+template class OutputFilter<3>;
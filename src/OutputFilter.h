@@ -0,0 +1,102 @@
+//=============================================================================
+//  OutputFilter.h
+//  Contains the definition of the particle filter used to write reduced
+//  ("filtered") snapshot files.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#ifndef _OUTPUT_FILTER_H_
+#define _OUTPUT_FILTER_H_
+
+
+#include <string>
+#include <vector>
+#include "Precision.h"
+#include "SphParticle.h"
+using namespace std;
+
+
+
+//=============================================================================
+//  Enum filterregionenum
+/// \brief  Region of an output filter written at full resolution.
+//=============================================================================
+enum filterregionenum{nofilterregion, boxfilterregion, spherefilterregion};
+
+
+
+//=============================================================================
+/// \brief  Returns true for the filtered variant of a snapshot file format
+///         (i.e. the format name with the prefix "filtered_").
+//=============================================================================
+inline bool FilteredFileForm(const string &fileform)
+{
+  return (fileform.compare(0,9,"filtered_") == 0);
+}
+
+
+
+//=============================================================================
+/// \brief  Returns the underlying file format of a (filtered) file format.
+//=============================================================================
+inline string BaseFileForm(const string &fileform)
+{
+  if (FilteredFileForm(fileform)) return fileform.substr(9);
+  else return fileform;
+}
+
+
+
+//=============================================================================
+//  Class OutputFilter
+/// \brief   Selects the SPH particles written to filtered snapshot files.
+/// \details A particle is written if it lies inside the selected region
+///          (box or sphere), if its original i.d. is in the i.d. list, or if
+///          it belongs to the random 1/Nsubsample subsample.  The subsample
+///          is a hash of the original i.d., so the same particles are
+///          written in every snapshot.  Star particles are always written.
+///          The criteria are OR-combined.  Subsampled particles keep their
+///          original masses (and smoothing lengths and densities), so the
+///          mass of the subsample outside the region is 1/Nsubsample of the
+///          true mass; scale by Nsubsample when estimating totals from it.
+//=============================================================================
+template <int ndim>
+class OutputFilter
+{
+ public:
+
+  OutputFilter();
+
+  bool Active(void) const;
+  void ReadIdList(string);
+  int SelectParticles(int, SphParticle<ndim> *, SnapshotParticle<ndim> *);
+  bool Selected(const SphParticle<ndim> &) const;
+
+  filterregionenum region;          ///< Region written at full resolution
+  int Nsubsample;                   ///< Write 1 in Nsubsample other ptcls
+                                    ///< (0 : write no other particles)
+  FLOAT boxmin[ndim];               ///< Minimum extent of filter box
+  FLOAT boxmax[ndim];               ///< Maximum extent of filter box
+  FLOAT centre[ndim];               ///< Centre of filter sphere
+  FLOAT radius;                     ///< Radius of filter sphere
+  vector<int> idlist;               ///< Sorted i.d.s of ptcls always written
+
+};
+#endif
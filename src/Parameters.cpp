@@ -175,12 +175,37 @@ void Parameters::SetDefaultValues(void)
   stringparams["in_file"] = "";
   stringparams["in_file_form"] = "column";
   stringparams["out_file_form"] = "column";
+  stringparams["bin_compression"] = "none";
+  floatparams["bin_lossy_error"] = 1.0e-4;
+  intparams["bin_per_rank_files"] = 0;
+  stringparams["filter_region"] = "none";
+  floatparams["filter_boxmin[0]"] = 0.0;
+  floatparams["filter_boxmin[1]"] = 0.0;
+  floatparams["filter_boxmin[2]"] = 0.0;
+  floatparams["filter_boxmax[0]"] = 0.0;
+  floatparams["filter_boxmax[1]"] = 0.0;
+  floatparams["filter_boxmax[2]"] = 0.0;
+  floatparams["filter_centre[0]"] = 0.0;
+  floatparams["filter_centre[1]"] = 0.0;
+  floatparams["filter_centre[2]"] = 0.0;
+  floatparams["filter_radius"] = 0.0;
+  stringparams["filter_idfile"] = "";
+  intparams["filter_nsubsample"] = 0;
+  stringparams["analysis"] = "";
+  floatparams["dt_analysis"] = 0.0;
+  intparams["analysis_nbins"] = 64;
+  floatparams["analysis_rmin"] = 0.001;
+  floatparams["analysis_rmax"] = 1.0;
   floatparams["tend"] = 1.0;
   floatparams["dt_snap"] = 0.2;
   floatparams["tsnapfirst"] = 0.2;
   intparams["Nstepsmax"] = 9999999;
   intparams["noutputstep"] = 128;
   intparams["ndiagstep"] = 1024;
+  intparams["async_output"] = 0;
+  intparams["Noutputbuffer"] = 2;
+  intparams["restart"] = 0;
+  floatparams["dt_restart_wall"] = 0.0;
 
   // Unit and scaling parameters
   //---------------------------------------------------------------------------
@@ -290,6 +315,16 @@ void Parameters::SetDefaultValues(void)
   intparams["ntreebuildstep"] = 1;
   intparams["ntreestockstep"] = 1;
   floatparams["thetamaxsqd"] = 0.1;
+  intparams["Ngridlevelmax"] = 8;
+  intparams["implicit_periodic"] = 0;
+
+  // MPI parameters
+  //---------------------------------------------------------------------------
+  stringparams["mpi_decomposition"] = "kdtree";
+
+  // OpenMP thread placement parameters
+  //---------------------------------------------------------------------------
+  stringparams["thread_pinning"] = "none";
 
   // N-body parameters
   //---------------------------------------------------------------------------
@@ -385,6 +420,7 @@ void Parameters::SetDefaultValues(void)
 
   // Python parameters
   //---------------------------------------------------------------------------
+  stringparams["snapshot_fields"] = "all";
   floatparams["dt_python"] = 8.0;
 
   return;
@@ -555,6 +591,22 @@ void Parameters::CheckInvalidParameters(void)
       errorflag = true;
     }
     
+    // Implicit periodic wrapping only implemented for grid and tree searches
+    if (intparams["implicit_periodic"] == 1 &&
+        stringparams["neib_search"] == "bruteforce") {
+      cout << "Parameter error : Implicit periodic boundaries not available "
+           << "with bruteforce neighbour search";
+      errorflag = true;
+    }
+
+    // Gravity walks do not (yet) use minimum-image distances
+    if (intparams["implicit_periodic"] == 1 &&
+        intparams["self_gravity"] == 1) {
+      cout << "Parameter error : Cannot compute self-gravity with "
+           << "implicit periodic boundaries";
+      errorflag = true;
+    }
+
     // Saitoh & Makino (2012) currently deactivated while development of MPI 
     // and other related features are underway.
     if (stringparams["sim"] == "sph" && stringparams["sph"] == "sm2012") {
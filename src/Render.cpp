@@ -28,6 +28,8 @@
 #include <math.h>
 #include <cstdio>
 #include <cstring>
+#include <vector>
+#include <algorithm>
 #include "SphParticle.h"
 #include "Sph.h"
 #include "SphSnapshot.h"
@@ -40,6 +42,9 @@
 using namespace std;
 
 
+static const int Ntilepixels = 32;  // Width (and height) of screen tiles
+
+
 //=============================================================================
 //  RenderBase::RenderFactory
 /// Create new render object for simulation object depending on dimensionality.
@@ -113,18 +118,9 @@ int Render<ndim>::CreateColumnRenderingGrid
 {
   int arraycheck = 1;              // Verification flag
   int c;                           // Rendering grid cell counter
-  int i;                           // Particle counter
-  int j;                           // Aux. counter
   int idummy;                      // Dummy integer to verify valid arrays
   int Nsph = snap.Nsph;            // No. of SPH particles in snap
-  float dr[2];                     // Rel. position vector on grid plane
-  float drsqd;                     // Distance squared on grid plane
-  float drmag;                     // Distance
   float dummyfloat = 0.0;          // Dummy variable for function argument
-  float hrangesqd;                 // Kernel range squared
-  float invh;                      // 1/h
-  float wkern;                     // Kernel value
-  float wnorm;                     // Kernel normalisation value
   float *xvalues;                  // Pointer to 'x' array
   float *yvalues;                  // Pointer to 'y' array
   float *rendervalues;             // Pointer to rendered quantity array
@@ -132,7 +128,6 @@ int Render<ndim>::CreateColumnRenderingGrid
   float *rhovalues;                // Pointer to density array
   float *hvalues;                  // Pointer to smoothing length array
   float *rendernorm;               // Normalisation array
-  float *rgrid;                    // Grid positions
   string dummystring = "";         // Dummy string for function argument
 
   // Check x and y strings are actual co-ordinate strings
@@ -159,17 +154,6 @@ int Render<ndim>::CreateColumnRenderingGrid
 
   // Allocate temporary memory for creating render grid
   rendernorm = new float[Ngrid];
-  rgrid = new float[2*Ngrid];
-
-  // Create grid positions here (need to improve in the future)
-  c = 0;
-  for (j=iygrid-1; j>=0; j--) {
-    for (i=0; i<ixgrid; i++) {
-      rgrid[2*c] = xmin + ((float) i + 0.5f)*(xmax - xmin)/(float)ixgrid;
-      rgrid[2*c + 1] = ymin + ((float) j + 0.5f)*(ymax - ymin)/(float)iygrid;
-      c++;
-    }
-  }
 
   // Zero arrays before computing rendering
   for (c=0; c<Ngrid; c++) values[c] = (float) 0.0;
@@ -179,83 +163,25 @@ int Render<ndim>::CreateColumnRenderingGrid
   // Create rendered grid depending on dimensionality
   //===========================================================================
   if (ndim == 2) {
-
-    // Loop over all particles in snapshot
-    //------------------------------------------------------------------------
-#pragma omp parallel for default(none) private(c,dr,drmag,drsqd,hrangesqd) \
-  private(invh,i,wkern,wnorm) shared(hvalues,mvalues,Nsph,rhovalues,rgrid) \
-  shared(xvalues,yvalues,rendervalues,values,rendernorm,Ngrid)
-    for (i=0; i<Nsph; i++) {
-      invh = 1.0/hvalues[i];
-      wnorm = mvalues[i]/rhovalues[i]*pow(invh,ndim);
-      hrangesqd = sph->kerntab.kernrangesqd*hvalues[i]*hvalues[i];
-      
-      // Now loop over all pixels and add current particles
-      //-----------------------------------------------------------------------
-      for (c=0; c<Ngrid; c++) {
-    	dr[0] = rgrid[2*c] - xvalues[i];
-        dr[1] = rgrid[2*c + 1] - yvalues[i];
-        drsqd = dr[0]*dr[0] + dr[1]*dr[1];
-	
-        if (drsqd > hrangesqd) continue;
-	
-        drmag = sqrt(drsqd);
-        wkern = float(sph->kerntab.w0((FLOAT) (drmag*invh)));
-	
-#pragma omp atomic
-        values[c] += wnorm*rendervalues[i]*wkern;
-#pragma omp atomic
-        rendernorm[c] += wnorm*wkern;
-      }
-      //-----------------------------------------------------------------------
-      
-    }
-    //-------------------------------------------------------------------------
+    ScatterRenderGrid(ixgrid,iygrid,xmin,xmax,ymin,ymax,Nsph,xvalues,yvalues,
+                      NULL,0.0f,rendervalues,mvalues,rhovalues,hvalues,ndim,
+                      false,values,rendernorm);
 
     // Normalise all grid cells
     for (c=0; c<Ngrid; c++) {
       if (rendernorm[c] > 1.e-10) values[c] /= rendernorm[c];
     }
-
-
   }
   //===========================================================================
   else if (ndim == 3) {
-
-    // Loop over all particles in snapshot
-    //-------------------------------------------------------------------------
-    for (i=0; i<snap.Nsph; i++) {
-      invh = 1.0f/hvalues[i];
-      wnorm = mvalues[i]/rhovalues[i]*pow(invh,(ndim - 1));
-      hrangesqd = sph->kerntab.kernrangesqd*hvalues[i]*hvalues[i];
-      
-      // Now loop over all pixels and add current particles
-      //-----------------------------------------------------------------------
-      for (c=0; c<Ngrid; c++) {
-	
-    	dr[0] = rgrid[2*c] - xvalues[i];
-        dr[1] = rgrid[2*c + 1] - yvalues[i];
-        drsqd = dr[0]*dr[0] + dr[1]*dr[1];
-	
-        if (drsqd > hrangesqd) continue;
-	
-        drmag = sqrt(drsqd);
-        wkern = float(sph->kerntab.wLOS((FLOAT) (drmag*invh)));
-	
-        values[c] += wnorm*rendervalues[i]*wkern;
-        rendernorm[c] += wnorm*wkern;
-      }
-      //-----------------------------------------------------------------------
-
-    }
-    //-------------------------------------------------------------------------
-
+    ScatterRenderGrid(ixgrid,iygrid,xmin,xmax,ymin,ymax,Nsph,xvalues,yvalues,
+                      NULL,0.0f,rendervalues,mvalues,rhovalues,hvalues,ndim-1,
+                      true,values,rendernorm);
   }
   //===========================================================================
 
 
   // Free all locally allocated memory
-  delete[] rgrid;
   delete[] rendernorm;
 
   return 1;
@@ -288,18 +214,8 @@ int Render<ndim>::CreateSliceRenderingGrid
 {
   int arraycheck = 1;              // Verification flag
   int c;                           // Rendering grid cell counter
-  int i;                           // Particle counter
-  int j;                           // Aux. counter
   int idummy;                      // Dummy integer to verify correct array
-  float dr[3];                     // Rel. position vector on grid plane
-  float drsqd;                     // Distance squared on grid plane
-  float drmag;                     // Distance
   float dummyfloat = 0.0;          // Dummy float for function arguments
-  float hrangesqd;                 // Kernel range squared
-  float invh;                      // 1/h
-  float skern;                     // r/h
-  float wkern;                     // Kernel value
-  float wnorm;                     // Kernel normalisation value
   float *xvalues;                  // Pointer to 'x' array
   float *yvalues;                  // Pointer to 'y' array
   float *zvalues;                  // Pointer to 'z' array
@@ -308,7 +224,6 @@ int Render<ndim>::CreateSliceRenderingGrid
   float *rhovalues;                // Pointer to density array
   float *hvalues;                  // Pointer to smoothing length array
   float *rendernorm;               // Normalisation array
-  float *rgrid;                    // Grid positions
   string dummystring = "";         // Dummy string for function arguments
 
 
@@ -337,65 +252,257 @@ int Render<ndim>::CreateSliceRenderingGrid
   if (arraycheck == 0) return -1;
 
   rendernorm = new float[Ngrid];
-  rgrid = new float[2*Ngrid];
-
-  // Create grid positions here
-  c = 0;
-  for (j=iygrid-1; j>=0; j--) {
-    for (i=0; i<ixgrid; i++) {
-      rgrid[2*c] = xmin + ((float) i + 0.5f)*(xmax - xmin)/(float)ixgrid;
-      rgrid[2*c + 1] = ymin + ((float) j + 0.5f)*(ymax - ymin)/(float)iygrid;
-      c++;
-    }
-  }
 
   // Zero arrays before computing rendering
   for (c=0; c<Ngrid; c++) values[c] = 0.0f;
   for (c=0; c<Ngrid; c++) rendernorm[c] = 0.0f;
 
+  // Add all particles intersecting the slice to the grid
+  ScatterRenderGrid(ixgrid,iygrid,xmin,xmax,ymin,ymax,snap.Nsph,xvalues,
+                    yvalues,zvalues,zslice,rendervalues,mvalues,rhovalues,
+                    hvalues,ndim,false,values,rendernorm);
 
-  // Loop over all particles in snapshot
-  //---------------------------------------------------------------------------
-  for (i=0; i<snap.Nsph; i++) {
-    invh = 1.0/hvalues[i];
-    wnorm = mvalues[i]/rhovalues[i]*pow(invh,ndim);
-    hrangesqd = sph->kerntab.kernrangesqd*hvalues[i]*hvalues[i];
+  // Normalise all grid cells
+  for (c=0; c<Ngrid; c++)
+    if (rendernorm[c] > 1.e-10) values[c] /= rendernorm[c];
 
-    // Now loop over all pixels and add current particles
-    //-------------------------------------------------------------------------
-    for (c=0; c<Ngrid; c++) {
+  // Free all locally allocated memory
+  delete[] rendernorm;
 
-      dr[0] = rgrid[2*c] - xvalues[i];
-      dr[1] = rgrid[2*c + 1] - yvalues[i];
-      dr[2] = zslice - zvalues[i];
-      drsqd = dr[0]*dr[0] + dr[1]*dr[1] + dr[2]*dr[2];
-      
-      if (drsqd > hrangesqd) continue;
+  return 1;
+}
 
-      drmag = sqrt(drsqd);
-      skern = (FLOAT) (drmag*invh);
-      wkern = float(sph->kerntab.w0(skern));
 
-#pragma omp atomic
-      values[c] += wnorm*rendervalues[i]*wkern;
-#pragma omp atomic
-      rendernorm[c] += wnorm*wkern;
 
+//=============================================================================
+//  Render::ScatterRenderGrid
+/// Add the kernel-weighted contributions of all particles to the grid 
+/// values and normalisation, visiting only the pixels inside each 
+/// particle's kernel footprint.  Particles are first binned into square 
+/// screen tiles of Ntilepixels x Ntilepixels pixels (a particle overlapping 
+/// several tiles is binned in each), and each tile is then rendered by a 
+/// single thread, so no atomic updates of the grid are required.  Pixel c 
+/// of column i and row j (counted from ymin) is c = (iygrid-1-j)*ixgrid + i.
+/// If zvalues is not NULL, the distance to the slice z = zslice is included.
+/// If los is true, the line-of-sight integrated kernel is used, and 
+/// particles whose kernel radius is smaller than a pixel are averaged over 
+/// the pixel area instead of being sampled at pixel centres (where they 
+/// would be missed or aliased).  Their fraction in each pixel is the product
+/// of the tabulated cumulative x- and y-marginals of the projected kernel
+/// (wLOScumulative), which conserves their integrated column exactly.
+//=============================================================================
+template <int ndim>
+void Render<ndim>::ScatterRenderGrid
+(int ixgrid,                       ///< [in] No. of x-grid spacings
+ int iygrid,                       ///< [in] No. of y-grid spacings
+ float xmin,                       ///< [in] Minimum x-extent
+ float xmax,                       ///< [in] Maximum x-extent
+ float ymin,                       ///< [in] Minimum y-extent
+ float ymax,                       ///< [in] Maximum y-extent
+ int Nsph,                         ///< [in] No. of SPH particles
+ float *xvalues,                   ///< [in] 'x' positions
+ float *yvalues,                   ///< [in] 'y' positions
+ float *zvalues,                   ///< [in] 'z' positions (or NULL)
+ float zslice,                     ///< [in] z-position of slice
+ float *rendervalues,              ///< [in] Rendered quantity
+ float *mvalues,                   ///< [in] Masses
+ float *rhovalues,                 ///< [in] Densities
+ float *hvalues,                   ///< [in] Smoothing lengths
+ int normdim,                      ///< [in] Power of 1/h in normalisation
+ bool los,                         ///< [in] Use line-of-sight kernel?
+ float *values,                    ///< [inout] Rendered values
+ float *rendernorm)                ///< [inout] Normalisation values
+{
+  int c;                           // Rendering grid cell counter
+  int i;                           // Particle counter
+  int itile;                       // Tile counter
+  int ix;                          // x-pixel counter
+  int iy;                          // y-pixel counter
+  int Ntile;                       // Total no. of tiles
+  int Ntilex = (ixgrid + Ntilepixels - 1)/Ntilepixels;  // No. of x-tiles
+  int Ntiley = (iygrid + Ntilepixels - 1)/Ntilepixels;  // No. of y-tiles
+  int tx;                          // x-tile counter
+  int ty;                          // y-tile counter
+  float dx = (xmax - xmin)/(float) ixgrid;   // Pixel width
+  float dy = (ymax - ymin)/(float) iygrid;   // Pixel height
+  float kernrange = sph->kerntab.kernrange;        // Kernel range
+  float kernrangesqd = sph->kerntab.kernrangesqd;  // Kernel range squared
+  float pixelsize = min(dx,dy);    // Smallest pixel dimension
+  vector<int> footprint(4*max(Nsph,1));  // Pixel range of each particle
+  vector<char> subpixel(max(Nsph,1),0);  // Area-average particle?
+  vector<float> xgrid(max(ixgrid,1));    // x-positions of pixel centres
+  vector<float> ygrid(max(iygrid,1));    // y-positions of pixel centres
+  vector<int> tilestart;           // First entry of each tile in tilelist
+  vector<int> tilefill;            // Current no. of entries of each tile
+  vector<int> tilelist;            // Ids of particles binned in each tile
+
+  debug2("[Render::ScatterRenderGrid]");
+
+  if (ixgrid <= 0 || iygrid <= 0 || dx <= 0.0f || dy <= 0.0f) return;
+  Ntile = Ntilex*Ntiley;
+
+  // Pixel centre positions
+  for (ix=0; ix<ixgrid; ix++)
+    xgrid[ix] = xmin + ((float) ix + 0.5f)*(xmax - xmin)/(float)ixgrid;
+  for (iy=0; iy<iygrid; iy++)
+    ygrid[iy] = ymin + ((float) iy + 0.5f)*(ymax - ymin)/(float)iygrid;
+
+
+  // Find the range of pixels covered by the kernel of each particle 
+  // (empty ranges have ix(min) > ix(max))
+  //---------------------------------------------------------------------------
+#pragma omp parallel for default(none) private(i) \
+  shared(dx,dy,footprint,hvalues,ixgrid,iygrid,kernrange,kernrangesqd,los) \
+  shared(Nsph,pixelsize,subpixel,xmin,xvalues,ymin,yvalues,zvalues,zslice)
+  for (i=0; i<Nsph; i++) {
+    double dz = (zvalues == NULL ? 0.0 : zslice - zvalues[i]);
+    double rangesqd = kernrangesqd*hvalues[i]*hvalues[i] - dz*dz;
+    double range;
+    double xpix[2];
+    double ypix[2];
+    if (rangesqd <= 0.0) {
+      footprint[4*i] = 0;  footprint[4*i + 1] = -1;
+      footprint[4*i + 2] = 0;  footprint[4*i + 3] = -1;
+      continue;
+    }
+    range = sqrt(rangesqd);
+
+    // Sub-pixel particles cover all pixels their kernel overlaps; others
+    // all pixels whose centres lie inside the kernel
+    if (los && kernrange*hvalues[i] < pixelsize) {
+      subpixel[i] = 1;
+      xpix[0] = floor((xvalues[i] - range - xmin)/dx);
+      xpix[1] = floor((xvalues[i] + range - xmin)/dx);
+      ypix[0] = floor((yvalues[i] - range - ymin)/dy);
+      ypix[1] = floor((yvalues[i] + range - ymin)/dy);
+    }
+    else {
+      xpix[0] = floor((xvalues[i] - range - xmin)/dx - 0.5);
+      xpix[1] = ceil((xvalues[i] + range - xmin)/dx - 0.5);
+      ypix[0] = floor((yvalues[i] - range - ymin)/dy - 0.5);
+      ypix[1] = ceil((yvalues[i] + range - ymin)/dy - 0.5);
     }
-    //-------------------------------------------------------------------------
+    footprint[4*i] = (int) max(min(xpix[0],(double) ixgrid),0.0);
+    footprint[4*i + 1] = (int) max(min(xpix[1],(double) ixgrid - 1),-1.0);
+    footprint[4*i + 2] = (int) max(min(ypix[0],(double) iygrid),0.0);
+    footprint[4*i + 3] = (int) max(min(ypix[1],(double) iygrid - 1),-1.0);
+  }
+
 
+  // Bin particles into all tiles overlapped by their footprints (counting 
+  // sort, so the particles of each tile stay in their original order)
+  //---------------------------------------------------------------------------
+  tilestart.assign(Ntile + 1,0);
+  tilefill.assign(Ntile,0);
+  for (i=0; i<Nsph; i++) {
+    if (footprint[4*i] > footprint[4*i + 1] || 
+        footprint[4*i + 2] > footprint[4*i + 3]) continue;
+    for (ty=footprint[4*i + 2]/Ntilepixels; 
+         ty<=footprint[4*i + 3]/Ntilepixels; ty++)
+      for (tx=footprint[4*i]/Ntilepixels; 
+           tx<=footprint[4*i + 1]/Ntilepixels; tx++)
+        tilestart[Ntilex*ty + tx + 1]++;
+  }
+  for (itile=0; itile<Ntile; itile++) tilestart[itile+1] += tilestart[itile];
+  tilelist.resize(max(tilestart[Ntile],1));
+  for (i=0; i<Nsph; i++) {
+    if (footprint[4*i] > footprint[4*i + 1] || 
+        footprint[4*i + 2] > footprint[4*i + 3]) continue;
+    for (ty=footprint[4*i + 2]/Ntilepixels; 
+         ty<=footprint[4*i + 3]/Ntilepixels; ty++) {
+      for (tx=footprint[4*i]/Ntilepixels; 
+           tx<=footprint[4*i + 1]/Ntilepixels; tx++) {
+        itile = Ntilex*ty + tx;
+        tilelist[tilestart[itile] + tilefill[itile]++] = i;
+      }
+    }
   }
+
+
+  // Render all tiles in parallel; each tile (and hence pixel) is only 
+  // written by the thread rendering it
   //---------------------------------------------------------------------------
+#pragma omp parallel for schedule(dynamic) default(none) \
+  private(c,i,itile,ix,iy,tx,ty) \
+  shared(dx,dy,footprint,hvalues,ixgrid,iygrid,kernrangesqd,los,mvalues) \
+  shared(normdim,Ntile,Ntilex,rendernorm,rendervalues,rhovalues,subpixel) \
+  shared(tilelist,tilestart,values,xgrid,xmin,xvalues,ygrid,ymin,yvalues) \
+  shared(zslice,zvalues)
+  for (itile=0; itile<Ntile; itile++) {
+    int j;                         // Tile particle counter
+    int ixmin, ixmax;              // x-pixel range of particle in tile
+    int iymin, iymax;              // y-pixel range of particle in tile
+    float dr[3];                   // Rel. position of pixel
+    float fx;                      // Fraction of kernel in pixel column
+    float fy;                      // Fraction of kernel in pixel row
+    float drsqd;                   // Distance squared
+    float hrangesqd;               // Kernel range squared
+    float invh;                    // 1/h
+    float wkern;                   // Kernel value
+    float wnorm;                   // Kernel normalisation value
+
+    tx = itile%Ntilex;
+    ty = itile/Ntilex;
+
+    for (j=tilestart[itile]; j<tilestart[itile+1]; j++) {
+      i = tilelist[j];
+      invh = 1.0f/hvalues[i];
+      wnorm = mvalues[i]/rhovalues[i]*pow(invh,normdim);
+      hrangesqd = kernrangesqd*hvalues[i]*hvalues[i];
+      dr[2] = (zvalues == NULL ? 0.0f : zslice - zvalues[i]);
+      ixmin = max(footprint[4*i],Ntilepixels*tx);
+      ixmax = min(footprint[4*i + 1],Ntilepixels*(tx + 1) - 1);
+      iymin = max(footprint[4*i + 2],Ntilepixels*ty);
+      iymax = min(footprint[4*i + 3],Ntilepixels*(ty + 1) - 1);
+
+      // Average particles smaller than a pixel over the pixel area
+      //-----------------------------------------------------------------------
+      if (subpixel[i]) {
+        wnorm = mvalues[i]/rhovalues[i]/(dx*dy);
+        for (iy=iymin; iy<=iymax; iy++) {
+          fy = sph->kerntab.wLOScumulative
+            ((ymin + (float) (iy + 1)*dy - yvalues[i])*invh) -
+            sph->kerntab.wLOScumulative
+            ((ymin + (float) iy*dy - yvalues[i])*invh);
+          c = (iygrid - 1 - iy)*ixgrid;
+          for (ix=ixmin; ix<=ixmax; ix++) {
+            fx = sph->kerntab.wLOScumulative
+              ((xmin + (float) (ix + 1)*dx - xvalues[i])*invh) -
+              sph->kerntab.wLOScumulative
+              ((xmin + (float) ix*dx - xvalues[i])*invh);
+            values[c + ix] += wnorm*rendervalues[i]*fx*fy;
+            rendernorm[c + ix] += wnorm*fx*fy;
+          }
+        }
+        continue;
+      }
 
-  // Normalise all grid cells
-  for (c=0; c<Ngrid; c++)
-    if (rendernorm[c] > 1.e-10) values[c] /= rendernorm[c];
+      // Loop over all pixels of the tile inside the particle's footprint
+      //-----------------------------------------------------------------------
+      for (iy=iymin; iy<=iymax; iy++) {
+        dr[1] = ygrid[iy] - yvalues[i];
+        c = (iygrid - 1 - iy)*ixgrid;
+        for (ix=ixmin; ix<=ixmax; ix++) {
+          dr[0] = xgrid[ix] - xvalues[i];
+          drsqd = dr[0]*dr[0] + dr[1]*dr[1] + dr[2]*dr[2];
+          if (drsqd > hrangesqd) continue;
+
+          if (los) 
+            wkern = float(sph->kerntab.wLOS_s2((FLOAT) (drsqd*invh*invh)));
+          else
+            wkern = float(sph->kerntab.w0((FLOAT) (sqrt(drsqd)*invh)));
+
+          values[c + ix] += wnorm*rendervalues[i]*wkern;
+          rendernorm[c + ix] += wnorm*wkern;
+        }
+      }
+      //-----------------------------------------------------------------------
 
-  // Free all locally allocated memory
-  delete[] rgrid;
-  delete[] rendernorm;
+    }
+  }
+  //---------------------------------------------------------------------------
 
-  return 1;
+  return;
 }
 
 
@@ -31,6 +31,7 @@
 #include <sstream>
 #include <string>
 #include <math.h>
+#include <vector>
 #include "SphParticle.h"
 #include "Sph.h"
 #include "SphSnapshot.h"
@@ -101,5 +102,11 @@ class Render : public RenderBase
   Sph<ndim>* sph;                  ///< Pointer to SPH object to be rendered
 
 
+ private:
+
+  void ScatterRenderGrid(int, int, float, float, float, float, int, float *,
+                         float *, float *, float, float *, float *, float *,
+                         float *, int, bool, float *, float *);
+
 };
 #endif
@@ -251,3 +251,62 @@ void Simulation<ndim>::OutputDiagnostics(void)
 
   return;
 }
+
+
+
+//=============================================================================
+//  Simulation::AddInSituAnalysis
+/// Register an in-situ analysis with the simulation, which then owns (and
+/// finally deletes) the analysis object.  Its time-series file is opened 
+/// later, once it is known whether the run starts from a restart file.
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::AddInSituAnalysis
+(InSituAnalysis<ndim> *analysis)    ///< [in] New in-situ analysis object
+{
+  debug2("[Simulation::AddInSituAnalysis]");
+
+  analyses.push_back(analysis);
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::OpenInSituAnalysisFiles
+/// Start new time-series files for all in-situ analyses (i.e. for runs not 
+/// started from a restart file).
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::OpenInSituAnalysisFiles(void)
+{
+  debug2("[Simulation::OpenInSituAnalysisFiles]");
+
+  for (unsigned int i=0; i<analyses.size(); i++)
+    analyses[i]->OpenFile(this,-1);
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::RunInSituAnalysis
+/// Evaluate all in-situ analyses if the next analysis time has been reached
+/// (or every step if dt_analysis is zero).
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::RunInSituAnalysis(void)
+{
+  debug2("[Simulation::RunInSituAnalysis]");
+
+  if (analyses.empty() || t < tanalysisnext) return;
+
+  for (unsigned int i=0; i<analyses.size(); i++) analyses[i]->Analyse(this);
+
+  if (dt_analysis > 0.0)
+    while (tanalysisnext <= t) tanalysisnext += dt_analysis;
+
+  return;
+}
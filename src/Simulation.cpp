@@ -42,6 +42,7 @@
 #include "SimulationIC.hpp"
 #include "SimAnalysis.hpp"
 #include "SphSnapshot.h"
+#include "ThreadAffinity.h"
 using namespace std;
 
 
@@ -128,6 +129,13 @@ SimulationBase::SimulationBase
   rank = 0;
   t = 0.0;
   timestep = 0.0;
+  dt_restart_wall = 0.0;
+  bin_compression = "none";
+  bin_lossy_error = 0.0;
+  bin_per_rank_files = 0;
+  dt_analysis = 0.0;
+  tanalysisnext = 0.0;
+  twall_restart = time(NULL);
   setup = false;
   initial_h_provided = false;
   ParametersProcessed = false;
@@ -157,6 +165,20 @@ SimulationBase::~SimulationBase()
 
 
 
+//=============================================================================
+//  Simulation::~Simulation
+/// Simulation destructor.  Writes any pending snapshots and stops the
+/// background snapshot writer, and closes all in-situ analysis files.
+//=============================================================================
+template <int ndim>
+Simulation<ndim>::~Simulation()
+{
+  if (snapwriter != NULL) delete snapwriter;
+  for (unsigned int i=0; i<analyses.size(); i++) delete analyses[i];
+}
+
+
+
 //=============================================================================
 //  SimulationBase::SplashScreen
 /// Write splash screen to standard output.
@@ -295,10 +317,30 @@ void SimulationBase::Run
 
     MainLoop();
     Output();
+    RunInSituAnalysis();
+    Checkpoint();
 
   }
   //---------------------------------------------------------------------------
 
+  // Leave a final restart file so the run can be extended later.  Restarted
+  // runs start with a tree rebuild, so unless the next step rebuilds the
+  // tree anyway (see Checkpoint) they only agree to round-off with an
+  // uninterrupted run.
+  if (dt_restart_wall > 0.0) {
+    if (rank == 0) {
+      cout << "Writing restart file : " << RestartFilename() << endl;
+      if ((Nsteps + 1)%ntreebuildstep != 0)
+        cout << "Warning: final restart file is not followed by a tree "
+             << "rebuild step, so a restarted run will not be bit-identical"
+             << endl;
+    }
+    WriteRestartFile(RestartFilename());
+  }
+
+  // Wait for all snapshots still being written in the background
+  FlushSnapshotFiles();
+
   CalculateDiagnostics();
   OutputDiagnostics();
   UpdateDiagnostics();
@@ -343,11 +385,14 @@ list<SphSnapshotBase*> SimulationBase::InteractiveRun
 	  
     // Call output routine
     filename=Output();
+    RunInSituAnalysis();
+    Checkpoint();
 	  
     // If we have written a snapshot, create a new snapshot object
     if (filename.length() != 0) {
       SphSnapshotBase* snapshot =
         SphSnapshotBase::SphSnapshotFactory(filename, this, ndims);
+      snapshot->SetRequestedFields(simparams->stringparams["snapshot_fields"]);
       snapshot->CopyDataFromSimulation();
       snap_list.push_back(snapshot);
     }
@@ -365,6 +410,9 @@ list<SphSnapshotBase*> SimulationBase::InteractiveRun
     UpdateDiagnostics();
   }
 
+  // Make sure all snapshot files exist before returning to Python
+  FlushSnapshotFiles();
+
   return snap_list;
 }
 
@@ -397,7 +445,7 @@ string SimulationBase::Output(void)
     nostring = ss.str();
     filename = run_id + '.' + out_file_form + '.' + nostring;
     ss.str(std::string());
-    WriteSnapshotFile(filename,out_file_form);
+    QueueSnapshotFile(filename,out_file_form);
   }
 
   // Output diagnostics to screen if passed sufficient number of block steps
@@ -411,6 +459,39 @@ string SimulationBase::Output(void)
 
 
 
+//=============================================================================
+//  SimulationBase::Checkpoint
+/// Write a restart file if the selected wall-clock interval has elapsed.
+/// Called at the end of a step (after any in-situ analysis), and only when 
+/// the next step rebuilds the tree and ghosts anyway, since restarted runs 
+/// always start with a rebuild.  Writing a restart file therefore never 
+/// changes the continuing run.
+//=============================================================================
+void SimulationBase::Checkpoint(void)
+{
+  debug2("[SimulationBase::Checkpoint]");
+
+  int write;                        // Flag if restart file is written now
+
+  if (dt_restart_wall <= 0.0 || (Nsteps + 1)%ntreebuildstep != 0) return;
+
+  // All MPI processes must write their restart file at the same step
+  write = (difftime(time(NULL),twall_restart) >= dt_restart_wall) ? 1 : 0;
+#ifdef MPI_PARALLEL
+  MPI_Bcast(&write,1,MPI_INT,0,MPI_COMM_WORLD);
+#endif
+  if (write == 0) return;
+
+  if (rank == 0)
+    cout << "Writing restart file : " << RestartFilename() << endl;
+  WriteRestartFile(RestartFilename());
+  twall_restart = time(NULL);
+
+  return;
+}
+
+
+
 //=============================================================================
 //  SimulationBase::SetupSimulation
 /// Main function for setting up a new SPH simulation.
@@ -441,6 +522,24 @@ void SimulationBase::SetupSimulation(void)
     ProcessParameters();
   }
 
+  // If restarting, resume from the last restart file instead of generating
+  // new initial conditions.  Fall back to a fresh start if none exists yet.
+  // ReadRestartFile restores or rebuilds all state otherwise set up by
+  // PostInitialConditionsSetup (see there).
+  //---------------------------------------------------------------------------
+  if (simparams->intparams["restart"] == 1) {
+    if (ReadRestartFile(RestartFilename())) {
+      if (rank == 0) cout << "Restarting from " << RestartFilename()
+                          << " at t : " << t*simunits.t.outscale << " "
+                          << simunits.t.outunit << endl;
+      twall_restart = time(NULL);
+      setup = true;
+      return;
+    }
+    else if (rank == 0)
+      cout << "No restart file found; starting from initial conditions" << endl;
+  }
+
   // Generate initial conditions for simulation on root process (for MPI jobs)
   //---------------------------------------------------------------------------
   if (rank == 0) {
@@ -455,13 +554,35 @@ void SimulationBase::SetupSimulation(void)
   // Call a messy function that does all the rest of the initialisation
   PostInitialConditionsSetup();
 
+  // Only now start new in-situ analysis files; restarted runs instead
+  // re-open them (discarding any newer records) in ReadRestartFile.
+  OpenInSituAnalysisFiles();
+
   Output();
+  RunInSituAnalysis();
+  twall_restart = time(NULL);
 
   return;
 }
 
 
 
+//=============================================================================
+//  SimulationBase::RestartFilename
+/// Name of the restart file of this run.  Each MPI process writes its own
+/// restart file, named as the pieces of binary snapshots.
+//=============================================================================
+string SimulationBase::RestartFilename(void)
+{
+#ifdef MPI_PARALLEL
+  return BinarySnapshotIndex::PieceFilename(run_id + ".restart",rank);
+#else
+  return run_id + ".restart";
+#endif
+}
+
+
+
 //=============================================================================
 //  Simulation::ProcessParameters
 /// Process all the options chosen in the parameters file, setting various 
@@ -483,8 +604,21 @@ void Simulation<ndim>::ProcessParameters(void)
 #ifdef MPI_PARALLEL
   rank = mpicontrol.rank;
   Nmpi = mpicontrol.Nmpi;
+  mpicontrol.decomposition = stringparams["mpi_decomposition"];
+  if (mpicontrol.decomposition != "kdtree" &&
+      mpicontrol.decomposition != "hilbert") {
+    string message = "Unrecognised parameter : mpi_decomposition = "
+      + mpicontrol.decomposition;
+    ExceptionHandler::getIstance().raise(message);
+  }
 #endif
 
+  // Pin OpenMP threads (if requested) before any particle memory is first
+  // touched, and report the processor topology used by each process
+  PinThreads(stringparams["thread_pinning"]);
+  if (stringparams["thread_pinning"] != "none")
+    PrintThreadTopology(rank,stringparams["thread_pinning"]);
+
 
   // Sanity check for valid dimensionality
   if (ndim < 1 || ndim > 3) {
@@ -539,7 +673,7 @@ void Simulation<ndim>::ProcessParameters(void)
     if (stringparams["neib_search"] == "bruteforce")
       sphneib = new BruteForceSearch<ndim>;
     else if (stringparams["neib_search"] == "grid")
-      sphneib = new GridSearch<ndim>;
+      sphneib = new GridSearch<ndim>(intparams["Ngridlevelmax"]);
     else if (stringparams["neib_search"] == "tree") {
       sphneib = new BinaryTree<ndim>(intparams["Nleafmax"],
 				     floatparams["thetamaxsqd"],
@@ -593,15 +727,53 @@ void Simulation<ndim>::ProcessParameters(void)
   simbox.z_boundary_lhs = stringparams["z_boundary_lhs"];
   simbox.z_boundary_rhs = stringparams["z_boundary_rhs"];
   simbox.boxmin[0] = floatparams["boxmin[0]"]/simunits.r.outscale;
-  simbox.boxmin[1] = floatparams["boxmin[1]"]/simunits.r.outscale;
-  simbox.boxmin[2] = floatparams["boxmin[2]"]/simunits.r.outscale;
   simbox.boxmax[0] = floatparams["boxmax[0]"]/simunits.r.outscale;
-  simbox.boxmax[1] = floatparams["boxmax[1]"]/simunits.r.outscale;
-  simbox.boxmax[2] = floatparams["boxmax[2]"]/simunits.r.outscale;
-  for (int k=0; k<3; k++) {
+  if (ndim > 1) {
+    simbox.boxmin[1] = floatparams["boxmin[1]"]/simunits.r.outscale;
+    simbox.boxmax[1] = floatparams["boxmax[1]"]/simunits.r.outscale;
+  }
+  if (ndim > 2) {
+    simbox.boxmin[2] = floatparams["boxmin[2]"]/simunits.r.outscale;
+    simbox.boxmax[2] = floatparams["boxmax[2]"]/simunits.r.outscale;
+  }
+  for (int k=0; k<ndim; k++) {
     simbox.boxsize[k] = simbox.boxmax[k] - simbox.boxmin[k];
     simbox.boxhalf[k] = 0.5*simbox.boxsize[k];
   }
+
+  // Periodic dimensions can optionally be wrapped directly by the neighbour 
+  // search (using minimum-image distances) instead of creating ghosts.
+  // Mirror (and mixed) boundaries still use ghost particles.
+  simbox.implicit_periodic = false;
+  for (int k=0; k<ndim; k++) simbox.periodic_wrap[k] = false;
+  if (intparams["implicit_periodic"] == 1) {
+#if defined MPI_PARALLEL
+    string message = "Implicit periodic boundaries not available with MPI";
+    ExceptionHandler::getIstance().raise(message);
+#endif
+    string lhs[3] = {simbox.x_boundary_lhs, simbox.y_boundary_lhs,
+                     simbox.z_boundary_lhs};
+    string rhs[3] = {simbox.x_boundary_rhs, simbox.y_boundary_rhs,
+                     simbox.z_boundary_rhs};
+    for (int k=0; k<ndim; k++) {
+      if (BoundaryType(lhs[k]) == periodicboundary &&
+          BoundaryType(rhs[k]) == periodicboundary) {
+        simbox.periodic_wrap[k] = true;
+        simbox.implicit_periodic = true;
+      }
+    }
+
+    // Only dimensions with ghost boundaries need space for ghosts
+    if (sim == "sph" || sim == "godunov_sph") {
+      sph->Nghostdim = 0;
+      for (int k=0; k<ndim; k++) {
+        if (!simbox.periodic_wrap[k] &&
+            (BoundaryType(lhs[k]) != openboundary ||
+             BoundaryType(rhs[k]) != openboundary)) sph->Nghostdim++;
+      }
+    }
+  }
+
   if (sim == "sph" || sim == "godunov_sph") sphneib->box = &simbox;
   if (IsAnyBoundarySpecial(simbox))
     LocalGhosts = new PeriodicGhosts<ndim>();
@@ -609,6 +781,26 @@ void Simulation<ndim>::ProcessParameters(void)
     LocalGhosts = new NullGhosts<ndim>();
 #ifdef MPI_PARALLEL
   MpiGhosts = new MPIGhosts<ndim>(&mpicontrol);
+
+  // Only the tree overlaps MPI ghost updates with the force computation.
+  // This requires MPI_THREAD_FUNNELED support, since the update is then
+  // progressed from inside OpenMP parallel regions; otherwise the MPI ghosts
+  // are updated with the blocking exchange.
+  int mpi_thread_provided;
+  MPI_Query_thread(&mpi_thread_provided);
+  if (sim == "sph" || sim == "godunov_sph")
+    sphneib->mpighosts = (stringparams["neib_search"] == "tree" &&
+                          mpi_thread_provided >= MPI_THREAD_FUNNELED ?
+                          MpiGhosts : NULL);
+
+  // Gravity due to other nodes requires their locally essential trees
+  if ((sim == "sph" || sim == "godunov_sph") && intparams["self_gravity"] == 1) {
+    if (stringparams["neib_search"] != "tree") {
+      string message = "Self-gravity with MPI requires neib_search = tree";
+      ExceptionHandler::getIstance().raise(message);
+    }
+    mpicontrol.SetGravityTree(static_cast<BinaryTree<ndim>* > (sphneib));
+  }
 #endif
 
 
@@ -633,7 +825,12 @@ void Simulation<ndim>::ProcessParameters(void)
 
 
   // Set other important simulation variables
+  bin_compression       = stringparams["bin_compression"];
+  bin_lossy_error       = floatparams["bin_lossy_error"];
+  bin_per_rank_files    = intparams["bin_per_rank_files"];
+  dt_analysis           = floatparams["dt_analysis"]/simunits.t.outscale;
   dt_python             = floatparams["dt_python"];
+  dt_restart_wall       = floatparams["dt_restart_wall"];
   dt_snap               = floatparams["dt_snap"]/simunits.t.outscale;
   level_diff_max        = intparams["level_diff_max"];
   Nlevels               = intparams["Nlevels"];
@@ -649,6 +846,90 @@ void Simulation<ndim>::ProcessParameters(void)
   tsnapnext             = floatparams["tsnapfirst"]/simunits.t.outscale;
 
 
+  if (bin_compression != "none" && bin_compression != "lossless" &&
+      bin_compression != "lossy") {
+    string msg = "Error: unrecognised bin_compression : " + bin_compression;
+    ExceptionHandler::getIstance().raise(msg);
+  }
+
+
+  // Output filter for filtered snapshot file formats
+  //---------------------------------------------------------------------------
+  if (stringparams["filter_region"] == "box")
+    outfilter.region = boxfilterregion;
+  else if (stringparams["filter_region"] == "sphere")
+    outfilter.region = spherefilterregion;
+  else if (stringparams["filter_region"] == "none")
+    outfilter.region = nofilterregion;
+  else {
+    string msg = "Error: unrecognised filter_region : " +
+      stringparams["filter_region"];
+    ExceptionHandler::getIstance().raise(msg);
+  }
+  for (int k=0; k<ndim; k++) {
+    stringstream ss;
+    ss << "[" << k << "]";
+    outfilter.boxmin[k] =
+      floatparams["filter_boxmin" + ss.str()]/simunits.r.outscale;
+    outfilter.boxmax[k] =
+      floatparams["filter_boxmax" + ss.str()]/simunits.r.outscale;
+    outfilter.centre[k] =
+      floatparams["filter_centre" + ss.str()]/simunits.r.outscale;
+  }
+  outfilter.radius = floatparams["filter_radius"]/simunits.r.outscale;
+  outfilter.Nsubsample = intparams["filter_nsubsample"];
+  if (stringparams["filter_idfile"] != "")
+    outfilter.ReadIdList(stringparams["filter_idfile"]);
+
+  if (FilteredFileForm(out_file_form)) {
+#ifdef MPI_PARALLEL
+    string msg = "Error: filtered snapshots are not supported for MPI runs";
+    ExceptionHandler::getIstance().raise(msg);
+#endif
+    if (!outfilter.Active()) {
+      string msg = "Error: " + out_file_form + " output requires "
+        "filter_region, filter_idfile or filter_nsubsample";
+      ExceptionHandler::getIstance().raise(msg);
+    }
+  }
+
+
+  // In-situ analyses (comma-separated list of names), each written to the
+  // time-series file run_id.<name>.dat
+  //---------------------------------------------------------------------------
+  stringstream analysislist(stringparams["analysis"]);
+  string analysisname;
+  while (getline(analysislist,analysisname,',')) {
+    string filename = run_id + "." + analysisname + ".dat";
+    if (analysisname == "")
+      continue;
+    else if (analysisname == "lagrangian_radii")
+      AddInSituAnalysis(new LagrangianRadiiAnalysis<ndim>(filename));
+    else if (analysisname == "density_pdf")
+      AddInSituAnalysis(new DensityPdfAnalysis<ndim>
+                        (filename,intparams["analysis_nbins"]));
+    else if (analysisname == "radial_profile")
+      AddInSituAnalysis(new RadialProfileAnalysis<ndim>
+                        (filename,intparams["analysis_nbins"],
+                         floatparams["analysis_rmin"]/simunits.r.outscale,
+                         floatparams["analysis_rmax"]/simunits.r.outscale));
+    else if (analysisname == "sink_history")
+      AddInSituAnalysis(new SinkHistoryAnalysis<ndim>(filename));
+    else {
+      string msg = "Error: unrecognised in-situ analysis : " + analysisname;
+      ExceptionHandler::getIstance().raise(msg);
+    }
+  }
+
+
+  // Start background snapshot writer.  Not used for MPI runs, where all
+  // processes write snapshots collectively from the main thread.
+#ifndef MPI_PARALLEL
+  if (intparams["async_output"] == 1)
+    snapwriter = new SnapshotWriter<ndim>(this,intparams["Noutputbuffer"]);
+#endif
+
+
   // Flag that we've processed all parameters already
   ParametersProcessed = true;
 
@@ -1657,3 +1938,9 @@ void Simulation<ndim>::UpdateDiagnostics ()
     cout << "Eerror : " << diag.Eerror << endl;
   }
 }
+
+
+
+template class Simulation<1>;
+template class Simulation<2>;
+template class Simulation<3>;
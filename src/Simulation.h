@@ -34,6 +34,7 @@
 #include <map>
 #include <string>
 #include <list>
+#include <ctime>
 #include "Diagnostics.h"
 #include "DomainBox.h"
 #include "Precision.h"
@@ -49,6 +50,10 @@
 #include "Ghosts.h"
 #include "Sinks.h"
 #include "HeaderInfo.h"
+#include "InSituAnalysis.h"
+#include "BinarySnapshot.h"
+#include "OutputFilter.h"
+#include "SnapshotWriter.h"
 using namespace std;
 #ifdef MPI_PARALLEL
 #include "mpi.h"
@@ -79,6 +84,17 @@ class SimulationBase
   virtual void ReadSerenFormHeaderFile(ifstream& infile, HeaderInfo& info)=0;
   virtual bool ReadSerenFormSnapshotFile(string)=0;
   virtual bool WriteSerenFormSnapshotFile(string)=0;
+  virtual void ReadBinaryHeaderFile(ifstream& infile, HeaderInfo& info,
+                                    string filename)=0;
+  virtual bool ReadBinarySnapshotFile(string)=0;
+  virtual bool WriteBinarySnapshotFile(string)=0;
+  virtual bool WriteFilteredSnapshotFile(string, string)=0;
+  virtual bool ReadRestartFile(string)=0;
+  virtual bool WriteRestartFile(string)=0;
+  virtual bool QueueSnapshotFile(string,string)=0;
+  virtual void FlushSnapshotFiles(void)=0;
+  virtual void OpenInSituAnalysisFiles(void)=0;
+  virtual void RunInSituAnalysis(void)=0;
 
   std::list<string> keys;
 
@@ -89,12 +105,14 @@ class SimulationBase
   // Constructor and Destructor
   //---------------------------------------------------------------------------
   SimulationBase(Parameters* params);
-  ~SimulationBase();
+  virtual ~SimulationBase();
   
   // Subroutine prototypes
   //---------------------------------------------------------------------------
   string GetParam(string key);
   string Output(void);
+  void Checkpoint(void);
+  string RestartFilename(void);
   void SetParam(string key, string value);
   void SetParam(string key, int value);
   void SetParam(string ket, float value);
@@ -140,6 +158,7 @@ class SimulationBase
   int nresync;                      ///< Integer time for resynchronisation
   int ntreebuildstep;               ///< Integer time between rebuilding tree
   int ntreestockstep;               ///< Integer time between restocking tree
+  int bin_per_rank_files;           ///< Write one binary file per process
   int Nblocksteps;                  ///< No. of full block timestep steps
   int Nsteps;                       ///< Total no. of steps in simulation
   int Nstepsmax;                    ///< Max. allowed no. of steps
@@ -150,17 +169,23 @@ class SimulationBase
   int rank;                         ///< Process i.d. (for MPI simulations)
   int sink_particles;               ///< Switch on sink particles
   int sph_single_timestep;          ///< Flag if SPH ptcls use same step
+  DOUBLE bin_lossy_error;           ///< Rel. error of lossy binary fields
+  DOUBLE dt_analysis;               ///< In-situ analysis time interval
   DOUBLE dt_max;                    ///< Value of maximum timestep level
+  DOUBLE dt_restart_wall;           ///< Wall-clock interval between restarts
   DOUBLE dt_snap;                   ///< Snapshot time interval
   DOUBLE dt_python;                 ///< Python window update time interval
   DOUBLE t;                         ///< Current simulation time
+  DOUBLE tanalysisnext;             ///< Time of next in-situ analysis
   DOUBLE tend;                      ///< End time of simulation
   DOUBLE timestep;                  ///< Current timestep
   DOUBLE tsnapfirst;                ///< Time of first snapshot
   DOUBLE tsnapnext;                 ///< Time of next snapshot
+  string bin_compression;           ///< Compression of binary snapshots
   string out_file_form;             ///< Output snapshot file format
   string paramfile;                 ///< Name of parameters file
   string run_id;                    ///< Simulation id string
+  time_t twall_restart;             ///< Wall-clock time of last restart file
 
   Parameters* simparams;            ///< Simulation parameters object (pointer)
   SimUnits simunits;                ///< Simulation units object
@@ -188,7 +213,9 @@ class Simulation : public SimulationBase
   Simulation(Parameters* parameters) : 
     SimulationBase(parameters),
     nbody(NULL),
-    sph(NULL) {this->ndims=ndim;};
+    sph(NULL),
+    snapwriter(NULL) {this->ndims=ndim;};
+  virtual ~Simulation();
 
 
   // Memory allocation routines
@@ -230,7 +257,10 @@ class Simulation : public SimulationBase
   virtual void ProcessSphParameters(void);
   virtual void OutputDiagnostics(void);
   virtual void UpdateDiagnostics(void);
+  virtual void OpenInSituAnalysisFiles(void);
+  virtual void RunInSituAnalysis(void);
   virtual void SetComFrame(void);
+  void AddInSituAnalysis(InSituAnalysis<ndim> *);
 
 #if defined(VERIFY_ALL)
   void VerifyBlockTimesteps(void);
@@ -260,11 +290,43 @@ class Simulation : public SimulationBase
   //---------------------------------------------------------------------------
   virtual void ReadColumnHeaderFile(ifstream& infile, HeaderInfo& info);
   virtual bool ReadColumnSnapshotFile(string);
+  bool ReadColumnDataParallel(string, long long);
   virtual bool WriteColumnSnapshotFile(string);
   virtual void ReadSerenFormHeaderFile(ifstream& infile, HeaderInfo& info);
   virtual bool ReadSerenFormSnapshotFile(string);
   virtual bool WriteSerenFormSnapshotFile(string);
+  virtual void ReadBinaryHeaderFile(ifstream& infile, HeaderInfo& info,
+                                    string filename);
+  virtual bool ReadBinarySnapshotFile(string);
+  virtual bool WriteBinarySnapshotFile(string);
+  virtual bool WriteFilteredSnapshotFile(string, string);
+  virtual bool ReadRestartFile(string);
+  virtual bool WriteRestartFile(string);
+  virtual bool QueueSnapshotFile(string,string);
+  virtual void FlushSnapshotFiles(void);
+  virtual bool WriteSnapshotData(SnapshotData<ndim> &);
   virtual void ConvertToCodeUnits(void);
+  void CaptureSnapshotData(SnapshotData<ndim> &);
+  void ViewSnapshotData(SnapshotData<ndim,SphParticle> &);
+  template <template<int> class ParticleType>
+  bool WriteSerenFormSnapshotFile(SnapshotData<ndim,ParticleType> &);
+#ifndef MPI_PARALLEL
+  template <template<int> class ParticleType>
+  bool WriteColumnSnapshotFile(SnapshotData<ndim,ParticleType> &);
+#else
+  bool WriteBinaryPieceFiles(string);
+#endif
+  template <template<int> class ParticleType>
+  bool WriteBinarySnapshotFile(SnapshotData<ndim,ParticleType> &);
+  template <template<int> class ParticleType>
+  bool WriteCompressedBinarySnapshotFile(SnapshotData<ndim,ParticleType> &);
+  void ReadBinaryBlocks(ifstream &, BinarySnapshotHeader &, int, int);
+  void ReadCompressedBinarySnapshotFile(ifstream &, BinarySnapshotHeader &,
+                                        int, int);
+  void SetBinaryHeader(BinarySnapshotHeader &, int, int, DOUBLE);
+  template <typename ParticleType>
+  char* BinaryFieldAddress(const BinaryFieldRecord &, ParticleType *,
+                           StarParticle<ndim> *, int, int &, int &);
 
 
   // Variables
@@ -277,16 +339,19 @@ class Simulation : public SimulationBase
   Diagnostics<ndim> diag;               ///< Current diagnostic state
   EnergyEquation<ndim> *uint;           ///< Energy equation pointer
   Ghosts<ndim>* LocalGhosts;            ///< Periodic ghost particle object
+  vector<InSituAnalysis<ndim>*> analyses;  ///< In-situ analyses of the run
   Nbody<ndim> *nbody;                   ///< N-body algorithm pointer
   Nbody<ndim> *subsystem;               ///< N-body object for sub-systems
   NbodySystemTree<ndim> nbodytree;      ///< N-body tree to create sub-systems
+  OutputFilter<ndim> outfilter;         ///< Particle filter of filtered output
   Sinks<ndim> sinks;                    ///< Sink particle object
   Sph<ndim> *sph;                       ///< SPH algorithm pointer
   SphIntegration<ndim> *sphint;         ///< SPH Integration scheme pointer
   SphNeighbourSearch<ndim> *sphneib;    ///< SPH Neighbour scheme pointer
+  SnapshotWriter<ndim> *snapwriter;     ///< Background snapshot writer
 #ifdef MPI_PARALLEL
   MpiControl<ndim> mpicontrol;          ///< MPI control object
-  Ghosts<ndim>* MpiGhosts;              ///< MPI ghost particle object
+  MPIGhosts<ndim>* MpiGhosts;           ///< MPI ghost particle object
 #endif
 
 };
@@ -415,6 +480,7 @@ class GodunovSphSimulation : public Simulation<ndim>
   using Simulation<ndim>::ntreebuildstep;
   using Simulation<ndim>::ntreestockstep;
 #ifdef MPI_PARALLEL
+  using Simulation<ndim>::mpicontrol;
   using Simulation<ndim>::MpiGhosts;
 #endif
 
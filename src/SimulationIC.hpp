@@ -26,6 +26,7 @@
 #include <cstdio>
 #include <cstring>
 #include <math.h>
+#include <sys/time.h>
 #include "Precision.h"
 #include "Exception.h"
 #include "Simulation.h"
@@ -48,12 +49,25 @@ using namespace std;
 template <int ndim>
 void Simulation<ndim>::GenerateIC(void)
 {
+  int i;                            // Particle counter
+  DOUBLE tread;                     // Wall-clock time to read IC file
+  struct timeval tstart;            // Wall-clock time before reading
+  struct timeval tend;              // Wall-clock time after reading
+
   debug2("[Simulation::GenerateIC]");
 
   // Generate initial conditions
   if (simparams->stringparams["ic"] == "file") {
+    gettimeofday(&tstart,NULL);
     ReadSnapshotFile(simparams->stringparams["in_file"],
 		     simparams->stringparams["in_file_form"]);
+    gettimeofday(&tend,NULL);
+    tread = (DOUBLE) (tend.tv_sec - tstart.tv_sec) +
+      1.0e-6*(DOUBLE) (tend.tv_usec - tstart.tv_usec);
+    cout << "Read " << sph->Nsph + nbody->Nstar << " particles from "
+         << simparams->stringparams["in_file"] << " in " << tread << " s ("
+         << (DOUBLE) (sph->Nsph + nbody->Nstar)/max(tread,(DOUBLE) 1.0e-9)
+         << " particles/s)" << endl;
     rescale_particle_data = true;
   }
   else if (simparams->stringparams["ic"] == "binaryacc")
@@ -96,6 +110,11 @@ void Simulation<ndim>::GenerateIC(void)
     ExceptionHandler::getIstance().raise(message);
   }
 
+  // Give all SPH particles without an original i.d. their position in the
+  // initial particle array (used to identify particles in the output)
+  for (i=0; i<sph->Nsph; i++)
+    if (sph->sphdata[i].iorig < 0) sph->sphdata[i].iorig = i;
+
   // Scale particle data to dimensionless code units if required
   if (rescale_particle_data) ConvertToCodeUnits();  
 
@@ -28,10 +28,18 @@
 #include <string>
 #include <cstdio>
 #include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "Simulation.h"
 #include "Parameters.h"
 #include "Debug.h"
 #include "HeaderInfo.h"
+#include "BinarySnapshot.h"
+#include "BinaryCodec.h"
 #ifdef MPI_PARALLEL
 #include <mpi.h>
 #endif
@@ -49,6 +57,9 @@ bool SimulationBase::ReadSnapshotFile
 {
   debug2("[Simulation::ReadSnapshotFile]");
 
+  // Filtered snapshots are read like unfiltered ones
+  fileform = BaseFileForm(fileform);
+
   cout << "Reading snapshot : " << filename << "   format : " << fileform << endl;
 
   // Read in snapshot file to main memory
@@ -56,6 +67,8 @@ bool SimulationBase::ReadSnapshotFile
     return ReadColumnSnapshotFile(filename);
   else if (fileform == "sf" || fileform == "seren_form")
     return ReadSerenFormSnapshotFile(filename);
+  else if (fileform == "gandalf_bin")
+    return ReadBinarySnapshotFile(filename);
   else {
     cout << "Unrecognised file format" << endl;
     return false;
@@ -78,14 +91,200 @@ bool SimulationBase::WriteSnapshotFile
 {
   debug2("[Simulation::WriteSnapshotFile]");
 
-  if (fileform == "column")
+  if (FilteredFileForm(fileform))
+    return WriteFilteredSnapshotFile(filename,fileform);
+  else if (fileform == "column")
     return WriteColumnSnapshotFile(filename);
   else if (fileform == "sf" || fileform == "seren_form")
     return WriteSerenFormSnapshotFile(filename);
+  else if (fileform == "gandalf_bin")
+    return WriteBinarySnapshotFile(filename);
+  else {
+    cout << "Unrecognised file format" << endl;
+    return false;
+  }
+}
+
+
+
+//=============================================================================
+//  Simulation::QueueSnapshotFile
+/// Capture the current particle data and hand the snapshot over to the
+/// background writer thread, so the main loop can continue immediately.
+/// Blocks only if all snapshot buffers are still waiting to be written.
+/// Without a writer thread, the snapshot is written directly.
+//=============================================================================
+template <int ndim>
+bool Simulation<ndim>::QueueSnapshotFile
+(string filename,                   ///< [in] Name of output snapshot file
+ string fileform)                   ///< [in] Format of output snapshot file
+{
+  SnapshotData<ndim> *snap;         // Buffer holding captured snapshot
+
+  debug2("[Simulation::QueueSnapshotFile]");
+
+  if (snapwriter == NULL) return WriteSnapshotFile(filename,fileform);
+
+  snap = snapwriter->GetFreeBuffer();
+  snap->filename = filename;
+  snap->fileform = fileform;
+  CaptureSnapshotData(*snap);
+  snapwriter->QueueSnapshot(snap);
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  Simulation::WriteFilteredSnapshotFile
+/// Write the particles selected by the output filter (plus all stars) in
+/// the underlying format of the filtered file format.  Not available for
+/// MPI runs.
+//=============================================================================
+template <int ndim>
+bool Simulation<ndim>::WriteFilteredSnapshotFile
+(string filename,                   ///< [in] Name of output snapshot file
+ string fileform)                   ///< [in] Filtered snapshot file format
+{
+  SnapshotData<ndim> snap;          // Filtered copy of particle data
+
+  debug2("[Simulation::WriteFilteredSnapshotFile]");
+
+#ifdef MPI_PARALLEL
+  string msg = "Error: filtered snapshots are not supported for MPI runs";
+  ExceptionHandler::getIstance().raise(msg);
+  return false;
+#else
+  snap.filename = filename;
+  snap.fileform = fileform;
+  CaptureSnapshotData(snap);
+
+  return WriteSnapshotData(snap);
+#endif
+}
+
+
+
+//=============================================================================
+//  Simulation::FlushSnapshotFiles
+/// Wait until all queued snapshots have been written to disk.
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::FlushSnapshotFiles(void)
+{
+  debug2("[Simulation::FlushSnapshotFiles]");
+
+  if (snapwriter != NULL) snapwriter->Flush();
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::CaptureSnapshotData
+/// Copy the particle quantities written to snapshot files into buffers owned
+/// by the snapshot object (which are re-used, and only grown when required).
+/// Only the fields of the snapshot formats are copied, so a captured
+/// snapshot is much smaller than the live particle arrays.  For filtered
+/// file formats, only the SPH particles selected by the output filter are
+/// copied.
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::CaptureSnapshotData
+(SnapshotData<ndim> &snap)          ///< [inout] Snapshot data object
+{
+  int i;                            // Particle counter
+  int Nsph = sph->Nsph;             // No. of SPH particles
+  SnapshotParticle<ndim> *sphcopy;  // Copy of SPH particle quantities
+  SphParticle<ndim> *sphdata = sph->sphdata;   // Live SPH particle array
+
+  debug2("[Simulation::CaptureSnapshotData]");
+
+  snap.Nsph = sph->Nsph;
+  snap.Nstar = nbody->Nstar;
+  snap.Nsteps = Nsteps;
+  snap.t = t;
+
+  // Grow the owned buffers if they are too small for the current arrays
+  if (snap.Nsph > snap.Nsphmax) {
+    delete[] snap.sphdata;
+    snap.Nsphmax = snap.Nsph;
+    snap.sphdata = new SnapshotParticle<ndim>[snap.Nsphmax];
+  }
+  if (snap.Nstar > snap.Nstarmax) {
+    delete[] snap.stardata;
+    snap.Nstarmax = snap.Nstar;
+    snap.stardata = new StarParticle<ndim>[snap.Nstarmax];
+  }
+
+  sphcopy = snap.sphdata;
+  if (FilteredFileForm(snap.fileform))
+    snap.Nsph = outfilter.SelectParticles(Nsph,sphdata,sphcopy);
+  else {
+#pragma omp parallel for default(none) private(i) shared(Nsph,sphcopy,sphdata)
+    for (i=0; i<Nsph; i++) sphcopy[i] = sphdata[i];
+  }
+  for (i=0; i<snap.Nstar; i++) snap.stardata[i] = nbody->stardata[i];
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::ViewSnapshotData
+/// Point a snapshot object to the live particle arrays, so snapshots written
+/// synchronously (i.e. not by the background writer thread) are written
+/// without copying the particles.
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::ViewSnapshotData
+(SnapshotData<ndim,SphParticle> &snap)  ///< [inout] Snapshot data object
+{
+  debug2("[Simulation::ViewSnapshotData]");
+
+  snap.owndata = false;
+  snap.Nsph = sph->Nsph;
+  snap.Nstar = nbody->Nstar;
+  snap.Nsteps = Nsteps;
+  snap.t = t;
+  snap.sphdata = sph->sphdata;
+  snap.stardata = nbody->stardata;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::WriteSnapshotData
+/// Write captured snapshot data in the format recorded in the snapshot.
+/// Called by the background writer thread.
+//=============================================================================
+template <int ndim>
+bool Simulation<ndim>::WriteSnapshotData
+(SnapshotData<ndim> &snap)          ///< [in] Snapshot data to be written
+{
+  debug2("[Simulation::WriteSnapshotData]");
+
+#ifdef MPI_PARALLEL
+  return WriteSnapshotFile(snap.filename,snap.fileform);
+#else
+  string fileform = BaseFileForm(snap.fileform);   // Underlying file format
+
+  if (fileform == "column")
+    return WriteColumnSnapshotFile(snap);
+  else if (fileform == "sf" || fileform == "seren_form")
+    return WriteSerenFormSnapshotFile(snap);
+  else if (fileform == "gandalf_bin")
+    return WriteBinarySnapshotFile(snap);
   else {
     cout << "Unrecognised file format" << endl;
     return false;
   }
+#endif
 }
 
 
@@ -105,12 +304,19 @@ HeaderInfo SimulationBase::ReadHeaderSnapshotFile
 
   debug2("[Simulation::ReadHeaderSnapshotFile]");
 
-  infile.open(filename.c_str());
+  fileform = BaseFileForm(fileform);
+
+  if (fileform == "gandalf_bin")
+    infile.open(filename.c_str(), ios::in | ios::binary);
+  else
+    infile.open(filename.c_str());
 
   if (fileform == "column")
     ReadColumnHeaderFile(infile, info);
   else if (fileform == "sf" || fileform == "seren_form")
     ReadSerenFormHeaderFile(infile, info);
+  else if (fileform == "gandalf_bin")
+    ReadBinaryHeaderFile(infile, info, filename);
   else
     ExceptionHandler::getIstance().raise("Unrecognised file format");
 
@@ -152,15 +358,330 @@ void Simulation<ndim>::ReadColumnHeaderFile
 
 
 
+//=============================================================================
+//  Column data parsing
+//
+//  The particle data of column files are parsed in parallel.  The file is
+//  split into blocks of roughly column_block_size bytes, each starting at
+//  the beginning of a line, the non-blank lines (i.e. particles) of each
+//  block are counted, and each block is then parsed independently knowing
+//  the i.d. of its first particle.  This requires one particle per line, as
+//  written by WriteColumnSnapshotFile; other files are read serially.
+//=============================================================================
+static const long long column_block_size = 1 << 22;
+static const int column_token_length = 64;
+
+
+
+//=============================================================================
+//  ParseDecimal
+/// Split a plain decimal token (e.g. -1.2345e-3) into its sign, integer
+/// mantissa and power of ten.  Returns false for tokens with more than 19
+/// significant digits or in any other form (inf, nan, hex, ...).
+//=============================================================================
+static bool ParseDecimal
+(const char *c,                     ///< [in] Token
+ int n,                             ///< [in] Length of token
+ bool &negative,                    ///< [out] Is value negative?
+ unsigned long long &mantissa,      ///< [out] Integer mantissa
+ int &exponent)                     ///< [out] Power of ten
+{
+  bool expnegative = false;         // Is exponent negative?
+  int expvalue = 0;                 // Absolute value of exponent
+  int Ndigits = 0;                  // No. of mantissa digits read
+  int Nsignificant = 0;             // No. of significant digits
+  const char *end = c + n;          // End of token
+
+  negative = false;
+  mantissa = 0;
+  exponent = 0;
+
+  if (c < end && (*c == '+' || *c == '-')) negative = (*c++ == '-');
+  for (; c<end && *c>='0' && *c<='9'; c++, Ndigits++) {
+    if (mantissa == 0 && *c == '0') continue;
+    if (++Nsignificant > 19) return false;
+    mantissa = 10*mantissa + (*c - '0');
+  }
+  if (c < end && *c == '.') {
+    for (c++; c<end && *c>='0' && *c<='9'; c++, Ndigits++) {
+      exponent--;
+      if (mantissa == 0 && *c == '0') continue;
+      if (++Nsignificant > 19) return false;
+      mantissa = 10*mantissa + (*c - '0');
+    }
+  }
+  if (Ndigits == 0) return false;
+  if (c < end && (*c == 'e' || *c == 'E')) {
+    c++;
+    if (c < end && (*c == '+' || *c == '-')) expnegative = (*c++ == '-');
+    if (c == end) return false;
+    for (; c<end && *c>='0' && *c<='9'; c++) {
+      if (expvalue > 1000) return false;
+      expvalue = 10*expvalue + (*c - '0');
+    }
+    exponent += (expnegative ? -expvalue : expvalue);
+  }
+
+  return (c == end);
+}
+
+
+
+//=============================================================================
+//  StringToValue
+/// Convert a token of n characters to the nearest float/double.  Values
+/// whose mantissa and power of ten are both exactly representable are
+/// converted with a single (correctly rounded) multiplication or division;
+/// all others with strtof/strtod, as used by the stream extraction
+/// operators, so both readers agree exactly.  Returns false if the token
+/// is not a valid number.
+//=============================================================================
+static inline bool StringToValue(const char *c, int n, float &value)
+{
+  static const float powers[11] = {1e0f,1e1f,1e2f,1e3f,1e4f,1e5f,1e6f,
+                                   1e7f,1e8f,1e9f,1e10f};
+  bool negative;
+  int exponent;
+  unsigned long long mantissa;
+  char token[column_token_length];
+  char *tokenend;
+
+  if (ParseDecimal(c,n,negative,mantissa,exponent) &&
+      mantissa <= (1ULL << 24) && exponent >= -10 && exponent <= 10) {
+    value = (float) mantissa;
+    if (exponent < 0) value /= powers[-exponent];
+    else value *= powers[exponent];
+    if (negative) value = -value;
+    return true;
+  }
+  if (n >= column_token_length) return false;
+  memcpy(token,c,n);
+  token[n] = '\0';
+  value = strtof(token,&tokenend);
+  return (n > 0 && tokenend == token + n);
+}
+static inline bool StringToValue(const char *c, int n, double &value)
+{
+  static const double powers[23] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,
+                                    1e9,1e10,1e11,1e12,1e13,1e14,1e15,1e16,
+                                    1e17,1e18,1e19,1e20,1e21,1e22};
+  bool negative;
+  int exponent;
+  unsigned long long mantissa;
+  char token[column_token_length];
+  char *tokenend;
+
+  if (ParseDecimal(c,n,negative,mantissa,exponent) &&
+      mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+    value = (double) mantissa;
+    if (exponent < 0) value /= powers[-exponent];
+    else value *= powers[exponent];
+    if (negative) value = -value;
+    return true;
+  }
+  if (n >= column_token_length) return false;
+  memcpy(token,c,n);
+  token[n] = '\0';
+  value = strtod(token,&tokenend);
+  return (n > 0 && tokenend == token + n);
+}
+
+
+
+//=============================================================================
+//  ParseColumnRow
+/// Parse the ncol values of the line starting at c.  On return, c points
+/// to the beginning of the next line.  Returns false if the line does not
+/// hold exactly ncol valid numbers.
+//=============================================================================
+template <typename T>
+static bool ParseColumnRow
+(const char *&c,                    ///< [inout] Current position in data
+ const char *end,                   ///< [in] End of data
+ int ncol,                          ///< [in] No. of values in line
+ T *values)                         ///< [out] Values of line
+{
+  int j;                            // Column counter
+  const char *token;                // Start of current token
+
+  for (j=0; j<ncol; j++) {
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r')) c++;
+    token = c;
+    while (c < end && !isspace((unsigned char) *c)) c++;
+    if (!StringToValue(token,(int) (c - token),values[j])) return false;
+  }
+
+  while (c < end && (*c == ' ' || *c == '\t' || *c == '\r')) c++;
+  if (c < end && *c != '\n') return false;
+  if (c < end) c++;
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  CountColumnRows
+/// Return the no. of non-blank lines in the byte range [c,end).
+//=============================================================================
+static long long CountColumnRows
+(const char *c,                     ///< [in] Start of byte range
+ const char *end)                   ///< [in] End of byte range
+{
+  const char *eol;                  // End of current line
+  long long Nrow = 0;               // No. of non-blank lines
+
+  while (c < end) {
+    eol = (const char *) memchr(c,'\n',end - c);
+    if (eol == NULL) eol = end;
+    while (c < eol && isspace((unsigned char) *c)) c++;
+    if (c < eol) Nrow++;
+    c = eol + 1;
+  }
+
+  return Nrow;
+}
+
+
+
+//=============================================================================
+//  Simulation::ReadColumnDataParallel
+/// Parse the particle data of a column data file, starting at the given
+/// byte offset (i.e. after the header), in parallel over blocks of lines.
+/// Returns false, without any message, if the file cannot be mapped or is
+/// not laid out as one particle per line, so the caller can fall back to
+/// the serial reader.
+//=============================================================================
+template <int ndim>
+bool Simulation<ndim>::ReadColumnDataParallel
+(string filename,                   ///< [in] Filename of column data file
+ long long offset)                  ///< [in] Byte offset of particle data
+{
+  int fd;                           // File descriptor of column file
+  int ib;                           // Block counter
+  int Nblock;                       // No. of blocks
+  int Nerror = 0;                   // No. of blocks with parse errors
+  long long Nrowtot = 0;            // Total no. of particle lines
+  long long size;                   // Size of file (bytes)
+  void *address;                    // Address of mapped file
+  const char *data;                 // Start of mapped file
+  struct stat filestat;             // File information
+  vector<long long> blockstart;     // Byte offset of each block
+  vector<long long> rowfirst;       // i.d. of first particle of each block
+
+  debug2("[Simulation::ReadColumnDataParallel]");
+
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) return false;
+  if (fstat(fd, &filestat) == -1 || filestat.st_size <= offset) {
+    close(fd);
+    return false;
+  }
+  size = filestat.st_size;
+  address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) return false;
+  data = (const char *) address;
+
+  // Split data into blocks, each starting at the beginning of a line
+  //---------------------------------------------------------------------------
+  Nblock = (int) max((size - offset)/column_block_size,1LL);
+  blockstart.resize(Nblock + 1);
+  rowfirst.resize(Nblock + 1);
+  for (ib=0; ib<Nblock; ib++) {
+    blockstart[ib] = offset + (size - offset)*ib/Nblock;
+    if (ib == 0 || data[blockstart[ib] - 1] == '\n') continue;
+    while (blockstart[ib] < size && data[blockstart[ib] - 1] != '\n')
+      blockstart[ib]++;
+  }
+  blockstart[Nblock] = size;
+
+  // Count particle lines of each block to find the first i.d. of each block
+  //---------------------------------------------------------------------------
+#pragma omp parallel for default(none) schedule(dynamic) \
+  shared(blockstart,data,Nblock,rowfirst)
+  for (ib=0; ib<Nblock; ib++)
+    rowfirst[ib] = CountColumnRows(data + blockstart[ib],
+                                   data + max(blockstart[ib],blockstart[ib+1]));
+
+  for (ib=0; ib<=Nblock; ib++) {
+    long long Nrow = (ib < Nblock ? rowfirst[ib] : 0);
+    rowfirst[ib] = Nrowtot;
+    Nrowtot += Nrow;
+  }
+
+  if (Nrowtot != (long long) (sph->Nsph + nbody->Nstar)) {
+    munmap(address, size);
+    return false;
+  }
+
+  // Parse all blocks independently
+  //---------------------------------------------------------------------------
+#pragma omp parallel for default(none) schedule(dynamic) \
+  shared(blockstart,data,Nblock,rowfirst) reduction(+:Nerror)
+  for (ib=0; ib<Nblock; ib++) {
+    const char *c = data + blockstart[ib];
+    const char *end = data + max(blockstart[ib],blockstart[ib+1]);
+    long long irow = rowfirst[ib];
+    int k;
+    FLOAT sphvalues[2*ndim + 4];
+    DOUBLE starvalues[2*ndim + 4];
+
+    while (c < end) {
+      const char *eol = c;
+      while (eol < end && *eol != '\n' && isspace((unsigned char) *eol)) eol++;
+      if (eol == end || *eol == '\n') {
+        c = (eol < end ? eol + 1 : eol);
+        continue;
+      }
+      if (irow < sph->Nsph) {
+        if (!ParseColumnRow(c,end,2*ndim + 4,sphvalues)) {
+          Nerror++;
+          break;
+        }
+        SphParticle<ndim>& part = sph->sphdata[irow];
+        for (k=0; k<ndim; k++) part.r[k] = sphvalues[k];
+        for (k=0; k<ndim; k++) part.v[k] = sphvalues[ndim + k];
+        part.m   = sphvalues[2*ndim];
+        part.h   = sphvalues[2*ndim + 1];
+        part.rho = sphvalues[2*ndim + 2];
+        part.u   = sphvalues[2*ndim + 3];
+      }
+      else {
+        if (!ParseColumnRow(c,end,2*ndim + 4,starvalues)) {
+          Nerror++;
+          break;
+        }
+        StarParticle<ndim>& star = nbody->stardata[irow - sph->Nsph];
+        for (k=0; k<ndim; k++) star.r[k] = starvalues[k];
+        for (k=0; k<ndim; k++) star.v[k] = starvalues[ndim + k];
+        star.m = starvalues[2*ndim];
+        star.h = starvalues[2*ndim + 1];
+      }
+      irow++;
+    }
+  }
+  //---------------------------------------------------------------------------
+
+  munmap(address, size);
+
+  return (Nerror == 0);
+}
+
+
+
 //=============================================================================
 //  Simulation::ReadColumnSnapshotFile
-/// Reads a column format data snapshot of given filename.
+/// Reads a column format data snapshot of given filename.  The particle
+/// data are parsed in parallel (see ReadColumnDataParallel) if the file has
+/// one particle per line, otherwise value by value from the file stream.
 //=============================================================================
 template <int ndim>
 bool Simulation<ndim>::ReadColumnSnapshotFile
 (string filename)                  ///< Filename of column data snapshot file
 {
   int i;
+  long long offset;
   ifstream infile;
   FLOAT raux;
   HeaderInfo info;
@@ -171,9 +692,20 @@ bool Simulation<ndim>::ReadColumnSnapshotFile
 
   ReadColumnHeaderFile(infile, info);
   t = info.t;
+  offset = infile.tellg();
 
   sph->Nsph = info.Nsph;
   sph->AllocateMemory(sph->Nsph);
+  nbody->Nstar = info.Nstar;
+  nbody->AllocateMemory(nbody->Nstar);
+
+  if (infile.good() && ReadColumnDataParallel(filename, offset)) {
+    infile.close();
+    return true;
+  }
+
+  infile.clear();
+  infile.seekg(offset, ios::beg);
   i = 0;
 
   // Read in data depending on dimensionality
@@ -193,8 +725,6 @@ bool Simulation<ndim>::ReadColumnSnapshotFile
     i++;
   }
 
-  nbody->Nstar = info.Nstar;
-  nbody->AllocateMemory(nbody->Nstar);
   i = 0;
 
   // Read in data depending on dimensionality
@@ -394,25 +924,45 @@ bool Simulation<ndim>::WriteColumnSnapshotFile(string filename)
 #else
 template <int ndim>
 bool Simulation<ndim>::WriteColumnSnapshotFile(string filename)
+{
+  SnapshotData<ndim,SphParticle> snap;   // View of current particle data
+
+  snap.filename = filename;
+  snap.fileform = "column";
+  ViewSnapshotData(snap);
+
+  return WriteColumnSnapshotFile(snap);
+}
+
+
+
+//=============================================================================
+//  Simulation::WriteColumnSnapshotFile
+/// Write captured SPH and N-body particle data to column data snapshot file.
+//=============================================================================
+template <int ndim>
+template <template<int> class ParticleType>
+bool Simulation<ndim>::WriteColumnSnapshotFile
+(SnapshotData<ndim,ParticleType> &snap)   ///< [in] Snapshot data to be written
 {
   int i;
   ofstream outfile;
 
   debug2("[Simulation::WriteColumnSnapshotFile]");
 
-  cout << "Writing current data to snapshot file : " << filename << endl;
+  cout << "Writing current data to snapshot file : " << snap.filename << endl;
 
   // Open file and read header information
-  outfile.open(filename.c_str());
-  outfile << sph->Nsph << endl;
-  outfile << nbody->Nstar << endl;
+  outfile.open(snap.filename.c_str());
+  outfile << snap.Nsph << endl;
+  outfile << snap.Nstar << endl;
   outfile << ndim << endl;
-  outfile << t*simunits.t.outscale << endl;
+  outfile << snap.t*simunits.t.outscale << endl;
 
   // Write data for SPH particles
   //---------------------------------------------------------------------------
-  for (i=0; i<sph->Nsph; i++) {
-    SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+  for (i=0; i<snap.Nsph; i++) {
+    ParticleType<ndim>* part = &(snap.sphdata[i]);
     if (ndim == 1) 
       outfile << part->r[0]*simunits.r.outscale << "   "
 	      << part->v[0]*simunits.v.outscale << "   "
@@ -447,34 +997,34 @@ bool Simulation<ndim>::WriteColumnSnapshotFile(string filename)
 
   // Write data for SPH particles
   //---------------------------------------------------------------------------
-  for (i=0; i<nbody->Nstar; i++) {
+  for (i=0; i<snap.Nstar; i++) {
     if (ndim == 1) 
-      outfile << nbody->stardata[i].r[0]*simunits.r.outscale << "   "
-	      << nbody->stardata[i].v[0]*simunits.v.outscale << "   "
-	      << nbody->stardata[i].m*simunits.m.outscale << "   "
-	      << nbody->stardata[i].h*simunits.r.outscale << "   "
+      outfile << snap.stardata[i].r[0]*simunits.r.outscale << "   "
+	      << snap.stardata[i].v[0]*simunits.v.outscale << "   "
+	      << snap.stardata[i].m*simunits.m.outscale << "   "
+	      << snap.stardata[i].h*simunits.r.outscale << "   "
 	      << 0.0 << "   "
 	      << 0.0
 	      << endl;
     else if (ndim == 2) 
-      outfile << nbody->stardata[i].r[0]*simunits.r.outscale << "   "
-	      << nbody->stardata[i].r[1]*simunits.r.outscale << "   "
-	      << nbody->stardata[i].v[0]*simunits.v.outscale << "   "
-	      << nbody->stardata[i].v[1]*simunits.v.outscale << "   "
-	      << nbody->stardata[i].m*simunits.m.outscale << "   "
-	      << nbody->stardata[i].h*simunits.r.outscale << "   "
+      outfile << snap.stardata[i].r[0]*simunits.r.outscale << "   "
+	      << snap.stardata[i].r[1]*simunits.r.outscale << "   "
+	      << snap.stardata[i].v[0]*simunits.v.outscale << "   "
+	      << snap.stardata[i].v[1]*simunits.v.outscale << "   "
+	      << snap.stardata[i].m*simunits.m.outscale << "   "
+	      << snap.stardata[i].h*simunits.r.outscale << "   "
 	      << 0.0 << "   "
 	      << 0.0
 	      << endl;
     else if (ndim == 3) 
-      outfile << nbody->stardata[i].r[0]*simunits.r.outscale << "   "
-	      << nbody->stardata[i].r[1]*simunits.r.outscale << "   "
-	      << nbody->stardata[i].r[2]*simunits.r.outscale << "   "
-	      << nbody->stardata[i].v[0]*simunits.v.outscale << "   "
-	      << nbody->stardata[i].v[1]*simunits.v.outscale << "   "
-	      << nbody->stardata[i].v[2]*simunits.v.outscale << "   "
-	      << nbody->stardata[i].m*simunits.m.outscale << "   "
-	      << nbody->stardata[i].h*simunits.r.outscale << "   "
+      outfile << snap.stardata[i].r[0]*simunits.r.outscale << "   "
+	      << snap.stardata[i].r[1]*simunits.r.outscale << "   "
+	      << snap.stardata[i].r[2]*simunits.r.outscale << "   "
+	      << snap.stardata[i].v[0]*simunits.v.outscale << "   "
+	      << snap.stardata[i].v[1]*simunits.v.outscale << "   "
+	      << snap.stardata[i].v[2]*simunits.v.outscale << "   "
+	      << snap.stardata[i].m*simunits.m.outscale << "   "
+	      << snap.stardata[i].h*simunits.r.outscale << "   "
 	      << 0.0 << "   "
 	      << 0.0
 	      << endl;
@@ -809,6 +1359,27 @@ bool Simulation<ndim>::ReadSerenFormSnapshotFile(string filename)
 //=============================================================================
 template <int ndim>
 bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
+{
+  SnapshotData<ndim,SphParticle> snap;   // View of current particle data
+
+  snap.filename = filename;
+  snap.fileform = "seren_form";
+  ViewSnapshotData(snap);
+
+  return WriteSerenFormSnapshotFile(snap);
+}
+
+
+
+//=============================================================================
+//  Simulation::WriteSerenFormSnapshotFile
+/// Write captured SPH and N-body particle data to snapshot file in Seren
+/// format.
+//=============================================================================
+template <int ndim>
+template <template<int> class ParticleType>
+bool Simulation<ndim>::WriteSerenFormSnapshotFile
+(SnapshotData<ndim,ParticleType> &snap)   ///< [in] Snapshot data to be written
 {
   //int dmdt_range_aux;          // Accretion history array size
   int i;                       // Aux. counter
@@ -832,9 +1403,9 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
 
   debug2("[Simulation::WriteSerenFormSnapshotFile]");
 
-  cout << "Writing snapshot file : " << filename << endl;
+  cout << "Writing snapshot file : " << snap.filename << endl;
 
-  outfile.open(filename.c_str());
+  outfile.open(snap.filename.c_str());
 
   for (i=0; i<50; i++) idata[i] = 0;
   for (i=0; i<50; i++) ilpdata[i] = 0;
@@ -874,60 +1445,60 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
 
   // Set array ids and array information data if there are any SPH particles
   //---------------------------------------------------------------------------
-  if (sph->Nsph > 0) {
+  if (snap.Nsph > 0) {
     data_id[ndata] = "porig";
     typedata[ndata][0] = 1; typedata[ndata][1] = 1;
-    typedata[ndata][2] = sph->Nsph; typedata[ndata][3] = 2;
+    typedata[ndata][2] = snap.Nsph; typedata[ndata][3] = 2;
     typedata[ndata][4] = 0; ndata++;
 
     data_id[ndata] = "r";
     typedata[ndata][0] = ndim; typedata[ndata][1] = 1;
-    typedata[ndata][2] = sph->Nsph; typedata[ndata][3] = 4;
+    typedata[ndata][2] = snap.Nsph; typedata[ndata][3] = 4;
     typedata[ndata][4] = 1; ndata++;
 
     data_id[ndata] = "m";
     typedata[ndata][0] = 1; typedata[ndata][1] = 1;
-    typedata[ndata][2] = sph->Nsph; typedata[ndata][3] = 4;
+    typedata[ndata][2] = snap.Nsph; typedata[ndata][3] = 4;
     typedata[ndata][4] = 2; ndata++;
 
     data_id[ndata] = "h";
     typedata[ndata][0] = 1; typedata[ndata][1] = 1;
-    typedata[ndata][2] = sph->Nsph; typedata[ndata][3] = 4;
+    typedata[ndata][2] = snap.Nsph; typedata[ndata][3] = 4;
     typedata[ndata][4] = 1; ndata++;
 
     data_id[ndata] = "v";
     typedata[ndata][0] = ndim; typedata[ndata][1] = 1;
-    typedata[ndata][2] = sph->Nsph; typedata[ndata][3] = 4;
+    typedata[ndata][2] = snap.Nsph; typedata[ndata][3] = 4;
     typedata[ndata][4] = 4; ndata++;
 
     data_id[ndata] = "rho";
     typedata[ndata][0] = 1; typedata[ndata][1] = 1;
-    typedata[ndata][2] = sph->Nsph; typedata[ndata][3] = 4;
+    typedata[ndata][2] = snap.Nsph; typedata[ndata][3] = 4;
     typedata[ndata][4] = 6; ndata++;
 
     data_id[ndata] = "u";
     typedata[ndata][0] = 1; typedata[ndata][1] = 1;
-    typedata[ndata][2] = sph->Nsph; typedata[ndata][3] = 4;
+    typedata[ndata][2] = snap.Nsph; typedata[ndata][3] = 4;
     typedata[ndata][4] = 20; ndata++;
   }
 
-  if (nbody->Nstar > 0) {
+  if (snap.Nstar > 0) {
     data_id[ndata] = "sink_v1";
     typedata[ndata][0] = 1; typedata[ndata][1] = 1;
-    typedata[ndata][2] = nbody->Nstar; typedata[ndata][3] = 7;
+    typedata[ndata][2] = snap.Nstar; typedata[ndata][3] = 7;
     typedata[ndata][4] = 0; ndata++;
   }
 
   // Set important header information
-  idata[0] = sph->Nsph;
-  idata[1] = nbody->Nstar;
+  idata[0] = snap.Nsph;
+  idata[1] = snap.Nstar;
   idata[19] = nunit;
   idata[20] = ndata;
   ilpdata[0] = 0;
-  ilpdata[1] = Nsteps;
+  ilpdata[1] = snap.Nsteps;
   rdata[0] = sph->h_fac;
   rdata[1] = 0.0;
-  ddata[0] = t*simunits.t.outscale;
+  ddata[0] = snap.t*simunits.t.outscale;
 
 
   // Write header information to file
@@ -953,33 +1524,33 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
 
   // Write arrays for SPH particles
   //---------------------------------------------------------------------------
-  if (sph->Nsph > 0) {
+  if (snap.Nsph > 0) {
 
     // porig
     //-------------------------------------------------------------------------
-    for (i=0; i<sph->Nsph; i++) {
-      SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+    for (i=0; i<snap.Nsph; i++) {
+      ParticleType<ndim>* part = &(snap.sphdata[i]);
       outfile << part->iorig << endl;
     }
 
     // Positions
     //-------------------------------------------------------------------------
     if (ndim == 1)
-      for (i=0; i<sph->Nsph; i++) {
-        SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+      for (i=0; i<snap.Nsph; i++) {
+        ParticleType<ndim>* part = &(snap.sphdata[i]);
         outfile << part->r[0]*simunits.r.outscale << endl;
       }
 
     else if (ndim == 2)
-      for (i=0; i<sph->Nsph; i++) {
-        SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+      for (i=0; i<snap.Nsph; i++) {
+        ParticleType<ndim>* part = &(snap.sphdata[i]);
         outfile << part->r[0]*simunits.r.outscale << "    "
                 << part->r[1]*simunits.r.outscale << endl;
       }
 
     else if (ndim == 3)
-      for (i=0; i<sph->Nsph; i++) {
-        SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+      for (i=0; i<snap.Nsph; i++) {
+        ParticleType<ndim>* part = &(snap.sphdata[i]);
         outfile << part->r[0]*simunits.r.outscale << "    "
                 << part->r[1]*simunits.r.outscale << "    "
                 << part->r[2]*simunits.r.outscale << endl;
@@ -988,16 +1559,16 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
 
     // Masses
     //-------------------------------------------------------------------------
-    for (i=0; i<sph->Nsph; i++) {
-      SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+    for (i=0; i<snap.Nsph; i++) {
+      ParticleType<ndim>* part = &(snap.sphdata[i]);
       outfile << part->m*simunits.m.outscale << endl;
     }
 
 
     // Smoothing lengths
     //-------------------------------------------------------------------------
-    for (i=0; i<sph->Nsph; i++) {
-      SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+    for (i=0; i<snap.Nsph; i++) {
+      ParticleType<ndim>* part = &(snap.sphdata[i]);
       outfile << part->h*simunits.r.outscale << endl;
     }
 
@@ -1005,21 +1576,21 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
     // Velocities
     //-------------------------------------------------------------------------
     if (ndim == 1)
-      for (i=0; i<sph->Nsph; i++) {
-        SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+      for (i=0; i<snap.Nsph; i++) {
+        ParticleType<ndim>* part = &(snap.sphdata[i]);
         outfile << part->v[0]*simunits.v.outscale << endl;
       }
 
     else if (ndim == 2)
-      for (i=0; i<sph->Nsph; i++) {
-        SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+      for (i=0; i<snap.Nsph; i++) {
+        ParticleType<ndim>* part = &(snap.sphdata[i]);
         outfile << part->v[0]*simunits.v.outscale << "    "
                 << part->v[1]*simunits.v.outscale << endl;
       }
 
     else if (ndim == 3)
-      for (i=0; i<sph->Nsph; i++) {
-        SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+      for (i=0; i<snap.Nsph; i++) {
+        ParticleType<ndim>* part = &(snap.sphdata[i]);
         outfile << part->v[0]*simunits.v.outscale << "    "
                 << part->v[1]*simunits.v.outscale << "    "
                 << part->v[2]*simunits.v.outscale << endl;
@@ -1028,16 +1599,16 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
 
     // Densities
     //-------------------------------------------------------------------------
-    for (i=0; i<sph->Nsph; i++) {
-      SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+    for (i=0; i<snap.Nsph; i++) {
+      ParticleType<ndim>* part = &(snap.sphdata[i]);
       outfile << part->rho*simunits.rho.outscale << endl;;
     }
 
 
     // Specific internal energies
     //-------------------------------------------------------------------------
-    for (i=0; i<sph->Nsph; i++) {
-      SphParticle<ndim>* part = sph->GetParticleIPointer(i);
+    for (i=0; i<snap.Nsph; i++) {
+      ParticleType<ndim>* part = &(snap.sphdata[i]);
       outfile << part->u*simunits.u.outscale << endl;
     }
 
@@ -1046,7 +1617,7 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
 
   // Sinks/stars
   //---------------------------------------------------------------------------
-  if (nbody->Nstar > 0) {
+  if (snap.Nstar > 0) {
     sink_data_length = 12 + 2*ndim; //+ 2*dmdt_range_aux;
     int ii;
     FLOAT sdata[sink_data_length];
@@ -1054,16 +1625,16 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
     outfile << 2 << "    " << 2 << "    " << 0 << "    "
 	    << sink_data_length << "    " << 0 << "    "
 	    << 0 << endl;
-    for (i=0; i<nbody->Nstar; i++) {
+    for (i=0; i<snap.Nstar; i++) {
       outfile << true << "   " << true << endl;
       outfile << i+1 << "    " << 0 << endl;
       for (k=0; k<ndim; k++) 
-        sdata[k+1] = nbody->stardata[i].r[k]*simunits.r.outscale;
+        sdata[k+1] = snap.stardata[i].r[k]*simunits.r.outscale;
       for (k=0; k<ndim; k++)
-        sdata[k+1+ndim] = nbody->stardata[i].v[k]*simunits.v.outscale;
-      sdata[1+2*ndim] = nbody->stardata[i].m*simunits.m.outscale;
-      sdata[2+2*ndim] = nbody->stardata[i].h*simunits.r.outscale;
-      sdata[3+2*ndim] = nbody->stardata[i].radius*simunits.r.outscale;
+        sdata[k+1+ndim] = snap.stardata[i].v[k]*simunits.v.outscale;
+      sdata[1+2*ndim] = snap.stardata[i].m*simunits.m.outscale;
+      sdata[2+2*ndim] = snap.stardata[i].h*simunits.r.outscale;
+      sdata[3+2*ndim] = snap.stardata[i].radius*simunits.r.outscale;
       for (ii=0; ii<sink_data_length; ii++) outfile << sdata[ii] << "    ";
       outfile << endl;
     }
@@ -1078,6 +1649,1067 @@ bool Simulation<ndim>::WriteSerenFormSnapshotFile(string filename)
 
 
 
+//=============================================================================
+//  CopyStridedBlock
+/// Copy N (scaled) values between two strided arrays, converting between
+/// the element types of the input and output arrays.
+//=============================================================================
+template <typename TIN, typename TOUT>
+static void CopyStridedBlock
+(const char *in,                    ///< [in] First input element
+ int instride,                      ///< [in] Stride (in bytes) of input
+ char *out,                         ///< [out] First output element
+ int outstride,                     ///< [in] Stride (in bytes) of output
+ int N,                             ///< [in] No. of elements to copy
+ DOUBLE scale)                      ///< [in] Scaling factor
+{
+  int j;                            // Element counter
+
+#pragma omp parallel for default(none) private(j) \
+  shared(in,instride,out,outstride,N,scale)
+  for (j=0; j<N; j++)
+    *((TOUT *) (out + (long) j*outstride)) =
+      (TOUT) (scale*(*((const TIN *) (in + (long) j*instride))));
+
+  return;
+}
+
+
+
+//=============================================================================
+//  CopyStridedBlock
+/// Select the typed copy depending on the element sizes (4 or 8 bytes) of
+/// the input and output arrays.
+//=============================================================================
+static void CopyStridedBlock
+(const char *in,                    ///< [in] First input element
+ int instride,                      ///< [in] Stride (in bytes) of input
+ int insize,                        ///< [in] Size of input element
+ char *out,                         ///< [out] First output element
+ int outstride,                     ///< [in] Stride (in bytes) of output
+ int outsize,                       ///< [in] Size of output element
+ int N,                             ///< [in] No. of elements to copy
+ DOUBLE scale)                      ///< [in] Scaling factor
+{
+  if (insize == 4 && outsize == 4)
+    CopyStridedBlock<float,float>(in,instride,out,outstride,N,scale);
+  else if (insize == 4 && outsize == 8)
+    CopyStridedBlock<float,double>(in,instride,out,outstride,N,scale);
+  else if (insize == 8 && outsize == 4)
+    CopyStridedBlock<double,float>(in,instride,out,outstride,N,scale);
+  else
+    CopyStridedBlock<double,double>(in,instride,out,outstride,N,scale);
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::SetBinaryHeader
+/// Fill the unit and field tables of a binary snapshot header with all
+/// quantities written for SPH and star particles.
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::SetBinaryHeader
+(BinarySnapshotHeader &header,      ///< [out] Binary snapshot header
+ int Ntotsph,                       ///< [in] Total no. of SPH particles
+ int Ntotstar,                      ///< [in] Total no. of star particles
+ DOUBLE tsnap)                      ///< [in] Simulation time of snapshot
+{
+  int k;                            // Dimension counter
+  string rname[3] = {"x","y","z"};  // Position array names
+  string vname[3] = {"vx","vy","vz"};   // Velocity array names
+
+  debug2("[Simulation::SetBinaryHeader]");
+
+  header.ndim      = ndim;
+  header.precision = sizeof(FLOAT);
+  header.Nsph      = Ntotsph;
+  header.Nstar     = Ntotstar;
+  header.t         = tsnap*simunits.t.outscale;
+
+  header.AddUnit("r",simunits.r.outunit,simunits.r.outscale);
+  header.AddUnit("v",simunits.v.outunit,simunits.v.outscale);
+  header.AddUnit("m",simunits.m.outunit,simunits.m.outscale);
+  header.AddUnit("rho",simunits.rho.outunit,simunits.rho.outscale);
+  header.AddUnit("u",simunits.u.outunit,simunits.u.outscale);
+  header.AddUnit("t",simunits.t.outunit,simunits.t.outscale);
+
+  // SPH particle arrays (stored in the precision of the SPH particle data)
+  //---------------------------------------------------------------------------
+  if (Ntotsph > 0) {
+    for (k=0; k<ndim; k++) header.AddField(rname[k],"sph","r",sizeof(FLOAT));
+    for (k=0; k<ndim; k++) header.AddField(vname[k],"sph","v",sizeof(FLOAT));
+    header.AddField("m","sph","m",sizeof(FLOAT));
+    header.AddField("h","sph","r",sizeof(FLOAT));
+    header.AddField("rho","sph","rho",sizeof(FLOAT));
+    header.AddField("u","sph","u",sizeof(FLOAT));
+  }
+
+  // Star particle arrays (stored in the precision of the N-body data)
+  //---------------------------------------------------------------------------
+  if (Ntotstar > 0) {
+    for (k=0; k<ndim; k++) header.AddField(rname[k],"star","r",sizeof(DOUBLE));
+    for (k=0; k<ndim; k++) header.AddField(vname[k],"star","v",sizeof(DOUBLE));
+    header.AddField("m","star","m",sizeof(DOUBLE));
+    header.AddField("h","star","r",sizeof(DOUBLE));
+    header.AddField("radius","star","r",sizeof(DOUBLE));
+  }
+
+  header.ComputeOffsets();
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::BinaryFieldAddress
+/// Return the address of the quantity of the given binary snapshot field for
+/// particle i, together with the stride between consecutive particles and
+/// the in-memory size of the quantity.  Returns NULL for unknown fields.
+/// Works on the live SPH particle array as well as on captured snapshots.
+//=============================================================================
+template <int ndim>
+template <typename ParticleType>
+char* Simulation<ndim>::BinaryFieldAddress
+(const BinaryFieldRecord &field,    ///< [in] Field record
+ ParticleType *sphdata,             ///< [in] SPH particle array
+ StarParticle<ndim> *stardata,      ///< [in] Star particle array
+ int i,                             ///< [in] Particle id
+ int &stride,                       ///< [out] Stride (in bytes) of array
+ int &memsize)                      ///< [out] Size of in-memory element
+{
+  int k;                            // Dimension counter
+  string rname[3] = {"x","y","z"};  // Position array names
+  string vname[3] = {"vx","vy","vz"};   // Velocity array names
+
+  // SPH particle quantities
+  //---------------------------------------------------------------------------
+  if (field.species == "sph") {
+    ParticleType *part = &(sphdata[i]);
+    stride = sizeof(ParticleType);
+    memsize = sizeof(FLOAT);
+    for (k=0; k<ndim; k++) {
+      if (field.name == rname[k]) return (char *) &(part->r[k]);
+      if (field.name == vname[k]) return (char *) &(part->v[k]);
+    }
+    if (field.name == "m") return (char *) &(part->m);
+    if (field.name == "h") return (char *) &(part->h);
+    if (field.name == "rho") return (char *) &(part->rho);
+    if (field.name == "u") return (char *) &(part->u);
+  }
+
+  // Star particle quantities
+  //---------------------------------------------------------------------------
+  else if (field.species == "star") {
+    StarParticle<ndim> *star = &(stardata[i]);
+    stride = sizeof(StarParticle<ndim>);
+    memsize = sizeof(DOUBLE);
+    for (k=0; k<ndim; k++) {
+      if (field.name == rname[k]) return (char *) &(star->r[k]);
+      if (field.name == vname[k]) return (char *) &(star->v[k]);
+    }
+    if (field.name == "m") return (char *) &(star->m);
+    if (field.name == "h") return (char *) &(star->h);
+    if (field.name == "radius") return (char *) &(star->radius);
+  }
+
+  return NULL;
+}
+
+
+
+//=============================================================================
+//  Simulation::ReadBinaryHeaderFile
+/// Read the header of a native binary snapshot.  Does not modify the
+/// variables of the Simulation class, but rather returns information in a
+/// HeaderInfo struct.  For snapshots written as one piece per process, the
+/// header of the first piece is read and the particle numbers are summed
+/// over all pieces.
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::ReadBinaryHeaderFile
+(ifstream& infile,                  ///< Input file stream (binary mode)
+ HeaderInfo& info,                  ///< Header info data structure
+ string filename)                   ///< Filename of (index) file
+{
+  unsigned int p;                   // Piece counter
+  BinarySnapshotHeader header;      // Binary snapshot header
+  BinarySnapshotIndex index;        // Index of per-process pieces
+  ifstream piecefile;               // Stream of first piece
+
+  debug2("[Simulation::ReadBinaryHeaderFile]");
+
+  if (index.ReadIndex(infile)) {
+    piecefile.open(BinarySnapshotIndex::PieceFilename(filename,0).c_str(),
+                   ios::in | ios::binary);
+    if (!header.ReadHeader(piecefile))
+      ExceptionHandler::getIstance().raise("Invalid gandalf_bin snapshot piece");
+    header.Nsph = 0;
+    header.Nstar = 0;
+    for (p=0; p<index.Nsph.size(); p++) {
+      header.Nsph += index.Nsph[p];
+      header.Nstar += index.Nstar[p];
+    }
+  }
+  else {
+    infile.clear();
+    if (!header.ReadHeader(infile))
+      ExceptionHandler::getIstance().raise("Invalid gandalf_bin snapshot file");
+  }
+
+  info.Nsph  = header.Nsph;
+  info.Nstar = header.Nstar;
+  info.ndim  = header.ndim;
+  info.t     = header.t/simunits.t.inscale;
+
+  // Check dimensionality matches if using fixed dimensions
+  if (info.ndim != ndim) {
+    std::ostringstream stream;
+    stream << "Incorrect no. of dimensions in file : "
+     << info.ndim << "  [ndim : " << ndim << "]" << endl;
+    ExceptionHandler::getIstance().raise(stream.str());
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::ReadBinarySnapshotFile
+/// Read a native binary snapshot, either a single file or the pieces listed
+/// in a per-process index file, which are merged in order of rank.
+//=============================================================================
+template <int ndim>
+bool Simulation<ndim>::ReadBinarySnapshotFile
+(string filename)                   ///< Filename of binary snapshot file
+{
+  int isphfirst = 0;                // i.d. of first SPH ptcl of piece
+  int istarfirst = 0;               // i.d. of first star of piece
+  unsigned int p;                   // Piece counter
+  HeaderInfo info;                  // Header information
+  BinarySnapshotHeader header;      // Binary snapshot header
+  BinarySnapshotIndex index;        // Index of per-process pieces
+  ifstream infile;                  // Input file stream
+  ifstream piecefile;               // Stream of current piece
+
+  debug2("[Simulation::ReadBinarySnapshotFile]");
+
+  infile.open(filename.c_str(), ios::in | ios::binary);
+
+  ReadBinaryHeaderFile(infile, info, filename);
+  t = info.t;
+
+  sph->Nsph = info.Nsph;
+  sph->AllocateMemory(sph->Nsph);
+  nbody->Nstar = info.Nstar;
+  nbody->AllocateMemory(nbody->Nstar);
+
+  // Single file
+  if (!index.ReadIndex(infile)) {
+    infile.clear();
+    header.ReadHeader(infile);
+    ReadBinaryBlocks(infile,header,0,0);
+    infile.close();
+    return true;
+  }
+  infile.close();
+
+  // Merge per-process pieces
+  //---------------------------------------------------------------------------
+  for (p=0; p<index.Nsph.size(); p++) {
+    piecefile.open(BinarySnapshotIndex::PieceFilename(filename,p).c_str(),
+                   ios::in | ios::binary);
+    if (!header.ReadHeader(piecefile) || header.Nsph != index.Nsph[p] ||
+        header.Nstar != index.Nstar[p])
+      ExceptionHandler::getIstance().raise("Invalid gandalf_bin snapshot piece");
+    ReadBinaryBlocks(piecefile,header,isphfirst,istarfirst);
+    piecefile.close();
+    piecefile.clear();
+    isphfirst += header.Nsph;
+    istarfirst += header.Nstar;
+  }
+  //---------------------------------------------------------------------------
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  Simulation::ReadBinaryBlocks
+/// Read the field blocks of one binary snapshot file into the particle
+/// arrays, starting at the given particle i.d.s.  Each block is read with a
+/// few large read calls and scattered directly into the particle arrays.
+/// Compressed snapshots are read with ReadCompressedBinarySnapshotFile.
+/// Fields not recognised by this version of the code are skipped.
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::ReadBinaryBlocks
+(ifstream &infile,                  ///< [in] Input file stream
+ BinarySnapshotHeader &header,      ///< [in] Binary snapshot header
+ int isphfirst,                     ///< [in] i.d. of first SPH particle
+ int istarfirst)                    ///< [in] i.d. of first star particle
+{
+  int i;                            // Particle counter
+  int ifirst;                       // i.d. of first particle of field
+  int memsize;                      // Size of in-memory element
+  int Nbuf;                         // No. of elements in current chunk
+  int stride;                       // Stride of in-memory array
+  unsigned int ifield;              // Field counter
+  char *buffer;                     // Read buffer
+  char *address;                    // Address of first in-memory element
+
+  debug2("[Simulation::ReadBinaryBlocks]");
+
+  if (header.Compressed()) {
+    ReadCompressedBinarySnapshotFile(infile,header,isphfirst,istarfirst);
+    return;
+  }
+
+  buffer = new char[binary_buffer_size*sizeof(DOUBLE)];
+
+  // Read each field block in large chunks
+  //---------------------------------------------------------------------------
+  for (ifield=0; ifield<header.fields.size(); ifield++) {
+    BinaryFieldRecord &field = header.fields[ifield];
+    if (field.typesize != 4 && field.typesize != 8) continue;
+    if (field.N != (field.species == "star" ? header.Nstar : header.Nsph))
+      continue;
+    if (field.N == 0) continue;
+    ifirst = (field.species == "star" ? istarfirst : isphfirst);
+    if (BinaryFieldAddress(field,sph->sphdata,nbody->stardata,ifirst,
+                           stride,memsize) == NULL) continue;
+
+    infile.seekg(field.offset, ios::beg);
+    for (i=0; i<field.N; i+=binary_buffer_size) {
+      Nbuf = min(binary_buffer_size, field.N - i);
+      infile.read(buffer, (long) Nbuf*field.typesize);
+      address = BinaryFieldAddress(field,sph->sphdata,nbody->stardata,
+                                   ifirst + i,stride,memsize);
+      CopyStridedBlock(buffer,field.typesize,field.typesize,
+                       address,stride,memsize,Nbuf,1.0);
+    }
+  }
+  //---------------------------------------------------------------------------
+
+  delete[] buffer;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::ReadCompressedBinarySnapshotFile
+/// Read the field blocks of a compressed native binary snapshot.  Each block
+/// is read whole, decompressed, restored to the original particle order
+/// (if the SPH arrays were stored in Morton order) and scattered into the
+/// particle arrays, starting at the given particle i.d.s.
+//=============================================================================
+template <int ndim>
+void Simulation<ndim>::ReadCompressedBinarySnapshotFile
+(ifstream &infile,                  ///< [in] Input file stream
+ BinarySnapshotHeader &header,      ///< [in] Binary snapshot header
+ int isphfirst,                     ///< [in] i.d. of first SPH particle
+ int istarfirst)                    ///< [in] i.d. of first star particle
+{
+  int iorder;                       // Position of order field
+  int memsize;                      // Size of in-memory element
+  int stride;                       // Stride of in-memory array
+  unsigned int ifield;              // Field counter
+  char *address;                    // Address of first in-memory element
+  vector<char> block;               // Compressed field block
+  vector<char> buffer;              // Decompressed field
+  vector<char> unsorted;            // Field in original particle order
+  vector<int> order;                // Storage order of SPH particles
+
+  debug2("[Simulation::ReadCompressedBinarySnapshotFile]");
+
+  // Read storage order of SPH particles (if present)
+  //---------------------------------------------------------------------------
+  iorder = header.FindField("order","sph");
+  if (iorder >= 0) {
+    BinaryFieldRecord &field = header.fields[iorder];
+    order.resize(field.N + 1);
+    block.resize(field.nbytes + 1);
+    infile.seekg(field.offset, ios::beg);
+    infile.read(&block[0], field.nbytes);
+    if (field.N != header.Nsph || field.typesize != sizeof(int) ||
+        !infile.good() ||
+        !DecodeBinaryField(field,&block[0],(char *) &order[0]) ||
+        !ValidPermutation(field.N,&order[0]))
+      ExceptionHandler::getIstance().raise("Invalid gandalf_bin order field");
+  }
+
+  // Read, decompress and scatter each field block
+  //---------------------------------------------------------------------------
+  for (ifield=0; ifield<header.fields.size(); ifield++) {
+    BinaryFieldRecord &field = header.fields[ifield];
+    if (field.typesize != 4 && field.typesize != 8) continue;
+    if (field.N != (field.species == "star" ? header.Nstar : header.Nsph))
+      continue;
+    if (field.N == 0) continue;
+    address = BinaryFieldAddress(field,sph->sphdata,nbody->stardata,
+                                 field.species == "star" ?
+                                 istarfirst : isphfirst,stride,memsize);
+    if (address == NULL) continue;
+
+    block.resize(field.nbytes + 1);
+    buffer.resize((size_t) field.N*field.typesize);
+    infile.seekg(field.offset, ios::beg);
+    infile.read(&block[0], field.nbytes);
+    if (!infile.good() || !DecodeBinaryField(field,&block[0],&buffer[0])) {
+      string msg = "Corrupt gandalf_bin field block : " + field.name;
+      ExceptionHandler::getIstance().raise(msg);
+    }
+
+    if (field.species == "sph" && iorder >= 0) {
+      unsorted.resize(buffer.size());
+      PermuteElements(field.N,field.typesize,&order[0],true,
+                      &buffer[0],&unsorted[0]);
+      buffer.swap(unsorted);
+    }
+
+    CopyStridedBlock(&buffer[0],field.typesize,field.typesize,
+                     address,stride,memsize,field.N,1.0);
+  }
+  //---------------------------------------------------------------------------
+
+  return;
+}
+
+
+
+//=============================================================================
+//  Simulation::WriteBinarySnapshotFile
+/// Write SPH and N-body particle data to a native binary snapshot file.
+/// Each field is gathered (and scaled to output units) from the particle
+/// arrays into a large buffer, which is written with a single call.
+/// The MPI version writes the header from the root process and each node
+/// writes its portion of every field block directly at its own offset.
+/// Compressed snapshots of MPI runs are written as per-process pieces.
+//=============================================================================
+#ifdef MPI_PARALLEL
+template <int ndim>
+bool Simulation<ndim>::WriteBinarySnapshotFile(string filename)
+{
+  int i;                            // Particle counter
+  int ifirst;                       // Global id of first local particle
+  int iunit;                        // Unit counter
+  int memsize;                      // Size of in-memory element
+  int Nbuf;                         // No. of elements in current chunk
+  int Nlocal;                       // No. of local particles of species
+  int Ntotsph;                      // Total no. of SPH particles
+  int Ntotstar;                     // Total no. of star particles
+  int isphfirst = 0;                // Global id of first local SPH particle
+  int istarfirst = 0;               // Global id of first local star
+  int stride;                       // Stride of in-memory array
+  unsigned int ifield;              // Field counter
+  char *buffer;                     // Write buffer
+  char *address;                    // Address of first in-memory element
+  DOUBLE scale;                     // Output unit scaling of field
+  string packedheader;              // Packed header
+  BinarySnapshotHeader header;      // Binary snapshot header
+  MPI_File file;                    // MPI file handle
+  MPI_Offset offset;                // Offset of current chunk in file
+  MPI_Status status;                // MPI status
+
+  debug2("[Simulation::WriteBinarySnapshotFileMPI]");
+
+  // The sizes of compressed blocks are only known once each node has
+  // encoded its particles, so compressed snapshots are written as pieces
+  if (bin_per_rank_files == 1 || bin_compression != "none")
+    return WriteBinaryPieceFiles(filename);
+
+  if (rank == 0)
+    cout << "Writing current data to snapshot file : " << filename << endl;
+
+  // Collect total numbers of particles and the offset of this node
+  MPI_Allreduce(&sph->Nsph,&Ntotsph,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD);
+  MPI_Allreduce(&nbody->Nstar,&Ntotstar,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD);
+  MPI_Exscan(&sph->Nsph,&isphfirst,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD);
+  MPI_Exscan(&nbody->Nstar,&istarfirst,1,MPI_INT,MPI_SUM,MPI_COMM_WORLD);
+  if (rank == 0) {
+    isphfirst = 0;
+    istarfirst = 0;
+  }
+
+  SetBinaryHeader(header,Ntotsph,Ntotstar,t);
+
+  // Open file (truncating any older, longer file) and write header
+  char* filename_str = new char[strlen(filename.c_str())+1];
+  strcpy(filename_str,filename.c_str());
+  MPI_File_open(MPI_COMM_WORLD, filename_str, MPI_MODE_CREATE|MPI_MODE_WRONLY,
+                MPI_INFO_NULL, &file);
+  delete[] filename_str;
+  MPI_File_set_size(file,0);
+  if (rank == 0) {
+    packedheader = header.Pack();
+    MPI_File_write_at(file, 0, &packedheader[0], packedheader.size(),
+                      MPI_BYTE, &status);
+  }
+
+  buffer = new char[binary_buffer_size*sizeof(DOUBLE)];
+
+  // Write local portion of each field block
+  //---------------------------------------------------------------------------
+  for (ifield=0; ifield<header.fields.size(); ifield++) {
+    BinaryFieldRecord &field = header.fields[ifield];
+    Nlocal = (field.species == "star" ? nbody->Nstar : sph->Nsph);
+    ifirst = (field.species == "star" ? istarfirst : isphfirst);
+    iunit = header.FindUnit(field.unit);
+    scale = header.units[iunit].outscale;
+
+    for (i=0; i<Nlocal; i+=binary_buffer_size) {
+      Nbuf = min(binary_buffer_size, Nlocal - i);
+      address = BinaryFieldAddress(field,sph->sphdata,nbody->stardata,i,
+                                   stride,memsize);
+      CopyStridedBlock(address,stride,memsize,buffer,field.typesize,
+                       field.typesize,Nbuf,scale);
+      offset = field.offset + (MPI_Offset) (ifirst + i)*field.typesize;
+      MPI_File_write_at(file, offset, buffer, Nbuf*field.typesize,
+                        MPI_BYTE, &status);
+    }
+  }
+  //---------------------------------------------------------------------------
+
+  delete[] buffer;
+  MPI_File_close(&file);
+
+  return true;
+}
+#else
+template <int ndim>
+bool Simulation<ndim>::WriteBinarySnapshotFile(string filename)
+{
+  SnapshotData<ndim,SphParticle> snap;   // View of current particle data
+
+  snap.filename = filename;
+  snap.fileform = "gandalf_bin";
+  ViewSnapshotData(snap);
+
+  return WriteBinarySnapshotFile(snap);
+}
+#endif
+
+
+
+//=============================================================================
+//  Simulation::WriteBinaryPieceFiles
+/// Write the local particles of each process to its own binary snapshot
+/// file (filename.rNNNNN, written without any communication) and an index
+/// file holding the particle numbers of all pieces under the snapshot name.
+/// The readers merge the pieces in order of rank on demand.
+//=============================================================================
+#ifdef MPI_PARALLEL
+template <int ndim>
+bool Simulation<ndim>::WriteBinaryPieceFiles(string filename)
+{
+  int p;                            // Piece counter
+  int Nlocal[2];                    // No. of local SPH and star particles
+  vector<int> Nall;                 // Particle numbers of all pieces
+  BinarySnapshotIndex index;        // Index of pieces
+  string packedindex;               // Packed index
+  SnapshotData<ndim,SphParticle> snap;   // View of local particle data
+  ofstream outfile;                 // Output stream of index file
+
+  debug2("[Simulation::WriteBinaryPieceFiles]");
+
+  snap.filename = BinarySnapshotIndex::PieceFilename(filename,rank);
+  snap.fileform = "gandalf_bin";
+  ViewSnapshotData(snap);
+  WriteBinarySnapshotFile(snap);
+
+  // Gather particle numbers of all pieces on the root process
+  Nlocal[0] = snap.Nsph;
+  Nlocal[1] = snap.Nstar;
+  if (rank == 0) Nall.resize(2*Nmpi);
+  MPI_Gather(Nlocal,2,MPI_INT,rank == 0 ? &Nall[0] : NULL,2,MPI_INT,
+             0,MPI_COMM_WORLD);
+
+  // Write the index last, so it only exists once all pieces are listed
+  if (rank == 0) {
+    index.Nsph.resize(Nmpi);
+    index.Nstar.resize(Nmpi);
+    for (p=0; p<Nmpi; p++) {
+      index.Nsph[p] = Nall[2*p];
+      index.Nstar[p] = Nall[2*p + 1];
+    }
+    packedindex = index.Pack();
+    outfile.open(filename.c_str(), ios::out | ios::binary | ios::trunc);
+    outfile.write(packedindex.c_str(), packedindex.size());
+    outfile.close();
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  return true;
+}
+#endif
+
+
+
+//=============================================================================
+//  Simulation::WriteBinarySnapshotFile
+/// Write captured SPH and N-body particle data to a native binary snapshot
+/// file.  Uncompressed fields are streamed in large chunks; compressed
+/// snapshots are written with WriteCompressedBinarySnapshotFile.
+//=============================================================================
+template <int ndim>
+template <template<int> class ParticleType>
+bool Simulation<ndim>::WriteBinarySnapshotFile
+(SnapshotData<ndim,ParticleType> &snap)   ///< [in] Snapshot data to be written
+{
+  int i;                            // Particle counter
+  int iunit;                        // Unit counter
+  int memsize;                      // Size of in-memory element
+  int Nbuf;                         // No. of elements in current chunk
+  int stride;                       // Stride of in-memory array
+  unsigned int ifield;              // Field counter
+  char *buffer;                     // Write buffer
+  char *address;                    // Address of first in-memory element
+  DOUBLE scale;                     // Output unit scaling of field
+  string packedheader;              // Packed header
+  BinarySnapshotHeader header;      // Binary snapshot header
+  ofstream outfile;                 // Output file stream
+
+  debug2("[Simulation::WriteBinarySnapshotFile]");
+
+  if (bin_compression != "none") return WriteCompressedBinarySnapshotFile(snap);
+
+  cout << "Writing current data to snapshot file : " << snap.filename << endl;
+
+  SetBinaryHeader(header,snap.Nsph,snap.Nstar,snap.t);
+  packedheader = header.Pack();
+
+  outfile.open(snap.filename.c_str(), ios::out | ios::binary | ios::trunc);
+  outfile.write(packedheader.c_str(), packedheader.size());
+
+  buffer = new char[binary_buffer_size*sizeof(DOUBLE)];
+
+  // Gather, scale and write each field block in large chunks
+  //---------------------------------------------------------------------------
+  for (ifield=0; ifield<header.fields.size(); ifield++) {
+    BinaryFieldRecord &field = header.fields[ifield];
+    iunit = header.FindUnit(field.unit);
+    scale = header.units[iunit].outscale;
+
+    for (i=0; i<field.N; i+=binary_buffer_size) {
+      Nbuf = min(binary_buffer_size, field.N - i);
+      address = BinaryFieldAddress(field,snap.sphdata,snap.stardata,i,
+                                   stride,memsize);
+      CopyStridedBlock(address,stride,memsize,buffer,field.typesize,
+                       field.typesize,Nbuf,scale);
+      outfile.write(buffer, (long) Nbuf*field.typesize);
+    }
+  }
+  //---------------------------------------------------------------------------
+
+  delete[] buffer;
+  outfile.close();
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  Simulation::WriteCompressedBinarySnapshotFile
+/// Write captured particle data to a compressed native binary snapshot.
+/// SPH particles are written in Morton order of their positions (recorded
+/// in the "order" field), so neighbouring particles are close in every
+/// array and delta-encode well.  Each field is gathered, scaled, reordered
+/// and compressed (in parallel over chunks) before being written; the
+/// header is rewritten with the final block sizes and offsets at the end.
+//=============================================================================
+template <int ndim>
+template <template<int> class ParticleType>
+bool Simulation<ndim>::WriteCompressedBinarySnapshotFile
+(SnapshotData<ndim,ParticleType> &snap)   ///< [in] Snapshot data to be written
+{
+  int i;                            // Particle counter
+  int iunit;                        // Unit counter
+  int k;                            // Dimension counter
+  int memsize;                      // Size of in-memory element
+  int stride;                       // Stride of in-memory array
+  unsigned int ifield;              // Field counter
+  long long offset;                 // Offset of next block in file
+  char *address;                    // Address of first in-memory element
+  DOUBLE scale;                     // Output unit scaling of field
+  string block;                     // Compressed field block
+  vector<char> buffer;              // Gathered field
+  vector<char> sorted;              // Gathered field in Morton order
+  vector<double> rsph;              // Positions of SPH particles
+  vector<int> order;                // Morton order of SPH particles
+  BinarySnapshotHeader header;      // Binary snapshot header
+  ofstream outfile;                 // Output file stream
+
+  debug2("[Simulation::WriteCompressedBinarySnapshotFile]");
+
+  cout << "Writing current data to snapshot file : " << snap.filename << endl;
+
+  SetBinaryHeader(header,snap.Nsph,snap.Nstar,snap.t);
+
+  // Compute Morton order of SPH particles
+  //---------------------------------------------------------------------------
+  if (snap.Nsph > 0) {
+    rsph.resize((size_t) snap.Nsph*ndim);
+    order.resize(snap.Nsph);
+    for (i=0; i<snap.Nsph; i++)
+      for (k=0; k<ndim; k++) rsph[i*ndim + k] = snap.sphdata[i].r[k];
+    ComputeMortonOrder(snap.Nsph,ndim,&rsph[0],&order[0]);
+    header.AddField("order","sph","",sizeof(int));
+  }
+
+  // Select codec of each field
+  //---------------------------------------------------------------------------
+  for (ifield=0; ifield<header.fields.size(); ifield++) {
+    BinaryFieldRecord &field = header.fields[ifield];
+    field.codec = binary_codec_lossless;
+    field.chunksize = binary_chunk_size;
+    if (bin_compression == "lossy" && field.species == "sph" &&
+        (field.name == "rho" || field.name == "u" || field.name == "h")) {
+      field.codec = binary_codec_quantised;
+      field.param = bin_lossy_error;
+    }
+  }
+
+  outfile.open(snap.filename.c_str(), ios::out | ios::binary | ios::trunc);
+  outfile.write(header.Pack().c_str(), header.HeaderSize());
+  offset = header.HeaderSize();
+
+  // Gather, scale, reorder, compress and write each field block
+  //---------------------------------------------------------------------------
+  for (ifield=0; ifield<header.fields.size(); ifield++) {
+    BinaryFieldRecord &field = header.fields[ifield];
+    buffer.resize((size_t) field.N*field.typesize + 1);
+
+    if (field.name == "order" && field.species == "sph") {
+      memcpy(&buffer[0],&order[0],(size_t) field.N*sizeof(int));
+    }
+    else if (field.N > 0) {
+      iunit = header.FindUnit(field.unit);
+      scale = header.units[iunit].outscale;
+      address = BinaryFieldAddress(field,snap.sphdata,snap.stardata,0,
+                                   stride,memsize);
+      CopyStridedBlock(address,stride,memsize,&buffer[0],field.typesize,
+                       field.typesize,field.N,scale);
+      if (field.species == "sph") {
+        sorted.resize(buffer.size());
+        PermuteElements(field.N,field.typesize,&order[0],false,
+                        &buffer[0],&sorted[0]);
+        buffer.swap(sorted);
+      }
+    }
+
+    EncodeBinaryField(field,&buffer[0],block);
+    field.offset = offset;
+    offset += field.nbytes;
+    outfile.write(block.c_str(), block.size());
+  }
+  //---------------------------------------------------------------------------
+
+  outfile.seekp(0, ios::beg);
+  outfile.write(header.Pack().c_str(), header.HeaderSize());
+  outfile.close();
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  Restart file layout
+//
+//  char magic[8], int idata[restart_Nint], DOUBLE ddata[5], FLOAT fdata[2],
+//  Diagnostics diag0, followed by the raw SPH particle, SPH integration,
+//  star and sink arrays, the star i.d. of each sink and the length of the
+//  time-series file of each in-situ analysis.  The first
+//  restart_Nlayout integers record the sizes of all dumped structures, so
+//  restart files can only be read by an executable built identically.
+//  MPI runs write one file per process (see RestartFilename) holding the
+//  particles of that process, so must be restarted on the same number of
+//  processes.
+//=============================================================================
+static const char restart_magic[8] = {'G','A','N','D','A','L','F','R'};
+static const int restart_version = 3;
+static const int restart_Nlayout = 9;
+static const int restart_Nint = 24;
+
+
+
+//=============================================================================
+//  Simulation::WriteRestartFile
+/// Write the complete integrator state to a restart file.  The file is first
+/// written under a temporary name and then renamed, so a run killed while
+/// writing always leaves the previous restart file intact.  Ghosts and trees
+/// are not stored but rebuilt by restarted runs, so restart files should 
+/// only be written before a tree-rebuild step (see Checkpoint) for the 
+/// restarted run to continue bit-identically.  For MPI runs, the files of 
+/// all processes are only renamed once all have been written.
+//=============================================================================
+template <int ndim>
+bool Simulation<ndim>::WriteRestartFile(string filename)
+{
+  int idata[restart_Nint];          // Integer restart data
+  int ok;                           // Flag if restart file was written
+  int s;                            // Sink counter
+  int *sinkstar;                    // Star i.d. of each sink
+  long *analysispos;                // Length of each analysis file
+  DOUBLE ddata[5];                  // Double precision restart data
+  FLOAT fdata[2];                   // Floating point restart data
+  string tmpfilename = filename + ".tmp";   // Temporary restart file name
+  ofstream outfile;                 // Output file stream
+
+  debug2("[Simulation::WriteRestartFile]");
+
+  // Restart file must never refer to snapshots not yet on disk
+  FlushSnapshotFiles();
+
+  idata[0]  = restart_version;
+  idata[1]  = ndim;
+  idata[2]  = sizeof(FLOAT);
+  idata[3]  = sizeof(DOUBLE);
+  idata[4]  = sizeof(SphParticle<ndim>);
+  idata[5]  = sizeof(SphIntParticle<ndim>);
+  idata[6]  = sizeof(StarParticle<ndim>);
+  idata[7]  = sizeof(SinkParticle<ndim>);
+  idata[8]  = sizeof(Diagnostics<ndim>);
+  idata[9]  = n;
+  idata[10] = nresync;
+  idata[11] = level_step;
+  idata[12] = level_max;
+  idata[13] = Nsteps;
+  idata[14] = Nblocksteps;
+  idata[15] = Noutsnap;
+  idata[16] = sph->Nsph;
+  idata[17] = sph->Nsphmax;
+  idata[18] = nbody->Nstar;
+  idata[19] = nbody->Nstarmax;
+  idata[20] = sinks.Nsink;
+  idata[21] = sinks.Nsinkmax;
+  idata[22] = (int) analyses.size();
+  idata[23] = Nmpi;
+  ddata[0]  = t;
+  ddata[1]  = timestep;
+  ddata[2]  = dt_max;
+  ddata[3]  = tsnapnext;
+  ddata[4]  = tanalysisnext;
+  fdata[0]  = sph->mmean;
+  fdata[1]  = sph->hmin_sink;
+
+  sinkstar = new int[max(sinks.Nsink,1)];
+  for (s=0; s<sinks.Nsink; s++)
+    sinkstar[s] = (int) (sinks.sink[s].star - nbody->stardata);
+  analysispos = new long[max((int) analyses.size(),1)];
+  for (s=0; s<(int) analyses.size(); s++)
+    analysispos[s] = analyses[s]->FilePosition();
+
+  outfile.open(tmpfilename.c_str(), ios::out | ios::binary | ios::trunc);
+  outfile.write(restart_magic,8);
+  outfile.write((char *) idata,restart_Nint*sizeof(int));
+  outfile.write((char *) ddata,5*sizeof(DOUBLE));
+  outfile.write((char *) fdata,2*sizeof(FLOAT));
+  outfile.write((char *) &diag0,sizeof(Diagnostics<ndim>));
+  outfile.write((char *) sph->sphdata,
+                (streamsize) sph->Nsph*sizeof(SphParticle<ndim>));
+  outfile.write((char *) sph->sphintdata,
+                (streamsize) sph->Nsph*sizeof(SphIntParticle<ndim>));
+  outfile.write((char *) nbody->stardata,
+                (streamsize) nbody->Nstar*sizeof(StarParticle<ndim>));
+  outfile.write((char *) sinks.sink,
+                (streamsize) sinks.Nsink*sizeof(SinkParticle<ndim>));
+  outfile.write((char *) sinkstar,sinks.Nsink*sizeof(int));
+  outfile.write((char *) analysispos,analyses.size()*sizeof(long));
+  outfile.close();
+  delete[] analysispos;
+  delete[] sinkstar;
+
+  // Only replace the old restart file once the new one is complete
+  ok = outfile.fail() ? 0 : 1;
+#ifdef MPI_PARALLEL
+  MPI_Allreduce(MPI_IN_PLACE,&ok,1,MPI_INT,MPI_MIN,MPI_COMM_WORLD);
+#endif
+  if (ok == 0 || rename(tmpfilename.c_str(),filename.c_str()) != 0) {
+    cout << "Warning: could not write restart file " << filename << endl;
+    remove(tmpfilename.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  Simulation::ReadRestartFile
+/// Restore the complete integrator state from a restart file.  Must be called
+/// after the parameters have been processed, in place of generating the
+/// initial conditions and PostInitialConditionsSetup.  All objects and
+/// variables set from the parameters (units, EOS, kernel, neighbour search,
+/// boundaries, sinks, output and analysis settings) are therefore set up as
+/// for a new run.  Everything PostInitialConditionsSetup computes from the
+/// initial conditions (smoothing lengths, densities, accelerations,
+/// viscosity parameters, start-of-step values, mmean and diag0) is part of
+/// the stored particle arrays and header.  What is not stored is rebuilt :
+///   - pointers : SphIntParticle::part, nbodydata and the star of each sink,
+///   - particle counters : Ntot, Nghost, Nghostmax and Nnbody,
+///   - in-situ analysis files, re-opened and truncated to the restart time,
+///   - ghost particles and all trees, rebuilt at the start of the first
+///     step (rebuild_tree),
+///   - for MPI runs, the domains of all processes, found again from the
+///     stored particles and their measured work.
+/// Returns false if no restart file exists (on any process).
+//=============================================================================
+template <int ndim>
+bool Simulation<ndim>::ReadRestartFile(string filename)
+{
+  int i;                            // Particle counter
+  int idata[restart_Nint];          // Integer restart data
+  int s;                            // Sink counter
+  int *sinkstar;                    // Star i.d. of each sink
+  long *analysispos;                // Length of each analysis file
+  char magic[8];                    // Magic string of file
+  DOUBLE ddata[5];                  // Double precision restart data
+  FLOAT fdata[2];                   // Floating point restart data
+  ifstream infile;                  // Input file stream
+#ifdef MPI_PARALLEL
+  int found[2];                     // -min and max of file found flags
+  int steps[2];                     // -min and max of Nsteps
+#endif
+
+  debug2("[Simulation::ReadRestartFile]");
+
+  infile.open(filename.c_str(), ios::in | ios::binary);
+
+  // All processes must find their file, or none (for a fresh start)
+#ifdef MPI_PARALLEL
+  found[0] = infile.is_open() ? -1 : 0;
+  found[1] = infile.is_open() ? 1 : 0;
+  MPI_Allreduce(MPI_IN_PLACE,found,2,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+  if (found[1] == 1 && found[0] == 0) {
+    string msg = "Error: restart files of some MPI processes are missing";
+    ExceptionHandler::getIstance().raise(msg);
+  }
+#endif
+  if (!infile.is_open()) return false;
+
+  infile.read(magic,8);
+  infile.read((char *) idata,restart_Nint*sizeof(int));
+  if (!infile.good() || memcmp(magic,restart_magic,8) != 0) {
+    string msg = "Error: " + filename + " is not a valid restart file";
+    ExceptionHandler::getIstance().raise(msg);
+  }
+  if (idata[0] != restart_version || idata[1] != ndim ||
+      idata[2] != (int) sizeof(FLOAT) || idata[3] != (int) sizeof(DOUBLE) ||
+      idata[4] != (int) sizeof(SphParticle<ndim>) ||
+      idata[5] != (int) sizeof(SphIntParticle<ndim>) ||
+      idata[6] != (int) sizeof(StarParticle<ndim>) ||
+      idata[7] != (int) sizeof(SinkParticle<ndim>) ||
+      idata[8] != (int) sizeof(Diagnostics<ndim>)) {
+    string msg = "Error: restart file " + filename +
+      " was written by an incompatible build of the code";
+    ExceptionHandler::getIstance().raise(msg);
+  }
+  if (idata[23] != Nmpi) {
+    string msg = "Error: restart file " + filename + 
+      " was written by a run with a different no. of MPI processes";
+    ExceptionHandler::getIstance().raise(msg);
+  }
+  if (idata[22] != (int) analyses.size()) {
+    string msg = "Error: in-situ analyses differ from those of the run " 
+      "that wrote restart file " + filename;
+    ExceptionHandler::getIstance().raise(msg);
+  }
+
+  infile.read((char *) ddata,5*sizeof(DOUBLE));
+  infile.read((char *) fdata,2*sizeof(FLOAT));
+  infile.read((char *) &diag0,sizeof(Diagnostics<ndim>));
+
+  n           = idata[9];
+  nresync     = idata[10];
+  level_step  = idata[11];
+  level_max   = idata[12];
+  Nsteps      = idata[13];
+  Nblocksteps = idata[14];
+  Noutsnap    = idata[15];
+#ifdef MPI_PARALLEL
+  steps[0] = -Nsteps;
+  steps[1] = Nsteps;
+  MPI_Allreduce(MPI_IN_PLACE,steps,2,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+  if (steps[0] != -steps[1]) {
+    string msg = "Error: restart files of the MPI processes were written "
+      "at different steps";
+    ExceptionHandler::getIstance().raise(msg);
+  }
+#endif
+  t           = ddata[0];
+  timestep    = ddata[1];
+  dt_max      = ddata[2];
+  tsnapnext   = ddata[3];
+  tanalysisnext = ddata[4];
+
+  // Allocate memory with the same capacities as the original run
+  if (!sph->allocated) sph->Nsphmax = idata[17];
+  sph->Nsph = idata[16];
+  sph->AllocateMemory(sph->Nsph);
+  sph->mmean = fdata[0];
+  sph->hmin_sink = fdata[1];
+  nbody->AllocateMemory(idata[19]);
+  nbody->Nstar = idata[18];
+  sinks.AllocateMemory(idata[21]);
+  sinks.Nsink = idata[20];
+
+  infile.read((char *) sph->sphdata,
+              (streamsize) sph->Nsph*sizeof(SphParticle<ndim>));
+  infile.read((char *) sph->sphintdata,
+              (streamsize) sph->Nsph*sizeof(SphIntParticle<ndim>));
+  infile.read((char *) nbody->stardata,
+              (streamsize) nbody->Nstar*sizeof(StarParticle<ndim>));
+  infile.read((char *) sinks.sink,
+              (streamsize) sinks.Nsink*sizeof(SinkParticle<ndim>));
+  sinkstar = new int[max(sinks.Nsink,1)];
+  infile.read((char *) sinkstar,sinks.Nsink*sizeof(int));
+  analysispos = new long[max((int) analyses.size(),1)];
+  infile.read((char *) analysispos,analyses.size()*sizeof(long));
+
+  if (!infile.good()) {
+    string msg = "Error: restart file " + filename + " is truncated";
+    ExceptionHandler::getIstance().raise(msg);
+  }
+  infile.close();
+
+  // Re-point all stored pointers to the newly allocated arrays
+  for (i=0; i<sph->Nsph; i++) sph->sphintdata[i].part = &(sph->sphdata[i]);
+  for (i=0; i<nbody->Nstar; i++) nbody->nbodydata[i] = &(nbody->stardata[i]);
+  for (s=0; s<sinks.Nsink; s++)
+    sinks.sink[s].star = &(nbody->stardata[sinkstar[s]]);
+  delete[] sinkstar;
+
+  // Continue the analysis time-series from the time of the restart file
+  for (s=0; s<(int) analyses.size(); s++)
+    analyses[s]->OpenFile(this,analysispos[s]);
+  delete[] analysispos;
+
+  // Find the domains of all processes again, moving particles if necessary
+#ifdef MPI_PARALLEL
+  mpicontrol.CreateRestartDomainDecomposition(sph,simbox);
+#endif
+
+  // Ghosts and trees are not stored, so rebuild them on the next step
+  sph->Nghost = 0;
+  sph->Nghostmax = sph->Nsphmax - sph->Nsph;
+  sph->Ntot = sph->Nsph;
+  nbody->Nnbody = nbody->Nstar;
+  rebuild_tree = true;
+
+  return true;
+}
+
+
+
 //=============================================================================
 //  Simulation::ConvertToCodeUnits
 /// For any simulations loaded into memory via a snapshot file, all particle 
@@ -0,0 +1,218 @@
+//=============================================================================
+//  SnapshotWriter.cpp
+//  Contains all functions of the background snapshot writer thread.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <algorithm>
+#include <string>
+#include <pthread.h>
+#include "SnapshotWriter.h"
+#include "Simulation.h"
+#include "ThreadAffinity.h"
+#include "Exception.h"
+#include "Debug.h"
+#if defined _OPENMP
+#include "omp.h"
+#endif
+using namespace std;
+
+
+
+//=============================================================================
+//  SnapshotWriter::SnapshotWriter
+/// SnapshotWriter constructor.  Creates the pool of snapshot buffers and
+/// starts the writer thread.
+//=============================================================================
+template <int ndim>
+SnapshotWriter<ndim>::SnapshotWriter
+(Simulation<ndim> *simaux,          ///< [in] Simulation writing snapshots
+ int Nbufferaux)                    ///< [in] No. of snapshot buffers
+{
+  int i;                            // Buffer counter
+
+  debug2("[SnapshotWriter::SnapshotWriter]");
+
+  finished = false;
+  writing = false;
+  Nbuffer = max(Nbufferaux,1);
+  sim = simaux;
+
+  for (i=0; i<Nbuffer; i++) {
+    buffers.push_back(new SnapshotData<ndim>());
+    freebuffers.push_back(buffers.back());
+  }
+
+  pthread_mutex_init(&lock,NULL);
+  pthread_cond_init(&cond,NULL);
+  if (pthread_create(&thread,NULL,ThreadMain,this) != 0) {
+    string msg = "Error: could not start snapshot writer thread";
+    ExceptionHandler::getIstance().raise(msg);
+  }
+}
+
+
+
+//=============================================================================
+//  SnapshotWriter::~SnapshotWriter
+/// SnapshotWriter destructor.  Writes all pending snapshots, then stops the
+/// writer thread and frees all buffers.
+//=============================================================================
+template <int ndim>
+SnapshotWriter<ndim>::~SnapshotWriter()
+{
+  unsigned int i;                   // Buffer counter
+
+  Flush();
+
+  pthread_mutex_lock(&lock);
+  finished = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread,NULL);
+
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+  for (i=0; i<buffers.size(); i++) delete buffers[i];
+}
+
+
+
+//=============================================================================
+//  SnapshotWriter::GetFreeBuffer
+/// Return a snapshot buffer to capture the next snapshot into.  Blocks until
+/// the writer thread has released a buffer if all are in use.
+//=============================================================================
+template <int ndim>
+SnapshotData<ndim>* SnapshotWriter<ndim>::GetFreeBuffer(void)
+{
+  SnapshotData<ndim> *snap;         // Free snapshot buffer
+
+  debug2("[SnapshotWriter::GetFreeBuffer]");
+
+  pthread_mutex_lock(&lock);
+  while (freebuffers.empty()) pthread_cond_wait(&cond,&lock);
+  snap = freebuffers.front();
+  freebuffers.pop_front();
+  pthread_mutex_unlock(&lock);
+
+  return snap;
+}
+
+
+
+//=============================================================================
+//  SnapshotWriter::QueueSnapshot
+/// Hand a captured snapshot over to the writer thread.
+//=============================================================================
+template <int ndim>
+void SnapshotWriter<ndim>::QueueSnapshot
+(SnapshotData<ndim> *snap)          ///< [in] Captured snapshot
+{
+  debug2("[SnapshotWriter::QueueSnapshot]");
+
+  pthread_mutex_lock(&lock);
+  queue.push_back(snap);
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SnapshotWriter::Flush
+/// Block until all queued snapshots have been written to disk.
+//=============================================================================
+template <int ndim>
+void SnapshotWriter<ndim>::Flush(void)
+{
+  debug2("[SnapshotWriter::Flush]");
+
+  pthread_mutex_lock(&lock);
+  while (!queue.empty() || writing) pthread_cond_wait(&cond,&lock);
+  pthread_mutex_unlock(&lock);
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SnapshotWriter::ThreadMain
+/// Entry point of the writer thread.  The writer runs serially, and (if
+/// threads are pinned) not on the CPU of OpenMP thread 0, so it does not
+/// compete with the OpenMP threads of the main loop.
+//=============================================================================
+template <int ndim>
+void* SnapshotWriter<ndim>::ThreadMain
+(void *writer)                      ///< [in] Pointer to SnapshotWriter
+{
+#if defined _OPENMP
+  omp_set_num_threads(1);
+#endif
+  UnpinThread();
+  static_cast<SnapshotWriter<ndim>*>(writer)->WriterLoop();
+  return NULL;
+}
+
+
+
+//=============================================================================
+//  SnapshotWriter::WriterLoop
+/// Write queued snapshots in order until the writer is finished.
+//=============================================================================
+template <int ndim>
+void SnapshotWriter<ndim>::WriterLoop(void)
+{
+  SnapshotData<ndim> *snap;         // Snapshot being written
+
+  pthread_mutex_lock(&lock);
+
+  //---------------------------------------------------------------------------
+  while (true) {
+    while (queue.empty() && !finished) pthread_cond_wait(&cond,&lock);
+    if (queue.empty()) break;
+
+    snap = queue.front();
+    queue.pop_front();
+    writing = true;
+    pthread_mutex_unlock(&lock);
+
+    sim->WriteSnapshotData(*snap);
+
+    pthread_mutex_lock(&lock);
+    writing = false;
+    freebuffers.push_back(snap);
+    pthread_cond_broadcast(&cond);
+  }
+  //---------------------------------------------------------------------------
+
+  pthread_mutex_unlock(&lock);
+
+  return;
+}
+
+
+
+template class SnapshotWriter<1>;
+template class SnapshotWriter<2>;
+template class SnapshotWriter<3>;
@@ -0,0 +1,132 @@
+//=============================================================================
+//  SnapshotWriter.h
+//  Contains the definitions of the captured snapshot data and of the
+//  background thread that writes captured snapshots to disk.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#ifndef _SNAPSHOT_WRITER_H_
+#define _SNAPSHOT_WRITER_H_
+
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include "Precision.h"
+#include "SphParticle.h"
+#include "StarParticle.h"
+using namespace std;
+
+
+// Forward declaration of Simulation to prevent circular dependency
+template <int ndim>
+class Simulation;
+
+
+
+//=============================================================================
+//  Struct SnapshotData
+/// \brief   Particle data and metadata of one snapshot to be written.
+/// \details Either owns a copy of the particle quantities written to
+///          snapshot files, taken at the time the snapshot was due, so the
+///          snapshot can be written while the simulation continues, or
+///          points to the live particle arrays (ParticleType = SphParticle)
+///          for synchronous writes.
+//=============================================================================
+template <int ndim, template<int> class ParticleType=SnapshotParticle>
+struct SnapshotData
+{
+  bool owndata;                     ///< Does the object own the arrays?
+  int Nsph;                         ///< No. of SPH particles
+  int Nsphmax;                      ///< Size of owned SPH particle array
+  int Nstar;                        ///< No. of star particles
+  int Nstarmax;                     ///< Size of owned star particle array
+  int Nsteps;                       ///< No. of steps when captured
+  DOUBLE t;                         ///< Simulation time when captured
+  string filename;                  ///< Name of snapshot file
+  string fileform;                  ///< Format of snapshot file
+  ParticleType<ndim> *sphdata;      ///< SPH particle data
+  StarParticle<ndim> *stardata;     ///< Star particle data
+
+  SnapshotData()
+  {
+    owndata = true;
+    Nsph = 0;
+    Nsphmax = 0;
+    Nstar = 0;
+    Nstarmax = 0;
+    Nsteps = 0;
+    t = 0.0;
+    sphdata = NULL;
+    stardata = NULL;
+  }
+
+  ~SnapshotData()
+  {
+    if (owndata) {
+      delete[] stardata;
+      delete[] sphdata;
+    }
+  }
+
+};
+
+
+
+//=============================================================================
+//  Class SnapshotWriter
+/// \brief   Background thread writing captured snapshots to disk.
+/// \details Owns a fixed pool of snapshot buffers.  The simulation fills a
+///          free buffer and queues it; the writer thread writes queued
+///          snapshots in order and returns their buffers to the pool.  When
+///          all buffers are in use, requesting a buffer blocks until the
+///          oldest pending snapshot has been written (back-pressure).
+//=============================================================================
+template <int ndim>
+class SnapshotWriter
+{
+ public:
+
+  SnapshotWriter(Simulation<ndim> *, int);
+  ~SnapshotWriter();
+
+  SnapshotData<ndim>* GetFreeBuffer(void);
+  void QueueSnapshot(SnapshotData<ndim> *);
+  void Flush(void);
+
+ private:
+
+  static void* ThreadMain(void *);
+  void WriterLoop(void);
+
+  bool finished;                    ///< Flag to terminate writer thread
+  bool writing;                     ///< Is a snapshot currently written?
+  int Nbuffer;                      ///< No. of snapshot buffers in pool
+  Simulation<ndim> *sim;            ///< Simulation writing the snapshots
+  pthread_t thread;                 ///< Writer thread
+  pthread_mutex_t lock;             ///< Lock protecting the queues
+  pthread_cond_t cond;              ///< Signalled on any queue change
+  deque<SnapshotData<ndim>*> freebuffers;   ///< Buffers free for capture
+  deque<SnapshotData<ndim>*> queue;         ///< Snapshots waiting to be written
+  vector<SnapshotData<ndim>*> buffers;      ///< All buffers of pool
+
+};
+#endif
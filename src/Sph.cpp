@@ -25,6 +25,7 @@
 #include <cstring>
 #include <cstdlib>
 #include <iostream>
+#include <new>
 #include <math.h>
 #include "Precision.h"
 #include "Sph.h"
@@ -65,7 +66,8 @@ Sph<ndim>::Sph(int hydro_forces_aux, int self_gravity_aux,
   Nsphmax(0),
   NPeriodicGhost(0),
   avisc(avisc_aux),
-  acond(acond_aux)
+  acond(acond_aux),
+  Nghostdim(ndim)
 {
 }
 
@@ -75,27 +77,57 @@ Sph<ndim>::Sph(int hydro_forces_aux, int self_gravity_aux,
 //  Sph::AllocateMemory
 /// Allocate main SPH particle array.  Currently sets the maximum memory to 
 /// be 10 times the numbers of particles to allow space for ghost particles 
-/// and new particle creation.
+/// and new particle creation.  The arrays are only reserved here and then 
+/// constructed (i.e. first touched) in the same static OpenMP partition as 
+/// the particle loops, so on NUMA machines each page is placed on the 
+/// memory node of the thread that later works on it.
 //=============================================================================
 template <int ndim>
 void Sph<ndim>::AllocateMemory(int N)
 {
+  int i;                            // Particle counter
+  int k;                            // Dimension counter
+
   debug2("[Sph::AllocateMemory]");
 
   if (N > Nsphmax || !allocated) {
     if (allocated) DeallocateMemory();
 
     // Set conservative estimate for maximum number of particles, assuming 
-    // extra space required for periodic ghost particles
+    // extra space required for ghost particles in all dimensions with ghost
+    // boundaries (i.e. not in dimensions wrapped by the neighbour search)
     if (Nsphmax < N) 
-      Nsphmax = pow(pow(N,invndim) + 8.0*kernp->kernrange,ndim);
+      Nsphmax = max(N,(int) (pow(pow(N,invndim),ndim - Nghostdim)*
+        pow(pow(N,invndim) + 8.0*kernp->kernrange,Nghostdim)));
 
     iorder = new int[Nsphmax];
     rsph = new FLOAT[ndim*Nsphmax];
-    sphdata = new struct SphParticle<ndim>[Nsphmax];
-    sphintdata = new SphIntParticle<ndim>[Nsphmax];
-    for (int i=0; i<Nsphmax; i++) {
-     sphintdata[i].part=&sphdata[i];
+    sphdata = static_cast<SphParticle<ndim> *>
+      (::operator new(sizeof(SphParticle<ndim>)*Nsphmax));
+    sphintdata = static_cast<SphIntParticle<ndim> *>
+      (::operator new(sizeof(SphIntParticle<ndim>)*Nsphmax));
+
+    // First-touch the real particles [0,N) and the spare (ghost) slots 
+    // [N,Nsphmax) with separate static loops, matching the partitions of 
+    // loops over Nsph and over ghost particles respectively
+#pragma omp parallel default(none) private(i,k) shared(N)
+    {
+#pragma omp for schedule(static)
+      for (i=0; i<N; i++) {
+        new (&sphdata[i]) SphParticle<ndim>();
+        new (&sphintdata[i]) SphIntParticle<ndim>();
+        sphintdata[i].part = &sphdata[i];
+        for (k=0; k<ndim; k++) rsph[ndim*i + k] = 0.0;
+        iorder[i] = i;
+      }
+#pragma omp for schedule(static)
+      for (i=N; i<Nsphmax; i++) {
+        new (&sphdata[i]) SphParticle<ndim>();
+        new (&sphintdata[i]) SphIntParticle<ndim>();
+        sphintdata[i].part = &sphdata[i];
+        for (k=0; k<ndim; k++) rsph[ndim*i + k] = 0.0;
+        iorder[i] = i;
+      }
     }
     allocated = true;
   }
@@ -108,6 +140,54 @@ void Sph<ndim>::AllocateMemory(int N)
 
 
 
+//=============================================================================
+//  Sph::ReallocateMemory
+/// Grow the main SPH particle arrays so they can hold at least N particles,
+/// preserving the data of all current (real and ghost) particles.  Does
+/// nothing if the arrays are already large enough.
+//=============================================================================
+template <int ndim>
+void Sph<ndim>::ReallocateMemory(int N)
+{
+  int i;                            // Particle counter
+  SphParticle<ndim> *sphdataold;    // Old SPH particle array
+  SphIntParticle<ndim> *sphintdataold;  // Old SPH integration array
+
+  debug2("[Sph::ReallocateMemory]");
+
+  if (!allocated) {
+    AllocateMemory(N);
+    return;
+  }
+  if (N <= Nsphmax) return;
+
+  // Keep the old particle arrays until the data has been copied
+  sphdataold = sphdata;
+  sphintdataold = sphintdata;
+#if defined _OPENMP
+  DestroyParticleLocks();
+#endif
+  delete[] rsph;
+  delete[] iorder;
+  allocated = false;
+  AllocateMemory(N);
+
+#pragma omp parallel for default(none) private(i) \
+  shared(sphdataold,sphintdataold)
+  for (i=0; i<Ntot; i++) {
+    sphdata[i] = sphdataold[i];
+    sphintdata[i] = sphintdataold[i];
+    sphintdata[i].part = &sphdata[i];
+  }
+
+  ::operator delete(sphintdataold);
+  ::operator delete(sphdataold);
+
+  return;
+}
+
+
+
 //=============================================================================
 //  Sph::DeallocateMemory
 /// Deallocate main array containing SPH particle data.
@@ -121,8 +201,8 @@ void Sph<ndim>::DeallocateMemory(void)
 #if defined _OPENMP
     DestroyParticleLocks();
 #endif
-    delete[] sphintdata;
-    delete[] sphdata;
+    ::operator delete(sphintdata);
+    ::operator delete(sphdata);
     delete[] rsph;
     delete[] iorder;
   }
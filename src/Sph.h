@@ -109,6 +109,7 @@ private:
   // SPH array memory allocation functions
   //---------------------------------------------------------------------------
   void AllocateMemory(int);
+  void ReallocateMemory(int);
   void DeallocateMemory(void);
   void DeleteParticles(int, int *);
   void ReorderParticles(void);
@@ -135,6 +136,7 @@ private:
   int Ntot;                           ///< No. of real + ghost particles
   int Nsphmax;                        ///< Max. no. of SPH particles in array
   int Nghostmax;                      ///< Max. allowed no. of ghost particles
+  int Nghostdim;                      ///< No. of dimensions with ghosts
 
   const FLOAT alpha_visc;             ///< alpha artificial viscosity parameter
   const FLOAT beta_visc;              ///< beta artificial viscosity parameter
@@ -65,6 +65,12 @@ class SphKernel
     ExceptionHandler::getIstance().raise(message);
     return 0;
   };
+  virtual FLOAT wLOScumulative(FLOAT) {
+    //We do not provide a default behaviour
+    string message = "Using a non-tabulated kernel, cannot use the column integrated kernel!";
+    ExceptionHandler::getIstance().raise(message);
+    return 0;
+  };
 
 
   // For the versions using the squared distance, the default behaviour
@@ -73,6 +79,7 @@ class SphKernel
   virtual inline FLOAT w0_s2(FLOAT s) {return this->w0(sqrt(s));};
   virtual inline FLOAT womega_s2(FLOAT s) {return this->womega(sqrt(s));};
   virtual inline FLOAT wzeta_s2(FLOAT s) {return this->wzeta(sqrt(s));};
+  virtual inline FLOAT wLOS_s2(FLOAT s) {return this->wLOS(sqrt(s));};
 
 
   // Kernel variables
@@ -559,6 +566,9 @@ class TabulatedKernel: public SphKernel<ndim>
   FLOAT* tableWomega_s2;            ///< Tabulated Womega with ssqd argument
   FLOAT* tableWzeta_s2;             ///< Tabulated Wzeta with ssqd argument
   FLOAT* tableLOS;                  ///< Tabulated Line-of-sight kernel
+  FLOAT* tableLOS_s2;               ///< Tabulated LOS kernel with ssqd argument
+  FLOAT* tableLOScumulative;        ///< Fraction of column-integrated kernel
+                                    ///< at x-offsets below u (res+1 values)
 
   void initializeTableLOS();
 
@@ -658,6 +668,8 @@ class TabulatedKernel: public SphKernel<ndim>
     delete[] tableWomega_s2;
     delete[] tableWzeta_s2;
     delete[] tableLOS;
+    delete[] tableLOS_s2;
+    delete[] tableLOScumulative;
   }
 
   FLOAT w0(FLOAT s);
@@ -670,6 +682,8 @@ class TabulatedKernel: public SphKernel<ndim>
   FLOAT wgrav(FLOAT s);
   FLOAT wpot(FLOAT s);
   FLOAT wLOS(FLOAT s);
+  FLOAT wLOS_s2(FLOAT s);
+  FLOAT wLOScumulative(FLOAT u);
 
 };
 
@@ -727,4 +741,25 @@ inline FLOAT TabulatedKernel<ndim>::wLOS (FLOAT s) {
   return tableLookup(tableLOS, s);
 }
 
+template <int ndim>
+inline FLOAT TabulatedKernel<ndim>::wLOS_s2 (FLOAT s2) {
+  return tableLookupSqd(tableLOS_s2, s2);
+}
+
+//-----------------------------------------------------------------------------
+//  Fraction of the column-integrated kernel lying at (projected) x-offsets 
+//  below u (in units of h), linearly interpolated so that it varies smoothly
+//  with particle position.  Used for pixel-area averaging of particles 
+//  smaller than a pixel.
+//-----------------------------------------------------------------------------
+template <int ndim>
+inline FLOAT TabulatedKernel<ndim>::wLOScumulative (FLOAT u) {
+  if (u <= -this->kernrange) return (FLOAT) 0.0;
+  if (u >= this->kernrange) return (FLOAT) 1.0;
+  FLOAT indexf = (FLOAT) 0.5*(u + this->kernrange)*resinvkernrange;
+  int index = min((int) indexf,res - 1);
+  return tableLOScumulative[index] + (indexf - (FLOAT) index)*
+    (tableLOScumulative[index+1] - tableLOScumulative[index]);
+}
+
 #endif
@@ -43,9 +43,13 @@ using namespace std;
 
 //=============================================================================
 //  Structure GridCell
-/// Neighbour grid cell data structure
+/// Neighbour grid cell data structure.  Only occupied cells are stored, 
+/// so each cell records its own level and coordinate.
 //=============================================================================
+template <int ndim>
 struct GridCell {
+  int level;                        ///< Grid level of cell
+  int igrid[ndim];                  ///< Cell coordinate on grid level
   int Nactive;                      ///< No. of active particles in grid cell
   int Nptcls;                       ///< Total no. of particles in grid cell
   int ifirst;                       ///< i.d. of first particle in cell
@@ -54,6 +58,25 @@ struct GridCell {
 
 
 
+//=============================================================================
+//  Structure GridLevel
+/// Neighbour grid level data structure.  Cells on level l are 2^l times 
+/// larger than cells on the finest level (l = 0).  The occupied cells of 
+/// each level are stored contiguously, ordered by position.
+//=============================================================================
+template <int ndim>
+struct GridLevel {
+  int cfirst;                       ///< i.d. of first cell on level
+  int Ncell;                        ///< No. of occupied cells on level
+  int Nptcls;                       ///< No. of particles on level
+  int imin[ndim];                   ///< Minimum cell coordinate on level
+  int imax[ndim];                   ///< Maximum cell coordinate on level
+  int Ngrid[ndim];                  ///< No. of cells in each dimension
+  FLOAT hrangemax;                  ///< Max. kernel extent of level ptcls
+};
+
+
+
 //=============================================================================
 //  Structure BinaryTreeCell
 /// Neighbour grid cell data structure
@@ -85,6 +108,16 @@ struct BinaryTreeCell {
 
 
 
+#if defined MPI_PARALLEL
+//Forward declare MpiNode and MPIGhosts to break circular dependency
+template <int ndim>
+class MpiNode;
+template <int ndim>
+class MPIGhosts;
+#endif
+
+
+
 //=============================================================================
 //  Class SphNeighbourSearch
 /// \brief   SphNeighbourSearch class definition.  
@@ -110,15 +143,13 @@ class SphNeighbourSearch
 
   bool neibcheck;                   ///< Flag to verify neighbour lists
   DomainBox<ndim> *box;             ///< Pointer to simulation bounding box
-
-};
-
 #if defined MPI_PARALLEL
-//Forward declare MpiNode to break circular dependency
-template <int ndim>
-class MpiNode;
+  MPIGhosts<ndim> *mpighosts;       ///< MPI ghosts whose pending update is
+                                    ///< completed during the force loops
 #endif
 
+};
+
 
 //=============================================================================
 //  Class BruteForceSearch
@@ -146,6 +177,9 @@ class BruteForceSearch: public SphNeighbourSearch<ndim>
 #if defined MPI_PARALLEL
   void FindGhostParticlesToExport(Sph<ndim>* sph, std::vector<std::vector<SphParticle<ndim>* > >&,
       const std::vector<int>&, MpiNode<ndim>*);
+  void FindGhostParticlesToExport(Sph<ndim>* sph, std::vector<std::vector<SphParticle<ndim>* > >&,
+      const std::vector<int>&, MpiNode<ndim>*, const std::vector<Box<ndim> >&,
+      const std::vector<int>&);
   void FindParticlesToTransfer(Sph<ndim>* sph, std::vector<std::vector<int> >& particles_to_export,
       std::vector<int>& all_particles_to_export, const std::vector<int>& potential_nodes, MpiNode<ndim>* mpinodes);
 #endif
@@ -155,18 +189,23 @@ class BruteForceSearch: public SphNeighbourSearch<ndim>
 
 //=============================================================================
 //  Class GridSearch
-/// Class for computing SPH neighbour lists using a uniform grid.  The size 
-/// of the grid is the maximum kernel extent (e.g. 2*h_max for the M4 kernel)
-/// multiplied by some tolerance.
+/// Class for computing SPH neighbour lists using a hierarchy of uniform 
+/// grids.  Particles are bucketed by their kernel extent (i.e. by log2(h)) 
+/// onto nested grid levels whose cell sizes differ by factors of two.  The 
+/// coarsest cell size is the maximum kernel extent (e.g. 2*h_max for the M4 
+/// kernel) multiplied by some tolerance.  Only occupied cells are stored and 
+/// are found with a spatial hash table, so memory scales with the number of 
+/// particles rather than the volume of the bounding box.
 //=============================================================================
 template <int ndim>
 class GridSearch: public SphNeighbourSearch<ndim>
 {
   using SphNeighbourSearch<ndim>::neibcheck;
+  using SphNeighbourSearch<ndim>::box;
 
  public:
 
-  GridSearch();
+  GridSearch(int);
   ~GridSearch();
 
   void BuildTree(bool, int, int, int, FLOAT, Sph<ndim> *);
@@ -183,11 +222,16 @@ class GridSearch: public SphNeighbourSearch<ndim>
   void AllocateGridMemory(int);
   void DeallocateGridMemory(void);
   void CreateGrid(Sph<ndim> *);
-  int ComputeParticleGridCell(FLOAT *);
-  void ComputeCellCoordinate(int, int *);
+  int ComputeParticleLevel(FLOAT);
+  void ComputeParticleCoordinate(FLOAT *, int *);
+  int ComputeHashSlot(int, int *);
+  int ComputeCellId(int, int *);
+  void ComputeCellCoordinate(int, int &, int *);
   int ComputeActiveCellList(int *);
   int ComputeActiveParticleList(int, int *, Sph<ndim> *);
-  int ComputeNeighbourList(int, int *);
+  int ComputeNeighbourList(int, int, int *);
+  int AddCellToList(int, int, int *);
+  bool PeriodicCell(int);
   int FindSplitAxis(int);
 #if defined(VERIFY_ALL)
   void CheckValidNeighbourList(Sph<ndim> *,int,int,int *,string);
@@ -199,17 +243,24 @@ class GridSearch: public SphNeighbourSearch<ndim>
   bool allocated_grid;              ///< Are grid arrays allocated?
   int Ncell;                        ///< Current no. of grid cells
   int Ncellmax;                     ///< Max. allowed no. of grid cells
-  int Ngrid[ndim];                  ///< No. of cells in each dimension
+  int Ngrid[ndim];                  ///< No. of finest cells in each dimension
+  int Nhash;                        ///< Size of cell hash table (power of 2)
+  int Nlevel;                       ///< No. of grid levels in use
+  int Nlevelmax;                    ///< Max. allowed no. of grid levels
   int Noccupymax;                   ///< Max. occupancy of all cells
   int Nlistmax;                     ///< Max. length of neighbour list
   int Nsph;                         ///< Total no. of points/ptcls in grid
   int Ntot;                         ///< No. of current points in list
   int Ntotmax;                      ///< Max. no. of points in list
+  int *hashtable;                   ///< Open-addressing table of cell ids
   int *inext;                       ///< Linked list for grid search
-  FLOAT dx_grid;                    ///< Grid spacing
+  int *ptclcell;                    ///< Grid cell i.d. of each particle
+  FLOAT dx_grid;                    ///< Grid spacing of coarsest level
+  FLOAT dxcell[ndim];               ///< Finest level cell size
   FLOAT rmin[ndim];                 ///< Minimum extent of bounding box
   FLOAT rmax[ndim];                 ///< Maximum extent of bounding box
-  GridCell *grid;                   ///< Main grid array
+  GridCell<ndim> *grid;             ///< Array of occupied grid cells
+  GridLevel<ndim> *gridlevel;       ///< Properties of all grid levels
 
 };
 
@@ -241,6 +292,8 @@ class BinarySubTree
   void OrderParticlesByCartCoord(SphParticle<ndim> *);
   void LoadParticlesToSubTree(void);
   void StockCellProperties(SphParticle<ndim> *);
+  void StockCellProperties(SphParticle<ndim> *, bool *,
+                           BinaryTreeCell<ndim> *);
   FLOAT UpdateHmaxValues(SphParticle<ndim> *);
   void UpdateActiveParticleCounters(Sph<ndim> *);
   void BuildSubTree(Sph<ndim> *);
@@ -252,6 +305,13 @@ class BinarySubTree
                                     int &, int &, int &, int *, int *, 
                                     BinaryTreeCell<ndim> **, 
                                     SphParticle<ndim> *);
+#if defined MPI_PARALLEL
+  int CreateLocallyEssentialTree(Box<ndim> &, bool *, SphParticle<ndim> *,
+                                 vector<BinaryTreeCell<ndim> > &);
+  void GraftLocallyEssentialTree(int, BinaryTreeCell<ndim> *);
+  int ComputeDistantGravityInteractionList(BinaryTreeCell<ndim> *, int,
+                                           int &, BinaryTreeCell<ndim> **);
+#endif
   int GlobalId(int local_id) {
     if (local_id < 0) cout << "local_id : " << local_id << endl;
     assert(local_id>=0);
@@ -291,7 +351,8 @@ class BinarySubTree
   FLOAT thetamaxsqd;                ///< ..
   FLOAT *rk[ndim];                  ///< Particle Cartesian coordinates
   BinaryTreeCell<ndim> *tree;       ///< Main tree array
-  DomainBox<ndim> box;             ///< Pointer to simulation bounding box
+  DomainBox<ndim> box;             ///< Bounding box of sub-tree
+  DomainBox<ndim> *simbox;         ///< Pointer to simulation bounding box
 
 };
 
@@ -312,6 +373,9 @@ class BinaryTree: public SphNeighbourSearch<ndim>
 
   using SphNeighbourSearch<ndim>::neibcheck;
   using SphNeighbourSearch<ndim>::box;
+#if defined MPI_PARALLEL
+  using SphNeighbourSearch<ndim>::mpighosts;
+#endif
 
   typedef typename vector <BinarySubTree<ndim> *>::iterator binlistiterator;
 
@@ -352,6 +416,18 @@ class BinaryTree: public SphNeighbourSearch<ndim>
                                  SphParticle<ndim> &);
   void ComputeCellQuadrupoleForces(int, int, BinaryTreeCell<ndim> **, 
                                    SphParticle<ndim> &);
+#if defined MPI_PARALLEL
+  void AddCellWork(BinaryTreeCell<ndim> *, int, int *, DOUBLE, Sph<ndim> *);
+#endif
+  bool MpiGhostUpdatePending(void);
+  void ProgressMpiGhostUpdate(void);
+  void FinishMpiGhostUpdate(Sph<ndim> *);
+#if defined MPI_PARALLEL
+  int CreateLocallyEssentialTree(Box<ndim> &, bool *, Sph<ndim> *,
+                                 vector<BinaryTreeCell<ndim> > &);
+  BinarySubTree<ndim> *GraftLocallyEssentialTree(int, int, 
+                                                 BinaryTreeCell<ndim> *);
+#endif
 #if defined(VERIFY_ALL)
   void CheckValidNeighbourList(Sph<ndim> *,int,int,int *,string);
 #endif
@@ -366,14 +442,16 @@ class BinaryTree: public SphNeighbourSearch<ndim>
   int ltot;                         ///< Total number of levels in tree
   int Ncell;                        ///< Current no. of grid cells
   int Ncellmax;                     ///< Max. allowed no. of grid cells
-  int Nsubtree;                     ///< No. of sub-trees
+  int Nsubtree;                     ///< No. of local sub-trees
   int Nsubtreemax;                  ///< ..
   int Nsubtreemaxold;               ///< No. of sub-trees
   int Nlevel;                       ///< ""
   int Nleafmax;                     ///< Max. number of particles per leaf cell
   int Nlistmax;                     ///< Max. length of neighbour list
   int Nlocalsubtrees;               ///< No. of local sub-trees in main tree
-  int Nmpisubtrees;                 ///< No. of MPI ghost trees
+  int Nmpisubtrees;                 ///< No. of MPI ghost trees (i.e. the
+                                    ///< grafted locally essential trees of
+                                    ///< all other MPI nodes)
   int Nsph;                         ///< Total no. of points/ptcls in grid
   int Ntot;                         ///< No. of current points in list
   int Ntotmax;                      ///< Max. no. of points in list
@@ -390,6 +468,7 @@ class BinaryTree: public SphNeighbourSearch<ndim>
   BinaryTreeCell<ndim> *tree;       ///< Main tree array
   BinarySubTree<ndim> *stree;       ///< Array of sub-tree objects
   vector <BinarySubTree<ndim> *> subtrees;   ///< List containing pointers to sub-trees
+                                    ///< (local sub-trees, then MPI ghost trees)
 };
 
 #endif
@@ -164,6 +164,54 @@ struct SphParticle
       return particle_type;
 
   }
+
+  // Datatypes of the fields of MPI ghost particles needed by the density
+  // pass (updated in the integration step) and by the force pass (updated
+  // in the density pass).  Both have the extent of the whole particle, so
+  // arrays of particles are exchanged directly, but only the listed fields
+  // are transferred and overwritten on the receiving node.
+  static MPI_Datatype CreateFieldsMpiDataType(int Nfield, void *fields[],
+                                              int nbytes[],
+                                              SphParticle<ndim> &dummy) {
+      MPI_Datatype tmp_type;
+      MPI_Datatype fields_type;
+      MPI_Aint base;
+      MPI_Aint offsets[32];
+
+      MPI_Get_address(&dummy,&base);
+      for (int i=0; i<Nfield; i++) {
+        MPI_Get_address(fields[i],&offsets[i]);
+        offsets[i] -= base;
+      }
+      MPI_Type_create_hindexed(Nfield,nbytes,offsets,MPI_BYTE,&tmp_type);
+      MPI_Type_create_resized(tmp_type,0,sizeof(SphParticle<ndim>),
+                              &fields_type);
+      MPI_Type_free(&tmp_type);
+
+      return fields_type;
+  }
+
+  static MPI_Datatype CreatePositionMpiDataType() {
+      SphParticle<ndim> p;
+      void *fields[10] = {&p.level, p.r, p.v, &p.u, &p.m, &p.h, &p.invh,
+                          &p.hfactor, &p.hrangesqd, &p.dt};
+      int nbytes[10] = {sizeof(int), ndim*sizeof(FLOAT), ndim*sizeof(FLOAT),
+                        sizeof(FLOAT), sizeof(FLOAT), sizeof(FLOAT),
+                        sizeof(FLOAT), sizeof(FLOAT), sizeof(FLOAT),
+                        sizeof(DOUBLE)};
+      return CreateFieldsMpiDataType(10,fields,nbytes,p);
+  }
+
+  static MPI_Datatype CreatePropertyMpiDataType() {
+      SphParticle<ndim> p;
+      void *fields[16] = {&p.u, &p.h, &p.invh, &p.hfactor, &p.hrangesqd,
+                          &p.rho, &p.invrho, &p.press, &p.pfactor, &p.sound,
+                          &p.alpha, &p.invomega, &p.zeta, &p.chi, &p.q,
+                          &p.invq};
+      int nbytes[16];
+      for (int i=0; i<16; i++) nbytes[i] = sizeof(FLOAT);
+      return CreateFieldsMpiDataType(16,fields,nbytes,p);
+  }
 #endif
 
 
@@ -189,6 +237,7 @@ struct SphIntParticle
   FLOAT a0[ndim];                   ///< Acceleration at beginning of step
   FLOAT u0;                         ///< u at beginning of step
   FLOAT dudt0;                      ///< dudt at beginning of step
+  FLOAT work;                       ///< Measured cost since last load-balance
 
 
   // SPH integration particle constructor to initialise all values
@@ -203,6 +252,7 @@ struct SphIntParticle
     for (int k=0; k<ndim; k++) a0[k] = (FLOAT) 0.0;
     u0 = (FLOAT) 0.0;
     dudt0 = (FLOAT) 0.0;
+    work = (FLOAT) 0.0;
   }
 
 #ifdef MPI_PARALLEL
@@ -223,4 +273,37 @@ struct SphIntParticle
 };
 
 
+//=============================================================================
+//  Structure SnapshotParticle
+/// \brief  Copy of the SPH particle quantities written to snapshot files.
+//=============================================================================
+template <int ndim>
+struct SnapshotParticle
+{
+  int iorig;                        ///< Original particle i.d.
+  FLOAT r[ndim];                    ///< Position
+  FLOAT v[ndim];                    ///< Velocity
+  FLOAT m;                          ///< Particle mass
+  FLOAT h;                          ///< SPH smoothing length
+  FLOAT rho;                        ///< SPH density
+  FLOAT u;                          ///< Specific internal energy
+
+
+  // Copy the snapshot quantities of an SPH particle
+  //---------------------------------------------------------------------------
+  SnapshotParticle<ndim>& operator=(const SphParticle<ndim> &part)
+  {
+    iorig = part.iorig;
+    for (int k=0; k<ndim; k++) r[k] = part.r[k];
+    for (int k=0; k<ndim; k++) v[k] = part.v[k];
+    m = part.m;
+    h = part.h;
+    rho = part.rho;
+    u = part.u;
+    return *this;
+  }
+
+};
+
+
 #endif
@@ -187,6 +187,9 @@ void SphSimulation<ndim>::PostInitialConditionsSetup(void)
     MpiGhosts->CopySphDataToGhosts(simbox,sph);
 #endif
     sphneib->BuildTree(rebuild_tree,n,ntreebuildstep,ntreestockstep,timestep,sph);
+#ifdef MPI_PARALLEL
+    if (sph->self_gravity == 1) mpicontrol.UpdateLocallyEssentialTrees(sph);
+#endif
 
     // Calculate SPH gravity and hydro forces, depending on which are activated
     if (sph->hydro_forces == 1 && sph->self_gravity == 1)
@@ -308,7 +311,7 @@ void SphSimulation<ndim>::MainLoop(void)
 	else {
 	  LocalGhosts->CopySphDataToGhosts(simbox,sph);
 	#ifdef MPI_PARALLEL
-	  MpiGhosts->CopySphDataToGhosts(simbox,sph);
+	  MpiGhosts->CopySphDataToGhosts(simbox,sph,ghost_positions);
 	#endif
 	}
 
@@ -318,11 +321,11 @@ void SphSimulation<ndim>::MainLoop(void)
 
     // Reorder particles to tree-walk order (not implemented yet)
 
-    //-------------------------------------------------------------------------
-    // MPI : Walk local tree to determine minimum tree to be sent to all other
-    //       MPI nodes.  Pack and send minimum sub-tree, along with the
-    //       MPI-ghost particles contained in leaf cells of the sub-tree.
-    //-------------------------------------------------------------------------
+    // MPI : Walk local tree to determine minimum (locally essential) tree 
+    //       to be sent to all other MPI nodes, and graft the received trees
+#ifdef MPI_PARALLEL
+    if (sph->self_gravity == 1) mpicontrol.UpdateLocallyEssentialTrees(sph);
+#endif
 
 
     // Iterate if we need to immediately change SPH particle timesteps
@@ -343,10 +346,15 @@ void SphSimulation<ndim>::MainLoop(void)
       //-----------------------------------------------------------------------
 
 
-      // Copy properties from original particles to ghost particles
+      // Copy properties from original particles to ghost particles.
+      // If possible, the MPI ghost update is completed by the force loops
+      // once all cells without MPI ghost neighbours have been computed.
       LocalGhosts->CopySphDataToGhosts(simbox,sph);
 #ifdef MPI_PARALLEL
-      MpiGhosts->CopySphDataToGhosts(simbox,sph);
+      if (sphneib->mpighosts != NULL)
+        MpiGhosts->StartCopySphDataToGhosts(sph,ghost_properties);
+      else
+        MpiGhosts->CopySphDataToGhosts(simbox,sph,ghost_properties);
 #endif
       
       // Zero accelerations
@@ -369,6 +377,9 @@ void SphSimulation<ndim>::MainLoop(void)
         sphneib->UpdateAllSphHydroForces(sph);
       else if (sph->self_gravity == 1)
         sphneib->UpdateAllSphGravForces(sph);
+#ifdef MPI_PARALLEL
+      MpiGhosts->FinishCopySphDataToGhosts(sph);
+#endif
       
       // Compute contribution to grav. accel from stars
       for (i=0; i<sph->Nsph; i++)
@@ -537,8 +548,12 @@ void SphSimulation<ndim>::ComputeGlobalTimestep(void)
 
     // For MPI, determine the global minimum timestep over all processors
 #ifdef MPI_PARALLEL
-    dt = dt_min;
-    MPI_Allreduce(&dt,&dt_min,1,MPI_DOUBLE,MPI_MIN,MPI_COMM_WORLD);
+    {
+      MpiReduction reduction;
+      reduction.minval[0] = dt_min;
+      mpicontrol.GlobalReduction(reduction);
+      dt_min = reduction.minval[0];
+    }
 #endif
 
 
@@ -587,6 +602,7 @@ void SphSimulation<ndim>::ComputeBlockTimesteps(void)
   int level_max_nbody = 0;              // level_max for star particles only
   int nstep;                            // ??
   int nfactor;                          // ??
+  bool resync = (n == nresync);         // Rebuild block timestep structure?
   DOUBLE dt;                            // Aux. timestep variable
   DOUBLE dt_min_sph = big_number_dp;    // Maximum SPH particle timestep
   DOUBLE dt_min_nbody = big_number_dp;  // Maximum N-body particle timestep
@@ -595,9 +611,10 @@ void SphSimulation<ndim>::ComputeBlockTimesteps(void)
 
   debug2("[SphSimulation::ComputeBlockTimesteps]");
 
-  // Synchronise all timesteps and reconstruct block timestep structure.
+  // Synchronise all timesteps, finding the new timesteps of all local
+  // particles.
   //===========================================================================
-  if (n == nresync) {
+  if (resync) {
 
     n = 0;
     timestep = big_number_dp;
@@ -629,63 +646,6 @@ void SphSimulation<ndim>::ComputeBlockTimesteps(void)
       nbody->nbodydata[i]->dt = dt;
     }
 
-    // For MPI, determine the global minimum timestep over all processors
-#ifdef MPI_PARALLEL
-    dt = timestep;
-    MPI_Allreduce(&dt,&timestep,1,MPI_DOUBLE,MPI_MIN,MPI_COMM_WORLD);
-    dt = dt_min_sph;
-    MPI_Allreduce(&dt,&dt_min_sph,1,MPI_DOUBLE,MPI_MIN,MPI_COMM_WORLD);
-#endif
-
-    // Calculate new block timestep levels
-    level_max = Nlevels - 1;
-    level_step = level_max + integration_step - 1;
-    dt_max = timestep*powf(2.0,level_max);
-    
-    // Calculate the maximum level occupied by all SPH particles
-    level_max_sph = min((int) (invlogetwo*log(dt_max/dt_min_sph)) + 1, 
-			level_max);
-    level_max_nbody = min((int) (invlogetwo*log(dt_max/dt_min_nbody)) + 1, 
-			  level_max);
-
-    // If enforcing a single SPH timestep, set it here.  Otherwise, populate 
-    // the timestep levels with SPH particles.
-    if (sph_single_timestep == 1) 
-      for (i=0; i<sph->Nsph; i++) {
-        sph->sphdata[i].level = level_max_sph;
-        sph->sphdata[i].levelneib = level_max_sph;
-        sph->sphintdata[i].nlast = n;
-        sph->sphintdata[i].nstep = pow(2,level_step - sph->sphdata[i].level);
-        level_min_sph = min(level_min_sph,sph->sphdata[i].level);
-      }
-    else {
-      for (i=0; i<sph->Nsph; i++) {
-        dt = sph->sphdata[i].dt;
-        level = min((int) (invlogetwo*log(dt_max/dt)) + 1, level_max);
-        level = max(level,0);
-        sph->sphdata[i].level = level;
-        sph->sphdata[i].levelneib = level;
-        sph->sphintdata[i].nlast = n;
-        sph->sphintdata[i].nstep = pow(2,level_step - sph->sphdata[i].level);
-        level_min_sph = min(level_min_sph,sph->sphdata[i].level);
-      }
-    }
-
-    // Populate timestep levels with N-body particles
-    for (i=0; i<nbody->Nnbody; i++) {
-      dt = nbody->nbodydata[i]->dt;
-      level = min((int) (invlogetwo*log(dt_max/dt)) + 1, level_max);
-      level = max(level,0);
-      nbody->nbodydata[i]->level = max(level,level_max_sph);
-      //nbody->nbodydata[i]->level = max(level,level_min_sph);
-      nbody->nbodydata[i]->nlast = n;
-      nbody->nbodydata[i]->nstep = 
-        pow(2,level_step - nbody->nbodydata[i]->level);
-    }
-
-    nresync = pow(2,level_step);
-    timestep = dt_max / (DOUBLE) nresync;
-
   }
 
   // If not resynchronising, check if any SPH/N-body particles need to move  
@@ -772,17 +732,89 @@ void SphSimulation<ndim>::ComputeBlockTimesteps(void)
       dt_min_nbody = min(dt_min_nbody,nbody->nbodydata[i]->dt);
     }
     //-------------------------------------------------------------------------
-      
 
-    // For MPI, find the global maximum timestep levels for each processor
+  }
+  //===========================================================================
+
+
+  // For MPI, find the global minimum timesteps and maximum timestep levels
+  // over all processors with a single reduction per step (of which each
+  // branch below only uses its own values)
 #ifdef MPI_PARALLEL
-    level = level_max;
-    MPI_Allreduce(&level,&level_max,1,MPI_DOUBLE,MPI_MIN,MPI_COMM_WORLD);
-    level = level_max_sph;
-    MPI_Allreduce(&level,&level_max_sph,1,MPI_DOUBLE,MPI_MIN,MPI_COMM_WORLD);
+  {
+    MpiReduction reduction;
+    reduction.minval[0] = timestep;
+    reduction.minval[1] = dt_min_sph;
+    reduction.maxval[0] = level_max;
+    reduction.maxval[1] = level_max_sph;
+    mpicontrol.GlobalReduction(reduction);
+    timestep = reduction.minval[0];
+    dt_min_sph = reduction.minval[1];
+    level_max = (int) reduction.maxval[0];
+    level_max_sph = (int) reduction.maxval[1];
+  }
 #endif
 
 
+  // Reconstruct block timestep structure from the new timesteps
+  //===========================================================================
+  if (resync) {
+
+    // Calculate new block timestep levels
+    level_max = Nlevels - 1;
+    level_step = level_max + integration_step - 1;
+    dt_max = timestep*powf(2.0,level_max);
+    
+    // Calculate the maximum level occupied by all SPH particles
+    level_max_sph = min((int) (invlogetwo*log(dt_max/dt_min_sph)) + 1, 
+			level_max);
+    level_max_nbody = min((int) (invlogetwo*log(dt_max/dt_min_nbody)) + 1, 
+			  level_max);
+
+    // If enforcing a single SPH timestep, set it here.  Otherwise, populate 
+    // the timestep levels with SPH particles.
+    if (sph_single_timestep == 1) 
+      for (i=0; i<sph->Nsph; i++) {
+        sph->sphdata[i].level = level_max_sph;
+        sph->sphdata[i].levelneib = level_max_sph;
+        sph->sphintdata[i].nlast = n;
+        sph->sphintdata[i].nstep = pow(2,level_step - sph->sphdata[i].level);
+        level_min_sph = min(level_min_sph,sph->sphdata[i].level);
+      }
+    else {
+      for (i=0; i<sph->Nsph; i++) {
+        dt = sph->sphdata[i].dt;
+        level = min((int) (invlogetwo*log(dt_max/dt)) + 1, level_max);
+        level = max(level,0);
+        sph->sphdata[i].level = level;
+        sph->sphdata[i].levelneib = level;
+        sph->sphintdata[i].nlast = n;
+        sph->sphintdata[i].nstep = pow(2,level_step - sph->sphdata[i].level);
+        level_min_sph = min(level_min_sph,sph->sphdata[i].level);
+      }
+    }
+
+    // Populate timestep levels with N-body particles
+    for (i=0; i<nbody->Nnbody; i++) {
+      dt = nbody->nbodydata[i]->dt;
+      level = min((int) (invlogetwo*log(dt_max/dt)) + 1, level_max);
+      level = max(level,0);
+      nbody->nbodydata[i]->level = max(level,level_max_sph);
+      //nbody->nbodydata[i]->level = max(level,level_min_sph);
+      nbody->nbodydata[i]->nlast = n;
+      nbody->nbodydata[i]->nstep = 
+        pow(2,level_step - nbody->nbodydata[i]->level);
+    }
+
+    nresync = pow(2,level_step);
+    timestep = dt_max / (DOUBLE) nresync;
+
+  }
+
+  // Otherwise, update the block timestep structure with the new levels
+  //===========================================================================
+  else {
+
     // Set fixed SPH timestep level here in case maximum has changed
     if (sph_single_timestep == 1) {
       for (i=0; i<sph->Nsph; i++) {
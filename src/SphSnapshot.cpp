@@ -23,7 +23,14 @@
 
 #include <ctime>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "Exception.h"
 #include "SphSnapshot.h"
 #include "Sph.h"
@@ -33,10 +40,18 @@
 #include "InlineFuncs.h"
 #include "UnitInfo.h"
 #include "HeaderInfo.h"
+#include "BinaryCodec.h"
 using namespace std;
 
 
 
+multimap<int,float*> SphSnapshotBase::freebuffers;
+map<float*,int> SphSnapshotBase::buffersize;
+long long SphSnapshotBase::pooledbytes = 0;
+long long SphSnapshotBase::maxpooledbytes = 256*1024*1024;
+
+
+
 //=============================================================================
 //  SphSnapshotBase::SphSnapshotFactory
 /// Creates and returns a new snapshot object based on dimensionality of sim.
@@ -84,8 +99,17 @@ SphSnapshotBase::SphSnapshotBase(SimUnits* _units, string auxfilename):
   Nstar = 0;
   Nstarmax = 0;
   t = 0.0;
+  lazyload = true;
+  mapped = false;
+  allfields = true;
   LastUsed = time(NULL);
   if (auxfilename != "") filename = auxfilename;
+
+  x = y = z = vx = vy = vz = ax = ay = az = NULL;
+  m = h = rho = u = dudt = NULL;
+  xstar = ystar = zstar = vxstar = vystar = vzstar = NULL;
+  axstar = aystar = azstar = mstar = hstar = NULL;
+  ecc = mbin = period = qbin = sma = NULL;
 }
 
 
@@ -105,9 +129,7 @@ simulation(static_cast<Simulation<ndims>* > (sim))
   this->fileform = sim->GetParam("out_file_form");
 
   // Computes how numbers we need to store for each sph/star particle
-  nneededsph = 3*ndims + 5;
-  nneededstar = 3*ndims + 2;
-  nneededbinary = 5;
+  SetRequestedFields("all");
  
   if (filename != "") {
     HeaderInfo info;
@@ -154,55 +176,17 @@ void SphSnapshotBase::AllocateBufferMemory(void)
 
 //=============================================================================
 //  SphSnapshotBase::AllocateBufferMemoryStar
-/// Allocate memory for stars in current snapshot.
+/// Allocate memory for the requested star fields in current snapshot.
 //=============================================================================
 void SphSnapshotBase::AllocateBufferMemoryStar(void) 
 {
   // If memory is already allocated and more memory is needed for more 
   // particles, deallocate now before reallocating.
-  if (allocatedstar) {
-    if (Nstar > Nstarmax)
-      DeallocateBufferMemoryStar();
-    else
-      return;
-  }
-
-  // Allocate memory for all vector quantities depending on dimensionality
-  if (ndim == 1) {
-    xstar = new float[Nstar];
-    vxstar = new float[Nstar];
-    axstar = new float[Nstar];
-  }
-  else if (ndim == 2) {
-    xstar = new float[Nstar];
-    ystar = new float[Nstar];
-    vxstar = new float[Nstar];
-    vystar = new float[Nstar];
-    axstar = new float[Nstar];
-    aystar = new float[Nstar];
-
-  }
-  else if (ndim == 3) {
-    xstar = new float[Nstar];
-    ystar = new float[Nstar];
-    zstar = new float[Nstar];
-    vxstar = new float[Nstar];
-    vystar = new float[Nstar];
-    vzstar = new float[Nstar];
-    axstar = new float[Nstar];
-    aystar = new float[Nstar];
-    azstar = new float[Nstar];
-
-  }
-
-  // Stars scalar quantities
-  mstar = new float[Nstar];
-  hstar = new float[Nstar];
+  if (allocatedstar && Nstar > Nstarmax) DeallocateBufferMemoryStar();
+  if (!allocatedstar) Nstarmax = Nstar;
 
-  // Record 3 vectors of size ndim (r,v,a) and 2 scalars (m,h)
-  nallocatedstar = 3*ndim + 2;
+  nallocatedstar = AllocateBufferFields("star", Nstarmax);
   allocatedstar = true;
-  Nstarmax = Nstar;
 
   return;
 }
@@ -211,56 +195,17 @@ void SphSnapshotBase::AllocateBufferMemoryStar(void)
 
 //=============================================================================
 //  SphSnapshotBase::AllocateBufferMemorySph
-/// Allocate memory for sph particles in current snapshot.
+/// Allocate memory for the requested SPH fields in current snapshot.
 //=============================================================================
 void SphSnapshotBase::AllocateBufferMemorySph(void) 
 {
   // If memory already allocated and more memory is needed for more particles,
   // deallocate now before reallocating.
-  if (allocatedsph) {
-    if (Nsph > Nsphmax)
-      DeallocateBufferMemorySph();
-    else
-      return;
-  }
+  if (allocatedsph && Nsph > Nsphmax) DeallocateBufferMemorySph();
+  if (!allocatedsph) Nsphmax = Nsph;
 
-  // Allocate memory for all vector quantities depending on dimensionality
-  if (ndim == 1) {
-    x = new float[Nsph];
-    vx = new float[Nsph];
-    ax = new float[Nsph];
-  }
-  else if (ndim == 2) {
-    x = new float[Nsph];
-    y = new float[Nsph];
-    vx = new float[Nsph];
-    vy = new float[Nsph];
-    ax = new float[Nsph];
-    ay = new float[Nsph];
-  }
-  else if (ndim == 3) {
-    x = new float[Nsph];
-    y = new float[Nsph];
-    z = new float[Nsph];
-    vx = new float[Nsph];
-    vy = new float[Nsph];
-    vz = new float[Nsph];
-    ax = new float[Nsph];
-    ay = new float[Nsph];
-    az = new float[Nsph];
-  }
-
-  // Allocate memory for other scalar quantities
-  m = new float[Nsph];
-  h = new float[Nsph];
-  rho = new float[Nsph];
-  u = new float[Nsph];
-  dudt = new float[Nsph];
-
-  // Record 3 vectors of size ndim (r,v,a) and 5 scalars (m,h,rho,u,dudt)
-  nallocatedsph = 3*ndim + 5;
+  nallocatedsph = AllocateBufferFields("sph", Nsphmax);
   allocatedsph = true;
-  Nsphmax = Nsph;
 
   return;
 }
@@ -269,36 +214,51 @@ void SphSnapshotBase::AllocateBufferMemorySph(void)
 
 //=============================================================================
 //  SphSnapshotBase::AllocateBufferMemoryBinary
-/// Allocate memory for binary orbits in current snapshot.
+/// Allocate memory for the requested binary orbit fields in current snapshot.
 //=============================================================================
 void SphSnapshotBase::AllocateBufferMemoryBinary(void) 
 {
   // If memory already allocated and more memory is needed for more particles,
   // deallocate now before reallocating.
-  if (allocatedbinary) {
-    if (Norbit > Norbitmax)
-      DeallocateBufferMemoryBinary();
-    else
-      return;
-  }
+  if (allocatedbinary && Norbit > Norbitmax) DeallocateBufferMemoryBinary();
+  if (!allocatedbinary) Norbitmax = Norbit;
 
-  // Allocate arrays for orbital quantities
-  ecc = new float[Norbit];
-  mbin = new float[Norbit];
-  period = new float[Norbit];
-  qbin = new float[Norbit];
-  sma = new float[Norbit];
-
-  // Record 5 floats
-  nallocatedbinary = 5;
+  nallocatedbinary = AllocateBufferFields("binary", Norbitmax);
   allocatedbinary = true;
-  Norbitmax = Norbit;
 
   return;
 }
 
 
 
+//=============================================================================
+//  SphSnapshotBase::AllocateBufferFields
+/// Take buffers of N elements from the buffer pool for all requested fields
+/// of the given particle type that are not allocated yet.  Returns the
+/// no. of allocated fields of this type.
+//=============================================================================
+int SphSnapshotBase::AllocateBufferFields
+(string type,                       ///< [in] Particle type
+ int N)                             ///< [in] No. of elements of buffers
+{
+  int Nfield = 0;                   // No. of allocated fields
+  unsigned int j;                   // Field counter
+  float **buffer;                   // Buffer pointer of field
+  vector<string> names;             // Names of all fields of type
+
+  FieldNames(type, names);
+  for (j=0; j<names.size(); j++) {
+    buffer = BufferPointer(names[j], type);
+    if (*buffer == NULL && FieldRequested(names[j]))
+      *buffer = AcquireBuffer(N);
+    if (*buffer != NULL) Nfield++;
+  }
+
+  return Nfield;
+}
+
+
+
 //=============================================================================
 //  SphSnapshotBase::DeallocateBufferMemory
 /// Deallocate memory for current snapshot.
@@ -307,6 +267,7 @@ void SphSnapshotBase::DeallocateBufferMemory(void)
 {
   debug2("[SphSnapshotBase::DeallocateBufferMemory]");
 
+  UnmapSnapshot();
   DeallocateBufferMemoryBinary();
   DeallocateBufferMemorySph();
   DeallocateBufferMemoryStar();
@@ -319,7 +280,7 @@ void SphSnapshotBase::DeallocateBufferMemory(void)
 
 //=============================================================================
 //  SphSnapshotBase::DeallocateBufferMemorySph
-/// Deallocate sph particles memory for current snapshot.
+/// Return SPH particle buffers of current snapshot to the buffer pool.
 //=============================================================================
 void SphSnapshotBase::DeallocateBufferMemorySph(void)
 {
@@ -328,39 +289,7 @@ void SphSnapshotBase::DeallocateBufferMemorySph(void)
   if (!allocatedsph)
     return;
 
-  // Deallocate scalar array memory
-  delete[] dudt;
-  delete[] u;
-  delete[] rho;
-  delete[] h;
-  delete[] m;
-  
-  // Deallocate vector array memory
-  if (ndim == 1) {
-    delete[] ax;
-    delete[] vx;
-    delete[] x;
-  }
-  else if (ndim == 2) {
-    delete[] ay;
-    delete[] ax;
-    delete[] vy;
-    delete[] vx;
-    delete[] y;
-    delete[] x;
-  }
-  else if (ndim == 3) {
-    delete[] az;
-    delete[] ay;
-    delete[] ax;
-    delete[] vz;
-    delete[] vy;
-    delete[] vx;
-    delete[] z;
-    delete[] y;
-    delete[] x;
-  }
-  
+  DeallocateBufferFields("sph");
   allocatedsph = false;
   nallocatedsph = 0;
   
@@ -371,7 +300,7 @@ void SphSnapshotBase::DeallocateBufferMemorySph(void)
 
 //=============================================================================
 //  SphSnapshotBase::DeallocateBufferMemoryStar
-/// Deallocate star particles memory for current snapshot.
+/// Return star particle buffers of current snapshot to the buffer pool.
 //=============================================================================
 void SphSnapshotBase::DeallocateBufferMemoryStar(void)
 {
@@ -380,36 +309,7 @@ void SphSnapshotBase::DeallocateBufferMemoryStar(void)
   if (!allocatedstar)
     return;
 
-  // Deallocate scalar array memory
-  delete[] hstar;
-  delete[] mstar;
-
-  // Deallocate vector array memory
-  if (ndim == 1) {
-    delete[] axstar;
-    delete[] vxstar;
-    delete[] xstar;
-  }
-  else if (ndim == 2) {
-    delete[] aystar;
-    delete[] axstar;
-    delete[] vystar;
-    delete[] vxstar;
-    delete[] ystar;
-    delete[] xstar;
-  }
-  else if (ndim == 3) {
-    delete[] azstar;
-    delete[] aystar;
-    delete[] axstar;
-    delete[] vzstar;
-    delete[] vystar;
-    delete[] vxstar;
-    delete[] zstar;
-    delete[] ystar;
-    delete[] xstar;
-  }
-  
+  DeallocateBufferFields("star");
   allocatedstar = false;
   nallocatedstar = 0;
   
@@ -420,7 +320,7 @@ void SphSnapshotBase::DeallocateBufferMemoryStar(void)
 
 //=============================================================================
 //  SphSnapshotBase::DeallocateBufferMemoryBinary
-/// Deallocate binary orbit memory for current snapshot.
+/// Return binary orbit buffers of current snapshot to the buffer pool.
 //=============================================================================
 void SphSnapshotBase::DeallocateBufferMemoryBinary(void)
 {
@@ -429,12 +329,7 @@ void SphSnapshotBase::DeallocateBufferMemoryBinary(void)
   if (!allocatedbinary)
     return;
 
-  delete[] sma;
-  delete[] qbin;
-  delete[] period;
-  delete[] mbin;
-  delete[] ecc;
-
+  DeallocateBufferFields("binary");
   allocatedbinary = false;
   nallocatedbinary = 0;
 
@@ -443,9 +338,583 @@ void SphSnapshotBase::DeallocateBufferMemoryBinary(void)
 
 
 
+//=============================================================================
+//  SphSnapshotBase::DeallocateBufferFields
+/// Return all allocated buffers of the given particle type to the pool.
+//=============================================================================
+void SphSnapshotBase::DeallocateBufferFields
+(string type)                       ///< [in] Particle type
+{
+  unsigned int j;                   // Field counter
+  float **buffer;                   // Buffer pointer of field
+  vector<string> names;             // Names of all fields of type
+
+  FieldNames(type, names);
+  for (j=0; j<names.size(); j++) {
+    buffer = BufferPointer(names[j], type);
+    ReleaseBuffer(*buffer);
+    *buffer = NULL;
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::AcquireBuffer
+/// Returns a buffer of at least N floats, reusing a free pooled buffer of
+/// similar size if possible.
+//=============================================================================
+float* SphSnapshotBase::AcquireBuffer
+(int N)                             ///< [in] Required no. of elements
+{
+  float *buffer;                    // Buffer returned
+  multimap<int,float*>::iterator it;  // Smallest free buffer that fits
+
+  N = max(N, 1);
+
+  // Reuse the smallest free buffer that is large enough (but not wastefully
+  // large), otherwise allocate a new one.
+  it = freebuffers.lower_bound(N);
+  if (it != freebuffers.end() && it->first <= 2*N) {
+    buffer = it->second;
+    pooledbytes -= (long long) it->first*sizeof(float);
+    freebuffers.erase(it);
+    return buffer;
+  }
+
+  buffer = new float[N];
+  buffersize[buffer] = N;
+
+  return buffer;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::ReleaseBuffer
+/// Return a buffer to the pool.  If the pool is full, the buffer is freed.
+//=============================================================================
+void SphSnapshotBase::ReleaseBuffer
+(float *buffer)                     ///< [in] Buffer taken from the pool
+{
+  int N;                            // Size of buffer
+  map<float*,int>::iterator it;     // Record of buffer size
+
+  if (buffer == NULL) return;
+  it = buffersize.find(buffer);
+  if (it == buffersize.end()) return;
+  N = it->second;
+
+  if (pooledbytes + (long long) (N*sizeof(float)) > maxpooledbytes) {
+    buffersize.erase(it);
+    delete[] buffer;
+  }
+  else {
+    freebuffers.insert(make_pair(N, buffer));
+    pooledbytes += (long long) N*sizeof(float);
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::FreeBufferPool
+/// Free all buffers currently held in the pool (i.e. not used by any
+/// snapshot).
+//=============================================================================
+void SphSnapshotBase::FreeBufferPool(void)
+{
+  multimap<int,float*>::iterator it;  // Free buffer iterator
+
+  for (it=freebuffers.begin(); it!=freebuffers.end(); it++) {
+    buffersize.erase(it->second);
+    delete[] it->second;
+  }
+  freebuffers.clear();
+  pooledbytes = 0;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::FieldNames
+/// Names of all fields stored in snapshots for the given particle type.
+//=============================================================================
+void SphSnapshotBase::FieldNames
+(string type,                       ///< [in] Particle type
+ vector<string> &names)             ///< [out] Names of fields
+{
+  static const char *rnames[3] = {"x", "y", "z"};
+  static const char *vnames[3] = {"vx", "vy", "vz"};
+  static const char *anames[3] = {"ax", "ay", "az"};
+
+  names.clear();
+  if (type == "binary") {
+    names.push_back("ecc");
+    names.push_back("mbin");
+    names.push_back("period");
+    names.push_back("qbin");
+    names.push_back("sma");
+    return;
+  }
+
+  for (int k=0; k<ndim; k++) names.push_back(rnames[k]);
+  for (int k=0; k<ndim; k++) names.push_back(vnames[k]);
+  for (int k=0; k<ndim; k++) names.push_back(anames[k]);
+  names.push_back("m");
+  names.push_back("h");
+  if (type == "sph") {
+    names.push_back("rho");
+    names.push_back("u");
+    names.push_back("dudt");
+  }
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::SetRequestedFields
+/// Select the fields copied or read into the snapshot, given as a
+/// comma-separated list of names ("all" for all fields).  Other fields are
+/// only copied or read in when first requested by ExtractArray.
+//=============================================================================
+void SphSnapshotBase::SetRequestedFields
+(string fieldlist)                  ///< [in] Comma-separated field names
+{
+  string name;                      // Name of field
+  stringstream ss(fieldlist);       // Stream of field names
+  vector<string> names;             // Names of all fields of each type
+
+  allfields = (fieldlist == "" || fieldlist == "all");
+  fields.clear();
+  while (!allfields && getline(ss, name, ',')) {
+    if (name == "") continue;
+    if (BufferPointer(name, "sph") == NULL &&
+        BufferPointer(name, "binary") == NULL) {
+      string message = "Error: unrecognised snapshot field : " + name;
+      ExceptionHandler::getIstance().raise(message);
+    }
+    fields.push_back(name);
+  }
+
+  // Record how many fields of each type will be needed
+  nneededsph = 0;
+  nneededstar = 0;
+  nneededbinary = 0;
+  FieldNames("sph", names);
+  for (unsigned int j=0; j<names.size(); j++)
+    if (FieldRequested(names[j])) nneededsph++;
+  FieldNames("star", names);
+  for (unsigned int j=0; j<names.size(); j++)
+    if (FieldRequested(names[j])) nneededstar++;
+  FieldNames("binary", names);
+  for (unsigned int j=0; j<names.size(); j++)
+    if (FieldRequested(names[j])) nneededbinary++;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::FieldRequested
+/// Returns true if the named field is copied or read into the snapshot.
+//=============================================================================
+bool SphSnapshotBase::FieldRequested
+(string name)                       ///< [in] Name of field
+{
+  return (allfields || find(fields.begin(), fields.end(), name) != fields.end());
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::MapSnapshot
+/// Memory-map a native binary snapshot file, or all pieces listed in a
+/// per-process index file.  Only the headers are read here; particle fields
+/// are faulted in individually by ExtractArray.  Returns false (leaving the
+/// snapshot unmapped) if any file cannot be mapped.
+//=============================================================================
+bool SphSnapshotBase::MapSnapshot(void)
+{
+  bool valid;                       // Is index/header valid?
+  unsigned int ifield;              // Field counter
+  unsigned int p;                   // Piece counter
+  char *address;                    // Address of mapping
+  float **buffer;                   // Buffer pointer of field
+  size_t size;                      // Size of mapping
+  BinarySnapshotIndex index;        // Index of per-process pieces
+
+  debug2("[SphSnapshotBase::MapSnapshot]");
+
+  if (!MapFile(filename, address, size)) return false;
+
+  // Map each piece of a per-process snapshot, or the single file itself
+  //---------------------------------------------------------------------------
+  if (BinarySnapshotIndex::IsIndex(address, size)) {
+    valid = index.Unpack(address, size);
+    munmap(address, size);
+    if (!valid) return false;
+    for (p=0; p<index.Nsph.size(); p++) {
+      if (!MapFile(BinarySnapshotIndex::PieceFilename(filename,p),
+                   address, size)) {
+        UnmapFiles();
+        return false;
+      }
+      mapaddress.push_back(address);
+      mapsize.push_back(size);
+    }
+  }
+  else {
+    mapaddress.push_back(address);
+    mapsize.push_back(size);
+  }
+
+  mapheaders.resize(mapaddress.size());
+  maporder.resize(mapaddress.size());
+  for (p=0; p<mapaddress.size(); p++) {
+    valid = mapheaders[p].Unpack(mapaddress[p], mapsize[p]) &&
+      mapheaders[p].Valid(mapsize[p]) && mapheaders[p].ndim == ndim;
+    if (valid && !index.Nsph.empty())
+      valid = (mapheaders[p].Nsph == index.Nsph[p] &&
+               mapheaders[p].Nstar == index.Nstar[p]);
+    if (!valid) {
+      UnmapFiles();
+      return false;
+    }
+  }
+
+  // The merged header holds the particle numbers summed over all pieces
+  mapheader = mapheaders[0];
+  for (p=1; p<mapheaders.size(); p++) {
+    mapheader.Nsph += mapheaders[p].Nsph;
+    mapheader.Nstar += mapheaders[p].Nstar;
+  }
+  for (ifield=0; ifield<mapheader.fields.size(); ifield++)
+    mapheader.fields[ifield].N = (mapheader.fields[ifield].species == "star" ?
+                                  mapheader.Nstar : mapheader.Nsph);
+
+  mapped = true;
+  allocated = true;
+  Nsph = mapheader.Nsph;
+  Nstar = mapheader.Nstar;
+  Norbit = 0;
+  nallocatedsph = 0;
+  nallocatedstar = 0;
+
+  // No field has been faulted in yet
+  for (ifield=0; ifield<mapheader.fields.size(); ifield++) {
+    buffer = BufferPointer(mapheader.fields[ifield].name,
+                           mapheader.fields[ifield].species);
+    if (buffer != NULL) *buffer = NULL;
+  }
+
+  _species.clear();
+  if (Nsph != 0) _species.push_back("sph");
+  if (Nstar != 0) _species.push_back("star");
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::MapFile
+/// Memory-map a whole file (privately, so arrays viewed from python can
+/// never modify it).  Returns false if the file cannot be mapped.
+//=============================================================================
+bool SphSnapshotBase::MapFile
+(string name,                       ///< [in] Name of file
+ char *&address,                    ///< [out] Address of mapping
+ size_t &size)                      ///< [out] Size of mapping
+{
+  int fd;                           // File descriptor of file
+  void *mapping;                    // Address of mapping
+  struct stat filestat;             // File information
+
+  fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1) return false;
+  if (fstat(fd, &filestat) == -1 || filestat.st_size < binary_preamble_size) {
+    close(fd);
+    return false;
+  }
+
+  mapping = mmap(NULL, filestat.st_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+
+  address = (char *) mapping;
+  size = filestat.st_size;
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::UnmapSnapshot
+/// Release all converted arrays and the mapping of a binary snapshot file.
+//=============================================================================
+void SphSnapshotBase::UnmapSnapshot(void)
+{
+  unsigned int i;                   // Buffer counter
+  unsigned int j;                   // Field counter
+  vector<string> names;             // Names of all fields of type
+
+  if (!mapped) return;
+
+  for (i=0; i<mappedbuffers.size(); i++) ReleaseBuffer(mappedbuffers[i]);
+  mappedbuffers.clear();
+  UnmapFiles();
+
+  // Buffer pointers referred to the mapping or to the released arrays
+  FieldNames("sph", names);
+  for (j=0; j<names.size(); j++) *BufferPointer(names[j], "sph") = NULL;
+  FieldNames("star", names);
+  for (j=0; j<names.size(); j++) *BufferPointer(names[j], "star") = NULL;
+
+  mapped = false;
+  nallocatedsph = 0;
+  nallocatedstar = 0;
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::UnmapFiles
+/// Unmap all mapped files (pieces) of a binary snapshot.
+//=============================================================================
+void SphSnapshotBase::UnmapFiles(void)
+{
+  unsigned int p;                   // Piece counter
+
+  for (p=0; p<mapaddress.size(); p++) munmap(mapaddress[p], mapsize[p]);
+  mapaddress.clear();
+  mapsize.clear();
+  mapheaders.clear();
+  maporder.clear();
+
+  return;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::BufferPointer
+/// Returns the address of the buffer pointer holding the given field (NULL
+/// if the particle type has no such field).
+//=============================================================================
+float** SphSnapshotBase::BufferPointer
+(string name,                       ///< Name of variable
+ string type)                       ///< Particle type
+{
+  if (type == "sph") {
+    if (name == "x") return &x;
+    else if (name == "y") return &y;
+    else if (name == "z") return &z;
+    else if (name == "vx") return &vx;
+    else if (name == "vy") return &vy;
+    else if (name == "vz") return &vz;
+    else if (name == "ax") return &ax;
+    else if (name == "ay") return &ay;
+    else if (name == "az") return &az;
+    else if (name == "m") return &m;
+    else if (name == "h") return &h;
+    else if (name == "rho") return &rho;
+    else if (name == "u") return &u;
+    else if (name == "dudt") return &dudt;
+  }
+  else if (type == "star") {
+    if (name == "x") return &xstar;
+    else if (name == "y") return &ystar;
+    else if (name == "z") return &zstar;
+    else if (name == "vx") return &vxstar;
+    else if (name == "vy") return &vystar;
+    else if (name == "vz") return &vzstar;
+    else if (name == "ax") return &axstar;
+    else if (name == "ay") return &aystar;
+    else if (name == "az") return &azstar;
+    else if (name == "m") return &mstar;
+    else if (name == "h") return &hstar;
+  }
+  else if (type == "binary") {
+    if (name == "ecc") return &ecc;
+    else if (name == "mbin") return &mbin;
+    else if (name == "period") return &period;
+    else if (name == "qbin") return &qbin;
+    else if (name == "sma") return &sma;
+  }
+
+  return NULL;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::FaultInField
+/// Make the given field of a memory-mapped snapshot available in its buffer
+/// pointer.  Uncompressed single precision blocks of single-file snapshots
+/// are used in place; all other fields are assembled from the pieces with
+/// ReadMappedField.  Values are left in the units of the file (see
+/// ExtractArray).  Returns false if the field is not in the file.
+//=============================================================================
+bool SphSnapshotBase::FaultInField
+(string name,                       ///< Name of variable
+ string type)                       ///< Particle type
+{
+  int ifirst = 0;                   // i.d. of first particle of piece
+  int ifield;                       // Position of field in field table
+  unsigned int p;                   // Piece counter
+  float **buffer;                   // Buffer pointer of field
+  float *converted;                 // Single precision copy of field
+
+  buffer = BufferPointer(name, type);
+  ifield = mapheader.FindField(name, type);
+  if (buffer == NULL || ifield == -1) return false;
+  if (*buffer != NULL) return true;
+
+  BinaryFieldRecord &field = mapheader.fields[ifield];
+  if (field.typesize != sizeof(float) && field.typesize != sizeof(double))
+    return false;
+
+  debug2("[SphSnapshotBase::FaultInField]");
+
+  if (mapaddress.size() == 1 && field.codec == binary_codec_raw &&
+      field.typesize == sizeof(float) &&
+      (type == "star" || mapheader.FindField("order","sph") == -1)) {
+    if (field.N != (type == "star" ? Nstar : Nsph)) return false;
+    if (field.offset + field.nbytes > (long long) mapsize[0]) return false;
+    *buffer = (float *) (mapaddress[0] + field.offset);
+  }
+  else {
+    converted = AcquireBuffer(field.N + 1);
+    for (p=0; p<mapaddress.size(); p++) {
+      if (!ReadMappedField(p, name, type, converted + ifirst)) {
+        ReleaseBuffer(converted);
+        return false;
+      }
+      ifirst += (type == "star" ? mapheaders[p].Nstar : mapheaders[p].Nsph);
+    }
+    mappedbuffers.push_back(converted);
+    *buffer = converted;
+  }
+
+  if (type == "star") nallocatedstar++;
+  else nallocatedsph++;
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::ReadMappedField
+/// Convert the given field of one mapped piece to single precision.  The
+/// block is decompressed and restored to the original particle order (if
+/// stored in Morton order) first.  Returns false if the field is missing
+/// or invalid.
+//=============================================================================
+bool SphSnapshotBase::ReadMappedField
+(int p,                             ///< Piece i.d.
+ string name,                       ///< Name of variable
+ string type,                       ///< Particle type
+ float *out)                        ///< [out] Converted field
+{
+  int i;                            // Element counter
+  int ifield;                       // Position of field in field table
+  bool sorted;                      // Is block stored in Morton order?
+  const char *data;                 // Field block
+  vector<char> decoded;             // Decompressed field block
+  vector<char> unsorted;            // Field block in original order
+  BinarySnapshotHeader &header = mapheaders[p];
+
+  ifield = header.FindField(name, type);
+  if (ifield == -1) return false;
+
+  BinaryFieldRecord &field = header.fields[ifield];
+  if (field.N != (type == "star" ? header.Nstar : header.Nsph)) return false;
+  if (field.typesize != sizeof(float) && field.typesize != sizeof(double))
+    return false;
+  if (field.offset + field.nbytes > (long long) mapsize[p]) return false;
+
+  sorted = (type == "sph" && header.FindField("order","sph") != -1);
+  if (sorted && !ReadMappedOrder(p)) return false;
+
+  data = mapaddress[p] + field.offset;
+  if (field.codec != binary_codec_raw) {
+    decoded.resize((size_t) field.N*field.typesize + 1);
+    if (!DecodeBinaryField(field, data, &decoded[0])) return false;
+    data = &decoded[0];
+  }
+  if (sorted) {
+    unsorted.resize((size_t) field.N*field.typesize + 1);
+    PermuteElements(field.N, field.typesize, &maporder[p][0], true,
+                    data, &unsorted[0]);
+    data = &unsorted[0];
+  }
+  if (field.typesize == sizeof(float))
+    memcpy(out, data, field.N*sizeof(float));
+  else {
+    for (i=0; i<field.N; i++) out[i] = (float) ((const double *) data)[i];
+  }
+
+  return true;
+}
+
+
+
+//=============================================================================
+//  SphSnapshotBase::ReadMappedOrder
+/// Decode the storage order of the SPH particles of a memory-mapped
+/// piece (once).  Returns false if the order field is invalid, i.e. not a
+/// permutation of the particles.
+//=============================================================================
+bool SphSnapshotBase::ReadMappedOrder
+(int p)                             ///< Piece i.d.
+{
+  int ifield;                       // Position of order field
+  vector<int> &order = maporder[p];
+  BinarySnapshotHeader &header = mapheaders[p];
+
+  if (!order.empty()) return true;
+
+  ifield = header.FindField("order", "sph");
+  if (ifield == -1) return false;
+  BinaryFieldRecord &field = header.fields[ifield];
+  if (field.N != header.Nsph || field.typesize != sizeof(int)) return false;
+  if (field.offset + field.nbytes > (long long) mapsize[p]) return false;
+
+  order.resize(field.N + 1);
+  if (!DecodeBinaryField(field, mapaddress[p] + field.offset,
+                         (char *) &order[0])) {
+    order.clear();
+    return false;
+  }
+  if (!ValidPermutation(field.N, &order[0])) {
+    order.clear();
+    return false;
+  }
+
+  return true;
+}
+
+
+
 //=============================================================================
 //  SphSnapshotBase::CalculateMemoryUsage
-/// Returns no. of bytes allocated for current snapshot.
+/// Returns no. of bytes allocated for current snapshot.  For memory-mapped
+/// snapshots, only the fields faulted in so far are counted.
 //=============================================================================
 int SphSnapshotBase::CalculateMemoryUsage(void)
 {
@@ -470,14 +939,24 @@ int SphSnapshotBase::CalculatePredictedMemoryUsage(void)
 
 //=============================================================================
 //  SphSnapshot::CopyDataFromSimulation
-/// Copy particle data from main memory to current snapshot arrays.
+/// Copy the requested fields of the particle data from main memory to the
+/// current snapshot arrays.  The SPH particles are copied in parallel.
 //=============================================================================
 template <int ndims>
 void SphSnapshot<ndims>::CopyDataFromSimulation()
 {
-  SphParticle<ndims>* sphaux;
-  StarParticle<ndims>* staraux;
-  BinaryOrbit *orbitaux;
+  int i;                            // Particle counter
+  int k;                            // Dimension counter
+  int level_step;                   // Level of smallest timestep unit
+  int N;                            // Local copy of no. of SPH particles
+  DOUBLE timestep;                  // Current timestep
+  float *rbuf[3];                   // Position buffers
+  float *vbuf[3];                   // Velocity buffers
+  float *abuf[3];                   // Acceleration buffers
+  float *sbuf[5];                   // m, h, rho, u and dudt buffers
+  SphParticle<ndims>* sphaux = NULL;
+  StarParticle<ndims>* staraux = NULL;
+  BinaryOrbit *orbitaux = NULL;
 
   debug2("[SphSnapshotBase::CopyDataFromSimulation]");
 
@@ -507,80 +986,63 @@ void SphSnapshot<ndims>::CopyDataFromSimulation()
 
   AllocateBufferMemory();
 
-  // Loop over all SPH particles and record particle data
-  for (int i=0; i<Nsph; i++) {
+  // Only the fields requested for this snapshot have (non-NULL) buffers
+  rbuf[0] = x; rbuf[1] = y; rbuf[2] = z;
+  vbuf[0] = vx; vbuf[1] = vy; vbuf[2] = vz;
+  abuf[0] = ax; abuf[1] = ay; abuf[2] = az;
+  sbuf[0] = m;
+  sbuf[1] = h;
+  sbuf[2] = rho;
+  sbuf[3] = u;
+  sbuf[4] = dudt;
+  level_step = simulation->level_step;
+  timestep = simulation->timestep;
+  N = Nsph;
 
-    if (ndim == 1) {
-      x[i] = (float) sphaux[i].r[0];
-      vx[i] = (float) sphaux[i].v[0];
-      ax[i] = (float) pow(2,simulation->level_step - sphaux[i].level)*
-	simulation->timestep; //(float) sphaux[i].a[0];
-    }
-    else if (ndim == 2) {
-      x[i] = (float) sphaux[i].r[0];
-      y[i] = (float) sphaux[i].r[1];
-      vx[i] = (float) sphaux[i].v[0];
-      vy[i] = (float) sphaux[i].v[1];
-      ax[i] = (float) sphaux[i].a[0];
-      ay[i] = (float) sphaux[i].a[1];
-    }
-    else if (ndim == 3) {
-      x[i] = (float) sphaux[i].r[0];
-      y[i] = (float) sphaux[i].r[1];
-      z[i] = (float) sphaux[i].r[2];
-      vx[i] = (float) sphaux[i].v[0];
-      vy[i] = (float) sphaux[i].v[1];
-      vz[i] = (float) sphaux[i].v[2];
-      ax[i] = (float) sphaux[i].a[0];
-      ay[i] = (float) sphaux[i].a[1];
-      az[i] = (float) sphaux[i].a[2];
+  // Loop over all SPH particles and record particle data
+  //---------------------------------------------------------------------------
+#pragma omp parallel for default(none) private(i,k) \
+  shared(abuf,level_step,N,rbuf,sbuf,sphaux,timestep,vbuf)
+  for (i=0; i<N; i++) {
+    for (k=0; k<ndims; k++) {
+      if (rbuf[k] != NULL) rbuf[k][i] = (float) sphaux[i].r[k];
+      if (vbuf[k] != NULL) vbuf[k][i] = (float) sphaux[i].v[k];
+      if (abuf[k] == NULL) continue;
+      if (ndims == 1)
+        abuf[k][i] = (float) pow(2,level_step - sphaux[i].level)*
+          timestep; //(float) sphaux[i].a[0];
+      else
+        abuf[k][i] = (float) sphaux[i].a[k];
     }
-    m[i] = (float) sphaux[i].m;
-    h[i] = (float) sphaux[i].h;
-    rho[i] = (float) sphaux[i].rho;
-    u[i] = (float) sphaux[i].u;
-    dudt[i] = sphaux[i].dudt;
-
+    if (sbuf[0] != NULL) sbuf[0][i] = (float) sphaux[i].m;
+    if (sbuf[1] != NULL) sbuf[1][i] = (float) sphaux[i].h;
+    if (sbuf[2] != NULL) sbuf[2][i] = (float) sphaux[i].rho;
+    if (sbuf[3] != NULL) sbuf[3][i] = (float) sphaux[i].u;
+    if (sbuf[4] != NULL) sbuf[4][i] = sphaux[i].dudt;
   }
+  //---------------------------------------------------------------------------
 
   // Loop over star particles and record particle data
-  for (int i=0; i<Nstar; i++) {
-    if (ndim == 1) {
-      xstar[i] = (float) staraux[i].r[0];
-      vxstar[i] = (float) staraux[i].v[0];
-      axstar[i] = (float) staraux[i].a[0];
+  rbuf[0] = xstar; rbuf[1] = ystar; rbuf[2] = zstar;
+  vbuf[0] = vxstar; vbuf[1] = vystar; vbuf[2] = vzstar;
+  abuf[0] = axstar; abuf[1] = aystar; abuf[2] = azstar;
+  for (i=0; i<Nstar; i++) {
+    for (k=0; k<ndims; k++) {
+      if (rbuf[k] != NULL) rbuf[k][i] = (float) staraux[i].r[k];
+      if (vbuf[k] != NULL) vbuf[k][i] = (float) staraux[i].v[k];
+      if (abuf[k] != NULL) abuf[k][i] = (float) staraux[i].a[k];
     }
-    else if (ndim == 2) {
-      xstar[i] = (float) staraux[i].r[0];
-      ystar[i] = (float) staraux[i].r[1];
-      vxstar[i] = (float) staraux[i].v[0];
-      vystar[i] = (float) staraux[i].v[1];
-      axstar[i] = (float) staraux[i].a[0];
-      aystar[i] = (float) staraux[i].a[1];
-    }
-    else if (ndim == 3) {
-      xstar[i] = (float) staraux[i].r[0];
-      ystar[i] = (float) staraux[i].r[1];
-      zstar[i] = (float) staraux[i].r[2];
-      vxstar[i] = (float) staraux[i].v[0];
-      vystar[i] = (float) staraux[i].v[1];
-      vzstar[i] = (float) staraux[i].v[2];
-      axstar[i] = (float) staraux[i].a[0];
-      aystar[i] = (float) staraux[i].a[1];
-      azstar[i] = (float) staraux[i].a[2];
-    }
-
-    mstar[i] = (float) staraux[i].m;
-    hstar[i] = (float) staraux[i].h;
+    if (mstar != NULL) mstar[i] = (float) staraux[i].m;
+    if (hstar != NULL) hstar[i] = (float) staraux[i].h;
   }
 
   // Loop over all binary orbits and record data
-  for (int i=0; i<Norbit; i++) {
-    ecc[i] = (float) orbitaux[i].ecc;
-    mbin[i] = (float) orbitaux[i].m;
-    period[i] = (float) orbitaux[i].period;
-    qbin[i] = (float) orbitaux[i].q;
-    sma[i] = (float) orbitaux[i].sma;
+  for (i=0; i<Norbit; i++) {
+    if (ecc != NULL) ecc[i] = (float) orbitaux[i].ecc;
+    if (mbin != NULL) mbin[i] = (float) orbitaux[i].m;
+    if (period != NULL) period[i] = (float) orbitaux[i].period;
+    if (qbin != NULL) qbin[i] = (float) orbitaux[i].q;
+    if (sma != NULL) sma[i] = (float) orbitaux[i].sma;
   }
 
   LastUsed = time(NULL);
@@ -649,6 +1111,8 @@ UnitInfo SphSnapshotBase::ExtractArray
  float& scaling_factor,             ///< Scaling factor for outputted variable
  string RequestedUnit)              ///< Requested unit for outputted variable
 {
+  int ifield;                       // Position of mapped field
+  int iunit;                        // Position of unit of mapped field
   string unitname;                  // Name of unit
   UnitInfo unitinfo;                // ..
   SimUnit* unit;                    // Unit pointer
@@ -677,6 +1141,33 @@ UnitInfo SphSnapshotBase::ExtractArray
     ExceptionHandler::getIstance().raise(message);
   }
 
+  // Fields not requested for this snapshot are copied from the simulation
+  // (live snapshots), or the complete snapshot is read in from its file.
+  float **buffer = BufferPointer(name, type);
+  if (!mapped && buffer != NULL && *buffer == NULL && !FieldRequested(name)) {
+    vector<string> names;
+    FieldNames(type, names);
+    if (find(names.begin(), names.end(), name) != names.end()) {
+      if (filename == "") {
+        fields.push_back(name);
+        CopyDataFromSimulation();
+      }
+      else {
+        SetRequestedFields("all");
+        DeallocateBufferMemory();
+        ReadSnapshot(fileform);
+      }
+    }
+  }
+
+  // For memory-mapped snapshots, only fault in the requested field.  If the
+  // field is not stored in the file, read in the complete snapshot instead.
+  if (mapped && !FaultInField(name, type)) {
+    lazyload = false;
+    DeallocateBufferMemory();
+    ReadSnapshot(fileform);
+  }
+
 
   // If array type and name is valid, pass pointer to array and also set unit
   if (name == "x") {
@@ -805,6 +1296,14 @@ UnitInfo SphSnapshotBase::ExtractArray
   label = unit->LatexLabel(RequestedUnit);
   scaling_factor = unit->OutputScale(RequestedUnit);
 
+  // Mapped fields are still in the output units of the file, so fold the
+  // conversion back to code units into the scaling factor.
+  if (mapped) {
+    ifield = mapheader.FindField(name, type);
+    iunit = mapheader.FindUnit(mapheader.fields[ifield].unit);
+    if (iunit != -1) scaling_factor /= mapheader.units[iunit].outscale;
+  }
+
   unitinfo.name = unitname;
   unitinfo.label = label;
 
@@ -825,6 +1324,20 @@ void SphSnapshot<ndims>::ReadSnapshot(string format)
   // Set pointer to units object
   units = &(simulation->simunits);
 
+  // Filtered snapshots are read like unfiltered ones
+  format = BaseFileForm(format);
+
+  // Binary snapshots are only mapped here; each field is then read in when
+  // first requested by ExtractArray.
+  if (format == "gandalf_bin" && lazyload) {
+    DeallocateBufferMemory();
+    units->SetupUnits(simulation->simparams);
+    if (MapSnapshot()) {
+      t = mapheader.t/units->t.inscale;
+      return;
+    }
+  }
+
   // Read simulation into main memory
   simulation->ReadSnapshotFile(filename, format);
 
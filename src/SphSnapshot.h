@@ -17,6 +17,7 @@
 #include "Simulation.h"
 #include "UnitInfo.h"
 #include "BinaryOrbit.h"
+#include "BinarySnapshot.h"
 using namespace std;
 
 
@@ -33,15 +34,47 @@ class SphSnapshotBase
   void AllocateBufferMemoryBinary();
   void AllocateBufferMemorySph();
   void AllocateBufferMemoryStar();
+  int AllocateBufferFields(string, int);
+  void DeallocateBufferFields(string);
   void DeallocateBufferMemoryBinary();
   void DeallocateBufferMemorySph();
   void DeallocateBufferMemoryStar();
+  float** BufferPointer(string, string);
+  bool FaultInField(string, string);
+  void FieldNames(string, vector<string> &);
+  bool MapFile(string, char *&, size_t &);
+  bool ReadMappedField(int, string, string, float *);
+  bool ReadMappedOrder(int);
+  void UnmapFiles(void);
+  void UnmapSnapshot(void);
+
+  // Pool of snapshot buffers shared by all snapshots
+  //---------------------------------------------------------------------------
+  static float* AcquireBuffer(int);
+  static void ReleaseBuffer(float *);
+  static multimap<int,float*> freebuffers;  ///< Free pooled buffers by size
+  static map<float*,int> buffersize;        ///< Sizes of all pooled buffers
+  static long long pooledbytes;             ///< Bytes held in free buffers
 
 protected:
   int nneededbinary;        ///< No. of variables needed to store binary orbit
   int nneededsph;           ///< No. of variables needed to store for sph ptcl
   int nneededstar;          ///< No. of variables needed to store for star ptcl
   vector<string> _species;
+  bool allfields;           ///< Are all fields requested?
+  vector<string> fields;    ///< Names of requested fields (if not all)
+  bool MapSnapshot(void);
+
+  // Memory-mapped (lazily loaded) binary snapshot variables
+  //---------------------------------------------------------------------------
+  bool lazyload;            ///< Open binary snapshots with mmap if possible
+  bool mapped;              ///< Is snapshot file currently memory-mapped?
+  vector<char*> mapaddress;         ///< Start addresses of mapped pieces
+  vector<size_t> mapsize;           ///< Sizes (in bytes) of mapped pieces
+  BinarySnapshotHeader mapheader;   ///< Header merged over all pieces
+  vector<BinarySnapshotHeader> mapheaders;  ///< Headers of mapped pieces
+  vector<float*> mappedbuffers;     ///< Converted arrays owned by snapshot
+  vector<vector<int> > maporder;    ///< Storage order of SPH ptcls in pieces
 
  public:
 
@@ -58,6 +91,10 @@ protected:
   void DeallocateBufferMemory(void);
   int CalculateMemoryUsage(void);
   int CalculatePredictedMemoryUsage(void);
+  bool FieldRequested(string);
+  void SetRequestedFields(string);
+  static void FreeBufferPool(void);
+  static long long maxpooledbytes;  ///< Max. bytes held in free buffers
   virtual void CopyDataFromSimulation()=0;
   UnitInfo ExtractArray(string, string, float** out_array, int* size_array,
 		    float& scaling_factor, string RequestedUnit);
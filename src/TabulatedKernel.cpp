@@ -77,6 +77,8 @@ TabulatedKernel<ndim>::TabulatedKernel(string KernelName, int resaux):
   tableWomega_s2 = new FLOAT[res];
   tableWzeta_s2 = new FLOAT[res];
   tableLOS = new FLOAT[res];
+  tableLOS_s2 = new FLOAT[res];
+  tableLOScumulative = new FLOAT[res+1];
 
   // Initialize the tables
   initializeTable(tableW0,&SphKernel<ndim>::w0);
@@ -98,43 +100,74 @@ TabulatedKernel<ndim>::TabulatedKernel(string KernelName, int resaux):
 
 //=============================================================================
 //  TabulatedKernel::initializeTableLOS
-/// Create and return new kernel object selected in parameters file.
+/// Tabulate the column-integrated (line-of-sight) kernel as a function of 
+/// impact parameter s and of s^2, plus the cumulative fraction of the 
+/// column-integrated kernel at x-offsets below u (its 1D marginal, 
+/// m(u) ~ int_|u|^kernrange W(s) s ds for a 3D kernel), used to average 
+/// particles smaller than a pixel over the pixel area.  All integrals use 
+/// the midpoint rule.
 //=============================================================================
 template <int ndim>
 void TabulatedKernel<ndim>::initializeTableLOS() 
 {
   int i;                                    // Kernel table element counter
   int j;                                    // Integration step counter
-  FLOAT dist;                               // ..
+  FLOAT dist;                               // Half-length of integration path
   FLOAT impactparametersqd;                 // Kernel impact parameter squared
-  FLOAT intstep;                            // ..
-  FLOAT position;                           // ..
+  FLOAT intstep;                            // Integration step
+  FLOAT position;                           // Position along path
   FLOAT sum;                                // Integration sum
   FLOAT s;                                  // Distance from the center
+  FLOAT u;                                  // Offset of marginal table entry
   const FLOAT step = kernel->kernrange/res; // Step in the tabulated variable
+  const FLOAT stepsqd = kernel->kernrangesqd/res;  // Step in s^2
+  const FLOAT stepu = 2.0*kernel->kernrange/res;  // Step in offset u
   const int intsteps = 4000;                // No. of steps per integration
+  const int margsteps = 200;                // No. of steps per marginal
 
   //---------------------------------------------------------------------------
   for (i=0; i<res; i++) {
+
+    // Column integral for impact parameter s (and for s^2)
     impactparametersqd = pow((FLOAT) i*step,2);
+    dist = sqrt(this->kernrangesqd - impactparametersqd); 
+    intstep = dist/intsteps;
     sum = 0.0;
+    for (j=0; j<intsteps; j++) {
+      position = intstep*((FLOAT) j + 0.5);
+      s = sqrt(position*position + impactparametersqd);
+      sum += kernel->w0(s)*intstep;
+    }
+    tableLOS[i] = 2.0*sum; 
 
-    // Half-length of the integration path
+    impactparametersqd = (FLOAT) i*stepsqd;
     dist = sqrt(this->kernrangesqd - impactparametersqd); 
     intstep = dist/intsteps;
-
-    // Now numerically integrate through kernel
+    sum = 0.0;
     for (j=0; j<intsteps; j++) {
-      position = intstep*j;
-
-      // Compute distance from the center
+      position = intstep*((FLOAT) j + 0.5);
       s = sqrt(position*position + impactparametersqd);
       sum += kernel->w0(s)*intstep;
     }
-    
-    // Multiply by 2 because we integrated only along half of the path
-    tableLOS[i] = 2.0*sum; 
+    tableLOS_s2[i] = 2.0*sum; 
+  }
+  //---------------------------------------------------------------------------
+
+
+  // Cumulative marginal; normalised to 1 at u = kernrange
+  //---------------------------------------------------------------------------
+  tableLOScumulative[0] = 0.0;
+  for (i=0; i<res; i++) {
+    u = fabs(-kernel->kernrange + stepu*((FLOAT) i + 0.5));
+    intstep = (kernel->kernrange - u)/margsteps;
+    sum = 0.0;
+    for (j=0; j<margsteps; j++) {
+      s = u + intstep*((FLOAT) j + 0.5);
+      sum += kernel->w0(s)*s*intstep;
+    }
+    tableLOScumulative[i+1] = tableLOScumulative[i] + sum*stepu;
   }
+  for (i=1; i<=res; i++) tableLOScumulative[i] /= tableLOScumulative[res];
   //---------------------------------------------------------------------------
 
   return;
@@ -0,0 +1,275 @@
+//=============================================================================
+//  TestBinaryCodec.cpp
+//  Unit tests of the compression codecs of native binary snapshot files.
+//  Checks that all codecs round-trip their data, that the lossless codec
+//  is bit-exact and that the quantised codec keeps its error bound.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "BinaryCodec.h"
+using namespace std;
+
+
+class BinaryCodecTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+  void TearDown(void);
+
+  BinaryFieldRecord Field(int, int, DOUBLE);
+  void Store(int, const vector<double> &, vector<char> &);
+  double Load(int, const vector<char> &, int);
+  bool RoundTrip(BinaryFieldRecord &, const vector<char> &, vector<char> &);
+
+  static const int N = 100000;      // No. of elements of test arrays
+  vector<double> positive;          // Positive values over 17 decades
+  vector<double> mixed;             // Values of both signs (plus zeros)
+  vector<double> lattice;           // Smooth (lattice) positions
+
+};
+
+
+
+void BinaryCodecTest::SetUp(void)
+{
+  int i;                            // Element counter
+
+  srand(1);
+  positive.resize(N);
+  mixed.resize(N);
+  lattice.resize(N);
+  for (i=0; i<N; i++) {
+    positive[i] = exp(40.0*((double) rand()/(double) RAND_MAX - 0.5));
+    mixed[i] = ((double) rand()/(double) RAND_MAX - 0.5)*1.0e3;
+    lattice[i] = -0.5 + ((double) i + 0.5)/(double) N;
+  }
+  for (i=0; i<N; i+=97) mixed[i] = 0.0;
+
+  return;
+}
+
+
+
+void BinaryCodecTest::TearDown(void)
+{
+  return;
+}
+
+
+
+BinaryFieldRecord BinaryCodecTest::Field(int typesize, int codec, DOUBLE eps)
+{
+  BinaryFieldRecord field;
+
+  field.name = "rho";
+  field.species = "sph";
+  field.unit = "rho";
+  field.typesize = typesize;
+  field.N = N;
+  field.offset = 0;
+  field.codec = codec;
+  field.chunksize = 0;
+  field.nbytes = 0;
+  field.param = eps;
+
+  return field;
+}
+
+
+
+void BinaryCodecTest::Store
+(int typesize, const vector<double> &values, vector<char> &data)
+{
+  int i;
+  float xf;
+
+  data.resize((size_t) values.size()*typesize);
+  for (i=0; i<(int) values.size(); i++) {
+    if (typesize == sizeof(float)) {
+      xf = (float) values[i];
+      memcpy(&data[(size_t) i*typesize],&xf,sizeof(float));
+    }
+    else memcpy(&data[(size_t) i*typesize],&values[i],sizeof(double));
+  }
+
+  return;
+}
+
+
+
+double BinaryCodecTest::Load(int typesize, const vector<char> &data, int i)
+{
+  double x;
+  float xf;
+
+  if (typesize == sizeof(float)) {
+    memcpy(&xf,&data[(size_t) i*typesize],sizeof(float));
+    return (double) xf;
+  }
+  memcpy(&x,&data[(size_t) i*typesize],sizeof(double));
+
+  return x;
+}
+
+
+
+bool BinaryCodecTest::RoundTrip
+(BinaryFieldRecord &field, const vector<char> &in, vector<char> &out)
+{
+  string block;
+
+  EncodeBinaryField(field,&in[0],block);
+  if (field.nbytes != (long long) block.size()) return false;
+  out.assign(in.size(),0);
+
+  return DecodeBinaryField(field,block.data(),&out[0]);
+}
+
+
+
+TEST_F(BinaryCodecTest, RawRoundTrip) {
+  int typesize;
+  vector<char> in, out;
+
+  for (typesize=4; typesize<=8; typesize+=4) {
+    BinaryFieldRecord field = Field(typesize,binary_codec_raw,0.0);
+    Store(typesize,mixed,in);
+    ASSERT_TRUE(RoundTrip(field,in,out));
+    EXPECT_EQ(binary_codec_raw,field.codec);
+    EXPECT_EQ((long long) in.size(),field.nbytes);
+    EXPECT_EQ(0,memcmp(&in[0],&out[0],in.size()));
+  }
+}
+
+
+TEST_F(BinaryCodecTest, LosslessRoundTrip) {
+  int typesize;
+  vector<char> in, out;
+
+  for (typesize=4; typesize<=8; typesize+=4) {
+    BinaryFieldRecord field = Field(typesize,binary_codec_lossless,0.0);
+    Store(typesize,mixed,in);
+    ASSERT_TRUE(RoundTrip(field,in,out));
+    EXPECT_EQ(binary_codec_lossless,field.codec);
+    EXPECT_EQ(0,memcmp(&in[0],&out[0],in.size()));
+
+    // Smooth arrays must also be bit-exact, and actually compressed
+    field = Field(typesize,binary_codec_lossless,0.0);
+    Store(typesize,lattice,in);
+    ASSERT_TRUE(RoundTrip(field,in,out));
+    EXPECT_EQ(0,memcmp(&in[0],&out[0],in.size()));
+    EXPECT_LT(field.nbytes,(long long) in.size());
+  }
+}
+
+
+TEST_F(BinaryCodecTest, QuantisedErrorBound) {
+  int i, k, typesize;
+  double emax;
+  vector<char> in, out;
+  const double eps[] = {1.0e-2, 1.0e-4, 1.0e-6, 3.0e-7, 1.2e-7, 5.0e-8};
+
+  for (typesize=4; typesize<=8; typesize+=4) {
+    for (k=0; k<(int) (sizeof(eps)/sizeof(double)); k++) {
+      BinaryFieldRecord field = Field(typesize,binary_codec_quantised,eps[k]);
+      Store(typesize,positive,in);
+      ASSERT_TRUE(RoundTrip(field,in,out));
+
+      // Tolerances below the precision of the field fall back to lossless
+      if (field.codec == binary_codec_lossless)
+        EXPECT_EQ(0,memcmp(&in[0],&out[0],in.size()));
+      else
+        EXPECT_EQ(binary_codec_quantised,field.codec);
+
+      emax = 0.0;
+      for (i=0; i<N; i++)
+        emax = max(emax,fabs(Load(typesize,out,i)/Load(typesize,in,i) - 1.0));
+      EXPECT_LE(emax,eps[k]) << "typesize " << typesize << ", eps " << eps[k];
+    }
+  }
+
+  // Coarse tolerances must be stored quantised (i.e. actually lossy)
+  BinaryFieldRecord field = Field(8,binary_codec_quantised,1.0e-4);
+  Store(8,positive,in);
+  ASSERT_TRUE(RoundTrip(field,in,out));
+  EXPECT_EQ(binary_codec_quantised,field.codec);
+}
+
+
+TEST_F(BinaryCodecTest, QuantisedFallback) {
+  vector<char> in, out;
+
+  // Values that are not all positive cannot be quantised logarithmically
+  BinaryFieldRecord field = Field(8,binary_codec_quantised,1.0e-4);
+  Store(8,mixed,in);
+  ASSERT_TRUE(RoundTrip(field,in,out));
+  EXPECT_EQ(binary_codec_lossless,field.codec);
+  EXPECT_EQ(0,memcmp(&in[0],&out[0],in.size()));
+}
+
+
+TEST_F(BinaryCodecTest, CorruptBlock) {
+  string block;
+  vector<char> in, out;
+
+  BinaryFieldRecord field = Field(8,binary_codec_lossless,0.0);
+  Store(8,mixed,in);
+  EncodeBinaryField(field,&in[0],block);
+  out.assign(in.size(),0);
+
+  // Truncated blocks and blocks with a wrong chunk count are rejected
+  field.nbytes = block.size()/2;
+  EXPECT_FALSE(DecodeBinaryField(field,block.data(),&out[0]));
+  field.nbytes = block.size();
+  field.N = N/2;
+  EXPECT_FALSE(DecodeBinaryField(field,block.data(),&out[0]));
+}
+
+
+TEST_F(BinaryCodecTest, MortonOrder) {
+  int i;
+  vector<double> r(2*N);
+  vector<int> order(N);
+  vector<char> in, sorted, out;
+
+  for (i=0; i<2*N; i++) r[i] = (double) rand()/(double) RAND_MAX;
+  ComputeMortonOrder(N,2,&r[0],&order[0]);
+  EXPECT_TRUE(ValidPermutation(N,&order[0]));
+
+  Store(8,mixed,in);
+  sorted.resize(in.size());
+  out.resize(in.size());
+  PermuteElements(N,8,&order[0],false,&in[0],&sorted[0]);
+  PermuteElements(N,8,&order[0],true,&sorted[0],&out[0]);
+  EXPECT_EQ(0,memcmp(&in[0],&out[0],in.size()));
+
+  // Repeated or out-of-range indices are not permutations
+  order[1] = order[0];
+  EXPECT_FALSE(ValidPermutation(N,&order[0]));
+  order[1] = N;
+  EXPECT_FALSE(ValidPermutation(N,&order[0]));
+}
@@ -0,0 +1,179 @@
+//=============================================================================
+//  TestBinarySnapshot.cpp
+//  Tests of the native binary ("gandalf_bin") snapshot readers.  Checks
+//  that the memory-mapped (lazily loaded) reader returns exactly the same
+//  arrays as reading the complete snapshot into the simulation, for all
+//  compression options.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Exception.h"
+#include "Parameters.h"
+#include "Simulation.h"
+#include "SphSnapshot.h"
+using namespace std;
+
+
+//=============================================================================
+//  Class EagerSnapshot
+/// Snapshot which always reads the complete file into the simulation, i.e.
+/// the reader used before snapshots were memory-mapped.
+//=============================================================================
+template <int ndim>
+class EagerSnapshot : public SphSnapshot<ndim>
+{
+public:
+  EagerSnapshot(string filename, SimulationBase* sim) :
+    SphSnapshot<ndim>(filename, sim) {this->lazyload = false;}
+};
+
+
+
+class BinarySnapshotTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+  void TearDown(void);
+
+  void CompareReaders(string);
+
+  static const int nfields = 8;     // No. of compared SPH arrays
+  static const string fields[nfields];
+  Parameters params;                // Parameters of test simulation
+  SimulationBase* sim;              // Test simulation (2D KHI)
+
+};
+
+const string BinarySnapshotTest::fields[BinarySnapshotTest::nfields] =
+  {"x", "y", "vx", "vy", "m", "h", "rho", "u"};
+
+
+
+void BinarySnapshotTest::SetUp(void)
+{
+  ExceptionHandler::makeExceptionHandler(cplusplus);
+
+  params.ReadParamsFile("khi.dat");
+  params.SetParameter("run_id", "TESTBIN");
+  params.SetParameter("out_file_form", "gandalf_bin");
+  params.SetParameter("Nlattice1[0]", "44");
+  params.SetParameter("Nlattice1[1]", "22");
+  params.SetParameter("Nlattice2[0]", "64");
+  params.SetParameter("Nlattice2[1]", "32");
+
+  sim = SimulationBase::SimulationFactory(params.intparams["ndim"], &params);
+  sim->SetupSimulation();
+
+  return;
+}
+
+
+
+void BinarySnapshotTest::TearDown(void)
+{
+  delete sim;
+  return;
+}
+
+
+
+void BinarySnapshotTest::CompareReaders(string compression)
+{
+  int i;                            // Particle counter
+  int k;                            // Field counter
+  int Nmapped;                      // No. of values of mapped array
+  int Neager;                       // No. of values of eager array
+  int Nerror;                       // No. of differing values
+  float smapped;                    // Scaling factor of mapped array
+  float seager;                     // Scaling factor of eager array
+  float *mapped;                    // Array of mapped snapshot
+  float *eager;                     // Array of eagerly read snapshot
+  string filename = "TESTBIN." + compression;
+  vector<float> rho;                // Densities written to the file
+
+  Simulation<2>* sim2 = static_cast<Simulation<2>* > (sim);
+  for (i=0; i<sim2->sph->Nsph; i++)
+    rho.push_back((float) sim2->sph->sphdata[i].rho);
+
+  sim->bin_compression = compression;
+  ASSERT_TRUE(sim->WriteSnapshotFile(filename, "gandalf_bin"));
+
+  SphSnapshotBase* snapmapped =
+    SphSnapshotBase::SphSnapshotFactory(filename, sim, 2);
+  SphSnapshotBase* snapeager = new EagerSnapshot<2>(filename, sim);
+  snapmapped->ReadSnapshot("gandalf_bin");
+  snapeager->ReadSnapshot("gandalf_bin");
+  EXPECT_EQ(snapeager->t, snapmapped->t);
+
+  // Both readers must return the same values for all arrays
+  for (k=0; k<nfields; k++) {
+    snapmapped->ExtractArray(fields[k], "sph", &mapped, &Nmapped, smapped,
+                             "default");
+    snapeager->ExtractArray(fields[k], "sph", &eager, &Neager, seager,
+                            "default");
+    ASSERT_EQ(Neager, Nmapped);
+    ASSERT_EQ((int) rho.size(), Nmapped);
+    Nerror = 0;
+    for (i=0; i<Nmapped; i++)
+      if (mapped[i]*smapped != eager[i]*seager) Nerror++;
+    EXPECT_EQ(0, Nerror) << "field " << fields[k] << ", " << compression;
+  }
+
+  // Check the values themselves against those written to the file
+  snapmapped->ExtractArray("rho", "sph", &mapped, &Nmapped, smapped,
+                           "default");
+  Nerror = 0;
+  for (i=0; i<Nmapped; i++) {
+    if (compression == "lossy") {
+      if (fabs(mapped[i]*smapped/rho[i] - 1.0) > sim->bin_lossy_error)
+        Nerror++;
+    }
+    else if (mapped[i]*smapped != rho[i]) Nerror++;
+  }
+  EXPECT_EQ(0, Nerror) << "field rho, " << compression;
+
+  delete snapeager;
+  delete snapmapped;
+  remove(filename.c_str());
+
+  return;
+}
+
+
+
+TEST_F(BinarySnapshotTest, Uncompressed) {
+  CompareReaders("none");
+}
+
+
+TEST_F(BinarySnapshotTest, Lossless) {
+  CompareReaders("lossless");
+}
+
+
+TEST_F(BinarySnapshotTest, Lossy) {
+  CompareReaders("lossy");
+}
@@ -0,0 +1,182 @@
+//=============================================================================
+//  TestColumnReader.cpp
+//  Tests of the column data reader.  Checks that the parallel parser of
+//  column files returns exactly (bit for bit) the values of the stream
+//  extraction operators, for numbers written in many different formats
+//  and for files which have to be read by the serial stream reader.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Exception.h"
+#include "Parameters.h"
+#include "Simulation.h"
+using namespace std;
+
+
+class ColumnReaderTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+  void TearDown(void);
+
+  string RandomToken(void);
+  void WriteColumnFile(string, int);
+  int CompareParticles(void);
+
+  static const int ncol = 8;        // No. of columns of 2D SPH particles
+  static const int Nrow = 60000;    // No. of particles (several blocks)
+  Parameters params;                // Parameters of test simulation
+  SimulationBase* sim;              // Test simulation (2D KHI)
+  vector<string> tokens;            // Tokens of all particles
+  vector<FLOAT> values;             // Tokens parsed with operator>>
+
+};
+
+
+
+void ColumnReaderTest::SetUp(void)
+{
+  int i;
+  FLOAT value;
+
+  ExceptionHandler::makeExceptionHandler(cplusplus);
+
+  params.ReadParamsFile("khi.dat");
+  params.SetParameter("run_id", "TESTCOL");
+  params.SetParameter("Nlattice1[0]", "16");
+  params.SetParameter("Nlattice1[1]", "8");
+  params.SetParameter("Nlattice2[0]", "16");
+  params.SetParameter("Nlattice2[1]", "8");
+  sim = SimulationBase::SimulationFactory(params.intparams["ndim"], &params);
+  sim->SetupSimulation();
+
+  srand(1);
+  for (i=0; i<Nrow*ncol; i++) {
+    tokens.push_back(RandomToken());
+    istringstream stream(tokens.back());
+    stream >> value;
+    values.push_back(value);
+  }
+
+  return;
+}
+
+
+
+void ColumnReaderTest::TearDown(void)
+{
+  delete sim;
+  return;
+}
+
+
+
+string ColumnReaderTest::RandomToken(void)
+{
+  char token[64];
+  double x = exp(60.0*((double) rand()/(double) RAND_MAX - 0.5));
+
+  if (rand()%2 == 0) x = -x;
+  switch (rand()%8) {
+  case 0: sprintf(token, "%.17g", x); break;
+  case 1: sprintf(token, "%.9g", x); break;
+  case 2: sprintf(token, "%.6e", x); break;
+  case 3: sprintf(token, "%g", x); break;
+  case 4: sprintf(token, "%.3f", fmod(x,1.0e6)); break;
+  case 5: sprintf(token, "%d", (int) fmod(x,1.0e9)); break;
+  case 6: sprintf(token, "%.15E", x); break;
+  default: sprintf(token, "%.8f", fmod(x,1.0e3)); break;
+  }
+
+  return string(token);
+}
+
+
+
+void ColumnReaderTest::WriteColumnFile
+(string filename, int Nperline)
+{
+  int i;
+  int j;
+  ofstream outfile(filename.c_str());
+
+  outfile << Nrow << endl << 0 << endl << 2 << endl << 0.0 << endl;
+  for (i=0; i<Nrow; i++) {
+    for (j=0; j<ncol; j++) outfile << "  " << tokens[i*ncol + j];
+    if ((i + 1)%Nperline == 0) outfile << endl;
+  }
+  outfile.close();
+
+  return;
+}
+
+
+
+int ColumnReaderTest::CompareParticles(void)
+{
+  int i;
+  int Nerror = 0;
+  Sph<2>* sph = static_cast<Simulation<2>* > (sim)->sph;
+  FLOAT parsed[ncol];
+
+  if (sph->Nsph != Nrow) return Nrow;
+  for (i=0; i<Nrow; i++) {
+    SphParticle<2> &part = sph->sphdata[i];
+    parsed[0] = part.r[0];
+    parsed[1] = part.r[1];
+    parsed[2] = part.v[0];
+    parsed[3] = part.v[1];
+    parsed[4] = part.m;
+    parsed[5] = part.h;
+    parsed[6] = part.rho;
+    parsed[7] = part.u;
+    if (memcmp(parsed, &values[i*ncol], sizeof(parsed)) != 0) Nerror++;
+  }
+
+  return Nerror;
+}
+
+
+
+TEST_F(ColumnReaderTest, ParallelParser) {
+  WriteColumnFile("TESTCOL.column", 1);
+  ASSERT_TRUE(sim->ReadSnapshotFile("TESTCOL.column", "column"));
+  EXPECT_EQ(0, CompareParticles());
+  remove("TESTCOL.column");
+}
+
+
+TEST_F(ColumnReaderTest, StreamFallback) {
+  // Files without one particle per line are read by the stream reader
+  WriteColumnFile("TESTCOL.column", 2);
+  ASSERT_TRUE(sim->ReadSnapshotFile("TESTCOL.column", "column"));
+  EXPECT_EQ(0, CompareParticles());
+  remove("TESTCOL.column");
+}
@@ -0,0 +1,267 @@
+//=============================================================================
+//  TestGhosts.cpp
+//  Tests of the periodic ghost particles.  Checks that every ghost is a
+//  periodic image of a real particle (i.e. that the minimum-image vector
+//  between them vanishes), that exactly the expected images are created,
+//  and that ghost positions follow their real particles when updated.
+//  Also checks that dimensions wrapped implicitly by the neighbour search
+//  neither create ghosts nor reserve memory for them.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <math.h>
+#include <set>
+#include <string>
+#include "gtest/gtest.h"
+#include "Precision.h"
+#include "Exception.h"
+#include "Parameters.h"
+#include "DomainBox.h"
+#include "Simulation.h"
+using namespace std;
+
+
+class GhostsTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+  void TearDown(void);
+
+  void NewSimulation(string, string);
+  int ExpectedGhosts(void);
+  void CheckGhostImages(void);
+
+  Parameters params;                // Simulation parameters
+  SimulationBase* sim;              // Simulation holding the particles
+  Simulation<2>* sim2d;             // 2D view of the same simulation
+
+};
+
+
+
+void GhostsTest::SetUp(void)
+{
+  ExceptionHandler::makeExceptionHandler(cplusplus);
+  sim = NULL;
+  return;
+}
+
+
+
+void GhostsTest::TearDown(void)
+{
+  delete sim;
+  return;
+}
+
+
+
+// Set-up a small 2D KHI lattice (box [-0.5,0.5]^2) with the given y-boundary
+// type and implicit periodic wrapping switched on or off
+void GhostsTest::NewSimulation(string implicit, string yboundary)
+{
+  params.ReadParamsFile("khi.dat");
+  params.SetParameter("run_id", "TESTGHOSTS");
+  params.SetParameter("Nlattice1[0]", "44");
+  params.SetParameter("Nlattice1[1]", "22");
+  params.SetParameter("Nlattice2[0]", "64");
+  params.SetParameter("Nlattice2[1]", "32");
+  params.SetParameter("implicit_periodic", implicit);
+  params.SetParameter("y_boundary_lhs", yboundary);
+  params.SetParameter("y_boundary_rhs", yboundary);
+  sim = SimulationBase::SimulationFactory(2, &params);
+  sim->SetupSimulation();
+  sim2d = static_cast<Simulation<2> *>(sim);
+
+  // Rebuild the ghosts so that they are consistent with the final h values
+  sim2d->LocalGhosts->SearchGhostParticles(0.0, sim2d->simbox, sim2d->sph);
+
+  return;
+}
+
+
+
+// Count the ghosts required by brute force.  A real particle needs one image
+// for every non-zero shift (sx,sy) where each shifted (non-wrapped) dimension
+// is within the ghost range of the boundary it is shifted across.
+int GhostsTest::ExpectedGhosts(void)
+{
+  int i;
+  int k;
+  int Nimage[2];
+  int Nexpected = 0;
+  Sph<2> *sph = sim2d->sph;
+  DomainBox<2> &simbox = sim2d->simbox;
+  FLOAT grange = Ghosts<2>::ghost_range*sph->kernp->kernrange*sph->kernfac;
+
+  for (i=0; i<sph->Nsph; i++) {
+    for (k=0; k<2; k++) {
+      Nimage[k] = 0;
+      if (simbox.periodic_wrap[k]) continue;
+      if (sph->sphdata[i].r[k] < simbox.boxmin[k] + grange*sph->sphdata[i].h)
+        Nimage[k]++;
+      if (sph->sphdata[i].r[k] > simbox.boxmax[k] - grange*sph->sphdata[i].h)
+        Nimage[k]++;
+    }
+    Nexpected += (Nimage[0] + 1)*(Nimage[1] + 1) - 1;
+  }
+
+  return Nexpected;
+}
+
+
+
+// Follow each periodic ghost back to its real particle, and check that the
+// offset is a non-zero multiple of the box size in each dimension (so that
+// the minimum-image vector between them vanishes) and that no image repeats
+void GhostsTest::CheckGhostImages(void)
+{
+  int i;
+  int j;
+  int k;
+  int shift[2];
+  FLOAT dr[2];
+  Sph<2> *sph = sim2d->sph;
+  DomainBox<2> wrapbox = sim2d->simbox;
+  set<long> images;
+
+  for (k=0; k<2; k++) wrapbox.periodic_wrap[k] = true;
+
+  for (i=sph->Nsph; i<sph->Ntot; i++) {
+    j = sph->sphdata[i].iorig;
+    while (j >= sph->Nsph) j = sph->sphdata[j].iorig;
+    ASSERT_GE(j, 0);
+
+    for (k=0; k<2; k++) {
+      dr[k] = sph->sphdata[i].r[k] - sph->sphdata[j].r[k];
+      shift[k] = (int) floor(dr[k]/wrapbox.boxsize[k] + 0.5);
+      EXPECT_NEAR(dr[k], shift[k]*wrapbox.boxsize[k], 1.0e-10);
+    }
+    EXPECT_TRUE(shift[0] != 0 || shift[1] != 0);
+    EXPECT_EQ(sph->sphdata[j].m, sph->sphdata[i].m);
+
+    NearestPeriodicVector(wrapbox, dr);
+    EXPECT_NEAR(0.0, dr[0], 1.0e-10);
+    EXPECT_NEAR(0.0, dr[1], 1.0e-10);
+
+    images.insert(9*(long) j + 3*(shift[0] + 1) + shift[1] + 1);
+  }
+  EXPECT_EQ(sph->Nghost, (int) images.size());
+
+  return;
+}
+
+
+
+TEST(DomainBoxTest, NearestPeriodicVector) {
+  DomainBox<3> box;
+
+  // Only wrapped dimensions are mapped into [-boxhalf,boxhalf]
+  for (int k=0; k<3; k++) {
+    box.boxmin[k] = -0.5;
+    box.boxmax[k] = 0.5;
+    box.boxsize[k] = 1.0;
+    box.boxhalf[k] = 0.5;
+    box.periodic_wrap[k] = true;
+  }
+  box.periodic_wrap[2] = false;
+
+  FLOAT dr[3] = {0.9, -0.7, 0.9};
+  NearestPeriodicVector(box, dr);
+  EXPECT_NEAR(-0.1, dr[0], 1.0e-12);
+  EXPECT_NEAR(0.3, dr[1], 1.0e-12);
+  EXPECT_EQ((FLOAT) 0.9, dr[2]);
+
+  FLOAT dsmall[3] = {0.2, -0.4, -0.2};
+  NearestPeriodicVector(box, dsmall);
+  EXPECT_EQ((FLOAT) 0.2, dsmall[0]);
+  EXPECT_EQ((FLOAT) -0.4, dsmall[1]);
+  EXPECT_EQ((FLOAT) -0.2, dsmall[2]);
+}
+
+
+
+TEST_F(GhostsTest, PeriodicImages) {
+  int i;
+  int k;
+  Sph<2> *sph;
+
+  NewSimulation("0", "periodic");
+  sph = sim2d->sph;
+
+  // Edge and corner ghosts of a fully periodic box
+  ASSERT_GT(sph->Nghost, 0);
+  EXPECT_EQ(sph->Nsph + sph->Nghost, sph->Ntot);
+  EXPECT_EQ(ExpectedGhosts(), sph->Nghost);
+  CheckGhostImages();
+
+  // Moving the real particles (without rebuilding the ghosts) moves all
+  // their images with them, including the corner ghosts of ghosts
+  for (i=0; i<sph->Nsph; i++) {
+    for (k=0; k<2; k++) sph->sphdata[i].r[k] += 0.01*sph->sphdata[i].h;
+  }
+  sim2d->LocalGhosts->CopySphDataToGhosts(sim2d->simbox, sph);
+  CheckGhostImages();
+}
+
+
+
+TEST_F(GhostsTest, ImplicitPeriodicLayout) {
+  Sph<2> *sph;
+
+  // With every dimension wrapped by the neighbour search, no ghosts are
+  // created and no memory is reserved for them
+  NewSimulation("1", "periodic");
+  sph = sim2d->sph;
+
+  EXPECT_TRUE(sim2d->simbox.periodic_wrap[0]);
+  EXPECT_TRUE(sim2d->simbox.periodic_wrap[1]);
+  EXPECT_EQ(0, sph->Nghostdim);
+  EXPECT_EQ(0, sph->Nghost);
+  EXPECT_EQ(sph->Nsph, sph->Ntot);
+  EXPECT_EQ(sph->Nsph, sph->Nsphmax);
+}
+
+
+
+TEST_F(GhostsTest, MixedImplicitLayout) {
+  int i;
+  Sph<2> *sph;
+
+  // Wrapped x-dimension with mirror y-boundaries : only y-ghosts are created
+  // (and no corner ghosts), and there is space reserved for them
+  NewSimulation("1", "mirror");
+  sph = sim2d->sph;
+
+  EXPECT_TRUE(sim2d->simbox.periodic_wrap[0]);
+  EXPECT_FALSE(sim2d->simbox.periodic_wrap[1]);
+  EXPECT_EQ(1, sph->Nghostdim);
+  ASSERT_GT(sph->Nghost, 0);
+  EXPECT_EQ(ExpectedGhosts(), sph->Nghost);
+  EXPECT_LE(sph->Ntot, sph->Nsphmax);
+
+  for (i=sph->Nsph; i<sph->Ntot; i++) {
+    EXPECT_LT(sph->sphdata[i].iorig, sph->Nsph);
+    EXPECT_TRUE(sph->sphdata[i].itype == x_lhs_mirror + 4 ||
+                sph->sphdata[i].itype == x_rhs_mirror + 4);
+    EXPECT_EQ(sph->sphdata[sph->sphdata[i].iorig].r[0], sph->sphdata[i].r[0]);
+  }
+}
@@ -0,0 +1,187 @@
+//=============================================================================
+//  TestGridSearch.cpp
+//  Tests of the hashed, multi-level grid neighbour search.  Checks that the
+//  potential neighbour list of every grid cell contains each true neighbour
+//  of the cell's particles (found by brute force) exactly once, with and
+//  without implicitly wrapped periodic dimensions.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <math.h>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Precision.h"
+#include "Exception.h"
+#include "Parameters.h"
+#include "DomainBox.h"
+#include "InlineFuncs.h"
+#include "Simulation.h"
+using namespace std;
+
+
+class GridSearchTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+  void TearDown(void);
+
+  void NewSimulation(string);
+  void CompareWithBruteForce(void);
+
+  Parameters params;                // Simulation parameters
+  SimulationBase* sim;              // Simulation holding the particles
+  Simulation<2>* sim2d;             // 2D view of the same simulation
+  GridSearch<2>* grid;              // Grid neighbour search of simulation
+
+};
+
+
+
+void GridSearchTest::SetUp(void)
+{
+  ExceptionHandler::makeExceptionHandler(cplusplus);
+  sim = NULL;
+  return;
+}
+
+
+
+void GridSearchTest::TearDown(void)
+{
+  delete sim;
+  return;
+}
+
+
+
+// Set-up a small, fully periodic 2D KHI lattice using the grid search, then
+// rebuild the grid after spreading the smoothing lengths over a factor of 8
+// so that particles are distributed over several grid levels
+void GridSearchTest::NewSimulation(string implicit)
+{
+  int i;
+  Sph<2> *sph;
+
+  params.ReadParamsFile("khi.dat");
+  params.SetParameter("run_id", "TESTGRID");
+  params.SetParameter("Nlattice1[0]", "44");
+  params.SetParameter("Nlattice1[1]", "22");
+  params.SetParameter("Nlattice2[0]", "64");
+  params.SetParameter("Nlattice2[1]", "32");
+  params.SetParameter("neib_search", "grid");
+  params.SetParameter("implicit_periodic", implicit);
+  sim = SimulationBase::SimulationFactory(2, &params);
+  sim->SetupSimulation();
+  sim2d = static_cast<Simulation<2> *>(sim);
+  grid = static_cast<GridSearch<2> *>(sim2d->sphneib);
+
+  sph = sim2d->sph;
+  for (i=0; i<sph->Nsph; i++) sph->sphdata[i].h *= (FLOAT) (1 << (i % 4));
+  sim2d->LocalGhosts->CopySphDataToGhosts(sim2d->simbox, sph);
+  grid->BuildTree(true, 0, 1, 1, 0.0, sph);
+
+  return;
+}
+
+
+
+// For every real particle, find all particles within the kernel extent of
+// either particle by brute force (using minimum-image distances in wrapped
+// dimensions) and check that each appears exactly once in the potential
+// neighbour list of the particle's grid cell
+void GridSearchTest::CompareWithBruteForce(void)
+{
+  int c;
+  int i;
+  int j;
+  int jj;
+  int k;
+  int Nneib;
+  int Nmissing = 0;
+  int Nrepeat = 0;
+  int Nchecked = 0;
+  FLOAT dr[2];
+  FLOAT drsqd;
+  FLOAT hrangesqdi;
+  FLOAT hrangesqdj;
+  Sph<2> *sph = sim2d->sph;
+  FLOAT kernrange = sph->kernfac*sph->kernp->kernrange;
+  vector<int> neiblist(sph->Ntot);
+  vector<int> count(sph->Ntot);
+
+  ASSERT_GT(grid->Nlevel, 1);
+
+  for (c=0; c<grid->Ncell; c++) {
+    Nneib = grid->ComputeNeighbourList(c, sph->Ntot, &neiblist[0]);
+    ASSERT_GE(Nneib, 0);
+    for (j=0; j<sph->Ntot; j++) count[j] = 0;
+    for (jj=0; jj<Nneib; jj++) count[neiblist[jj]]++;
+    for (j=0; j<sph->Ntot; j++) if (count[j] > 1) Nrepeat++;
+
+    // Walk the particles of the cell and compare against all particles
+    i = grid->grid[c].ifirst;
+    do {
+      if (i < sph->Nsph) {
+        hrangesqdi = pow(kernrange*sph->sphdata[i].h,2);
+        for (j=0; j<sph->Ntot; j++) {
+          for (k=0; k<2; k++)
+            dr[k] = sph->sphdata[j].r[k] - sph->sphdata[i].r[k];
+          if (sim2d->simbox.implicit_periodic)
+            NearestPeriodicVector(sim2d->simbox, dr);
+          drsqd = DotProduct(dr,dr,2);
+          hrangesqdj = pow(kernrange*sph->sphdata[j].h,2);
+          if ((drsqd < hrangesqdi || drsqd < hrangesqdj) && count[j] == 0)
+            Nmissing++;
+        }
+        Nchecked++;
+      }
+      if (i == grid->grid[c].ilast) break;
+      i = grid->inext[i];
+    } while (i != -1);
+  }
+
+  EXPECT_EQ(sph->Nsph, Nchecked);
+  EXPECT_EQ(0, Nmissing);
+  EXPECT_EQ(0, Nrepeat);
+
+  return;
+}
+
+
+
+TEST_F(GridSearchTest, GhostNeighbourLists) {
+
+  // Periodic boundaries handled by ghost particles, which are also gridded
+  NewSimulation("0");
+  ASSERT_GT(sim2d->sph->Nghost, 0);
+  CompareWithBruteForce();
+}
+
+
+
+TEST_F(GridSearchTest, WrappedNeighbourLists) {
+
+  // Periodic boundaries wrapped by the grid search itself
+  NewSimulation("1");
+  ASSERT_EQ(0, sim2d->sph->Nghost);
+  CompareWithBruteForce();
+}
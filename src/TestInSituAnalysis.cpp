@@ -0,0 +1,240 @@
+//=============================================================================
+//  TestInSituAnalysis.cpp
+//  Tests of the in-situ analyses.  Checks the Lagrangian radii and density
+//  PDF written for simple particle distributions with known results, and
+//  that reopening an analysis file on restart discards the records written
+//  after the restart file.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <math.h>
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Precision.h"
+#include "Exception.h"
+#include "Parameters.h"
+#include "Simulation.h"
+#include "InSituAnalysis.h"
+using namespace std;
+
+
+class InSituAnalysisTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+  void TearDown(void);
+
+  vector<vector<DOUBLE> > ReadRecords(int &);
+
+  Parameters params;                // Simulation parameters
+  SimulationBase* simbase;          // Simulation holding the particles
+  Simulation<3>* sim;               // 3D view of the same simulation
+  Sph<3>* sph;                      // SPH particles of simulation
+  string filename;                  // Analysis time-series file
+
+};
+
+
+
+void InSituAnalysisTest::SetUp(void)
+{
+  ExceptionHandler::makeExceptionHandler(cplusplus);
+  params.ReadParamsFile("freefall.dat");
+  params.SetParameter("run_id", "TESTINSITU");
+  params.SetParameter("Nsph", "2000");
+  simbase = SimulationBase::SimulationFactory(3, &params);
+  simbase->SetupSimulation();
+  sim = static_cast<Simulation<3> *>(simbase);
+  sph = sim->sph;
+  sim->nbody->Nstar = 0;
+  filename = "TESTINSITU.dat";
+  return;
+}
+
+
+
+void InSituAnalysisTest::TearDown(void)
+{
+  remove(filename.c_str());
+  delete simbase;
+  return;
+}
+
+
+
+// Read all records (lines not starting with '#') of the analysis file, and
+// return the number of header lines in Nheader
+vector<vector<DOUBLE> > InSituAnalysisTest::ReadRecords(int &Nheader)
+{
+  DOUBLE value;
+  string line;
+  ifstream infile(filename.c_str());
+  vector<vector<DOUBLE> > records;
+
+  Nheader = 0;
+  while (getline(infile,line)) {
+    if (line.empty()) continue;
+    if (line[0] == '#') {
+      Nheader++;
+      continue;
+    }
+    istringstream ss(line);
+    records.push_back(vector<DOUBLE>());
+    while (ss >> value) records.back().push_back(value);
+  }
+
+  return records;
+}
+
+
+
+TEST_F(InSituAnalysisTest, LagrangianRadii) {
+  int i;
+  int j;
+  int k;
+  int Nheader;
+  const int N = 999;
+  const DOUBLE dx = 0.001;
+  vector<vector<DOUBLE> > records;
+  LagrangianRadiiAnalysis<3> analysis(filename);
+
+  // One particle at the origin and equal-mass pairs at +/-(j + 1)*dx on the
+  // x-axis, so the particle with distance rank k (from 0) lies at
+  // ((k + 1)/2)*dx.  No mass fraction falls exactly on a particle.
+  ASSERT_GE(sph->Nsph, N);
+  sph->Nsph = N;
+  for (i=0; i<N; i++) {
+    for (k=0; k<3; k++) sph->sphdata[i].r[k] = 0.0;
+    for (k=0; k<3; k++) sph->sphdata[i].v[k] = 0.0;
+    sph->sphdata[i].m = 1.0/(DOUBLE) N;
+    if (i > 0) sph->sphdata[i].r[0] = (i%2 == 0 ? -1.0 : 1.0)*((i + 1)/2)*dx;
+  }
+
+  sim->t = 0.5;
+  analysis.OpenFile(sim, -1);
+  analysis.Analyse(sim);
+  analysis.outfile.close();
+
+  records = ReadRecords(Nheader);
+  EXPECT_EQ(1, Nheader);
+  ASSERT_EQ(1, (int) records.size());
+  ASSERT_EQ((int) analysis.mfrac.size() + 1, (int) records[0].size());
+  EXPECT_NEAR(0.5, records[0][0], 1.0e-12);
+  for (j=0; j<(int) analysis.mfrac.size(); j++) {
+    k = (int) ceil(analysis.mfrac[j]*(DOUBLE) N) - 1;
+    EXPECT_NEAR(((k + 1)/2)*dx, records[0][j + 1], 1.0e-9);
+  }
+}
+
+
+
+TEST_F(InSituAnalysisTest, DensityPdf) {
+  int b;
+  int i;
+  int Nheader;
+  const int N = 1000;
+  const int Nbin = 20;
+  vector<vector<DOUBLE> > records;
+  DensityPdfAnalysis<3> analysis(filename, Nbin);
+
+  // Equal masses at densities 1 and 4, so the volume-weighted mean density
+  // is 1.6 and s = ln(rho/1.6) takes two values separated by ln(4).  With
+  // bins of width 1 in [-10,10], they fall in the two bins either side of 0.
+  ASSERT_GE(sph->Nsph, N);
+  sph->Nsph = N;
+  for (i=0; i<N; i++) {
+    sph->sphdata[i].m = 1.0/(DOUBLE) N;
+    sph->sphdata[i].rho = (i%2 == 0 ? 1.0 : 4.0);
+  }
+
+  sim->t = 0.25;
+  analysis.OpenFile(sim, -1);
+  analysis.Analyse(sim);
+  analysis.outfile.close();
+
+  records = ReadRecords(Nheader);
+  EXPECT_EQ(2, Nheader);
+  ASSERT_EQ(1, (int) records.size());
+  ASSERT_EQ(Nbin + 4, (int) records[0].size());
+  EXPECT_NEAR(0.25, records[0][0], 1.0e-12);
+  EXPECT_NEAR(1.6, records[0][1], 1.0e-7);
+  EXPECT_NEAR(0.5*(log(0.625) + log(2.5)), records[0][2], 1.0e-7);
+  EXPECT_NEAR(0.5*log(4.0), records[0][3], 1.0e-7);
+  for (b=0; b<Nbin; b++) {
+    EXPECT_NEAR((b == 9 || b == 10) ? 0.5 : 0.0, records[0][b + 4], 1.0e-7);
+  }
+}
+
+
+
+TEST_F(InSituAnalysisTest, RestartTruncation) {
+  int Nheader;
+  long position;
+  vector<vector<DOUBLE> > records;
+  LagrangianRadiiAnalysis<3> *analysis;
+
+  // First run : header and records at t = 1 and t = 2, with the restart
+  // file written in between
+  analysis = new LagrangianRadiiAnalysis<3>(filename);
+  analysis->OpenFile(sim, -1);
+  sim->t = 1.0;
+  analysis->Analyse(sim);
+  position = analysis->FilePosition();
+  sim->t = 2.0;
+  analysis->Analyse(sim);
+  delete analysis;
+  records = ReadRecords(Nheader);
+  ASSERT_EQ(2, (int) records.size());
+
+  // Restarted run : the t = 2 record is discarded, no new header is written
+  // and the next record is appended
+  analysis = new LagrangianRadiiAnalysis<3>(filename);
+  analysis->OpenFile(sim, position);
+  sim->t = 3.0;
+  analysis->Analyse(sim);
+  delete analysis;
+
+  records = ReadRecords(Nheader);
+  EXPECT_EQ(1, Nheader);
+  ASSERT_EQ(2, (int) records.size());
+  EXPECT_EQ(1.0, records[0][0]);
+  EXPECT_EQ(3.0, records[1][0]);
+
+  // A file shorter than recorded in the restart file is an error
+  analysis = new LagrangianRadiiAnalysis<3>(filename);
+  EXPECT_EXIT(analysis->OpenFile(sim, position + 1000),
+              testing::ExitedWithCode(255), "");
+  delete analysis;
+
+  // A missing file is started afresh, with a header
+  remove(filename.c_str());
+  analysis = new LagrangianRadiiAnalysis<3>(filename);
+  analysis->OpenFile(sim, position);
+  analysis->Analyse(sim);
+  delete analysis;
+  records = ReadRecords(Nheader);
+  EXPECT_EQ(1, Nheader);
+  EXPECT_EQ(1, (int) records.size());
+}
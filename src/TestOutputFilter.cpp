@@ -0,0 +1,228 @@
+//=============================================================================
+//  TestOutputFilter.cpp
+//  Tests of the particle filter used for filtered snapshots.  Checks the
+//  particle i.d.s selected by the box, sphere, i.d.-list and hash-subsample
+//  criteria on their own and combined, and that the selected particles are
+//  copied unchanged (i.e. with their original masses).
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Precision.h"
+#include "Exception.h"
+#include "SphParticle.h"
+#include "OutputFilter.h"
+using namespace std;
+
+
+static const int Nlattice = 100;    // No. of particles per dimension
+static const int N = Nlattice*Nlattice;   // Total no. of particles
+
+
+
+class OutputFilterTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+
+  vector<int> SelectedIds(OutputFilter<2> &);
+
+  vector<SphParticle<2> > sphdata;  // Particles on [0,1]^2 lattice
+  vector<SnapshotParticle<2> > sphout;  // Selected particles
+
+};
+
+
+
+// Particles on a regular lattice, with original i.d.s in reverse order of
+// position and distinct masses
+void OutputFilterTest::SetUp(void)
+{
+  ExceptionHandler::makeExceptionHandler(cplusplus);
+  sphdata.resize(N);
+  sphout.resize(N);
+  for (int i=0; i<N; i++) {
+    sphdata[i].r[0] = ((FLOAT) (i%Nlattice) + 0.5)/(FLOAT) Nlattice;
+    sphdata[i].r[1] = ((FLOAT) (i/Nlattice) + 0.5)/(FLOAT) Nlattice;
+    sphdata[i].iorig = N - 1 - i;
+    sphdata[i].m = 1.0 + 0.001*(FLOAT) i;
+  }
+  return;
+}
+
+
+
+// Run the filter over all particles, check that the selected particles are
+// unchanged copies (in their original order) and return their i.d.s
+vector<int> OutputFilterTest::SelectedIds(OutputFilter<2> &filter)
+{
+  int i = 0;
+  int Nselected = filter.SelectParticles(N, &sphdata[0], &sphout[0]);
+  vector<int> ids;
+
+  for (int j=0; j<Nselected; j++) {
+    while (i < N && sphdata[i].iorig != sphout[j].iorig) i++;
+    EXPECT_LT(i, N);
+    if (i == N) break;
+    EXPECT_EQ(sphdata[i].m, sphout[j].m);
+    EXPECT_EQ(sphdata[i].r[0], sphout[j].r[0]);
+    EXPECT_EQ(sphdata[i].r[1], sphout[j].r[1]);
+    ids.push_back(sphout[j].iorig);
+  }
+
+  return ids;
+}
+
+
+
+TEST_F(OutputFilterTest, NoCriteria) {
+  OutputFilter<2> filter;
+  EXPECT_FALSE(filter.Active());
+  EXPECT_TRUE(SelectedIds(filter).empty());
+}
+
+
+
+TEST_F(OutputFilterTest, Regions) {
+  int i;
+  vector<int> expected;
+  OutputFilter<2> boxfilter;
+  OutputFilter<2> spherefilter;
+
+  // Box [0.2,0.5]x[0.6,0.9], i.e. 30x30 lattice points
+  boxfilter.region = boxfilterregion;
+  boxfilter.boxmin[0] = 0.2;
+  boxfilter.boxmax[0] = 0.5;
+  boxfilter.boxmin[1] = 0.6;
+  boxfilter.boxmax[1] = 0.9;
+  EXPECT_TRUE(boxfilter.Active());
+  for (i=0; i<N; i++) {
+    if (i%Nlattice >= 20 && i%Nlattice < 50 &&
+        i/Nlattice >= 60 && i/Nlattice < 90) expected.push_back(N - 1 - i);
+  }
+  EXPECT_EQ(900, (int) expected.size());
+  EXPECT_EQ(expected, SelectedIds(boxfilter));
+
+  // Sphere of radius 0.25 around (0.5,0.5)
+  spherefilter.region = spherefilterregion;
+  spherefilter.centre[0] = 0.5;
+  spherefilter.centre[1] = 0.5;
+  spherefilter.radius = 0.25;
+  expected.clear();
+  for (i=0; i<N; i++) {
+    FLOAT dx = sphdata[i].r[0] - 0.5;
+    FLOAT dy = sphdata[i].r[1] - 0.5;
+    if (dx*dx + dy*dy <= 0.0625) expected.push_back(N - 1 - i);
+  }
+  EXPECT_GT((int) expected.size(), 0);
+  EXPECT_EQ(expected, SelectedIds(spherefilter));
+}
+
+
+
+TEST_F(OutputFilterTest, IdList) {
+  int i;
+  string filename = "TESTFILTER.ids";
+  vector<int> expected;
+  OutputFilter<2> filter;
+
+  // Unsorted list with comments and a repeated i.d.
+  ofstream outfile(filename.c_str());
+  outfile << "# particles to follow" << endl;
+  outfile << "17 4000 3" << endl;
+  outfile << "9999 17" << endl;
+  outfile.close();
+  filter.ReadIdList(filename);
+  remove(filename.c_str());
+
+  EXPECT_TRUE(filter.Active());
+  EXPECT_EQ(4, (int) filter.idlist.size());
+  for (i=0; i<N; i++) {
+    if (sphdata[i].iorig == 3 || sphdata[i].iorig == 17 ||
+        sphdata[i].iorig == 4000 || sphdata[i].iorig == 9999)
+      expected.push_back(sphdata[i].iorig);
+  }
+  EXPECT_EQ(expected, SelectedIds(filter));
+}
+
+
+
+TEST_F(OutputFilterTest, Subsample) {
+  int i;
+  vector<int> ids;
+  OutputFilter<2> filter;
+
+  // The subsample is a 1 in 8 random sample of the i.d.s
+  filter.Nsubsample = 8;
+  ids = SelectedIds(filter);
+  EXPECT_NEAR((double) ids.size(), (double) N/8.0, 0.05*N/8.0);
+
+  // ... which depends only on the i.d.s, not on the particle positions
+  for (i=0; i<N; i++) sphdata[i].r[0] += 10.0;
+  EXPECT_EQ(ids, SelectedIds(filter));
+
+  filter.Nsubsample = 1;
+  EXPECT_EQ(N, (int) SelectedIds(filter).size());
+}
+
+
+
+TEST_F(OutputFilterTest, CombinedCriteria) {
+  int i;
+  vector<int> expected;
+  vector<int> boxids;
+  vector<int> subids;
+  OutputFilter<2> filter;
+  OutputFilter<2> boxfilter;
+  OutputFilter<2> subfilter;
+
+  // Each criterion on its own
+  boxfilter.region = boxfilterregion;
+  boxfilter.boxmin[0] = 0.0;
+  boxfilter.boxmax[0] = 0.3;
+  boxfilter.boxmin[1] = 0.0;
+  boxfilter.boxmax[1] = 1.0;
+  subfilter.Nsubsample = 10;
+  boxids = SelectedIds(boxfilter);
+  subids = SelectedIds(subfilter);
+
+  // A particle is written if any criterion selects it
+  filter.region = boxfilter.region;
+  for (int k=0; k<2; k++) {
+    filter.boxmin[k] = boxfilter.boxmin[k];
+    filter.boxmax[k] = boxfilter.boxmax[k];
+  }
+  filter.Nsubsample = subfilter.Nsubsample;
+  filter.idlist.push_back(sphdata[N - 1].iorig);
+  for (i=0; i<N; i++) {
+    int id = sphdata[i].iorig;
+    if (find(boxids.begin(), boxids.end(), id) != boxids.end() ||
+        find(subids.begin(), subids.end(), id) != subids.end() ||
+        i == N - 1) expected.push_back(id);
+  }
+  EXPECT_GT(expected.size(), boxids.size() + 1);
+  EXPECT_EQ(expected, SelectedIds(filter));
+}
@@ -0,0 +1,186 @@
+//=============================================================================
+//  TestRender.cpp
+//  Tests of the column-integrated rendering of SPH particles.  Checks that
+//  the rendered column density, summed over a grid covering all particles,
+//  recovers the total mass of a known particle distribution, both for
+//  resolved and for sub-pixel (area-averaged) particles, and that the
+//  tabulated line-of-sight kernels are normalised.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "Exception.h"
+#include "Parameters.h"
+#include "Simulation.h"
+#include "SphSnapshot.h"
+#include "SphKernel.h"
+#include "Render.h"
+using namespace std;
+
+
+class RenderTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+  void TearDown(void);
+
+  double RenderedMass(int, float, vector<float> &);
+
+  Parameters params;                // Parameters of rendered simulation
+  SimulationBase* sim;              // Simulation holding the particles
+  SphSnapshot<3>* snap;             // Snapshot of simulation
+  Render<3>* render;                // Render object
+  double mtot;                      // Total mass of all particles
+
+};
+
+
+
+void RenderTest::SetUp(void)
+{
+  int i;
+
+  // Uniform sphere (radius 1) of particles on a hexagonal lattice
+  ExceptionHandler::makeExceptionHandler(cplusplus);
+  params.ReadParamsFile("freefall.dat");
+  params.SetParameter("run_id", "TESTRENDER");
+  params.SetParameter("Nsph", "1000");
+  sim = SimulationBase::SimulationFactory(3, &params);
+  sim->SetupSimulation();
+
+  snap = new SphSnapshot<3>("", sim);
+  snap->CopyDataFromSimulation();
+  render = new Render<3>(sim);
+
+  mtot = 0.0;
+  for (i=0; i<snap->Nsph; i++) mtot += snap->m[i];
+
+  return;
+}
+
+
+
+void RenderTest::TearDown(void)
+{
+  delete render;
+  delete snap;
+  delete sim;
+  return;
+}
+
+
+
+// Render the column density on an Ngrid x Ngrid grid covering the square
+// [-extent,extent]^2 and return the column summed over the grid area
+double RenderTest::RenderedMass
+(int Ngrid, float extent, vector<float> &values)
+{
+  int c;
+  double mass = 0.0;
+  float dx = 2.0f*extent/(float) Ngrid;
+  float scaling_factor;
+
+  values.assign(Ngrid*Ngrid,0.0f);
+  render->CreateColumnRenderingGrid(Ngrid, Ngrid, "x", "y", "rho", "",
+                                    -extent, extent, -extent, extent,
+                                    &values[0], Ngrid*Ngrid, *snap,
+                                    scaling_factor);
+  for (c=0; c<Ngrid*Ngrid; c++) mass += (double) values[c]*dx*dx;
+
+  return mass;
+}
+
+
+
+TEST_F(RenderTest, ColumnMassConservation) {
+
+  // Resolved particles (kernels spanning many pixels) are sampled at the
+  // pixel centres, so the rendered mass agrees to the sampling error.  No
+  // pixel is shared between threads, so repeated renders are bit-identical.
+  vector<float> values;
+  vector<float> repeat;
+  double mass = RenderedMass(256, 1.5f, values);
+
+  EXPECT_NEAR(mass/mtot, 1.0, 1.0e-2);
+
+  RenderedMass(256, 1.5f, repeat);
+  EXPECT_EQ(0, memcmp(&values[0], &repeat[0], values.size()*sizeof(float)));
+}
+
+
+
+TEST_F(RenderTest, SubPixelColumnConservation) {
+
+  // With 2x2 pixels, all kernels are smaller than a pixel, so all particles
+  // are averaged over the pixel area (split between pixels where they
+  // straddle a pixel edge).  This conserves their column exactly.
+  vector<float> values;
+  double mass = RenderedMass(4, 4.0f, values);
+
+  EXPECT_NEAR(mass/mtot, 1.0, 1.0e-5);
+}
+
+
+
+TEST(RenderKernelTest, LOSNormalisation) {
+  int i;
+  int j;
+  const int Nstep = 4000;
+  const double pi = 3.14159265358979323846;
+  TabulatedKernel<3> kern("m4");
+  double range = kern.kernrange;
+  double ds = range/(double) Nstep;
+  double s;
+  double u;
+  double norm = 0.0;
+  double normsqd = 0.0;
+  double marginal = 0.0;
+  double maxerror = 0.0;
+
+  // Column-integrated (2D) kernel, looked up in s and in s^2.  Lookups are
+  // not interpolated, so both are only normalised to the table resolution.
+  for (i=0; i<Nstep; i++) {
+    s = ((double) i + 0.5)*ds;
+    norm += kern.wLOS(s)*2.0*pi*s*ds;
+    normsqd += kern.wLOS_s2(s*s)*2.0*pi*s*ds;
+  }
+  EXPECT_NEAR(norm, 1.0, 5.0e-3);
+  EXPECT_NEAR(normsqd, 1.0, 5.0e-3);
+
+  // Cumulative x-marginal of the column-integrated kernel
+  EXPECT_EQ(0.0, kern.wLOScumulative(-range));
+  EXPECT_EQ(1.0, kern.wLOScumulative(range));
+  EXPECT_NEAR(0.5, kern.wLOScumulative(0.0), 1.0e-5);
+  for (i=0; i<Nstep/10; i++) {
+    u = -range + ((double) i + 0.5)*10.0*ds;
+    for (j=0; j<Nstep/5; j++) {
+      s = -range + ((double) j + 0.5)*10.0*ds;
+      marginal += kern.wLOS(sqrt(u*u + s*s))*100.0*ds*ds;
+    }
+    u += 5.0*ds;
+    maxerror = max(maxerror, fabs(marginal - kern.wLOScumulative(u)));
+  }
+  EXPECT_LT(maxerror, 5.0e-3);
+}
@@ -0,0 +1,167 @@
+//=============================================================================
+//  TestRestart.cpp
+//  Tests of binary restart files.  Checks that a run which is stopped,
+//  written to a restart file and restarted ends up in exactly (bit for bit)
+//  the same state as the same run integrated without interruption.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "gtest/gtest.h"
+#include "Exception.h"
+#include "Parameters.h"
+#include "Simulation.h"
+using namespace std;
+
+
+class RestartTest : public testing::Test
+{
+public:
+
+  void SetUp(void);
+  void TearDown(void);
+
+  SimulationBase* NewSimulation(Parameters &, string, int, string="0.0");
+
+  // Restarted runs start by rebuilding the tree, so the first run stops
+  // just before a rebuild step, i.e. (Nfirst + 1) a multiple of ntreebuildstep
+  static const int Nfirst = 23;     // Steps before the restart file
+  static const int Nsecond = 16;    // Steps after restarting
+
+  Parameters refparams;             // Parameters of uninterrupted run
+  Parameters firstparams;           // Parameters of run before restart
+  Parameters restartparams;         // Parameters of restarted run
+  SimulationBase* ref;              // Uninterrupted run
+  SimulationBase* first;            // Run writing the restart file
+  SimulationBase* restarted;        // Run restarted from restart file
+
+};
+
+
+
+void RestartTest::SetUp(void)
+{
+  ExceptionHandler::makeExceptionHandler(cplusplus);
+  ref = NULL;
+  first = NULL;
+  restarted = NULL;
+  return;
+}
+
+
+
+void RestartTest::TearDown(void)
+{
+  if (first != NULL) remove(first->RestartFilename().c_str());
+  delete restarted;
+  delete first;
+  delete ref;
+  return;
+}
+
+
+
+SimulationBase* RestartTest::NewSimulation
+(Parameters &params, string run_id, int restart, string dt_restart_wall)
+{
+  params.ReadParamsFile("khi.dat");
+  params.SetParameter("run_id", run_id);
+  params.SetParameter("restart", restart == 1 ? "1" : "0");
+  params.SetParameter("dt_restart_wall", dt_restart_wall);
+  params.SetParameter("Nlattice1[0]", "44");
+  params.SetParameter("Nlattice1[1]", "22");
+  params.SetParameter("Nlattice2[0]", "64");
+  params.SetParameter("Nlattice2[1]", "32");
+  params.SetParameter("Nlevels", "3");
+  params.SetParameter("ntreebuildstep", "4");
+
+  return SimulationBase::SimulationFactory(params.intparams["ndim"], &params);
+}
+
+
+
+TEST_F(RestartTest, BitIdentical) {
+  int i;
+  int Nerror = 0;
+
+  ref = NewSimulation(refparams, "TESTREF", 0);
+  ref->SetupSimulation();
+  ref->Run(Nfirst + Nsecond);
+
+  // Runs with restart files enabled leave a final restart file, here just
+  // before a tree rebuild (after Nfirst steps)
+  first = NewSimulation(firstparams, "TESTRESTART", 0, "1.0e9");
+  first->SetupSimulation();
+  first->Run(Nfirst);
+
+  restarted = NewSimulation(restartparams, "TESTRESTART", 1);
+  restarted->SetupSimulation();
+  ASSERT_EQ((int) Nfirst, restarted->Nsteps);
+  restarted->Run(Nsecond);
+
+  EXPECT_EQ(ref->Nsteps, restarted->Nsteps);
+  EXPECT_EQ(ref->n, restarted->n);
+  EXPECT_EQ(ref->level_max, restarted->level_max);
+  EXPECT_EQ(0, memcmp(&ref->t, &restarted->t, sizeof(DOUBLE)));
+  EXPECT_EQ(0, memcmp(&ref->timestep, &restarted->timestep, sizeof(DOUBLE)));
+
+  Sph<2>* sphref = static_cast<Simulation<2>* > (ref)->sph;
+  Sph<2>* sph = static_cast<Simulation<2>* > (restarted)->sph;
+  ASSERT_EQ(sphref->Nsph, sph->Nsph);
+  for (i=0; i<sph->Nsph; i++) {
+    SphParticle<2> &p = sphref->sphdata[i];
+    SphParticle<2> &q = sph->sphdata[i];
+    if (memcmp(p.r, q.r, sizeof(p.r)) != 0 ||
+        memcmp(p.v, q.v, sizeof(p.v)) != 0 ||
+        memcmp(p.a, q.a, sizeof(p.a)) != 0 ||
+        memcmp(&p.u, &q.u, sizeof(FLOAT)) != 0 ||
+        memcmp(&p.dudt, &q.dudt, sizeof(FLOAT)) != 0 ||
+        memcmp(&p.h, &q.h, sizeof(FLOAT)) != 0 ||
+        memcmp(&p.rho, &q.rho, sizeof(FLOAT)) != 0 ||
+        memcmp(&p.dt, &q.dt, sizeof(DOUBLE)) != 0 ||
+        p.level != q.level || p.iorig != q.iorig)
+      Nerror++;
+  }
+  EXPECT_EQ(0, Nerror) << "particles differing after restart";
+}
+
+
+
+TEST_F(RestartTest, FinalRestartFile) {
+
+  // The final restart file is also written if the next step does not
+  // rebuild the tree; the restarted run then continues from the same state
+  first = NewSimulation(firstparams, "TESTRESTART", 0, "1.0e9");
+  first->SetupSimulation();
+  first->Run(Nfirst + 1);
+
+  restarted = NewSimulation(restartparams, "TESTRESTART", 1);
+  restarted->SetupSimulation();
+  ASSERT_EQ((int) Nfirst + 1, restarted->Nsteps);
+  EXPECT_EQ(0, memcmp(&first->t, &restarted->t, sizeof(DOUBLE)));
+
+  Sph<2>* sphfirst = static_cast<Simulation<2>* > (first)->sph;
+  Sph<2>* sph = static_cast<Simulation<2>* > (restarted)->sph;
+  ASSERT_EQ(sphfirst->Nsph, sph->Nsph);
+  EXPECT_EQ(0, memcmp(sphfirst->sphdata, sph->sphdata,
+                      sph->Nsph*sizeof(SphParticle<2>)));
+}
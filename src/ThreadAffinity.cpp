@@ -0,0 +1,416 @@
+//=============================================================================
+//  ThreadAffinity.cpp
+//  Functions for pinning OpenMP threads to cores and reporting the
+//  processor (socket, core and NUMA node) topology of each process.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if defined __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+#if defined _OPENMP
+#include "omp.h"
+#endif
+#if defined MPI_PARALLEL
+#include "mpi.h"
+#endif
+#include "ThreadAffinity.h"
+#include "Exception.h"
+#include "Debug.h"
+using namespace std;
+
+
+//=============================================================================
+//  CpuInfo
+/// Position of one logical CPU in the processor topology.
+//=============================================================================
+struct CpuInfo
+{
+  int cpu;                          ///< Logical CPU id
+  int socket;                       ///< Physical package (socket) id
+  int core;                         ///< Core id within socket
+  int smt;                          ///< Index among hardware threads of core
+  int numanode;                     ///< NUMA memory node id
+  int corerank;                     ///< Index of core within its socket
+};
+
+
+static vector<CpuInfo> cpulist;     // CPUs the process may run on
+static vector<int> pinnedcpus;      // CPUs OpenMP threads are pinned to
+static bool topology_read = false;  // Has cpulist been filled?
+
+
+
+#if defined __linux__
+//=============================================================================
+//  ReadSysInt
+/// Read a single integer from a sysfs file, returning -1 if unavailable.
+//=============================================================================
+static int ReadSysInt(const char *filename)
+{
+  int value = -1;                   // Value read from file
+  FILE *file = fopen(filename,"r"); // sysfs file
+
+  if (file == NULL) return -1;
+  if (fscanf(file,"%d",&value) != 1) value = -1;
+  fclose(file);
+
+  return value;
+}
+
+
+
+//=============================================================================
+//  ReadNumaNode
+/// Return the NUMA node of logical CPU 'cpu' (the 'nodeN' entry of its 
+/// sysfs directory), or 0 if the kernel does not expose NUMA information.
+//=============================================================================
+static int ReadNumaNode(int cpu)
+{
+  int node = 0;                     // NUMA node id
+  char dirname[128];                // sysfs directory of cpu
+  DIR *dir;                         // Directory stream
+  struct dirent *entry;             // Directory entry
+
+  sprintf(dirname,"/sys/devices/system/cpu/cpu%d",cpu);
+  dir = opendir(dirname);
+  if (dir == NULL) return 0;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name,"node",4) == 0 &&
+        sscanf(entry->d_name + 4,"%d",&node) == 1) break;
+  }
+  closedir(dir);
+
+  return node;
+}
+#endif
+
+
+
+//=============================================================================
+//  CompareCompact
+/// Order CPUs socket by socket, physical cores before their extra 
+/// hardware threads.
+//=============================================================================
+static bool CompareCompact(const CpuInfo &a, const CpuInfo &b)
+{
+  if (a.smt != b.smt) return a.smt < b.smt;
+  if (a.socket != b.socket) return a.socket < b.socket;
+  if (a.core != b.core) return a.core < b.core;
+  return a.cpu < b.cpu;
+}
+
+
+
+//=============================================================================
+//  CompareScatter
+/// Order CPUs round-robin over sockets, physical cores before their extra 
+/// hardware threads.
+//=============================================================================
+static bool CompareScatter(const CpuInfo &a, const CpuInfo &b)
+{
+  if (a.smt != b.smt) return a.smt < b.smt;
+  if (a.corerank != b.corerank) return a.corerank < b.corerank;
+  if (a.socket != b.socket) return a.socket < b.socket;
+  return a.cpu < b.cpu;
+}
+
+
+
+//=============================================================================
+//  ReadTopology
+/// Record the socket, core and NUMA node of every CPU in the affinity mask 
+/// the process was started with.  Only done once, so that later calls 
+/// (after the main thread has been pinned) still see the full mask.
+//=============================================================================
+static void ReadTopology(void)
+{
+  if (topology_read) return;
+  topology_read = true;
+
+#if defined __linux__
+  int c;                            // CPU counter
+  int i;                            // Aux. counter
+  char filename[128];               // sysfs file name
+  cpu_set_t mask;                   // Process affinity mask
+  CpuInfo info;                     // Topology of current CPU
+
+  CPU_ZERO(&mask);
+  if (sched_getaffinity(0,sizeof(mask),&mask) != 0) return;
+
+  for (c=0; c<CPU_SETSIZE; c++) {
+    if (!CPU_ISSET(c,&mask)) continue;
+    info.cpu = c;
+    sprintf(filename,"/sys/devices/system/cpu/cpu%d/topology/physical_package_id",c);
+    info.socket = max(ReadSysInt(filename),0);
+    sprintf(filename,"/sys/devices/system/cpu/cpu%d/topology/core_id",c);
+    info.core = ReadSysInt(filename);
+    if (info.core < 0) info.core = c;
+    info.numanode = ReadNumaNode(c);
+    info.smt = 0;
+    info.corerank = 0;
+    cpulist.push_back(info);
+  }
+
+  // Number the hardware threads of each core, and the cores of each socket
+  for (c=0; c<(int) cpulist.size(); c++) {
+    for (i=0; i<c; i++) {
+      if (cpulist[i].socket != cpulist[c].socket) continue;
+      if (cpulist[i].core == cpulist[c].core) cpulist[c].smt++;
+    }
+    if (cpulist[c].smt > 0) continue;
+    for (i=0; i<c; i++) {
+      if (cpulist[i].socket == cpulist[c].socket && cpulist[i].smt == 0)
+        cpulist[c].corerank++;
+    }
+  }
+  for (c=0; c<(int) cpulist.size(); c++) {
+    if (cpulist[c].smt == 0) continue;
+    for (i=0; i<(int) cpulist.size(); i++) {
+      if (cpulist[i].socket == cpulist[c].socket && 
+          cpulist[i].core == cpulist[c].core && cpulist[i].smt == 0)
+        cpulist[c].corerank = cpulist[i].corerank;
+    }
+  }
+#endif
+
+  return;
+}
+
+
+
+//=============================================================================
+//  NodeLocalRank
+/// Rank of this process amongst the MPI processes sharing its node.
+//=============================================================================
+static int NodeLocalRank(void)
+{
+  int localrank = 0;                // Node-local rank
+#if defined MPI_PARALLEL
+  MPI_Comm nodecomm;                // Communicator of processes on node
+
+  MPI_Comm_split_type(MPI_COMM_WORLD,MPI_COMM_TYPE_SHARED,0,
+                      MPI_INFO_NULL,&nodecomm);
+  MPI_Comm_rank(nodecomm,&localrank);
+  MPI_Comm_free(&nodecomm);
+#endif
+  return localrank;
+}
+
+
+
+//=============================================================================
+//  PinThreads
+/// Bind each OpenMP thread of this process to a single CPU following the 
+/// chosen pinning mode (none, compact or scatter).  Must be called before 
+/// the particle arrays are allocated so that their first-touch pages end 
+/// up on the NUMA node of the thread that uses them.
+//=============================================================================
+void PinThreads
+(string pinning)                    ///< [in] Pinning mode
+{
+  int i;                            // Thread counter
+  int localrank;                    // Node-local MPI rank
+  int Nthreads = 1;                 // No. of OpenMP threads
+  vector<CpuInfo> order;            // CPUs in order of assignment
+
+  debug2("[PinThreads]");
+
+  if (pinning != "none" && pinning != "compact" && pinning != "scatter") {
+    string message = "Unrecognised parameter : thread_pinning = " + pinning;
+    ExceptionHandler::getIstance().raise(message);
+  }
+
+  ReadTopology();
+  localrank = NodeLocalRank();
+#if defined _OPENMP
+  Nthreads = omp_get_max_threads();
+#endif
+  if (pinning == "none") return;
+
+#if defined __linux__
+  if (cpulist.size() == 0) {
+    cout << "Warning : could not read CPU topology; threads not pinned" << endl;
+    return;
+  }
+
+  order = cpulist;
+  if (pinning == "compact") sort(order.begin(),order.end(),CompareCompact);
+  else sort(order.begin(),order.end(),CompareScatter);
+
+  // Each thread binds itself; the slot is offset by the node-local rank so
+  // that processes sharing a node use disjoint CPUs where possible
+#pragma omp parallel default(none) shared(localrank,Nthreads,order)
+  {
+    int ithread = 0;                // Thread id
+    int slot;                       // Position in CPU ordering
+    cpu_set_t mask;                 // Affinity mask of thread
+#if defined _OPENMP
+    ithread = omp_get_thread_num();
+#endif
+    slot = (localrank*Nthreads + ithread) % (int) order.size();
+    CPU_ZERO(&mask);
+    CPU_SET(order[slot].cpu,&mask);
+    sched_setaffinity(0,sizeof(mask),&mask);
+  }
+
+  // Record the CPUs used, so other threads can be kept off them
+  pinnedcpus.clear();
+  for (i=0; i<Nthreads; i++)
+    pinnedcpus.push_back(order[(localrank*Nthreads + i) % order.size()].cpu);
+#else
+  cout << "Warning : thread pinning is not supported on this platform" << endl;
+#endif
+
+  return;
+}
+
+
+
+//=============================================================================
+//  UnpinThread
+/// Give the calling (non-OpenMP) thread its own affinity mask.  Threads
+/// inherit the mask of the thread creating them, so without this e.g. the
+/// background snapshot writer would share the single CPU of OpenMP thread
+/// 0.  The thread may run on any CPU of the process not used by a pinned
+/// OpenMP thread, or on all CPUs of the process if there are none spare.
+/// Does nothing if threads are not pinned.
+//=============================================================================
+void UnpinThread(void)
+{
+  debug2("[UnpinThread]");
+
+#if defined __linux__
+  int c;                            // CPU counter
+  cpu_set_t mask;                   // Affinity mask of thread
+
+  if (pinnedcpus.size() == 0) return;
+
+  CPU_ZERO(&mask);
+  for (c=0; c<(int) cpulist.size(); c++) {
+    if (find(pinnedcpus.begin(),pinnedcpus.end(),cpulist[c].cpu) 
+        == pinnedcpus.end()) CPU_SET(cpulist[c].cpu,&mask);
+  }
+  if (CPU_COUNT(&mask) == 0)
+    for (c=0; c<(int) cpulist.size(); c++) CPU_SET(cpulist[c].cpu,&mask);
+  sched_setaffinity(0,sizeof(mask),&mask);
+#endif
+
+  return;
+}
+
+
+
+//=============================================================================
+//  PrintThreadTopology
+/// Print a summary of the processor topology seen by each process (host, 
+/// sockets, NUMA nodes, available CPUs) and where its threads run.  With 
+/// MPI, the summaries of all processes are printed by the root process.
+//=============================================================================
+void PrintThreadTopology
+(int rank,                          ///< [in] MPI rank of process
+ string pinning)                    ///< [in] Pinning mode
+{
+  int c;                            // CPU counter
+  int i;                            // Thread counter
+  int Nthreads = 1;                 // No. of OpenMP threads
+  char hostname[256] = "unknown";   // Host name
+  vector<int> sockets;              // Distinct sockets available
+  vector<int> numanodes;            // Distinct NUMA nodes available
+  vector<int> runcpu;               // CPU each thread currently runs on
+  stringstream report;              // Report of this process
+  string text;                      // Report of all processes
+
+  debug2("[PrintThreadTopology]");
+
+  ReadTopology();
+#if defined _OPENMP
+  Nthreads = omp_get_max_threads();
+#endif
+  runcpu.assign(Nthreads,-1);
+
+#if defined __linux__
+  gethostname(hostname,sizeof(hostname) - 1);
+#pragma omp parallel default(none) shared(runcpu)
+  {
+    int ithread = 0;
+#if defined _OPENMP
+    ithread = omp_get_thread_num();
+#endif
+    runcpu[ithread] = sched_getcpu();
+  }
+#endif
+
+  for (c=0; c<(int) cpulist.size(); c++) {
+    if (find(sockets.begin(),sockets.end(),cpulist[c].socket) == sockets.end())
+      sockets.push_back(cpulist[c].socket);
+    if (find(numanodes.begin(),numanodes.end(),cpulist[c].numanode) 
+        == numanodes.end()) numanodes.push_back(cpulist[c].numanode);
+  }
+
+  report << "Process " << rank << " on " << hostname << " : "
+         << cpulist.size() << " CPUs, " << sockets.size() << " sockets, "
+         << numanodes.size() << " NUMA nodes, " << Nthreads 
+         << " threads (pinning : " << pinning << ")" << endl;
+  report << "  thread -> cpu :";
+  for (i=0; i<Nthreads; i++) {
+    report << " " << i << "->";
+    if (runcpu[i] >= 0) report << runcpu[i];
+    else report << "?";
+  }
+  report << endl;
+  text = report.str();
+
+#if defined MPI_PARALLEL
+  {
+    int Nmpi;                       // No. of MPI processes
+    int length = text.length();     // Length of local report
+    vector<int> lengths;            // Lengths of all reports
+    vector<int> displs;             // Offsets of all reports
+    vector<char> buffer;            // Received reports
+
+    MPI_Comm_size(MPI_COMM_WORLD,&Nmpi);
+    lengths.resize(Nmpi);
+    displs.resize(Nmpi);
+    MPI_Gather(&length,1,MPI_INT,&lengths[0],1,MPI_INT,0,MPI_COMM_WORLD);
+    if (rank == 0) {
+      for (i=1; i<Nmpi; i++) displs[i] = displs[i-1] + lengths[i-1];
+      buffer.resize(displs[Nmpi-1] + lengths[Nmpi-1] + 1);
+    }
+    else buffer.resize(1);
+    MPI_Gatherv(const_cast<char *>(text.c_str()),length,MPI_CHAR,&buffer[0],
+                &lengths[0],&displs[0],MPI_CHAR,0,MPI_COMM_WORLD);
+    if (rank == 0) text.assign(buffer.begin(),buffer.end() - 1);
+  }
+#endif
+
+  if (rank == 0) cout << text;
+
+  return;
+}
@@ -0,0 +1,52 @@
+//=============================================================================
+//  ThreadAffinity.h
+//  Functions for pinning OpenMP threads to cores and reporting the
+//  processor (socket, core and NUMA node) topology of each process.
+//
+//  This file is part of GANDALF :
+//  Graphical Astrophysics code for N-body Dynamics And Lagrangian Fluids
+//  https://github.com/gandalfcode/gandalf
+//  Contact : gandalfcode@gmail.com
+//
+//  Copyright (C) 2013  D. A. Hubber, G. Rosotti
+//
+//  GANDALF is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  GANDALF is distributed in the hope that it will be useful, but
+//  WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//  General Public License (http://www.gnu.org/licenses) for more details.
+//=============================================================================
+
+
+#ifndef _THREAD_AFFINITY_H_
+#define _THREAD_AFFINITY_H_
+
+
+#include <string>
+using namespace std;
+
+
+//=============================================================================
+//  Thread pinning modes (parameter thread_pinning)
+//
+//  none    : leave thread placement to the OS and OpenMP runtime
+//  compact : consecutive threads on consecutive physical cores, filling
+//            one socket before the next (hardware threads of a core last)
+//  scatter : consecutive threads alternate between sockets, so every
+//            socket (and its memory controller) is used with few threads
+//
+//  Threads are only placed on CPUs in the affinity mask the process was
+//  started with.  With several MPI processes per node, each process uses
+//  its own block of slots (offset by the node-local rank).
+//=============================================================================
+
+
+void PinThreads(string);
+void UnpinThread(void);
+void PrintThreadTopology(int, string);
+
+#endif
@@ -43,17 +43,21 @@ int main(int argc, char** argv)
 
   // Initialise all MPI processes (if activated in Makefile)
 #ifdef MPI_PARALLEL
-  MPI_Init(&argc,&argv);
+  int mpi_thread_provided;
+  // MPI is only called by the main thread, including while ghost
+  // communication is overlapped with OpenMP force loops
+  MPI_Init_thread(&argc,&argv,MPI_THREAD_FUNNELED,&mpi_thread_provided);
   MPI_Comm_rank(MPI_COMM_WORLD,&rank);
   //Tell exception handler to call MPI_Abort on error
   ExceptionHandler::set_mpi(1);
 #ifdef _OPENMP
-  //Check that OpenMP and MPI can work together
-  int mpi_thread_support;
-  MPI_Query_thread(&mpi_thread_support);
-  if (mpi_thread_support == MPI_THREAD_SINGLE)
-    ExceptionHandler::getIstance().raise("This implementation of MPI is not interoperable with OpenMP, aborting!"
-        "Refer to your system administrator to know how to solve this problem");
+  //Check that OpenMP and MPI can work together, i.e. that the MPI library
+  //provides (at least) the requested MPI_THREAD_FUNNELED support
+  if (mpi_thread_provided < MPI_THREAD_FUNNELED)
+    ExceptionHandler::getIstance().raise("This implementation of MPI does "
+        "not provide MPI_THREAD_FUNNELED support and is not interoperable "
+        "with OpenMP, aborting! Refer to your system administrator to know "
+        "how to solve this problem, or compile without OpenMP");
 #endif
 #endif
 
@@ -0,0 +1,125 @@
+#==============================================================================
+# rendercachetest.py
+# Tests of the cache of pre-rendered tiles (analysis/rendercache.py) with a
+# stub rendering function, so that no compiled (SWIG) module is required.
+# Run with 'python rendercachetest.py' from the tests directory.
+#==============================================================================
+import gc
+import os
+import sys
+import unittest
+import weakref
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                '..', 'analysis'))
+from rendercache import RenderCache
+
+
+#------------------------------------------------------------------------------
+class StubRenderer(object):
+    """Renders the linear field f(x,y) = 1 + 2x + 3y, whose pixel averages
+    are the values at the pixel centres, and counts the rendered pixels."""
+
+    def __init__(self):
+        self.ncalls = 0
+        self.npixels = 0
+
+    def __call__(self, xres, yres, xmin, xmax, ymin, ymax):
+        self.ncalls += 1
+        self.npixels += xres*yres
+        x = xmin + (np.arange(xres) + 0.5)*(xmax - xmin)/float(xres)
+        y = ymax - (np.arange(yres) + 0.5)*(ymax - ymin)/float(yres)
+        return (1.0 + 2.0*x[np.newaxis,:] + 3.0*y[:,np.newaxis]), 2.0
+
+
+#------------------------------------------------------------------------------
+class Snapshot(object):
+    """Stands in for a snapshot, which keeps its caches in rendercaches."""
+
+    def __init__(self):
+        self.rendercaches = {}
+
+
+#------------------------------------------------------------------------------
+def snapshot_renderfunction(snap, stub):
+    """Returns a rendering function referring to the snapshot, like the
+    closure created by the render command."""
+    def renderfunction(xres, yres, xmin, xmax, ymin, ymax):
+        snap.rendercaches
+        return stub(xres, yres, xmin, xmax, ymin, ymax)
+    return renderfunction
+
+
+#------------------------------------------------------------------------------
+class RenderCacheTest(unittest.TestCase):
+
+    def test_matches_direct_render(self):
+        """Cached views agree with rendering the view directly.  Views whose
+        pixels are whole tile pixels, or as large as the tile pixels, are
+        exact for a linear field.  Otherwise, view pixels only partly overlap
+        some tile pixels, whose whole-pixel averages are used, so the error
+        is bounded by the field variation across one tile pixel."""
+        stub = StubRenderer()
+        cache = RenderCache()
+        views = [(64, 48, 0.0, 1.0, 0.0, 0.75),
+                 (64, 64, 0.1, 0.35, 0.2, 0.45),
+                 (32, 32, -0.3, 0.7, 0.5, 1.5),
+                 (50, 30, 0.0123, 0.5123, 0.301, 0.601)]
+        tolerances = [1.0e-5, 1.0e-5, 1.0e-5,
+                      (2.0 + 3.0)/RenderCache.tileres]
+        for (xres, yres, xmin, xmax, ymin, ymax), tol in zip(views, tolerances):
+            view, scaling = cache.render(stub, xres, yres, xmin, xmax,
+                                         ymin, ymax)
+            direct, scaling_direct = stub(xres, yres, xmin, xmax, ymin, ymax)
+            self.assertEqual(view.shape, (yres, xres))
+            self.assertEqual(scaling, scaling_direct)
+            self.assertTrue(np.abs(view - direct).max() < tol)
+
+    def test_reuses_tiles(self):
+        """Repeated views render nothing, and panning renders only the newly
+        exposed tiles, all with a single call."""
+        stub = StubRenderer()
+        cache = RenderCache()
+        T = RenderCache.tileres
+        cache.render(stub, T, T, 0.0, 1.0, 0.0, 1.0)
+        self.assertEqual((stub.ncalls, stub.npixels), (1, T*T))
+        cache.render(stub, T, T, 0.0, 1.0, 0.0, 1.0)
+        self.assertEqual((stub.ncalls, stub.npixels), (1, T*T))
+        cache.render(stub, T, T, 0.5, 1.5, 0.0, 1.0)
+        self.assertEqual((stub.ncalls, stub.npixels), (2, 2*T*T))
+        self.assertEqual(len(cache.tiles), 2)
+        self.assertEqual(cache.memory_usage(), 2*T*T*4)
+
+    def test_evicts_least_recently_used(self):
+        """No more than maxtiles tiles are kept, and the most recently used
+        tiles survive."""
+        stub = StubRenderer()
+        cache = RenderCache()
+        cache.maxtiles = 4
+        T = RenderCache.tileres
+        for i in range(6):
+            cache.render(stub, T, T, float(i), float(i + 1), 0.0, 1.0)
+        self.assertEqual(len(cache.tiles), 4)
+        self.assertTrue((0, 5, 0) in cache.tiles)
+        self.assertFalse((0, 0, 0) in cache.tiles)
+
+    def test_no_reference_cycle(self):
+        """A cache stored with a snapshot, used with a rendering function
+        referring to that snapshot (as the render command does), does not
+        keep the snapshot alive once it is no longer referenced."""
+        gc.disable()
+        try:
+            snap = Snapshot()
+            renderfunction = snapshot_renderfunction(snap, StubRenderer())
+            cache = snap.rendercaches['rho'] = RenderCache()
+            cache.render(renderfunction, 16, 16, 0.0, 1.0, 0.0, 1.0)
+            snapref = weakref.ref(snap)
+            del snap, cache, renderfunction
+            self.assertTrue(snapref() is None)
+        finally:
+            gc.enable()
+
+
+if __name__ == '__main__':
+    unittest.main()